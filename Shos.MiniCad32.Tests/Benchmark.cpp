@@ -0,0 +1,368 @@
+// Measures the costs the changes to the core were weighed by. Not a test: the numbers are the machine's own.
+//   ./Benchmark                 runs every benchmark
+//   ./Benchmark columns ...     runs the ones named
+#include <chrono>
+#include <sstream>
+#include <unistd.h>
+#include "Test.h"
+
+using namespace Test;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+// The milliseconds action takes.
+template <class TAction>
+double Measure(const TAction& action)
+{
+    const auto start = Clock::now();
+    action();
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// A drawing on a grid, as a CAD drawing is: lines and rectangles of a few sizes at a fixed pitch, in one colour.
+vector<shared_ptr<Figure>> MakeGrid(size_t figureCount)
+{
+    const long                 pitch    = 500;
+    const size_t               rowCount = 100;
+    vector<shared_ptr<Figure>> figures;
+    for (size_t index = 0; index < figureCount; index++) {
+        const CPoint point(long(index / rowCount) * pitch, long(index % rowCount) * pitch);
+        const CSize  size(pitch / 2 + long(index % 3) * 50, pitch / 4);
+        if (index % 2 == 0)
+            figures.push_back(shared_ptr<Figure>(new LineFigure     (CLine(point, point + size))));
+        else
+            figures.push_back(shared_ptr<Figure>(new RectangleFigure(CRect(point, size)       )));
+    }
+    return figures;
+}
+
+// The size of the block-compressed file, and how fast its columns decode against reading the document, which makes
+// the figures as well.
+void BenchmarkColumns()
+{
+    const size_t figureCount = 20000;
+    const int    repeatCount = 50;
+    CadData      cadData;
+    cadData.Add(MakeGrid(figureCount));
+    stringstream stream;
+    cadData.Write(stream);
+    const auto file = stream.str();
+
+    FigureColumns columns;
+    for (const auto& figure : cadData)
+        figure->Write(columns);
+    vector<uint8_t> encoded;
+    ByteWriter      writer(encoded);
+    columns.Encode(writer);
+
+    const auto decodeTime = Measure([&] {
+        for (int repeat = 0; repeat < repeatCount; repeat++) {
+            ByteReader    reader(encoded.data(), encoded.size());
+            FigureColumns decoded;
+            decoded.Decode(reader);
+        }
+    });
+    const auto readTime = Measure([&] {
+        for (int repeat = 0; repeat < repeatCount; repeat++) {
+            istringstream input(file);
+            CadData       read;
+            read.Read(input);
+        }
+    });
+    printf("  %zu figures on a grid: %.1f bytes per figure\n", figureCount, double(file.size()) / figureCount);
+    printf("  column decoding     : %.0f MB/s\n", double(encoded.size()) * repeatCount / decodeTime / 1000.0);
+    printf("  reading the document: %.0f MB/s, %.2f ms per 10k figures\n", double(file.size()) * repeatCount / readTime / 1000.0,
+           readTime / repeatCount * 10000.0 / figureCount);
+}
+
+// Exporting a million random figures to a 4K PNG image, and how much of that is encoding.
+void BenchmarkExport()
+{
+    const size_t figureCount = 1000000;
+    const CSize  size(3840, 2160);
+    const CRect  area(CPoint(0, 0), CSize(104000, 104000));
+    CadData      cadData;
+    Build(cadData, figureCount);
+
+    ostringstream stream;
+    const auto    exportTime = Measure([&] { RasterExporter::ExportPng(cadData.GetSnapshot(), area, size, stream); });
+    CRasterDC     dc(size);
+    RasterExporter::Render(cadData.GetSnapshot(), area, dc);
+    ostringstream encoded;
+    const auto    encodeTime = Measure([&] {
+        PngWriter pngWriter(encoded, uint32_t(size.cx), uint32_t(size.cy));
+        for (long y = 0; y < size.cy; y++)
+            pngWriter.WriteRow(dc.GetRow(y));
+    });
+    printf("  %zu figures to %ldx%ld, threads %zu: %.0f ms, of which encoding %.0f ms; %zu KB\n", figureCount, size.cx, size.cy,
+           TaskScheduler::Get().GetConcurrency(), exportTime, encodeTime, stream.str().size() / 1024);
+}
+
+bool IsSame(const CRasterDC& dc1, const CRasterDC& dc2)
+{
+    for (long y = 0; y < dc1.GetHeight(); y++) {
+        if (memcmp(dc1.GetRow(y), dc2.GetRow(y), size_t(dc1.GetWidth()) * 4) != 0)
+            return false;
+    }
+    return true;
+}
+
+// The tiled rasterizer against the single pass on a million random figures, on one thread and on pools of 1, 3, 7...
+// workers as far as the processors go.
+void BenchmarkTiles()
+{
+    const size_t figureCount = 1000000;
+    const CSize  size(3840, 2160);
+    const CRect  area(CPoint(0, 0), CSize(104000, 104000));
+    CadData      cadData;
+    Build(cadData, figureCount);
+
+    CRasterDC  singleDC(size);
+    const auto singleTime = Measure([&] { RasterExporter::Render(cadData.GetSnapshot(), area, singleDC); });
+    printf("  %zu figures to %ldx%ld, single pass: %.0f ms\n", figureCount, size.cx, size.cy, singleTime);
+    for (size_t workerCount = 0; workerCount < Math::Max(thread::hardware_concurrency(), 1U); workerCount = workerCount * 2 + 1) {
+        TaskScheduler scheduler(workerCount);
+        CRasterDC     tiledDC(size);
+        const auto    tiledTime = Measure([&] {
+            TiledRasterizer::Render(cadData.GetSnapshot(), area, tiledDC, TiledRasterizer::defaultTileSize, scheduler);
+        });
+        printf("  tiled, threads %zu: %.0f ms, %s\n", scheduler.GetConcurrency(), tiledTime, IsSame(singleDC, tiledDC) ? "the same pixels" : "DIFFERENT PIXELS");
+    }
+}
+
+// The device height of the standard font when a square of extent is shown in size.
+long GetDeviceHeight(long extent, SIZE size)
+{
+    CRasterDC dc(size);
+    CadView::PrepareDC(dc, CRect(CPoint(0, 0), CSize(extent, extent)), CRect(CPoint(), size));
+    long deviceHeight = StandardLogFont::defaultHeight;
+    dc.CDC::LPtoDP(deviceHeight);
+    return deviceHeight;
+}
+
+// Text at device heights either side of GlyphAtlas::maximumHeight: smaller text is drawn from the atlas, larger text dot
+// by dot, and text no higher than LevelOfDetail::greekingHeight as a bar. Each time is the best of three renders after
+// the first, which builds the atlas pages and the layouts.
+void BenchmarkText()
+{
+    const size_t figureCount   = 100000;
+    const CSize  size(800, 600);
+    const long   pixelHeights[] = { 6, 7, 9, 11, 13, 17, 40 };
+    for (auto pixelHeight : pixelHeights) {
+        auto extent = StandardLogFont::defaultHeight * size.cy / pixelHeight;
+        while (GetDeviceHeight(extent, size) > pixelHeight)
+            extent += extent / 100;
+        while (GetDeviceHeight(extent, size) < pixelHeight)
+            extent -= extent / 200;
+        const CRect area(CPoint(0, 0), CSize(extent, extent));
+        CRasterDC   dc(size);
+        CadView::PrepareDC(dc, area, CRect(CPoint(), size));
+
+        // Each text is measured as the text tool does, or it would have no size and be drawn as a dot.
+        vector<shared_ptr<Figure>> figures;
+        for (size_t index = 0; index < figureCount; index++) {
+            const auto figure = new TextFigure(CPoint(Random(extent), Random(extent)), _T("MiniCad"));
+            figure->CalculateArea(dc);
+            figures.push_back(shared_ptr<Figure>(figure));
+        }
+        CadData cadData;
+        cadData.Add(figures);
+
+        TaskScheduler scheduler(0);
+        TiledRasterizer::Render(cadData.GetSnapshot(), area, dc, TiledRasterizer::defaultTileSize, scheduler);
+        auto time = numeric_limits<double>::max();
+        for (int repeat = 0; repeat < 3; repeat++)
+            time = Math::Min(time, Measure([&] { TiledRasterizer::Render(cadData.GetSnapshot(), area, dc, TiledRasterizer::defaultTileSize, scheduler); }));
+        const auto deviceHeight = GetDeviceHeight(extent, size);
+        const auto path = deviceHeight <= LevelOfDetail::greekingHeight ? "bar" : deviceHeight <= GlyphAtlas::maximumHeight ? "atlas" : "dot by dot";
+        printf("  %zu texts of %2ld px to %ldx%ld, %-10s: %.0f ms\n", figureCount, deviceHeight, size.cx, size.cy, path, time);
+    }
+}
+
+// What journaling adds to an edit on the UI thread: batches of the same moves of a figure with and without a journal,
+// taken in turn and the best of each kept, including the time the flush thread takes from the UI thread and a final flush.
+void BenchmarkJournal()
+{
+    const size_t figureCount = 1000;
+    const int    editCount   = 2000; // per batch
+    const int    batchCount  = 8;
+    const auto   path        = "Benchmark." + to_string(getpid()) + ".journal";
+    {
+        OperationJournal journal(tstring(path.begin(), path.end()));
+        CadData          plainData, journaledData;
+        journaledData.Recover(journal, 0);
+        for (auto cadData : { &plainData, &journaledData }) {
+            cadData->Add(MakeGrid(figureCount));
+            cadData->SelectAlone(CPoint(0, 0), 1000);
+        }
+        const auto edit = [&](CadData& cadData) {
+            for (int step = 0; step < editCount; step++)
+                cadData.MoveSelection(CSize(1, 1));
+        };
+
+        auto plainTime = numeric_limits<double>::max(), journaledTime = numeric_limits<double>::max();
+        for (int batch = 0; batch < batchCount; batch++) {
+            plainTime     = Math::Min(plainTime    , Measure([&] { edit(plainData); }));
+            journaledTime = Math::Min(journaledTime, Measure([&] {
+                edit(journaledData);
+                journal.Flush();
+            }));
+        }
+        printf("  moves in %zu figures: %.2f us per edit without a journal, %.2f us with one; journaling %.2f us\n", figureCount,
+               plainTime * 1000.0 / editCount, journaledTime * 1000.0 / editCount, (journaledTime - plainTime) * 1000.0 / editCount);
+    }
+    unlink(path.c_str());
+}
+
+// Busy work of units steps.
+void Spin(uint64_t units)
+{
+    static atomic<uint64_t> sink(0);
+    uint64_t                value = 0;
+    for (uint64_t step = 0; step < units * 64; step++)
+        value = value * 6364136223846793005ULL + step;
+    sink += value;
+}
+
+// The work each thread of scheduler did on a skewed load, over its fair share: 2% of the items, all at the start, carry
+// 70% of the work. The same for a static split into one contiguous range per thread.
+pair<double, double> GetSkew(TaskScheduler& scheduler)
+{
+    const size_t     itemCount  = 10000;
+    const size_t     heavyCount = itemCount / 50;
+    const uint64_t   lightUnits = 3;
+    const uint64_t   heavyUnits = lightUnits * 7 * (itemCount - heavyCount) / (3 * heavyCount);
+    const auto       units      = [&](size_t item) { return item < heavyCount ? heavyUnits : lightUnits; };
+    const auto       threads    = scheduler.GetConcurrency();
+    vector<uint64_t> done(threads, 0);
+    scheduler.ParallelFor(0, itemCount, 16, [&](size_t first, size_t last) {
+        const auto worker = scheduler.GetCurrentWorker();
+        for (auto item = first; item < last; item++) {
+            Spin(units(item));
+            done[worker == TaskScheduler::anyWorker ? threads - 1 : worker] += units(item);
+        }
+    });
+
+    uint64_t total = 0, staticBusiest = 0;
+    for (size_t thread = 0; thread < threads; thread++) {
+        uint64_t range = 0;
+        for (auto item = itemCount * thread / threads; item < itemCount * (thread + 1) / threads; item++)
+            range += units(item);
+        total        += range;
+        staticBusiest = Math::Max(staticBusiest, range);
+    }
+    const auto fair = double(total) / threads;
+    return make_pair(*max_element(done.begin(), done.end()) / fair, staticBusiest / fair);
+}
+
+// The cost of a task to the scheduler, as leaves of a parallel for and queued one by one, and how evenly stealing spreads
+// a skewed load over 4 and 8 threads. With fewer processors than threads the threads are time-sliced.
+void BenchmarkScheduler()
+{
+    const size_t taskCount = 200000;
+    for (size_t workerCount : { 0, 3, 7 }) {
+        TaskScheduler scheduler(workerCount);
+        const auto    forTime   = Measure([&] { scheduler.ParallelFor(0, taskCount, 1, [](size_t, size_t) {}); });
+        const auto    queueTime = Measure([&] {
+            TaskScheduler::TaskGroup group(scheduler);
+            for (size_t task = 0; task < taskCount; task++)
+                group.Run([] {});
+            group.Wait();
+        });
+        printf("  threads %zu: %.0f ns per parallel for leaf, %.0f ns per task queued", scheduler.GetConcurrency(),
+               forTime * 1e6 / taskCount, queueTime * 1e6 / taskCount);
+        if (workerCount > 0) {
+            const auto skew = GetSkew(scheduler);
+            printf("; skewed load, busiest thread %.2fx its share, %.2fx split statically", skew.first, skew.second);
+        }
+        printf("\n");
+    }
+}
+
+// The nearest figure search of selection on a million lines, one in five a copy of the one before so that ties are
+// common, against a single pass over the figures with the same tie rule. Each query must pick the same figure; the
+// search runs on the shared pool, and its time includes selecting.
+void BenchmarkSearch()
+{
+    const size_t               figureCount = 1000000;
+    const int                  queryCount  = 20;
+    vector<shared_ptr<Figure>> figures;
+    for (size_t index = 0; index < figureCount; index++) {
+        if (index % 5 == 4) {
+            figures.push_back(shared_ptr<Figure>(figures.back()->Clone()));
+        } else {
+            const CPoint point(Random(100000), Random(100000));
+            figures.push_back(shared_ptr<Figure>(new LineFigure(CLine(point, point + CSize(Random(2000), Random(2000))))));
+        }
+    }
+    CadData cadData;
+    cadData.Add(figures);
+
+    for (long minimumDistance : { 100L, 1000L, 100000L }) {
+        auto   searchTime = 0.0, passTime = 0.0;
+        size_t matchCount = 0;
+        for (int query = 0; query < queryCount; query++) {
+            const CPoint point(Random(100000), Random(100000));
+            const Figure* nearest = nullptr;
+            passTime += Measure([&] {
+                auto distance = minimumDistance;
+                for (const auto& figure : cadData) {
+                    const auto figureDistance = figure->GetDistance(point);
+                    if (figureDistance < distance) {
+                        distance = figureDistance;
+                        nearest  = figure.get();
+                    }
+                }
+            });
+            searchTime += Measure([&] { cadData.SelectAlone(point, minimumDistance); });
+            const auto selected = find_if(cadData.begin(), cadData.end(), [](const shared_ptr<Figure>& figure) { return figure->IsSelected(); });
+            if ((selected == cadData.end() ? nullptr : selected->get()) == nearest)
+                matchCount++;
+        }
+        printf("  %zu lines, distance %6ld, threads %zu: %.1f ms per search and select, %.1f ms per single pass; %zu of %d the same\n",
+               figureCount, minimumDistance, TaskScheduler::Get().GetConcurrency(), searchTime / queryCount, passTime / queryCount, matchCount, queryCount);
+    }
+}
+
+struct Benchmark
+{
+    const char* name;
+    void        (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    { "columns"  , BenchmarkColumns   },
+    { "export"   , BenchmarkExport    },
+    { "tiles"    , BenchmarkTiles     },
+    { "text"     , BenchmarkText      },
+    { "journal"  , BenchmarkJournal   },
+    { "scheduler", BenchmarkScheduler },
+    { "search"   , BenchmarkSearch    },
+};
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    srand(1);
+    auto isFound = true;
+    for (int argument = 1; argument < argc; argument++)
+        isFound = isFound && any_of(begin(benchmarks), end(benchmarks), [&](const Benchmark& benchmark) { return strcmp(benchmark.name, argv[argument]) == 0; });
+    if (!isFound) {
+        printf("benchmarks:");
+        for (const auto& benchmark : benchmarks)
+            printf(" %s", benchmark.name);
+        printf("\n");
+        return 1;
+    }
+    for (const auto& benchmark : benchmarks) {
+        if (argc == 1 || any_of(argv + 1, argv + argc, [&](const char* name) { return strcmp(benchmark.name, name) == 0; })) {
+            printf("%s\n", benchmark.name);
+            fflush(stdout);
+            benchmark.run();
+        }
+    }
+    return 0;
+}
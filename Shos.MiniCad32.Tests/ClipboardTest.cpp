@@ -0,0 +1,101 @@
+// Copies a selection through the in-process clipboard and pastes it back: the figures round-trip, the paste is one undo
+// group, and a truncated clipboard is rejected without changing the document.
+#include "Test.h"
+
+using namespace Test;
+
+namespace {
+
+// Selects every seventh figure and a run in the middle.
+void SelectSome(CadData& cadData)
+{
+    size_t index = 0;
+    for (const auto& figure : cadData) {
+        figure->Select(index % 7 == 0 || (index >= 40 && index < 60));
+        index++;
+    }
+}
+
+vector<shared_ptr<Figure>> GetSelection(const CadData& cadData)
+{
+    vector<shared_ptr<Figure>> selection;
+    for (const auto& figure : cadData) {
+        if (figure->IsSelected())
+            selection.push_back(figure);
+    }
+    return selection;
+}
+
+vector<shared_ptr<Figure>> GetLast(const CadData& cadData, size_t count)
+{
+    vector<shared_ptr<Figure>> figures(cadData.begin(), cadData.end());
+    return vector<shared_ptr<Figure>>(figures.end() - count, figures.end());
+}
+
+void TestRoundTrip(size_t figureCount)
+{
+    CadData cadData;
+    Build(cadData, figureCount);
+    SelectSome(cadData);
+    const auto copied      = Dump(GetSelection(cadData));
+    const auto copiedCount = GetSelection(cadData).size();
+
+    // Pasting selects only the pasted figures, and the selection is not undone, so the undo is compared without it.
+    MemoryClipboard clipboard;
+    cadData.Copy(clipboard);
+    const auto before    = Dump(cadData, false);
+    const auto undoCount = cadData.GetUndoBuffer().GetUndoCount();
+    cadData.Paste(clipboard);
+    const auto pasted    = Dump(cadData);
+    Check(size_t(distance(cadData.begin(), cadData.end())) == figureCount + copiedCount, "paste", "the figure count differs");
+    Check(Dump(GetLast(cadData, copiedCount)) == copied                                , "paste", "the pasted figures differ from the copied ones");
+    Check(cadData.GetUndoBuffer().GetUndoCount() == undoCount + 1                     , "paste", "the paste is not a single undo group");
+
+    cadData.Undo();
+    Check(Dump(cadData, false) == before, "paste", "one undo does not remove every pasted figure");
+    cadData.Redo();
+    Check(Dump(cadData) == pasted       , "paste", "the redo differs");
+
+    // A second paste of the same data adds the same figures again.
+    cadData.Paste(clipboard);
+    Check(Dump(GetLast(cadData, copiedCount)) == copied, "paste", "a second paste differs");
+}
+
+void TestTruncated(size_t figureCount)
+{
+    CadData cadData;
+    Build(cadData, figureCount);
+    SelectSome(cadData);
+    MemoryClipboard clipboard;
+    cadData.Copy(clipboard);
+    vector<uint8_t> data;
+    clipboard.GetData(data);
+    Check(data.size() > 0, "truncated", "nothing was copied");
+
+    const auto before    = Dump(cadData);
+    const auto undoCount = cadData.GetUndoBuffer().GetUndoCount();
+    auto       isKept    = true;
+    for (size_t size = 0; size < data.size(); size++) {
+        MemoryClipboard truncated;
+        truncated.SetData(vector<uint8_t>(data.begin(), data.begin() + size));
+        cadData.Paste(truncated);
+        isKept = isKept && Dump(cadData) == before && cadData.GetUndoBuffer().GetUndoCount() == undoCount;
+    }
+    Check(isKept, "truncated", "a truncated clipboard changed the document or its history");
+
+    // An empty clipboard pastes nothing.
+    MemoryClipboard empty;
+    cadData.Paste(empty);
+    Check(Dump(cadData) == before, "empty", "an empty clipboard changed the document");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const size_t figureCount = argc > 1 ? size_t(atol(argv[1])) : 300;
+    srand(1);
+    TestRoundTrip(figureCount);
+    TestTruncated(figureCount);
+    return Report();
+}
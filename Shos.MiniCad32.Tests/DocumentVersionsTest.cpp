@@ -0,0 +1,148 @@
+// Edits a document while readers on other threads pin its versions and render them, and checks that each pin saw the
+// document exactly as it was published, and that without a reader no version is kept to make the document copy on write.
+// Meant to be run under ThreadSanitizer as well: make tsan.
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <thread>
+#include "Test.h"
+
+using namespace Test;
+
+namespace {
+
+// Selection goes through the document too, as the figures may be shared with the versions being read.
+void Select(CadData& cadData, int count)
+{
+    cadData.SelectAlone(CPoint(Random(100000), Random(100000)), 100000);
+    for (int index = 1; index < count; index++)
+        cadData.ToggleSelect(CPoint(Random(100000), Random(100000)), 100000);
+}
+
+vector<const Figure*> GetFigures(const CadData& cadData)
+{
+    vector<const Figure*> figures;
+    for (const auto& figure : cadData)
+        figures.push_back(figure.get());
+    return figures;
+}
+
+// The edits of the commands; each is followed by a publish, as the command manager does.
+void Edit(CadData& cadData, int step)
+{
+    switch (step % 5) {
+        case 0:
+            Select(cadData, 20);
+            cadData.MoveSelection(CSize(Random(100) - 50, 3));
+            break;
+        case 1: {
+            Select(cadData, 5);
+            LongOperationRunner runner;
+            runner.Start(cadData.ColorSelectionInSlices(RGB(step, 1, 2)));
+            runner.Finish();
+            break;
+        }
+        case 2:
+            Select(cadData, 50);
+            cadData.Delete();
+            cadData.Undo();
+            break;
+        case 3:
+            Select(cadData, 1);
+            cadData.Delete();
+            break;
+        default:
+            cadData.Undo();
+            cadData.Undo();
+            cadData.Redo();
+            break;
+    }
+}
+
+void TestReaders(size_t figureCount, int stepCount, int readerCount)
+{
+    CadData cadData;
+    Build(cadData, figureCount);
+    DocumentVersions versions(cadData);
+
+    // The writer's own reader tells it the number of each version it publishes.
+    DocumentVersions::Reader writerReader(versions);
+    map<uint64_t, size_t>    expected;
+    expected[DocumentVersions::Pin(writerReader).GetNumber()] = Hash(cadData);
+
+    atomic<bool>                           isDone(false);
+    vector<vector<pair<uint64_t, size_t>>> seen(readerCount);
+    vector<thread>                         readers;
+    for (int readerIndex = 0; readerIndex < readerCount; readerIndex++) {
+        // Readers are made on the writer's thread.
+        shared_ptr<DocumentVersions::Reader> reader(new DocumentVersions::Reader(versions));
+        readers.push_back(thread([&, reader, readerIndex] {
+            for (unsigned pinCount = 1; !isDone.load(); pinCount++) {
+                const DocumentVersions::Pin pin(*reader);
+                seen[size_t(readerIndex)].push_back(make_pair(pin.GetNumber(), Hash(pin.GetSnapshot())));
+                if (pinCount % 4 == 0) {
+                    const CRect  area(CPoint(0, 0), CSize(104000, 104000));
+                    CRasterDC    dc(CSize(64, 64));
+                    stringstream stream;
+                    TiledRasterizer::Render(pin.GetSnapshot(), area, dc, 16);
+                    RasterExporter::ExportPngBanded(pin.GetSnapshot(), area, CSize(48, 48), 8, 2, stream);
+                }
+            }
+        }));
+    }
+    for (int step = 0; step < stepCount; step++) {
+        Edit(cadData, step);
+        versions.Publish();
+        expected[DocumentVersions::Pin(writerReader).GetNumber()] = Hash(cadData);
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+    isDone = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    size_t pinCount = 0;
+    auto   isSeen   = true;
+    for (const auto& readerSeen : seen) {
+        for (const auto& version : readerSeen) {
+            pinCount++;
+            const auto found = expected.find(version.first);
+            isSeen = isSeen && found != expected.end() && found->second == version.second;
+        }
+    }
+    Check(pinCount > 0, "no reader pinned a version");
+    Check(isSeen      , "a reader saw a version other than the one published");
+    versions.Publish();
+    Check(versions.GetRetiredCount() == 0, "versions were left after the readers were done");
+}
+
+// With the readers gone the next publish lets go of the last version, and the document changes its figures in place.
+void TestNoReader()
+{
+    CadData cadData;
+    Build(cadData, 100);
+    DocumentVersions versions(cadData);
+    {
+        DocumentVersions::Reader reader(versions);
+        const DocumentVersions::Pin pin(reader);
+    }
+    versions.Publish();
+    const auto figures = GetFigures(cadData);
+    Select(cadData, 10);
+    cadData.MoveSelection(CSize(1, 1));
+    Check(GetFigures(cadData) == figures  , "a figure was copied with no reader");
+    Check(versions.GetRetiredCount() == 0 , "a version was kept with no reader");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const size_t figureCount = argc > 1 ? size_t(atol(argv[1])) : 2000;
+    const int    stepCount   = argc > 2 ? atoi(argv[2])         : 300;
+    const int    readerCount = argc > 3 ? atoi(argv[3])         : 4;
+    srand(1);
+    TestNoReader();
+    TestReaders(figureCount, stepCount, readerCount);
+    return Report();
+}
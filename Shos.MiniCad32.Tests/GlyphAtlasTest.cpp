@@ -0,0 +1,25 @@
+// Fills the glyph atlas with a page of every height, and checks that it stays within its capacity by evicting the pages
+// least recently used, while a page still held stays valid.
+#include "Test.h"
+
+using namespace Test;
+
+int main()
+{
+    auto& atlas = GlyphAtlas::Get();
+
+    const auto heldPage = atlas.Find(1);
+    const auto heldRuns = heldPage->GetLastRun(_T('W')) - heldPage->GetFirstRun(_T('W'));
+    shared_ptr<const GlyphAtlas::Page> lastPage;
+    size_t                             pagesSize = 0;
+    for (long height = 1; height <= GlyphAtlas::maximumHeight; height++) {
+        lastPage   = atlas.Find(height);
+        pagesSize += lastPage->GetSize();
+    }
+    Check(pagesSize > GlyphAtlas::capacity, "atlas", "every page fits, so nothing is ever evicted");
+    Check(atlas.GetSize() <= GlyphAtlas::capacity, "atlas", "the atlas outgrew its capacity");
+    Check(atlas.Find(1) != heldPage, "atlas", "the page least recently used was not evicted");
+    Check(heldPage->GetLastRun(_T('W')) - heldPage->GetFirstRun(_T('W')) == heldRuns, "atlas", "an evicted page still held changed");
+    Check(atlas.Find(GlyphAtlas::maximumHeight) == lastPage, "atlas", "the page most recently used was evicted");
+    return Report();
+}
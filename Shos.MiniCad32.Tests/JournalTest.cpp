@@ -0,0 +1,112 @@
+// Autosaves an edited document again and again and checks that each autosave compacts the journal down to the changes
+// since it, that a crash recovers the document from the autosave and what is left of the journal, and that a compacted
+// journal whose autosave is gone is not replayed on an empty document.
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Test.h"
+
+using namespace Test;
+
+namespace {
+
+long long GetFileSize(const string& path)
+{
+    struct stat status;
+    return stat(path.c_str(), &status) == 0 ? (long long)status.st_size : -1;
+}
+
+void Edit(CadData& cadData, int step)
+{
+    switch (step % 4) {
+        case 0:
+            cadData.Add(MakeFigures(8));
+            break;
+        case 1:
+            cadData.SelectAlone(CPoint(Random(100000), Random(100000)), 100000);
+            cadData.MoveSelection(CSize(Random(100) - 50, 7));
+            break;
+        case 2:
+            cadData.SelectAlone(CPoint(Random(100000), Random(100000)), 100000);
+            cadData.Delete();
+            break;
+        default:
+            cadData.Undo();
+            cadData.Undo();
+            cadData.Redo();
+            break;
+    }
+}
+
+void TestCompaction(const string& journalPath, const string& autosavePath, size_t figureCount)
+{
+    const tstring journalFile (journalPath .begin(), journalPath .end());
+    const tstring autosaveFile(autosavePath.begin(), autosavePath.end());
+    const int     roundCount      = 20;
+    const int     editCount       = 6;  // per round
+    long long     largestUnsaved  = 0;  // the journal before an autosave
+    long long     largestCompacted = 0; // and after it
+    string        crashed;
+    {
+        OperationJournal journal(journalFile);
+        CadData          cadData;
+        cadData.Recover(journal, 0);
+        Build(cadData, figureCount);
+        Autosaver autosaver(cadData, autosaveFile);
+        for (int round = 0; round < roundCount; round++) {
+            for (int step = 0; step < editCount; step++)
+                Edit(cadData, round * editCount + step);
+            journal.Flush();
+            largestUnsaved = Math::Max(largestUnsaved, GetFileSize(journalPath));
+            Check(autosaver.Save(), "compaction", "an autosave did not start");
+            autosaver.Flush();
+            journal.Flush();
+            largestCompacted = Math::Max(largestCompacted, GetFileSize(journalPath));
+        }
+        // Changes after the last autosave, undoing across its checkpoint too, and then a crash.
+        for (int step = 0; step < editCount; step++)
+            Edit(cadData, step);
+        cadData.Undo();
+        cadData.Undo();
+        cadData.Undo();
+        journal.Flush();
+        crashed = Dump(cadData, false);
+    }
+    Check(largestUnsaved > 256  , "compaction", "the edits were not journaled");
+    Check(largestCompacted < 64 , "compaction", "an autosave left more than its checkpoint in the journal");
+
+    {
+        OperationJournal journal(journalFile);
+        CadData          cadData;
+        uint64_t         checkpoint = 0;
+        Check(Autosaver::Load(cadData, autosaveFile, checkpoint), "recovery", "the autosave could not be read");
+        Check(journal.GetRecoveredRecords().size() <= size_t(editCount * 4 + 4), "recovery", "the journal holds more than the changes since the autosave");
+        cadData.Recover(journal, checkpoint);
+        Check(Dump(cadData, false) == crashed, "recovery", "the recovered document differs");
+    }
+
+    // Without the autosave the changes left in the journal have nothing to apply to.
+    unlink(autosavePath.c_str());
+    {
+        OperationJournal journal(journalFile);
+        CadData          cadData;
+        uint64_t         checkpoint = 0;
+        Check(!Autosaver::Load(cadData, autosaveFile, checkpoint), "lost autosave", "a deleted autosave was read");
+        cadData.Recover(journal, checkpoint);
+        Check(Dump(cadData).empty(), "lost autosave", "the changes to a lost autosave were replayed on an empty document");
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const size_t figureCount  = argc > 1 ? size_t(atol(argv[1])) : 2000;
+    const string name         = "JournalTest." + to_string(getpid());
+    const string journalPath  = name + ".journal";
+    const string autosavePath = name + ".autosave";
+    srand(1);
+    TestCompaction(journalPath, autosavePath, figureCount);
+    unlink(journalPath .c_str());
+    unlink(autosavePath.c_str());
+    return Report();
+}
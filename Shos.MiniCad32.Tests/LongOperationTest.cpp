@@ -0,0 +1,139 @@
+// Runs the long operations headless, a slice at a time as the message loop would, and checks each against the same
+// operation run to the end at once: the result, the undo history, progress, cancellation and journal recovery.
+#include <unistd.h>
+#include "Test.h"
+
+using namespace Test;
+
+namespace {
+
+// The same figures for the same seed, with a selection of runs and single figures.
+void Build(CadData& cadData, size_t figureCount, unsigned seed)
+{
+    srand(seed);
+    Test::Build(cadData, figureCount);
+    size_t index = 0;
+    for (const auto& figure : cadData) {
+        figure->Select((index / 37) % 3 == 0 || index % 11 == 0);
+        index++;
+    }
+}
+
+// The message loop: a slice per pass, cancelling before the slice numbered cancelSlice.
+int RunLoop(LongOperationRunner& runner, long sliceTime, int cancelSlice, bool& isMonotonic)
+{
+    int      sliceCount = 0;
+    unsigned percentage = 0;
+    isMonotonic         = true;
+    while (runner.IsRunning()) {
+        if (sliceCount == cancelSlice)
+            runner.Cancel();
+        runner.RunSlice(sliceTime);
+        sliceCount++;
+        if (runner.GetPercentage() < percentage)
+            isMonotonic = false;
+        percentage = runner.GetPercentage();
+    }
+    return sliceCount;
+}
+
+struct Operation
+{
+    const char*                       name;
+    function<LongOperation(CadData&)> start;
+};
+
+// Returns the slice count.
+int TestSlices(const Operation& operation, size_t figureCount)
+{
+    CadData sliced;
+    CadData whole;
+    Build(sliced, figureCount, 1);
+    Build(whole , figureCount, 1);
+    const auto original = Dump(sliced);
+    const auto snapshot = sliced.GetSnapshot(); // a live snapshot makes the figures copy on write
+
+    LongOperationRunner runner;
+    bool                isMonotonic = false;
+    runner.Start(operation.start(sliced));
+    const auto sliceCount = RunLoop(runner, 0, -1, isMonotonic);
+    runner.Start(operation.start(whole));
+    runner.Finish();
+
+    Check(sliceCount > 1                 , operation.name, "ran in a single slice");
+    Check(isMonotonic                    , operation.name, "progress went back");
+    Check(Dump(sliced) == Dump(whole)    , operation.name, "the result differs from one run at once");
+    Check(Dump(snapshot) == original     , operation.name, "the snapshot changed");
+    sliced.Undo();
+    Check(Dump(sliced) == original       , operation.name, "a single undo does not take it back");
+    sliced.Undo();
+    whole .Undo();
+    whole .Undo();
+    Check(Dump(sliced) == Dump(whole)    , operation.name, "the history differs");
+    sliced.Redo();
+    sliced.Redo();
+    whole .Redo();
+    whole .Redo();
+    Check(Dump(sliced) == Dump(whole)    , operation.name, "the redo differs");
+    return sliceCount;
+}
+
+// A cancelled operation leaves the document and the history as they were, in memory and as the journal recovers them.
+void TestCancel(const Operation& operation, size_t figureCount, int cancelSlice)
+{
+    const string  path = "LongOperationTest." + to_string(getpid()) + ".journal";
+    const tstring journalPath(path.begin(), path.end());
+    string before;     // without the selection
+    string recovered;
+    string undone;
+    {
+        OperationJournal journal(journalPath);
+        CadData          cadData;
+        cadData.Recover(journal, 0);
+        Build(cadData, figureCount, 1);
+        cadData.MoveSelection(CSize(1, 1)); // something to undo
+        const auto selected = Dump(cadData);
+        before              = Dump(cadData, false);
+
+        LongOperationRunner runner;
+        bool                isMonotonic = false;
+        runner.Start(operation.start(cadData));
+        RunLoop(runner, 0, cancelSlice, isMonotonic);
+        Check(Dump(cadData) == selected, operation.name, "a cancel left changes");
+        cadData.Redo();
+        Check(Dump(cadData) == selected, operation.name, "a cancel left a group to redo");
+        cadData.Undo();
+        undone = Dump(cadData, false);
+        cadData.Redo();
+        journal.Flush();
+    }
+    {
+        OperationJournal journal(journalPath);
+        CadData          cadData;
+        cadData.Recover(journal, 0);
+        recovered = Dump(cadData, false);
+        cadData.Redo();
+        Check(Dump(cadData, false) == recovered, operation.name, "the recovered history has a group to redo");
+        cadData.Undo();
+        Check(Dump(cadData, false) == undone   , operation.name, "the recovered history differs");
+    }
+    Check(recovered == before, operation.name, "the recovered document differs");
+    unlink(path.c_str());
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const size_t figureCount = argc > 1 ? size_t(atol(argv[1])) : 20000;
+    const Operation operations[] = {
+        { "delete", [](CadData& cadData) { return cadData.DeleteInSlices(); }                    },
+        { "color" , [](CadData& cadData) { return cadData.ColorSelectionInSlices(RGB(1, 2, 3)); } },
+    };
+    for (const auto& operation : operations) {
+        const auto sliceCount = TestSlices(operation, figureCount);
+        for (auto cancelSlice : { 0, 1, sliceCount / 2, sliceCount - 2, sliceCount - 1 })
+            TestCancel(operation, figureCount, cancelSlice);
+    }
+    return Report();
+}
@@ -0,0 +1,96 @@
+#pragma once
+// What the tests share: the application source built against the Win32 stand-ins, checks, and documents to test on.
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include "Win32/windows.h"
+// LONG is 32 bits on Windows.
+#undef LONG_MAX
+#define LONG_MAX 2147483647L
+#undef LONG_MIN
+#define LONG_MIN (-LONG_MAX - 1L)
+#include "../Shos.MiniCad32/MiniCad32.cpp"
+
+using namespace Shos::MiniCad;
+using namespace Shos::MiniCad::CadCore;
+using namespace Shos::MiniCad::Application;
+using namespace Shos::MiniCad::Windows;
+
+namespace Test {
+
+inline int failureCount = 0;
+
+inline void Check(bool condition, const char* what)
+{
+    if (!condition) {
+        printf("%s\n", what);
+        failureCount++;
+    }
+}
+
+inline void Check(bool condition, const char* name, const char* what)
+{
+    if (!condition) {
+        printf("%s: %s\n", name, what);
+        failureCount++;
+    }
+}
+
+// Prints the outcome and returns the exit code.
+inline int Report()
+{
+    printf(failureCount == 0 ? "passed\n" : "%d failed\n", failureCount);
+    return failureCount == 0 ? 0 : 1;
+}
+
+inline long Random(long n)
+{
+    return long(((unsigned long)rand() << 16 ^ (unsigned long)rand()) % (unsigned long)n);
+}
+
+// The figures as text; the selection is left out where it is compared with a recovered document, as it is not journaled.
+template <class TFigures>
+string Dump(const TFigures& figures, bool withSelection = true)
+{
+    string text;
+    for (const auto& figure : figures) {
+        const auto bounds = figure->GetBoundRect();
+        char       line[128];
+        snprintf(line, sizeof(line), "%ld,%ld,%ld,%ld/%lu/%d/%zu;", long(bounds.left), long(bounds.top), long(bounds.right), long(bounds.bottom),
+                 (unsigned long)figure->GetColor(), int(withSelection && figure->IsSelected()), figure->GetText().size());
+        text += line;
+    }
+    return text;
+}
+
+template <class TFigures>
+size_t Hash(const TFigures& figures)
+{
+    return std::hash<string>()(Dump(figures));
+}
+
+// Random lines, rectangles, ellipses and texts in turn, none selected.
+inline vector<shared_ptr<Figure>> MakeFigures(size_t figureCount)
+{
+    vector<shared_ptr<Figure>> figures;
+    for (size_t index = 0; index < figureCount; index++) {
+        const CPoint point1(Random(100000), Random(100000));
+        const CPoint point2(point1.x + 1 + Random(4000), point1.y + Random(4000));
+        switch (index % 4) {
+            case 0 : figures.push_back(shared_ptr<Figure>(new LineFigure     (CLine(point1, point2)))); break;
+            case 1 : figures.push_back(shared_ptr<Figure>(new RectangleFigure(CRect(point1, point2)))); break;
+            case 2 : figures.push_back(shared_ptr<Figure>(new EllipseFigure  (CRect(point1, point2)))); break;
+            default: figures.push_back(shared_ptr<Figure>(new TextFigure     (point1, _T("text")   ))); break;
+        }
+    }
+    return figures;
+}
+
+inline void Build(CadData& cadData, size_t figureCount)
+{
+    cadData.Add(MakeFigures(figureCount));
+}
+
+} // namespace Test
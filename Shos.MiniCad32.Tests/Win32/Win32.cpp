@@ -0,0 +1,133 @@
+// The definitions of the functions windows.h declares.
+#include "windows.h"
+#include <cstring>
+#include <algorithm>
+BOOL MoveToEx(HDC a0, int a1, int a2, POINT* a3) { return BOOL{}; }
+BOOL LineTo(HDC a0, int a1, int a2) { return BOOL{}; }
+BOOL Rectangle(HDC a0, int a1, int a2, int a3, int a4) { return BOOL{}; }
+BOOL Ellipse(HDC a0, int a1, int a2, int a3, int a4) { return BOOL{}; }
+BOOL Polyline(HDC a0, const POINT* a1, int a2) { return BOOL{}; }
+BOOL PolyPolyline(HDC a0, const POINT* a1, const DWORD* a2, DWORD a3) { return BOOL{}; }
+BOOL Arc(HDC a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7, int a8) { return BOOL{}; }
+BOOL SetPixelV(HDC a0, int a1, int a2, COLORREF a3) { return BOOL{}; }
+int FillRect(HDC a0, const RECT* a1, HBRUSH a2) { return int{}; }
+HGDIOBJ SelectObject(HDC a0, HGDIOBJ a1) { return HGDIOBJ{}; }
+HGDIOBJ GetStockObject(int a0) { return HGDIOBJ{}; }
+HBRUSH CreateSolidBrush(COLORREF a0) { return HBRUSH{}; }
+BOOL DeleteObject(HGDIOBJ a0) { return BOOL{}; }
+int DrawTextW(HDC a0, LPCWSTR a1, int a2, RECT* a3, UINT a4) { return int{}; }
+int DrawTextW(HDC a0, LPWSTR a1, int a2, RECT* a3, UINT a4) { return int{}; }
+BOOL ExtTextOutW(HDC a0, int a1, int a2, UINT a3, const RECT* a4, LPCWSTR a5, UINT a6, const int* a7) { return BOOL{}; }
+COLORREF SetTextColor(HDC a0, COLORREF a1) { return COLORREF{}; }
+int SetBkMode(HDC a0, int a1) { return int{}; }
+int SetROP2(HDC a0, int a1) { return int{}; }
+int SetMapMode(HDC a0, int a1) { return int{}; }
+BOOL SetWindowOrgEx(HDC a0, int a1, int a2, POINT* a3) { return BOOL{}; }
+BOOL SetWindowExtEx(HDC a0, int a1, int a2, SIZE* a3) { return BOOL{}; }
+BOOL SetViewportOrgEx(HDC a0, int a1, int a2, POINT* a3) { return BOOL{}; }
+BOOL SetViewportExtEx(HDC a0, int a1, int a2, SIZE* a3) { return BOOL{}; }
+BOOL DPtoLP(HDC a0, POINT* a1, int a2) { return BOOL{}; }
+BOOL LPtoDP(HDC a0, POINT* a1, int a2) { return BOOL{}; }
+HPEN CreatePen(int a0, int a1, COLORREF a2) { return (HPEN)1; }
+HFONT CreateFontIndirect(const LOGFONT* a0) { return (HFONT)1; }
+HDC BeginPaint(HWND a0, PAINTSTRUCT* a1) { return HDC{}; }
+BOOL EndPaint(HWND a0, const PAINTSTRUCT* a1) { return BOOL{}; }
+HDC GetDC(HWND a0) { return HDC{}; }
+int ReleaseDC(HWND a0, HDC a1) { return int{}; }
+HDC CreateCompatibleDC(HDC a0) { static char c; return HDC(&c); }
+BOOL DeleteDC(HDC a0) { return BOOL{}; }
+HBITMAP CreateCompatibleBitmap(HDC a0, int a1, int a2) { static char c; return HBITMAP(&c); }
+BOOL BitBlt(HDC a0, int a1, int a2, int a3, int a4, HDC a5, int a6, int a7, DWORD a8) { return BOOL{}; }
+BOOL StretchBlt(HDC a0, int a1, int a2, int a3, int a4, HDC a5, int a6, int a7, int a8, int a9, DWORD a10) { return BOOL{}; }
+HBITMAP CreateDIBSection(HDC a0, const BITMAPINFO* a1, UINT a2, void** a3, HANDLE a4, DWORD a5) { return HBITMAP{}; }
+int SetDIBitsToDevice(HDC a0, int a1, int a2, DWORD a3, DWORD a4, int a5, int a6, UINT a7, UINT a8, const void* a9, const BITMAPINFO* a10, UINT a11) { return int{}; }
+BOOL DestroyWindow(HWND a0) { return BOOL{}; }
+BOOL MoveWindow(HWND a0, int a1, int a2, int a3, int a4, BOOL a5) { return BOOL{}; }
+BOOL ShowWindow(HWND a0, int a1) { return BOOL{}; }
+HWND SetFocus(HWND a0) { return HWND{}; }
+BOOL SetWindowTextW(HWND a0, LPCWSTR a1) { return BOOL{}; }
+int GetWindowTextW(HWND a0, LPWSTR a1, int a2) { return int{}; }
+BOOL GetClientRect(HWND a0, RECT* a1) { return BOOL{}; }
+BOOL InvalidateRect(HWND a0, const RECT* a1, BOOL a2) { return BOOL{}; }
+BOOL ShowScrollBar(HWND a0, int a1, BOOL a2) { return BOOL{}; }
+int SetScrollInfo(HWND a0, int a1, const SCROLLINFO* a2, BOOL a3) { return int{}; }
+BOOL GetScrollInfo(HWND a0, int a1, SCROLLINFO* a2) { return BOOL{}; }
+BOOL UpdateWindow(HWND a0) { return BOOL{}; }
+HWND GetParent(HWND a0) { return HWND{}; }
+LONG_PTR GetWindowLongPtr(HWND a0, int a1) { return LONG_PTR{}; }
+LONG_PTR SetWindowLongPtr(HWND a0, int a1, LONG_PTR a2) { return LONG_PTR{}; }
+HCURSOR LoadCursor(HINSTANCE a0, LPCWSTR a1) { return HCURSOR{}; }
+ATOM RegisterClassEx(const WNDCLASSEXW* a0) { return ATOM{}; }
+LRESULT DefWindowProc(HWND a0, UINT a1, WPARAM a2, LPARAM a3) { return LRESULT{}; }
+BOOL TrackMouseEvent(TRACKMOUSEEVENT* a0) { return BOOL{}; }
+HWND CreateWindowW(LPCWSTR a0, LPCWSTR a1, DWORD a2, int a3, int a4, int a5, int a6, HWND a7, HMENU a8, HINSTANCE a9, void* a10) { return HWND{}; }
+INT_PTR DialogBox(HINSTANCE a0, LPCWSTR a1, HWND a2, DLGPROC a3) { return INT_PTR{}; }
+BOOL EndDialog(HWND a0, INT_PTR a1) { return BOOL{}; }
+void PostQuitMessage(int a0) {  }
+BOOL GetMessage(MSG* a0, HWND a1, UINT a2, UINT a3) { return BOOL{}; }
+BOOL PeekMessage(MSG* a0, HWND a1, UINT a2, UINT a3, UINT a4) { return BOOL{}; }
+BOOL TranslateMessage(const MSG* a0) { return BOOL{}; }
+LRESULT DispatchMessage(const MSG* a0) { return LRESULT{}; }
+BOOL PostMessage(HWND a0, UINT a1, WPARAM a2, LPARAM a3) { return BOOL{}; }
+DWORD MsgWaitForMultipleObjectsEx(DWORD a0, const HANDLE* a1, DWORD a2, DWORD a3, DWORD a4) { return DWORD{}; }
+DWORD GetTickCount() { return DWORD{}; }
+void ZeroMemory(void* a0, size_t a1) { memset(a0,0,a1); }
+LPWSTR lstrcpy(LPWSTR a0, LPCWSTR a1) { return wcscpy(a0,a1); }
+int lstrlen(LPCWSTR a0) { return (int)wcslen(a0); }
+UINT RegisterClipboardFormat(LPCWSTR a0) { return UINT{}; }
+BOOL OpenClipboard(HWND a0) { return BOOL{}; }
+BOOL CloseClipboard() { return BOOL{}; }
+BOOL EmptyClipboard() { return BOOL{}; }
+HANDLE SetClipboardData(UINT a0, HANDLE a1) { return HANDLE{}; }
+HANDLE GetClipboardData(UINT a0) { return HANDLE{}; }
+BOOL IsClipboardFormatAvailable(UINT a0) { return BOOL{}; }
+HGLOBAL GlobalAlloc(UINT a0, size_t a1) { return HGLOBAL{}; }
+void* GlobalLock(HGLOBAL a0) { return nullptr; }
+BOOL GlobalUnlock(HGLOBAL a0) { return BOOL{}; }
+size_t GlobalSize(HGLOBAL a0) { return size_t{}; }
+HGLOBAL GlobalFree(HGLOBAL a0) { return HGLOBAL{}; }
+UINT_PTR SetTimer(HWND a0, uintptr_t a1, UINT a2, void* a3) { return UINT_PTR{}; }
+BOOL KillTimer(HWND a0, uintptr_t a1) { return BOOL{}; }
+BOOL IntersectRect(RECT* a0, const RECT* a1, const RECT* a2) { RECT r{std::max(a1->left,a2->left),std::max(a1->top,a2->top),std::min(a1->right,a2->right),std::min(a1->bottom,a2->bottom)}; if (r.left>=r.right||r.top>=r.bottom) { *a0 = RECT{0,0,0,0}; return 0; } *a0=r; return 1; }
+BOOL InflateRect(RECT* a0, int a1, int a2) { a0->left-=a1; a0->right+=a1; a0->top-=a2; a0->bottom+=a2; return 1; }
+BOOL UnionRect(RECT* a0, const RECT* a1, const RECT* a2) { *a0 = RECT{std::min(a1->left,a2->left),std::min(a1->top,a2->top),std::max(a1->right,a2->right),std::max(a1->bottom,a2->bottom)}; return 1; }
+BOOL IsRectEmpty(const RECT* a0) { return a0->right <= a0->left || a0->bottom <= a0->top; }
+BOOL PtInRect(const RECT* a0, POINT a1) { return BOOL{}; }
+BOOL OffsetRect(RECT* a0, int a1, int a2) { return BOOL{}; }
+void* operator new(std::size_t s, int, const char*, int) { return ::operator new(s); }
+void* operator new[](std::size_t s, int, const char*, int) { return ::operator new[](s); }
+int SetStretchBltMode(HDC, int) { return 0; } BOOL SetBrushOrgEx(HDC, int, int, POINT*) { return 1; } int SaveDC(HDC) { return 1; } BOOL RestoreDC(HDC, int) { return 1; }
+int GetClipBox(HDC, RECT* a0) { *a0 = RECT{0, 0, 0, 0}; return 1; }
+BOOL GetWindowOrgEx(HDC, POINT* a) { *a = POINT{0, 0}; return 1; }
+BOOL GetWindowExtEx(HDC, SIZE* a) { *a = SIZE{1, 1}; return 1; }
+BOOL GetViewportOrgEx(HDC, POINT* a) { *a = POINT{0, 0}; return 1; }
+BOOL GetViewportExtEx(HDC, SIZE* a) { *a = SIZE{1, 1}; return 1; }
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+static std::string Narrow(LPCWSTR s) { std::string r; while (*s) r += char(*s++); return r; }
+static LPWSTR Widen(const std::string& s, LPWSTR d) { for (char c : s) *d++ = c; *d = 0; return d; }
+DWORD GetTempPathW(DWORD, LPWSTR b) { Widen("/tmp/", b); return 5; }
+static int tempCounter = 0;
+UINT GetTempFileNameW(LPCWSTR f, LPCWSTR p, UINT, LPWSTR b) { auto s = Narrow(f) + Narrow(p) + std::to_string(getpid()) + "_" + std::to_string(tempCounter++) + ".tmp"; close(open(s.c_str(), O_CREAT|O_WRONLY, 0600)); Widen(s, b); return 1; }
+HANDLE CreateFileW(LPCWSTR n, DWORD, DWORD, void*, DWORD disp, DWORD flags, HANDLE) { auto s = Narrow(n); int fd = open(s.c_str(), O_RDWR|(disp == 3 ? 0 : O_CREAT)|(disp == 2 ? O_TRUNC : 0), 0600); if (fd < 0) return INVALID_HANDLE_VALUE; if (flags & FILE_FLAG_DELETE_ON_CLOSE) unlink(s.c_str()); return (HANDLE)(long)fd; }
+BOOL DeleteFileW(LPCWSTR n) { return unlink(Narrow(n).c_str()) == 0; }
+BOOL CloseHandle(HANDLE h) { return close(int((long)h)) == 0; }
+BOOL WriteFile(HANDLE h, const void* d, DWORD n, DWORD* w, void*) { auto r = write(int((long)h), d, n); if (r < 0) return 0; *w = DWORD(r); return 1; }
+BOOL ReadFile(HANDLE h, void* d, DWORD n, DWORD* w, void*) { auto r = read(int((long)h), d, n); if (r < 0) return 0; *w = DWORD(r); return 1; }
+BOOL SetFilePointerEx(HANDLE h, LARGE_INTEGER p, LARGE_INTEGER* o, DWORD m) { auto r = lseek(int((long)h), p.QuadPart, m == 0 ? SEEK_SET : m == 1 ? SEEK_CUR : SEEK_END); if (r < 0) return 0; if (o) o->QuadPart = r; return 1; }
+BOOL SetEndOfFile(HANDLE h) { int fd = int((long)h); return ftruncate(fd, lseek(fd, 0, SEEK_CUR)) == 0; }
+#include <sys/stat.h>
+#include <cstdio>
+#include <ctime>
+BOOL FlushFileBuffers(HANDLE h) { return fsync(int((long)h)) == 0; }
+BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER* s) { struct stat st; if (fstat(int((long)h), &st) != 0) return 0; s->QuadPart = st.st_size; return 1; }
+BOOL MoveFileExW(LPCWSTR a, LPCWSTR b, DWORD) { return rename(Narrow(a).c_str(), Narrow(b).c_str()) == 0; }
+#include <sys/resource.h>
+#include <sys/syscall.h>
+HANDLE GetCurrentThread() { return (HANDLE)(long)-2; }
+#include <sched.h>
+BOOL SetThreadPriority(HANDLE, int priority) { sched_param param{}; return sched_setscheduler((pid_t)syscall(SYS_gettid), priority < 0 ? SCHED_IDLE : SCHED_OTHER, &param) == 0; }
+int MessageBoxW(HWND, LPCWSTR, LPCWSTR, UINT) { return 1; }
+#include "commdlg.h"
+BOOL GetSaveFileNameW(OPENFILENAMEW*) { return FALSE; }
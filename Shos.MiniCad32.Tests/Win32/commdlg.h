@@ -0,0 +1,9 @@
+#pragma once
+#include "windows.h"
+struct OPENFILENAMEW { DWORD lStructSize; HWND hwndOwner; HINSTANCE hInstance; LPCWSTR lpstrFilter; LPWSTR lpstrCustomFilter; DWORD nMaxCustFilter, nFilterIndex; LPWSTR lpstrFile; DWORD nMaxFile; LPWSTR lpstrFileTitle; DWORD nMaxFileTitle; LPCWSTR lpstrInitialDir, lpstrTitle; DWORD Flags; WORD nFileOffset, nFileExtension; LPCWSTR lpstrDefExt; };
+typedef OPENFILENAMEW OPENFILENAME;
+#define OFN_OVERWRITEPROMPT 0x00000002
+#define OFN_HIDEREADONLY    0x00000004
+#define OFN_PATHMUSTEXIST   0x00000800
+BOOL GetSaveFileNameW(OPENFILENAMEW*);
+#define GetSaveFileName GetSaveFileNameW
@@ -0,0 +1,11 @@
+#pragma once
+#define _NORMAL_BLOCK 1
+#define _CRTDBG_ALLOC_MEM_DF 1
+#define _CRTDBG_LEAK_CHECK_DF 0x20
+#define _CRT_ERROR 1
+#define _CRT_WARN 0
+#define _CRTDBG_MODE_DEBUG 2
+inline int _CrtSetDbgFlag(int) { return 0; }
+inline int _CrtSetReportMode(int, int) { return 0; }
+#define _RPTW0(a, b) ((void)0)
+#define _RPT0(a, b) ((void)0)
@@ -0,0 +1,2 @@
+#pragma once
+#include "../../Shos.MiniCad32/Resource.h"
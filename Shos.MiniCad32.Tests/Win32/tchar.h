@@ -0,0 +1,7 @@
+#pragma once
+#include <cwchar>
+typedef wchar_t _TCHAR;
+typedef wchar_t TCHAR;
+#define _T(x) L##x
+template <size_t N, class... A> int _stprintf_s(wchar_t (&b)[N], const wchar_t* f, A... a) { return swprintf(b, N, f, a...); }
+#define _tcscmp wcscmp
@@ -0,0 +1,128 @@
+#pragma once
+// Just enough of the Win32 API for MiniCad32.cpp to build and run headless on POSIX: drawing and windowing do nothing,
+// files and threads are the real thing. Win32.cpp has the definitions.
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#define _In_
+#define _In_opt_
+#define APIENTRY
+#define CALLBACK
+#define TRUE 1
+#define FALSE 0
+typedef int BOOL; typedef unsigned int UINT; typedef unsigned long DWORD; typedef unsigned short WORD; typedef unsigned char BYTE;
+typedef long LONG; typedef intptr_t LONG_PTR; typedef intptr_t LRESULT; typedef uintptr_t WPARAM; typedef intptr_t LPARAM; typedef intptr_t INT_PTR;
+typedef unsigned short ATOM; typedef DWORD COLORREF; typedef wchar_t WCHAR; typedef wchar_t* LPWSTR; typedef const wchar_t* LPCWSTR; typedef void* HANDLE;
+struct HDC__; typedef HDC__* HDC; struct HWND__; typedef HWND__* HWND; struct HGDIOBJ__; typedef HGDIOBJ__* HGDIOBJ; typedef HGDIOBJ HPEN; typedef HGDIOBJ HBRUSH; typedef HGDIOBJ HFONT; typedef HGDIOBJ HBITMAP;
+struct HINSTANCE__; typedef HINSTANCE__* HINSTANCE; typedef void* HMENU; typedef void* HICON; typedef void* HCURSOR; typedef void* HGLOBAL;
+struct POINT { LONG x, y; }; struct SIZE { LONG cx, cy; }; struct RECT { LONG left, top, right, bottom; };
+struct PAINTSTRUCT { HDC hdc; RECT rcPaint; };
+struct LOGFONT { LONG lfHeight, lfWidth, lfEscapement, lfOrientation, lfWeight; BYTE lfItalic, lfUnderline, lfStrikeOut, lfCharSet, lfOutPrecision, lfClipPrecision, lfQuality, lfPitchAndFamily; WCHAR lfFaceName[32]; };
+struct SCROLLINFO { UINT cbSize, fMask; int nMin, nMax; UINT nPage; int nPos, nTrackPos; };
+struct MSG { HWND hwnd; UINT message; WPARAM wParam; LPARAM lParam; DWORD time; POINT pt; };
+typedef LRESULT (*WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+struct WNDCLASSEXW { UINT cbSize, style; WNDPROC lpfnWndProc; int cbClsExtra, cbWndExtra; HINSTANCE hInstance; HICON hIcon; HCURSOR hCursor; HBRUSH hbrBackground; LPCWSTR lpszMenuName, lpszClassName; HICON hIconSm; };
+typedef WNDCLASSEXW WNDCLASSEX;
+struct TRACKMOUSEEVENT { DWORD cbSize, dwFlags; HWND hwndTrack; DWORD dwHoverTime; };
+struct CREATESTRUCT { void* lpCreateParams; };
+struct BITMAPINFOHEADER { DWORD biSize; LONG biWidth, biHeight; WORD biPlanes, biBitCount; DWORD biCompression, biSizeImage; LONG biXPelsPerMeter, biYPelsPerMeter; DWORD biClrUsed, biClrImportant; };
+struct RGBQUAD { BYTE rgbBlue, rgbGreen, rgbRed, rgbReserved; };
+struct BITMAPINFO { BITMAPINFOHEADER bmiHeader; RGBQUAD bmiColors[1]; };
+#define RGB(r,g,b) ((COLORREF)(((BYTE)(r)|((WORD)((BYTE)(g))<<8))|(((DWORD)(BYTE)(b))<<16)))
+#define GetRValue(rgb) ((BYTE)(rgb))
+#define GetGValue(rgb) ((BYTE)(((WORD)(rgb)) >> 8))
+#define GetBValue(rgb) ((BYTE)((rgb)>>16))
+#define LOWORD(l) ((WORD)(((uintptr_t)(l)) & 0xffff))
+#define HIWORD(l) ((WORD)((((uintptr_t)(l)) >> 16) & 0xffff))
+#define MAKEWPARAM(l, h) ((WPARAM)(DWORD)((WORD)(l) | ((DWORD)(WORD)(h)) << 16))
+#define GET_X_LPARAM(lp) ((int)(short)LOWORD(lp))
+#define GET_Y_LPARAM(lp) ((int)(short)HIWORD(lp))
+#define MAKEINTRESOURCEW(i) ((LPWSTR)((uintptr_t)((WORD)(i))))
+#define MAKEINTRESOURCE MAKEINTRESOURCEW
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+#define SetWindowFont(hwnd, hfont, fRedraw) ((void)0)
+enum { PS_SOLID, NULL_BRUSH = 5, R2_NOT = 6, R2_COPYPEN = 13, TRANSPARENT = 1, MM_TEXT = 1, MM_ISOTROPIC = 7, DT_LEFT = 0, DT_TOP = 0, DT_CALCRECT = 0x400, DT_SINGLELINE = 0x20, DT_NOCLIP = 0x100,
+  WS_OVERLAPPEDWINDOW = 0xcf0000, WS_CHILDWINDOW = 0x40000000, WS_CHILD = 0x40000000, ES_AUTOHSCROLL = 0x80, ES_AUTOVSCROLL = 0x40, ES_LEFT = 0, ES_MULTILINE = 4, ES_WANTRETURN = 0x1000,
+  SW_SHOW = 5, SW_HIDE = 0, CS_HREDRAW = 2, CS_VREDRAW = 1, COLOR_WINDOW = 5, GWLP_HINSTANCE = -6, GWLP_USERDATA = -21, TME_LEAVE = 2, FW_NORMAL = 400, DEFAULT_CHARSET = 1, OUT_DEFAULT_PRECIS = 0, CLIP_DEFAULT_PRECIS = 0, PROOF_QUALITY = 2, DEFAULT_PITCH = 0, FF_DONTCARE = 0,
+  WM_CREATE = 1, WM_DESTROY = 2, WM_SIZE = 5, WM_PAINT = 0xf, WM_ERASEBKGND = 0x14, WM_COMMAND = 0x111, WM_TIMER = 0x113, WM_HSCROLL = 0x114, WM_VSCROLL = 0x115, WM_MOUSEMOVE = 0x200, WM_LBUTTONDOWN = 0x201, WM_LBUTTONUP = 0x202, WM_MOUSEWHEEL = 0x20a, WM_MOUSELEAVE = 0x2a3, WM_USER = 0x400, WM_APP = 0x8000, WM_QUIT = 0x12,
+  WHEEL_DELTA = 120, MK_LBUTTON = 1, MK_CONTROL = 8, MK_SHIFT = 4, SB_HORZ = 0, SB_VERT = 1, SIF_POS = 4, SIF_RANGE = 1, SIF_PAGE = 2,
+  SB_LINEUP = 0, SB_LINELEFT = 0, SB_LINEDOWN = 1, SB_LINERIGHT = 1, SB_PAGEUP = 2, SB_PAGELEFT = 2, SB_PAGEDOWN = 3, SB_PAGERIGHT = 3, SB_THUMBPOSITION = 4, SB_THUMBTRACK = 5, SB_TOP = 6, SB_LEFT = 6, SB_BOTTOM = 7, SB_RIGHT = 7,
+  EN_KILLFOCUS = 0x200, IDOK = 1, IDCANCEL = 2, WM_INITDIALOG = 0x110, PM_REMOVE = 1, WM_KEYDOWN = 0x100, VK_ESCAPE = 0x1b, PM_NOREMOVE = 0, QS_ALLINPUT = 0x4ff, SRCCOPY = 0xcc0020, BI_RGB = 0, DIB_RGB_COLORS = 0, CF_PRIVATEFIRST = 0x200, GMEM_MOVEABLE = 2, INFINITE = -1, MWMO_INPUTAVAILABLE = 4, WAIT_TIMEOUT = 258, CW_USEDEFAULT = (int)0x80000000 };
+#define IDC_ARROW MAKEINTRESOURCEW(32512)
+BOOL MoveToEx(HDC, int, int, POINT*); BOOL LineTo(HDC, int, int); BOOL Rectangle(HDC, int, int, int, int); BOOL Ellipse(HDC, int, int, int, int);
+BOOL Polyline(HDC, const POINT*, int); BOOL PolyPolyline(HDC, const POINT*, const DWORD*, DWORD); BOOL Arc(HDC, int, int, int, int, int, int, int, int); BOOL SetPixelV(HDC, int, int, COLORREF);
+int FillRect(HDC, const RECT*, HBRUSH); HGDIOBJ SelectObject(HDC, HGDIOBJ); HGDIOBJ GetStockObject(int); HBRUSH CreateSolidBrush(COLORREF); BOOL DeleteObject(HGDIOBJ);
+int DrawTextW(HDC, LPCWSTR, int, RECT*, UINT); int DrawTextW(HDC, LPWSTR, int, RECT*, UINT); 
+#define DrawText DrawTextW
+BOOL ExtTextOutW(HDC, int, int, UINT, const RECT*, LPCWSTR, UINT, const int*);
+COLORREF SetTextColor(HDC, COLORREF); int SetBkMode(HDC, int); int SetROP2(HDC, int); int SetMapMode(HDC, int);
+BOOL SetWindowOrgEx(HDC, int, int, POINT*); BOOL SetWindowExtEx(HDC, int, int, SIZE*); BOOL SetViewportOrgEx(HDC, int, int, POINT*); BOOL SetViewportExtEx(HDC, int, int, SIZE*);
+BOOL GetWindowOrgEx(HDC, POINT*); BOOL GetWindowExtEx(HDC, SIZE*); BOOL GetViewportOrgEx(HDC, POINT*); BOOL GetViewportExtEx(HDC, SIZE*);
+BOOL DPtoLP(HDC, POINT*, int); BOOL LPtoDP(HDC, POINT*, int);
+HPEN CreatePen(int, int, COLORREF); HFONT CreateFontIndirect(const LOGFONT*);
+HDC BeginPaint(HWND, PAINTSTRUCT*); BOOL EndPaint(HWND, const PAINTSTRUCT*); HDC GetDC(HWND); int ReleaseDC(HWND, HDC);
+HDC CreateCompatibleDC(HDC); BOOL DeleteDC(HDC); HBITMAP CreateCompatibleBitmap(HDC, int, int); BOOL BitBlt(HDC, int, int, int, int, HDC, int, int, DWORD); BOOL StretchBlt(HDC, int, int, int, int, HDC, int, int, int, int, DWORD);
+HBITMAP CreateDIBSection(HDC, const BITMAPINFO*, UINT, void**, HANDLE, DWORD); int SetDIBitsToDevice(HDC, int, int, DWORD, DWORD, int, int, UINT, UINT, const void*, const BITMAPINFO*, UINT);
+BOOL DestroyWindow(HWND); BOOL MoveWindow(HWND, int, int, int, int, BOOL); BOOL ShowWindow(HWND, int); HWND SetFocus(HWND); BOOL SetWindowTextW(HWND, LPCWSTR); int GetWindowTextW(HWND, LPWSTR, int);
+#define SetWindowText SetWindowTextW
+#define GetWindowText GetWindowTextW
+BOOL GetClientRect(HWND, RECT*); BOOL InvalidateRect(HWND, const RECT*, BOOL); BOOL ShowScrollBar(HWND, int, BOOL); int SetScrollInfo(HWND, int, const SCROLLINFO*, BOOL); BOOL GetScrollInfo(HWND, int, SCROLLINFO*);
+BOOL UpdateWindow(HWND); HWND GetParent(HWND); LONG_PTR GetWindowLongPtr(HWND, int); LONG_PTR SetWindowLongPtr(HWND, int, LONG_PTR);
+HCURSOR LoadCursor(HINSTANCE, LPCWSTR); ATOM RegisterClassEx(const WNDCLASSEXW*); LRESULT DefWindowProc(HWND, UINT, WPARAM, LPARAM); BOOL TrackMouseEvent(TRACKMOUSEEVENT*);
+HWND CreateWindowW(LPCWSTR, LPCWSTR, DWORD, int, int, int, int, HWND, HMENU, HINSTANCE, void*);
+#define CreateWindow CreateWindowW
+typedef INT_PTR (*DLGPROC)(HWND, UINT, WPARAM, LPARAM);
+INT_PTR DialogBox(HINSTANCE, LPCWSTR, HWND, DLGPROC); BOOL EndDialog(HWND, INT_PTR); void PostQuitMessage(int);
+#define MB_OK 0x0
+#define MB_ICONERROR 0x10
+int MessageBoxW(HWND, LPCWSTR, LPCWSTR, UINT);
+#define MessageBox MessageBoxW
+BOOL GetMessage(MSG*, HWND, UINT, UINT); BOOL PeekMessage(MSG*, HWND, UINT, UINT, UINT); BOOL TranslateMessage(const MSG*); LRESULT DispatchMessage(const MSG*); BOOL PostMessage(HWND, UINT, WPARAM, LPARAM);
+DWORD MsgWaitForMultipleObjectsEx(DWORD, const HANDLE*, DWORD, DWORD, DWORD);
+DWORD GetTickCount(); void ZeroMemory(void*, size_t); LPWSTR lstrcpy(LPWSTR, LPCWSTR); int lstrlen(LPCWSTR);
+UINT RegisterClipboardFormat(LPCWSTR); BOOL OpenClipboard(HWND); BOOL CloseClipboard(); BOOL EmptyClipboard(); HANDLE SetClipboardData(UINT, HANDLE); HANDLE GetClipboardData(UINT); BOOL IsClipboardFormatAvailable(UINT);
+HGLOBAL GlobalAlloc(UINT, size_t); void* GlobalLock(HGLOBAL); BOOL GlobalUnlock(HGLOBAL); size_t GlobalSize(HGLOBAL); HGLOBAL GlobalFree(HGLOBAL);
+typedef uintptr_t UINT_PTR; UINT_PTR SetTimer(HWND, uintptr_t, UINT, void*); BOOL KillTimer(HWND, uintptr_t);
+BOOL IntersectRect(RECT*, const RECT*, const RECT*); BOOL InflateRect(RECT*, int, int); BOOL UnionRect(RECT*, const RECT*, const RECT*); BOOL IsRectEmpty(const RECT*); BOOL PtInRect(const RECT*, POINT); BOOL OffsetRect(RECT*, int, int);
+#include <new>
+void* operator new(std::size_t, int, const char*, int);
+void* operator new[](std::size_t, int, const char*, int);
+#ifndef WIN32_FILES_AND_THREADS
+#define WIN32_FILES_AND_THREADS
+#define HALFTONE 4
+int SetStretchBltMode(HDC, int); BOOL SetBrushOrgEx(HDC, int, int, POINT*); int SaveDC(HDC); BOOL RestoreDC(HDC, int);
+int GetClipBox(HDC, RECT*);
+#define MAX_PATH 260
+typedef long long LONGLONG; union LARGE_INTEGER { LONGLONG QuadPart; };
+#define INVALID_HANDLE_VALUE ((HANDLE)(long)-1)
+#define GENERIC_READ 0x80000000u
+#define GENERIC_WRITE 0x40000000u
+#define CREATE_ALWAYS 2
+#define FILE_ATTRIBUTE_TEMPORARY 0x100
+#define FILE_FLAG_DELETE_ON_CLOSE 0x04000000
+#define FILE_BEGIN 0
+DWORD GetTempPathW(DWORD, LPWSTR); UINT GetTempFileNameW(LPCWSTR, LPCWSTR, UINT, LPWSTR);
+HANDLE CreateFileW(LPCWSTR, DWORD, DWORD, void*, DWORD, DWORD, HANDLE); BOOL DeleteFileW(LPCWSTR); BOOL CloseHandle(HANDLE);
+BOOL WriteFile(HANDLE, const void*, DWORD, DWORD*, void*); BOOL ReadFile(HANDLE, void*, DWORD, DWORD*, void*);
+BOOL SetFilePointerEx(HANDLE, LARGE_INTEGER, LARGE_INTEGER*, DWORD); BOOL SetEndOfFile(HANDLE);
+#define GetTempPath GetTempPathW
+#define GetTempFileName GetTempFileNameW
+#define CreateFile CreateFileW
+#define DeleteFile DeleteFileW
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_FLAG_WRITE_THROUGH 0x80000000u
+#define FILE_CURRENT 1
+#define FILE_END 2
+#define FILE_SHARE_READ 1
+#define MOVEFILE_REPLACE_EXISTING 1
+#define MOVEFILE_WRITE_THROUGH 8
+BOOL FlushFileBuffers(HANDLE); BOOL GetFileSizeEx(HANDLE, LARGE_INTEGER*); BOOL MoveFileExW(LPCWSTR, LPCWSTR, DWORD);
+#define MoveFileEx MoveFileExW
+#define THREAD_PRIORITY_BELOW_NORMAL (-1)
+HANDLE GetCurrentThread(); BOOL SetThreadPriority(HANDLE, int);
+#endif
@@ -0,0 +1,2 @@
+#pragma once
+// Nothing: windows.h declares what MiniCad32.cpp uses.
@@ -6,13 +6,28 @@
 #define WIN32_LEAN_AND_MEAN // Windows ヘッダーから使用されていない部分を除外します。
 #include <windows.h>
 #include <windowsx.h>
+#include <commdlg.h>
 
 #include <memory>
 #include <string>
 #include <sstream>
 #include <exception>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
 #include <algorithm>
+#include <iterator>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <coroutine>
+#include <chrono>
+#include <cstdint>
 using namespace std;
 
 #include <cassert>
@@ -85,6 +100,18 @@ class Observer
 public:
     virtual void OnUpdate(void* data)
     {}
+
+    // The data has left the observable; an observer that keeps nothing by data takes it as an update.
+    virtual void OnRemoved(void* data)
+    {
+        OnUpdate(data);
+    }
+
+    // Many changes within area at once; an observer that keeps nothing by area takes it as an update of everything.
+    virtual void OnAreaUpdate(const RECT& area)
+    {
+        OnUpdate(nullptr);
+    }
 };
 
 class Observable
@@ -103,6 +130,18 @@ protected:
         for (auto observer : observers)
             observer->OnUpdate(data);
     }
+
+    void UpdateRemoved(void* data)
+    {
+        for (auto observer : observers)
+            observer->OnRemoved(data);
+    }
+
+    void UpdateArea(const RECT& area)
+    {
+        for (auto observer : observers)
+            observer->OnAreaUpdate(area);
+    }
 };
 
 class Uncopyable
@@ -151,6 +190,405 @@ public:
     }
 };
 
+class ByteWriter
+{
+    vector<uint8_t>& buffer;
+
+public:
+    ByteWriter(vector<uint8_t>& buffer) : buffer(buffer)
+    {}
+
+    size_t GetSize() const
+    {
+        return buffer.size();
+    }
+
+    void Write(const void* data, size_t size)
+    {
+        auto bytes = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    }
+
+    void WriteVarUInt(uint64_t value)
+    {
+        while (value >= 0x80) {
+            buffer.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(uint8_t(value));
+    }
+
+    void WriteVarInt(int64_t value)
+    {
+        WriteVarUInt(ZigZag(value));
+    }
+
+    static uint64_t ZigZag(int64_t value)
+    {
+        return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+    }
+};
+
+class ByteReader
+{
+    const uint8_t* position;
+    const uint8_t* end;
+
+public:
+    ByteReader(const uint8_t* data, size_t size) : position(data), end(data + size)
+    {}
+
+    ByteReader(const vector<uint8_t>& buffer) : ByteReader(buffer.data(), buffer.size())
+    {}
+
+    bool IsEnd() const
+    {
+        return position >= end;
+    }
+
+    size_t GetRemainingSize() const
+    {
+        return size_t(end - position);
+    }
+
+    void Read(void* data, size_t size)
+    {
+        if (size_t(end - position) < size)
+            throw exception();
+        ::memcpy(data, position, size);
+        position += size;
+    }
+
+    uint64_t ReadVarUInt()
+    {
+        if (position < end && *position < 0x80)
+            return *position++;
+
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (position >= end)
+                throw exception();
+            const auto byte = *position++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (byte < 0x80)
+                return value;
+        }
+        throw exception();
+    }
+
+    int64_t ReadVarInt()
+    {
+        return UnZigZag(ReadVarUInt());
+    }
+
+    static int64_t UnZigZag(uint64_t value)
+    {
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+};
+
+// Column codec: delta + zigzag + varint for coordinates, run-length for small enumerations (kinds, colours, flags).
+class BlockCodec
+{
+public:
+    static const size_t blockSize = 4096;
+
+    static void EncodeDeltas(const vector<long>& values, ByteWriter& writer)
+    {
+        writer.WriteVarUInt(values.size());
+        int64_t previous = 0;
+        for (auto value : values) {
+            writer.WriteVarInt(value - previous);
+            previous = value;
+        }
+    }
+
+    static void DecodeDeltas(ByteReader& reader, vector<long>& values)
+    {
+        const auto count = size_t(reader.ReadVarUInt());
+        values.resize(count);
+        int64_t previous = 0;
+        for (size_t index = 0; index < count; index++) {
+            previous += reader.ReadVarInt();
+            values[index] = long(previous);
+        }
+    }
+
+    static void EncodeRuns(const vector<uint32_t>& values, ByteWriter& writer)
+    {
+        writer.WriteVarUInt(values.size());
+        for (size_t index = 0; index < values.size(); ) {
+            auto end = index + 1;
+            while (end < values.size() && values[end] == values[index])
+                end++;
+            writer.WriteVarUInt(values[index]);
+            writer.WriteVarUInt(end - index);
+            index = end;
+        }
+    }
+
+    static void DecodeRuns(ByteReader& reader, vector<uint32_t>& values)
+    {
+        const auto count = size_t(reader.ReadVarUInt());
+        values.clear();
+        values.reserve(count);
+        while (values.size() < count) {
+            const auto value  = uint32_t(reader.ReadVarUInt());
+            const auto length = size_t(reader.ReadVarUInt());
+            if (length == 0 || length > count - values.size())
+                throw exception();
+            values.insert(values.end(), length, value);
+        }
+    }
+};
+
+class Clipboard
+{
+public:
+    virtual ~Clipboard()
+    {}
+
+    virtual bool SetData(const vector<uint8_t>& data) = 0;
+    virtual bool GetData(vector<uint8_t>& data) = 0;
+};
+
+// In-process clipboard; usable without a window system.
+class MemoryClipboard : public Clipboard
+{
+    vector<uint8_t> data;
+    bool            hasData;
+
+public:
+    MemoryClipboard() : hasData(false)
+    {}
+
+    virtual bool SetData(const vector<uint8_t>& data)
+    {
+        this->data = data;
+        hasData    = true;
+        return true;
+    }
+
+    virtual bool GetData(vector<uint8_t>& data)
+    {
+        if (!hasData)
+            return false;
+        data = this->data;
+        return true;
+    }
+};
+
+// The CRC-32 of PNG chunks and journal records.
+class Crc32
+{
+    struct Table
+    {
+        uint32_t values[256];
+
+        Table()
+        {
+            for (uint32_t index = 0; index < 256; index++) {
+                auto value = index;
+                for (int bit = 0; bit < 8; bit++)
+                    value = (value & 1) != 0 ? 0xedb88320 ^ (value >> 1) : value >> 1;
+                values[index] = value;
+            }
+        }
+    };
+
+public:
+    static uint32_t Get(const uint8_t* data, size_t size)
+    {
+        static const Table table;
+        uint32_t crc = 0xffffffff;
+        for (size_t index = 0; index < size; index++)
+            crc = table.values[(crc ^ data[index]) & 0xff] ^ (crc >> 8);
+        return crc ^ 0xffffffff;
+    }
+};
+
+// Streaming PNG encoder for 8-bit RGBA rows.
+// The image data is one fixed-Huffman deflate block whose only matches repeat the previous pixel,
+// which is cheap to produce and compresses drawings on a plain background well.
+class PngWriter : public Uncopyable
+{
+    static const size_t chunkSize = 1 << 16;
+
+    ostream&        stream;
+    const uint32_t  width;
+    const uint32_t  height;
+    uint32_t        rowCount;
+    vector<uint8_t> compressed;
+    vector<uint8_t> row;
+    uint32_t        bitBuffer;
+    int             bitCount;
+    uint32_t        adler1;
+    uint32_t        adler2;
+    bool            isClosed;
+
+public:
+    PngWriter(ostream& stream, uint32_t width, uint32_t height)
+        : stream(stream), width(width), height(height), rowCount(0), bitBuffer(0), bitCount(0), adler1(1), adler2(0), isClosed(false)
+    {
+        static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        stream.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+        vector<uint8_t> header;
+        WriteUInt32(header, width );
+        WriteUInt32(header, height);
+        header.push_back(8); // bit depth
+        header.push_back(6); // colour type: RGBA
+        header.push_back(0); // compression
+        header.push_back(0); // filter
+        header.push_back(0); // interlace
+        WriteChunk("IHDR", header);
+
+        compressed.push_back(0x78); // zlib header
+        compressed.push_back(0x01);
+        WriteBits(1, 1);            // final block
+        WriteBits(1, 2);            // fixed Huffman codes
+    }
+
+    virtual ~PngWriter()
+    {
+        Close();
+    }
+
+    uint32_t GetRowCount() const
+    {
+        return rowCount;
+    }
+
+    // rgba: width * 4 bytes.
+    void WriteRow(const uint8_t* rgba)
+    {
+        Diagnostics::Debug::Assert(rowCount < height && !isClosed);
+
+        const size_t historySize = row.size() < 4 ? row.size() : 4;
+        vector<uint8_t>(row.end() - historySize, row.end()).swap(row);
+        row.push_back(0); // filter type: none
+        row.insert(row.end(), rgba, rgba + size_t(width) * 4);
+        UpdateAdler(row.data() + historySize, row.size() - historySize);
+        Deflate(historySize);
+
+        rowCount++;
+        if (compressed.size() >= chunkSize) {
+            WriteChunk("IDAT", compressed);
+            compressed.clear();
+        }
+    }
+
+    void Close()
+    {
+        if (isClosed)
+            return;
+        isClosed = true;
+
+        WriteLiteral(256);
+        if (bitCount > 0)
+            WriteBits(0, 8 - bitCount);
+        WriteUInt32(compressed, (adler2 << 16) | adler1);
+        WriteChunk("IDAT", compressed);
+        WriteChunk("IEND", vector<uint8_t>());
+        stream.flush();
+    }
+
+private:
+    void Deflate(size_t start)
+    {
+        static const uint16_t lengthBases [] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t  lengthExtras[] = { 0, 0, 0, 0, 0, 0, 0,  0,  1,  1,  1,  1,  2,  2,  2,  2,  3,  3,  3,  3,  4,  4,  4,   4,   5,   5,   5,   5,   0 };
+        const size_t maximumLength = 258;
+
+        for (auto index = start; index < row.size(); ) {
+            size_t length = 0;
+            if (index >= 4) {
+                while (index + length < row.size() && length < maximumLength && row[index + length] == row[index + length - 4])
+                    length++;
+            }
+            if (length < 3) {
+                WriteLiteral(row[index]);
+                index++;
+                continue;
+            }
+            auto code = sizeof(lengthBases) / sizeof(lengthBases[0]) - 1;
+            while (lengthBases[code] > length)
+                code--;
+            WriteLiteral(int(257 + code));
+            WriteBits(uint32_t(length - lengthBases[code]), lengthExtras[code]);
+            WriteCode(3, 5); // distance 4
+            index += length;
+        }
+    }
+
+    void WriteLiteral(int symbol)
+    {
+        if (symbol < 144)
+            WriteCode(0x30 + symbol, 8);
+        else if (symbol < 256)
+            WriteCode(0x190 + symbol - 144, 9);
+        else if (symbol < 280)
+            WriteCode(symbol - 256, 7);
+        else
+            WriteCode(0xc0 + symbol - 280, 8);
+    }
+
+    // Huffman codes are stored most significant bit first.
+    void WriteCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int bit = 0; bit < length; bit++)
+            reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+        WriteBits(reversed, length);
+    }
+
+    void WriteBits(uint32_t value, int count)
+    {
+        bitBuffer |= value << bitCount;
+        bitCount  += count;
+        while (bitCount >= 8) {
+            compressed.push_back(uint8_t(bitBuffer));
+            bitBuffer >>= 8;
+            bitCount   -= 8;
+        }
+    }
+
+    void UpdateAdler(const uint8_t* data, size_t size)
+    {
+        const uint32_t modulus   = 65521;
+        const size_t   blockSize = 5552;
+        while (size > 0) {
+            const auto count = size < blockSize ? size : blockSize;
+            for (size_t index = 0; index < count; index++) {
+                adler1 += data[index];
+                adler2 += adler1;
+            }
+            adler1 %= modulus;
+            adler2 %= modulus;
+            data   += count;
+            size   -= count;
+        }
+    }
+
+    void WriteChunk(const char* type, const vector<uint8_t>& data)
+    {
+        vector<uint8_t> chunk;
+        WriteUInt32(chunk, uint32_t(data.size()));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        WriteUInt32(chunk, Crc32::Get(chunk.data() + 4, chunk.size() - 4));
+        stream.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+
+    static void WriteUInt32(vector<uint8_t>& buffer, uint32_t value)
+    {
+        buffer.push_back(uint8_t(value >> 24));
+        buffer.push_back(uint8_t(value >> 16));
+        buffer.push_back(uint8_t(value >>  8));
+        buffer.push_back(uint8_t(value      ));
+    }
+};
+
 //class Utility
 //{
 //public:
@@ -254,9 +692,18 @@ struct CLine
     CPoint start;
     CPoint end  ;
 
+    CLine()
+    {}
+
     CLine(CPoint start, CPoint end) : start(start), end(end)
     {}
 
+    void Offset(const SIZE& offset)
+    {
+        start = start + offset;
+        end   = end   + offset;
+    }
+
     long GetDistance(CPoint point) const
     {
         auto d  = end   - start;
@@ -332,6 +779,14 @@ struct CRect : public RECT
         Enlarge(bottom, basePoint.y, rate);
     }
 
+    void Offset(const SIZE& offset)
+    {
+        left   += offset.cx;
+        top    += offset.cy;
+        right  += offset.cx;
+        bottom += offset.cy;
+    }
+
     CRect Intersect(const RECT& rect) const
     {
         CRect result;
@@ -339,6 +794,31 @@ struct CRect : public RECT
         return result;
     }
 
+    // Unlike ::UnionRect, an empty rectangle counts, so that the bounds of a horizontal line are not lost.
+    // GetNone() is the rectangle that adds nothing.
+    CRect Union(const RECT& rect) const
+    {
+        CRect result;
+        result.left   = Math::Min(left  , rect.left  );
+        result.top    = Math::Min(top   , rect.top   );
+        result.right  = Math::Max(right , rect.right );
+        result.bottom = Math::Max(bottom, rect.bottom);
+        return result;
+    }
+
+    bool IsNone() const
+    {
+        return left > right || top > bottom;
+    }
+
+    static CRect GetNone()
+    {
+        CRect none;
+        none.left = none.top = LONG_MAX;
+        none.right = none.bottom = LONG_MIN;
+        return none;
+    }
+
     virtual long GetDistance(CPoint point) const
     {
         auto minimumDistance = LONG_MAX;
@@ -455,6 +935,46 @@ struct CEllipse : public CRect
     }
 };
 
+// An affine map under which lines parallel to the axes stay so: a scale, negative to mirror, and quarter turns clockwise
+// about a centre, then an offset. Boxes map to boxes, so rectangles and ellipses stay rectangles and ellipses.
+struct AxisTransform
+{
+    CPoint center;
+    int    quarterTurns;
+    double scaleX;
+    double scaleY;
+    CSize  offset;
+
+    AxisTransform(const SIZE& offset) : quarterTurns(0), scaleX(1.0), scaleY(1.0), offset(offset)
+    {}
+
+    AxisTransform(POINT center, int quarterTurns, double scaleX, double scaleY)
+        : center(center), quarterTurns(((quarterTurns % 4) + 4) % 4), scaleX(scaleX), scaleY(scaleY)
+    {}
+
+    CPoint Map(POINT point) const
+    {
+        auto x = (point.x - center.x) * scaleX;
+        auto y = (point.y - center.y) * scaleY;
+        for (auto turn = 0; turn < quarterTurns; turn++) {
+            const auto turnedX = -y;
+            y = x;
+            x = turnedX;
+        }
+        return CPoint(Math::Round(center.x + x), Math::Round(center.y + y)) + offset;
+    }
+
+    CLine Map(const CLine& line) const
+    {
+        return CLine(Map(line.start), Map(line.end));
+    }
+
+    CRect Map(const RECT& rect) const
+    {
+        return CRect(Map(CPoint(rect.left, rect.top)), Map(CPoint(rect.right, rect.bottom)));
+    }
+};
+
 class Color
 {
 public:
@@ -503,7 +1023,12 @@ public:
 class CDC : public Uncopyable
 {
 protected:
-	HDC hdc;
+	HDC      hdc;
+    COLORREF penColor;
+    long     fontHeight;
+
+    CDC() : hdc(nullptr), penColor(Color::Black), fontHeight(0)
+    {}
 
 public:
 	HDC GetHandle() const
@@ -513,12 +1038,12 @@ public:
 
 	virtual ~CDC() = 0;
 
-	void MoveTo(POINT point) const
+	virtual void MoveTo(POINT point) const
 	{
 		::MoveToEx(hdc, point.x, point.y, nullptr);
 	}
 
-	void LineTo(POINT point) const
+	virtual void LineTo(POINT point) const
 	{
 		::LineTo(hdc, point.x, point.y);
 	}
@@ -529,77 +1054,151 @@ public:
         LineTo(line.end  );
     }
 
-	void Rectangle(const RECT& rect) const
+    virtual void PolyPolyline(const POINT* points, const DWORD* pointCounts, DWORD polylineCount) const
+    {
+        ::PolyPolyline(hdc, points, pointCounts, polylineCount);
+    }
+
+	virtual void Rectangle(const RECT& rect) const
 	{
 		NullBrush nullBrush(hdc);
 		::Rectangle(hdc, rect.left, rect.top, rect.right, rect.bottom);
 	}
 
-	void Ellipse(const RECT& rect) const
+	virtual void Ellipse(const RECT& rect) const
 	{
 		NullBrush nullBrush(hdc);
 		::Ellipse(hdc, rect.left, rect.top, rect.right, rect.bottom);
 	}
 
-	void FillRect(const RECT& area, COLORREF color) const
+	virtual void FillRect(const RECT& area, COLORREF color) const
 	{
 		SolidBrush brush(color);
 		::FillRect(hdc, &area, brush.GetHandle());
 	}
 
-    int DrawText(tstring text, RECT& area, UINT format) const
+    virtual int DrawText(const tstring& text, RECT& area, UINT format) const
+    {
+        return ::DrawText(hdc, text.c_str(), int(text.size()), &area, format);
+    }
+
+    // The face that text in logFont is laid out with; a key of TextLayoutCache.
+    virtual const TCHAR* GetFaceName(const LOGFONT& logFont) const
+    {
+        return logFont.lfFaceName;
+    }
+
+    void BitBlt(const RECT& area, const CDC& source, POINT sourcePoint) const
+    {
+        ::BitBlt(hdc, area.left, area.top, area.right - area.left, area.bottom - area.top, source.GetHandle(), sourcePoint.x, sourcePoint.y, SRCCOPY);
+    }
+
+    void StretchBlt(const RECT& area, const CDC& source, const RECT& sourceArea) const
+    {
+        ::SetStretchBltMode(hdc, HALFTONE);
+        ::SetBrushOrgEx(hdc, 0, 0, nullptr);
+        ::StretchBlt(hdc, area.left, area.top, area.right - area.left, area.bottom - area.top,
+                     source.GetHandle(), sourceArea.left, sourceArea.top, sourceArea.right - sourceArea.left, sourceArea.bottom - sourceArea.top, SRCCOPY);
+    }
+
+    CRect GetClipBox() const
+    {
+        CRect area;
+        ::GetClipBox(hdc, &area);
+        return area;
+    }
+
+    // The device pixels drawing can reach.
+    virtual CRect GetDeviceClipBox() const
+    {
+        auto area = GetClipBox();
+        LPtoDP(area);
+        return area;
+    }
+
+    // The mapping as device = (logical - windowOrg) * scale + viewportOrg, for coordinates too far out to round through LPtoDP.
+    virtual void GetMapping(CPoint& windowOrg, double& scaleX, double& scaleY, CPoint& viewportOrg) const
+    {
+        SIZE windowExt, viewportExt;
+        ::GetWindowOrgEx  (hdc, &windowOrg  );
+        ::GetWindowExtEx  (hdc, &windowExt  );
+        ::GetViewportOrgEx(hdc, &viewportOrg);
+        ::GetViewportExtEx(hdc, &viewportExt);
+        scaleX = double(viewportExt.cx) / windowExt.cx;
+        scaleY = double(viewportExt.cy) / windowExt.cy;
+    }
+
+    virtual int SaveDC() const
     {
-        auto buffer = unique_ptr<TCHAR>(new TCHAR[text.size() + 4]);
-        lstrcpy(buffer.get(), text.c_str());
-        return ::DrawText(hdc, buffer.get(), -1, &area, format);
+        return ::SaveDC(hdc);
     }
 
-    COLORREF SetTextColor(COLORREF color) const
+    virtual bool RestoreDC(int savedDC) const
+    {
+        return ::RestoreDC(hdc, savedDC) != FALSE;
+    }
+
+    // The pen colour and font height are tracked for render targets that do not draw with GDI objects.
+    COLORREF SetPenColor(COLORREF color)
+    {
+        const auto oldColor = penColor;
+        penColor = color;
+        return oldColor;
+    }
+
+    long SetFontHeight(long height)
+    {
+        const auto oldHeight = fontHeight;
+        fontHeight = height;
+        return oldHeight;
+    }
+
+    virtual COLORREF SetTextColor(COLORREF color) const
     {
         return ::SetTextColor(hdc, color);
     }
 
-    int SetBkMode(int backMode) const
+    virtual int SetBkMode(int backMode) const
     {
         return ::SetBkMode(hdc, backMode);
     }
 
-	int SetROP2(int drawMode) const
+	virtual int SetROP2(int drawMode) const
 	{
 		return ::SetROP2(hdc, drawMode);
 	}
 
-    int SetMapMode(int mode) const
+    virtual int SetMapMode(int mode) const
     {
         return ::SetMapMode(hdc, mode);
     }
 
-    bool SetWindowOrg(POINT logicalPoint) const
+    virtual bool SetWindowOrg(POINT logicalPoint) const
     {
         return ::SetWindowOrgEx(hdc, logicalPoint.x, logicalPoint.y, nullptr);
     }
 
-    bool SetWindowExt(SIZE logicalSize) const
+    virtual bool SetWindowExt(SIZE logicalSize) const
     {
         return ::SetWindowExtEx(hdc, logicalSize.cx, logicalSize.cy, nullptr);
     }
 
-    bool SetViewportOrg(POINT phisicalPoint) const
+    virtual bool SetViewportOrg(POINT phisicalPoint) const
     {
         return ::SetViewportOrgEx(hdc, phisicalPoint.x, phisicalPoint.y, nullptr);
     }
 
-    bool SetViewportExt(SIZE phisicalSize) const
+    virtual bool SetViewportExt(SIZE phisicalSize) const
     {
         return ::SetViewportExtEx(hdc, phisicalSize.cx, phisicalSize.cy, nullptr);
     }
 
-    bool DPtoLP(POINT& point) const
+    virtual bool DPtoLP(POINT& point) const
     {
         return ::DPtoLP(hdc, &point, 1);
     }
 
-    bool LPtoDP(POINT& point) const
+    virtual bool LPtoDP(POINT& point) const
     {
         return ::LPtoDP(hdc, &point, 1);
     }
@@ -669,931 +1268,6032 @@ public:
 	}
 };
 
-template <class THandle>
-class CGdiObj : public Uncopyable
+class CMemoryDC : public CDC
 {
-protected:
-    const THandle hObject;
-    HGDIOBJ       hOldObject;
-
-    CGdiObj(THandle hObject) : hObject(hObject)
+public:
+    CMemoryDC(const CDC& dc)
     {
-        if (hObject == nullptr)
+        hdc = ::CreateCompatibleDC(dc.GetHandle());
+        if (hdc == nullptr)
             throw exception();
     }
 
-public:
-    THandle GetHandle() const
+    virtual ~CMemoryDC()
     {
-        return this == nullptr ? nullptr : hObject;
+        ::DeleteDC(hdc);
     }
+};
 
-    virtual ~CGdiObj()
+// 5x7 bitmap font for the printable ASCII range; one byte per column, least significant bit at the top.
+class BitmapFont
+{
+public:
+    static const int glyphWidth  = 5;
+    static const int glyphHeight = 7;
+    static const int cellWidth   = 6;
+    static const int cellHeight  = 8;
+
+    static const int glyphCount  = 0x7f - 0x20 + 1; // the printable range and the glyph of unknown characters
+
+    static const TCHAR* GetFaceName()
     {
-        if (hObject != nullptr)
-            ::DeleteObject(hObject);
+        return _T("BitmapFont");
     }
 
-    void AttachTo(CDC& dc)
+    // 0 to glyphCount - 1; GetGlyph(_TCHAR(0x20 + index)) is the glyph.
+    static int GetGlyphIndex(_TCHAR character)
     {
-        hOldObject = ::SelectObject(dc.GetHandle(), GetHandle());
+        return character >= 0x20 && character < 0x7f ? int(character - 0x20) : glyphCount - 1;
     }
 
-    void DetachFrom(CDC& dc)
+    static const uint8_t* GetGlyph(_TCHAR character)
     {
-        ::SelectObject(dc.GetHandle(), hOldObject);
+        static const uint8_t glyphs[][glyphWidth] = {
+            { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7f, 0x14, 0x7f, 0x14 },
+            { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+            { 0x00, 0x1c, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1c, 0x00 }, { 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, { 0x08, 0x08, 0x3e, 0x08, 0x08 },
+            { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+            { 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 }, { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 },
+            { 0x18, 0x14, 0x12, 0x7f, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+            { 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+            { 0x00, 0x08, 0x14, 0x22, 0x41 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, { 0x41, 0x22, 0x14, 0x08, 0x00 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+            { 0x32, 0x49, 0x79, 0x41, 0x3e }, { 0x7e, 0x11, 0x11, 0x11, 0x7e }, { 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 },
+            { 0x7f, 0x41, 0x41, 0x22, 0x1c }, { 0x7f, 0x49, 0x49, 0x49, 0x41 }, { 0x7f, 0x09, 0x09, 0x01, 0x01 }, { 0x3e, 0x41, 0x41, 0x51, 0x32 },
+            { 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 }, { 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 },
+            { 0x7f, 0x40, 0x40, 0x40, 0x40 }, { 0x7f, 0x02, 0x04, 0x02, 0x7f }, { 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e },
+            { 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e }, { 0x7f, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+            { 0x01, 0x01, 0x7f, 0x01, 0x01 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f }, { 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x7f, 0x20, 0x18, 0x20, 0x7f },
+            { 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x00, 0x7f, 0x41, 0x41 },
+            { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x41, 0x41, 0x7f, 0x00, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+            { 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, { 0x7f, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+            { 0x38, 0x44, 0x44, 0x48, 0x7f }, { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7e, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3c },
+            { 0x7f, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7d, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3d, 0x00 }, { 0x00, 0x7f, 0x10, 0x28, 0x44 },
+            { 0x00, 0x41, 0x7f, 0x40, 0x00 }, { 0x7c, 0x04, 0x18, 0x04, 0x78 }, { 0x7c, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+            { 0x7c, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7c }, { 0x7c, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+            { 0x04, 0x3f, 0x44, 0x40, 0x20 }, { 0x3c, 0x40, 0x40, 0x20, 0x7c }, { 0x1c, 0x20, 0x40, 0x20, 0x1c }, { 0x3c, 0x40, 0x30, 0x40, 0x3c },
+            { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0c, 0x50, 0x50, 0x50, 0x3c }, { 0x44, 0x64, 0x54, 0x4c, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+            { 0x00, 0x00, 0x7f, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x10, 0x08, 0x08, 0x10, 0x08 }
+        };
+        static const uint8_t unknownGlyph[glyphWidth] = { 0x7f, 0x41, 0x41, 0x41, 0x7f };
+
+        return character >= 0x20 && character < 0x7f ? glyphs[character - 0x20] : unknownGlyph;
     }
-};
 
-class CPen : public CGdiObj<HPEN>
-{
-public:
-	CPen(int style = PS_SOLID, int width = 0, COLORREF color = Color::Black)
-		: CGdiObj<HPEN>(::CreatePen(style, width, color))
-	{}
 };
 
-class CFont : public CGdiObj<HFONT>
+// The line breaks of a string and its size in device pixels as measured by a render target at one font height.
+struct TextLayout
 {
-public:
-    CFont(const LOGFONT& logFont)
-        : CGdiObj<HFONT>(::CreateFontIndirect(&logFont))
-    {}
+    struct Line
+    {
+        size_t start;
+        size_t length;
+    };
+
+    vector<Line> lines;
+    size_t       columnCount; // characters in the longest line
+    CSize        size;
+
+    TextLayout(const tstring& text) : columnCount(0), size(0, 0)
+    {
+        Line line = { 0, 0 };
+        for (size_t index = 0; index <= text.size(); index++) {
+            if (index < text.size() && text[index] != _T('\n'))
+                continue;
+            line.length = index - line.start;
+            if (line.length > 0 && text[index - 1] == _T('\r'))
+                line.length--;
+            lines.push_back(line);
+            columnCount = Math::Max(columnCount, line.length);
+            line.start  = index + 1;
+        }
+    }
 };
 
-template <class TCGdiObj>
-class CGdiObjSelector : public Uncopyable
+// Text layouts shared by all text with the same string and font face at the same device font height. The height is the zoom
+// bucket: zooming without changing it reuses the layouts, and changed text simply looks up another key.
+// Lookups take no copy of the text. Past capacity the cache starts over.
+class TextLayoutCache : public Uncopyable
 {
-	CDC&                 dc;
-    unique_ptr<TCGdiObj> obj;
-	bool                 isMine;
+    static const size_t capacity = 65536;
+
+    struct Key
+    {
+        tstring text;
+        tstring faceName;
+        long    pixelHeight;
+    };
+
+    struct KeyReference
+    {
+        const tstring& text;
+        const TCHAR*   faceName;
+        long           pixelHeight;
+    };
+
+    struct KeyLess
+    {
+        typedef void is_transparent;
+
+        template <class TKey1, class TKey2>
+        bool operator()(const TKey1& key1, const TKey2& key2) const
+        {
+            if (key1.pixelHeight != key2.pixelHeight)
+                return key1.pixelHeight < key2.pixelHeight;
+            const auto order = key1.text.compare(key2.text);
+            if (order != 0)
+                return order < 0;
+            return _tcscmp(GetFaceName(key1), GetFaceName(key2)) < 0;
+        }
+
+        static const TCHAR* GetFaceName(const Key&          key) { return key.faceName.c_str(); }
+        static const TCHAR* GetFaceName(const KeyReference& key) { return key.faceName        ; }
+    };
+
+    mutex                                            layoutsMutex;
+    map<Key, shared_ptr<const TextLayout>, KeyLess> layouts;
 
 public:
-    CGdiObjSelector(CDC& dc, TCGdiObj& obj, bool isMine) : dc(dc), obj(&obj), isMine(isMine)
-	{
-		obj.AttachTo(dc);
-	}
+    static TextLayoutCache& Get()
+    {
+        static TextLayoutCache cache;
+        return cache;
+    }
 
-	virtual ~CGdiObjSelector()
-	{
-        obj->DetachFrom(dc);
-        if (!isMine)
-            obj.release();
-	}
+    // Returns the layout of text, calling measure(layout) for its size the first time. Measuring runs outside the lock.
+    template <class TMeasure>
+    shared_ptr<const TextLayout> Find(const tstring& text, const TCHAR* faceName, long pixelHeight, TMeasure measure)
+    {
+        const KeyReference key = { text, faceName, pixelHeight };
+        {
+            lock_guard<mutex> lock(layoutsMutex);
+            const auto position = layouts.find(key);
+            if (position != layouts.end())
+                return position->second;
+        }
+
+        auto layout = shared_ptr<TextLayout>(new TextLayout(text));
+        layout->size = measure(*layout);
+
+        lock_guard<mutex> lock(layoutsMutex);
+        if (layouts.size() >= capacity)
+            layouts.clear();
+        const Key newKey = { text, faceName, pixelHeight };
+        return layouts.insert(make_pair(newKey, layout)).first->second;
+    }
 };
 
-class PenSelector : public CGdiObjSelector<CPen>
+// Antialiased BitmapFont glyphs rasterised by area coverage at whole device font heights, shared by all software render
+// targets. Only small text, where filling dot by dot costs most per pixel, is drawn from here; larger text keeps its look.
+// The pages of the least recently used heights are dropped past the memory cap.
+class GlyphAtlas : public Uncopyable
 {
 public:
-    PenSelector(CDC& dc, CPen& pen)
-        : CGdiObjSelector<CPen>(dc, pen, false)
-    {}
+    // Every glyph of BitmapFont at one device font height, as horizontal runs of pixels of the same alpha.
+    class Page
+    {
+    public:
+        struct Run
+        {
+            long    y;     // from the top of the glyph
+            long    left;  // from the left of the glyph
+            long    right;
+            uint8_t alpha; // 1 to 0xff
+        };
+
+    private:
+        long           width;
+        long           height;
+        vector<Run>    runs;
+        vector<size_t> glyphRuns; // the runs of the glyph with index i are [glyphRuns[i], glyphRuns[i + 1])
+
+    public:
+        // Each dot is a scale-sized square; a pixel's alpha is the area of it the dots cover.
+        Page(long pixelHeight)
+        {
+            const auto scale = pixelHeight / double(BitmapFont::cellHeight);
+            width  = long(ceil(BitmapFont::glyphWidth  * scale));
+            height = long(ceil(BitmapFont::glyphHeight * scale));
+            vector<double>  coverage(size_t(width) * height);
+            vector<uint8_t> alphas(coverage.size());
+            for (int index = 0; index < BitmapFont::glyphCount; index++) {
+                const auto glyph = BitmapFont::GetGlyph(_TCHAR(0x20 + index));
+                fill(coverage.begin(), coverage.end(), 0.0);
+                for (int column = 0; column < BitmapFont::glyphWidth; column++) {
+                    for (int row = 0; row < BitmapFont::glyphHeight; row++) {
+                        if ((glyph[column] & (1 << row)) == 0)
+                            continue;
+                        const auto dotLeft = column * scale, dotRight  = (column + 1) * scale;
+                        const auto dotTop  = row    * scale, dotBottom = (row    + 1) * scale;
+                        for (auto y = long(dotTop); y < height && y < dotBottom; y++) {
+                            const auto dotHeight = Math::Min(dotBottom, y + 1.0) - Math::Max(dotTop, double(y));
+                            for (auto x = long(dotLeft); x < width && x < dotRight; x++)
+                                coverage[size_t(y) * width + x] += dotHeight * (Math::Min(dotRight, x + 1.0) - Math::Max(dotLeft, double(x)));
+                        }
+                    }
+                }
+                for (size_t pixel = 0; pixel < coverage.size(); pixel++)
+                    alphas[pixel] = uint8_t(Math::Round(Math::Min(coverage[pixel], 1.0) * 255));
+
+                glyphRuns.push_back(runs.size());
+                for (long y = 0; y < height; y++) {
+                    const auto row = alphas.data() + size_t(y) * width;
+                    for (long x = 0; x < width; ) {
+                        auto right = x + 1;
+                        while (right < width && row[right] == row[x])
+                            right++;
+                        if (row[x] != 0) {
+                            const Run run = { y, x, right, row[x] };
+                            runs.push_back(run);
+                        }
+                        x = right;
+                    }
+                }
+            }
+            glyphRuns.push_back(runs.size());
+        }
 
-    PenSelector(CDC& dc, int style = PS_SOLID, int width = 0, COLORREF color = Color::Black)
-        : CGdiObjSelector<CPen>(dc, *new CPen(style, width, color), true)
+        long GetWidth() const
+        {
+            return width;
+        }
+
+        long GetHeight() const
+        {
+            return height;
+        }
+
+        const Run* GetFirstRun(_TCHAR character) const
+        {
+            return runs.data() + glyphRuns[BitmapFont::GetGlyphIndex(character)];
+        }
+
+        const Run* GetLastRun(_TCHAR character) const // past the last
+        {
+            return runs.data() + glyphRuns[BitmapFont::GetGlyphIndex(character) + 1];
+        }
+
+        size_t GetSize() const
+        {
+            return runs.size() * sizeof(Run) + glyphRuns.size() * sizeof(size_t);
+        }
+    };
+
+    // Every page together takes about 550 KB, so text drawn at many heights, as while zooming, evicts the ones least used.
+    static const long   maximumHeight = 12;         // device font height; larger text is filled dot by dot
+    static const size_t capacity      = 256 * 1024; // bytes of runs
+
+private:
+    mutex                          pagesMutex;
+    vector<shared_ptr<const Page>> pages;               // indexed by font height
+    list<long>                     recentlyUsedHeights; // most recently used first
+    size_t                         size;
+
+    GlyphAtlas() : pages(maximumHeight + 1), size(0)
     {}
-};
 
-class FontSelector : public CGdiObjSelector<CFont>
-{
 public:
-    FontSelector(CDC& dc, CFont& font)
-        : CGdiObjSelector<CFont>(dc, font, false)
-    {}
+    static GlyphAtlas& Get()
+    {
+        static GlyphAtlas atlas;
+        return atlas;
+    }
 
-    FontSelector(CDC& dc, const LOGFONT& logFont)
-        : CGdiObjSelector<CFont>(dc, *new CFont(logFont), true)
-    {}
+    // Least recently used pages are dropped once the atlas outgrows capacity; a page stays valid while it is held.
+    shared_ptr<const Page> Find(long pixelHeight)
+    {
+        Debug::Assert(pixelHeight > 0 && pixelHeight <= maximumHeight);
+        lock_guard<mutex> lock(pagesMutex);
+        auto& page = pages[pixelHeight];
+        if (page) {
+            if (recentlyUsedHeights.front() != pixelHeight) {
+                recentlyUsedHeights.remove(pixelHeight);
+                recentlyUsedHeights.push_front(pixelHeight);
+            }
+            return page;
+        }
+        page = shared_ptr<const Page>(new Page(pixelHeight));
+        recentlyUsedHeights.push_front(pixelHeight);
+        size += page->GetSize();
+        while (size > capacity && recentlyUsedHeights.size() > 1) {
+            auto& leastRecentlyUsed = pages[recentlyUsedHeights.back()];
+            size -= leastRecentlyUsed->GetSize();
+            leastRecentlyUsed.reset();
+            recentlyUsedHeights.pop_back();
+        }
+        return page;
+    }
+
+    size_t GetSize()
+    {
+        lock_guard<mutex> lock(pagesMutex);
+        return size;
+    }
 };
 
-class CWnd
+// Software render target: rasterises the drawing calls into an in-memory RGBA buffer with the same mapping modes as GDI.
+class CRasterDC : public CDC
 {
-	static const _TCHAR windowClassName[];            // メイン ウィンドウ クラス名
+    struct Mapping
+    {
+        int    mapMode;
+        CPoint windowOrg;
+        CSize  windowExt;
+        CPoint viewportOrg;
+        CSize  viewportExt;
+    };
 
-protected:
-	HINSTANCE hInstance;
-	HWND      hWnd;
-    bool      isAttached;
+    const long               width;
+    const long               height;
+    vector<uint32_t>         buffer;
+    uint32_t* const          pixels;
+    const CRect              clipArea;
+    mutable CPoint           currentPosition;
+    mutable int              mapMode;
+    mutable int              drawMode;
+    mutable int              backMode;
+    mutable COLORREF         textColor;
+    mutable CPoint           windowOrg;
+    mutable CSize            windowExt;
+    mutable CPoint           viewportOrg;
+    mutable CSize            viewportExt;
+    mutable vector<Mapping>  savedMappings;
 
 public:
-	HWND GetSafeHwnd() const
-	{
-		return this == nullptr ? nullptr : hWnd;
-	}
+    CRasterDC(SIZE size, COLORREF backgroundColor = RGB(0xff, 0xff, 0xff))
+        : width(size.cx), height(size.cy), buffer(size_t(size.cx) * size.cy, ToPixel(backgroundColor)), pixels(buffer.data())
+        , clipArea(CPoint(), size)
+        , mapMode(MM_TEXT), drawMode(R2_COPYPEN), backMode(TRANSPARENT), textColor(Color::Black)
+        , windowExt(1, 1), viewportExt(1, 1)
+    {}
 
-	CWnd(HINSTANCE hInstance = nullptr) : hInstance(hInstance), hWnd(nullptr), isAttached(false)
-	{}
+    // A view of target's pixels with its mapping that draws only inside clipArea (device coordinates).
+    // Views of disjoint areas may draw concurrently.
+    CRasterDC(const CRasterDC& target, const RECT& clipArea)
+        : width(target.width), height(target.height), pixels(target.pixels)
+        , clipArea(CRect(clipArea).Intersect(target.clipArea))
+        , mapMode(target.mapMode), drawMode(target.drawMode), backMode(target.backMode), textColor(target.textColor)
+        , windowOrg(target.windowOrg), windowExt(target.windowExt), viewportOrg(target.viewportOrg), viewportExt(target.viewportExt)
+    {}
 
-    virtual ~CWnd()
+    long GetWidth() const
     {
-        Destroy();
+        return width;
     }
 
-    bool Destroy()
+    long GetHeight() const
     {
-        if (isAttached || hWnd == nullptr)
-            return false;
-        ::DestroyWindow(hWnd);
-        hWnd = nullptr;
-        return true;
+        return height;
     }
 
-	bool Create(CWnd* parent = nullptr, tstring title = _T(""), UINT style = WS_OVERLAPPEDWINDOW, UINT menuId = 0, int nCmdShow = SW_SHOW)
-	{
-		RegisterWindowClass(menuId);
-		return Create(parent, title, style, nCmdShow);
-	}
-
-    CWnd& Attach(HWND hWnd)
+    // Bytes of a row in R, G, B, A order.
+    const uint8_t* GetRow(long y) const
     {
-        Destroy();
-        isAttached      = true;
-        this->hWnd      = hWnd;
-        this->hInstance = HINSTANCE(::GetWindowLongPtr(hWnd, GWLP_HINSTANCE));
-        return *this;
+        return reinterpret_cast<const uint8_t*>(pixels + size_t(y) * width);
     }
 
-    HWND Detach()
+    static uint32_t ToPixel(COLORREF color)
     {
-        isAttached = false;
-        auto hWnd  = this->hWnd;
-        this->hWnd = nullptr;
-        return hWnd;
+        return (color & 0x00ffffff) | 0xff000000;
     }
 
-	bool Move(const RECT& area) const
+	virtual void MoveTo(POINT point) const
 	{
-		return ::MoveWindow(GetSafeHwnd(), area.left, area.top, area.right - area.left, area.bottom - area.top, TRUE);
+        LPtoDP(point);
+        currentPosition = point;
 	}
 
-    bool Show(int showCommand = SW_SHOW)
+	virtual void LineTo(POINT point) const
+	{
+        LPtoDP(point);
+        DrawLine(currentPosition, point);
+        currentPosition = point;
+	}
+
+    virtual void PolyPolyline(const POINT* points, const DWORD* pointCounts, DWORD polylineCount) const
     {
-        return ::ShowWindow(GetSafeHwnd(), showCommand);
+        for (DWORD polyline = 0; polyline < polylineCount; polyline++) {
+            if (pointCounts[polyline] > 0)
+                MoveTo(points[0]);
+            for (DWORD index = 1; index < pointCounts[polyline]; index++)
+                LineTo(points[index]);
+            points += pointCounts[polyline];
+        }
     }
 
-    void SetFocus()
+	virtual void Rectangle(const RECT& rect) const
+	{
+        auto area = ToDevice(rect);
+        if (area.right <= area.left || area.bottom <= area.top)
+            return;
+        const CPoint corners[] = { area.GetTopLeft(), CPoint(area.right - 1, area.top), CPoint(area.right - 1, area.bottom - 1), CPoint(area.left, area.bottom - 1) };
+        for (int index = 0; index < 4; index++)
+            DrawLine(corners[index], corners[(index + 1) % 4]);
+	}
+
+	virtual void Ellipse(const RECT& rect) const
+	{
+        auto area = ToDevice(rect);
+        if (area.right <= area.left || area.bottom <= area.top)
+            return;
+        DrawEllipse(area.left, area.top, area.right - 1, area.bottom - 1);
+	}
+
+	virtual void FillRect(const RECT& area, COLORREF color) const
+	{
+        Fill(ToDevice(area), ToPixel(color));
+	}
+
+    virtual int DrawText(const tstring& text, RECT& area, UINT format) const
     {
-        ::SetFocus(GetSafeHwnd());
+        auto pixelHeight = fontHeight;
+        CDC::LPtoDP(pixelHeight);
+        pixelHeight = Math::Max(pixelHeight, 1L);
+        const auto scale  = pixelHeight / double(BitmapFont::cellHeight);
+        const auto layout = TextLayoutCache::Get().Find(text, BitmapFont::GetFaceName(), pixelHeight, [=](const TextLayout& layout) {
+            return CSize(int(Math::Round(layout.columnCount * BitmapFont::cellWidth * scale)), int(Math::Round(layout.lines.size() * BitmapFont::cellHeight * scale)));
+        });
+        const auto& lines = layout->lines;
+        const auto  size  = layout->size;
+
+        CPoint topLeft(area.left, area.top);
+        LPtoDP(topLeft);
+
+        if ((format & DT_CALCRECT) != 0) {
+            CPoint bottomRight = topLeft + size;
+            DPtoLP(bottomRight);
+            area.right  = bottomRight.x;
+            area.bottom = bottomRight.y;
+            return area.bottom - area.top;
+        }
+
+        const auto textArea = (format & DT_NOCLIP) != 0 ? clipArea : ToDevice(area);
+        const auto pixel    = ToPixel(textColor);
+        if (pixelHeight <= GlyphAtlas::maximumHeight) {
+            DrawFromAtlas(text, lines, topLeft, pixelHeight, scale, textArea.Intersect(clipArea), pixel);
+            return size.cy;
+        }
+        for (size_t lineIndex = 0; lineIndex < lines.size(); lineIndex++) {
+            const auto top = topLeft.y + lineIndex * BitmapFont::cellHeight * scale;
+            for (size_t characterIndex = 0; characterIndex < lines[lineIndex].length; characterIndex++) {
+                const auto left = topLeft.x + characterIndex * BitmapFont::cellWidth * scale;
+                if (IsOutside(long(left), long(top), long(left + BitmapFont::cellWidth * scale) + 1, long(top + BitmapFont::cellHeight * scale) + 1))
+                    continue;
+                DrawGlyph(BitmapFont::GetGlyph(text[lines[lineIndex].start + characterIndex]), left, top, scale, textArea, pixel);
+            }
+        }
+        return size.cy;
     }
 
-    void Set(const CFont& font)
+    // Every font is drawn with BitmapFont.
+    virtual const TCHAR* GetFaceName(const LOGFONT& logFont) const
     {
-        SetWindowFont(GetSafeHwnd(), font.GetHandle(), true);
+        return BitmapFont::GetFaceName();
     }
 
-    bool SetText(tstring text) const
+    virtual COLORREF SetTextColor(COLORREF color) const
     {
-        return ::SetWindowText(GetSafeHwnd(), text.c_str());
+        const auto oldColor = textColor;
+        textColor = color;
+        return oldColor;
     }
 
-    tstring GetText() const
+    virtual int SetBkMode(int backMode) const
     {
-        const int bufferSize = 1024;
-        TCHAR     buffer[bufferSize];
-        ::GetWindowText(GetSafeHwnd(), buffer, bufferSize - 2);
-        buffer[bufferSize - 1] = TCHAR('\0');
-        return tstring(buffer);
+        const auto oldBackMode = this->backMode;
+        this->backMode = backMode;
+        return oldBackMode;
     }
 
-	CRect GetClientArea() const
+	virtual int SetROP2(int drawMode) const
 	{
-		CRect clientArea;
-		::GetClientRect(GetSafeHwnd(), &clientArea);
-		return clientArea;
+        const auto oldDrawMode = this->drawMode;
+        this->drawMode = drawMode;
+        return oldDrawMode;
 	}
 
-	void Invalidate(const RECT* area = nullptr, bool bErase = true)
-	{
-		::InvalidateRect(GetSafeHwnd(), area, bErase);
-	}
+    virtual int SetMapMode(int mode) const
+    {
+        const auto oldMapMode = mapMode;
+        mapMode = mode;
+        return oldMapMode;
+    }
 
-    bool ShowScrollBar(int bar, bool show = true)
+    virtual bool SetWindowOrg(POINT logicalPoint) const
     {
-        return ::ShowScrollBar(hWnd, bar, show);
+        windowOrg = logicalPoint;
+        return true;
     }
 
-    bool SetScrollInfo(int bar, const SCROLLINFO* scrollInfo, bool redraw = true)
+    virtual bool SetWindowExt(SIZE logicalSize) const
     {
-        return ::SetScrollInfo(hWnd, bar, scrollInfo, redraw);
+        if (logicalSize.cx == 0 || logicalSize.cy == 0)
+            return false;
+        windowExt = logicalSize;
+        return true;
     }
 
-    bool GetScrollInfo(int bar, SCROLLINFO* scrollInfo)
+    virtual bool SetViewportOrg(POINT phisicalPoint) const
     {
-        return ::GetScrollInfo(hWnd, bar, scrollInfo);
+        viewportOrg = phisicalPoint;
+        return true;
     }
 
-protected:
-	virtual LRESULT OnCommand(UINT notificationCode, int commandId)
-	{
-		return 0;
-	}
+    virtual bool SetViewportExt(SIZE phisicalSize) const
+    {
+        if (phisicalSize.cx == 0 || phisicalSize.cy == 0)
+            return false;
+        viewportExt = phisicalSize;
+        return true;
+    }
 
-    virtual void OnPrepareDC(CDC& dc)
-    {}
+    // Saves the mapping only; savedDC counts from 1 as with GDI.
+    virtual int SaveDC() const
+    {
+        const Mapping mapping = { mapMode, windowOrg, windowExt, viewportOrg, viewportExt };
+        savedMappings.push_back(mapping);
+        return int(savedMappings.size());
+    }
 
-	virtual void OnDraw(CDC& dc)
-	{}
+    virtual bool RestoreDC(int savedDC) const
+    {
+        if (savedDC <= 0 || size_t(savedDC) > savedMappings.size())
+            return false;
+        const auto& mapping = savedMappings[savedDC - 1];
+        mapMode     = mapping.mapMode;
+        windowOrg   = mapping.windowOrg;
+        windowExt   = mapping.windowExt;
+        viewportOrg = mapping.viewportOrg;
+        viewportExt = mapping.viewportExt;
+        savedMappings.resize(savedDC - 1);
+        return true;
+    }
 
-	virtual void OnEraseBackground(CDC& dc)
-	{}
+    virtual CRect GetDeviceClipBox() const
+    {
+        return clipArea;
+    }
 
-	virtual void OnLButtonDown(UINT keys, POINT point)
-	{}
+    virtual void GetMapping(CPoint& windowOrg, double& scaleX, double& scaleY, CPoint& viewportOrg) const
+    {
+        windowOrg   = this->windowOrg;
+        viewportOrg = this->viewportOrg;
+        GetScale(scaleX, scaleY);
+    }
 
-	virtual void OnLButtonUp(UINT keys, POINT point)
-	{}
+    virtual bool DPtoLP(POINT& point) const
+    {
+        double scaleX, scaleY;
+        GetScale(scaleX, scaleY);
+        point.x = Math::Round((point.x - viewportOrg.x) / scaleX) + windowOrg.x;
+        point.y = Math::Round((point.y - viewportOrg.y) / scaleY) + windowOrg.y;
+        return true;
+    }
 
-	virtual void OnMouseMove(UINT keys, POINT point)
-	{}
+    virtual bool LPtoDP(POINT& point) const
+    {
+        double scaleX, scaleY;
+        GetScale(scaleX, scaleY);
+        point.x = Math::Round((point.x - windowOrg.x) * scaleX) + viewportOrg.x;
+        point.y = Math::Round((point.y - windowOrg.y) * scaleY) + viewportOrg.y;
+        return true;
+    }
 
-    virtual void OnMouseLeave()
-    {}
+private:
+    // MM_ISOTROPIC uses the smaller of the two axis scales for both axes, as GDI does.
+    void GetScale(double& scaleX, double& scaleY) const
+    {
+        if (mapMode == MM_TEXT) {
+            scaleX = scaleY = 1.0;
+            return;
+        }
+        scaleX = double(viewportExt.cx) / windowExt.cx;
+        scaleY = double(viewportExt.cy) / windowExt.cy;
+        if (mapMode == MM_ISOTROPIC) {
+            const auto scale = Math::Min(::fabs(scaleX), ::fabs(scaleY));
+            scaleX = scaleX < 0 ? -scale : scale;
+            scaleY = scaleY < 0 ? -scale : scale;
+        }
+    }
 
-    virtual void OnMouseWheel(UINT keys, double delta, POINT point)
-    {}
-
-    virtual void OnHScroll(UINT code, UINT position, CWnd* pScrollBar)
-    {}
-
-    virtual void OnVScroll(UINT code, UINT position, CWnd* pScrollBar)
-    {}
-
-    virtual void OnCreate()
-	{}
+    CRect ToDevice(const RECT& rect) const
+    {
+        CRect area(rect);
+        CDC::LPtoDP(area);
+        return area;
+    }
 
-	virtual void OnDestroy()
-	{}
+    void Plot(long x, long y, uint32_t pixel) const
+    {
+        if (x < clipArea.left || y < clipArea.top || x >= clipArea.right || y >= clipArea.bottom)
+            return;
+        auto& target = pixels[size_t(y) * width + x];
+        target = drawMode == R2_NOT ? ~target | 0xff000000 : pixel;
+    }
 
-	virtual void OnSize()
-	{}
+    void Fill(CRect area, uint32_t pixel) const
+    {
+        area.left   = Math::Max(area.left  , clipArea.left  );
+        area.top    = Math::Max(area.top   , clipArea.top   );
+        area.right  = Math::Min(area.right , clipArea.right );
+        area.bottom = Math::Min(area.bottom, clipArea.bottom);
+        if (area.left >= area.right)
+            return;
+        for (auto y = area.top; y < area.bottom; y++)
+            std::fill(pixels + size_t(y) * width + area.left, pixels + size_t(y) * width + area.right, pixel);
+    }
 
-private:
-	ATOM RegisterWindowClass(UINT menuId = 0)
-	{
-		WNDCLASSEXW wcex;
-		wcex.cbSize        = sizeof(WNDCLASSEX);
-		wcex.style         = CS_HREDRAW | CS_VREDRAW;
-		wcex.lpfnWndProc   = WndProc;
-		wcex.cbClsExtra    = 0;
-		wcex.cbWndExtra    = 0;
-		wcex.hInstance     = hInstance;
-		wcex.hIcon         = nullptr;
-		wcex.hCursor       = ::LoadCursor(nullptr, IDC_ARROW);
-		wcex.hbrBackground = HBRUSH(COLOR_WINDOW + 1);
-		wcex.lpszMenuName  = menuId == 0 ? nullptr : MAKEINTRESOURCEW(menuId);
-		wcex.lpszClassName = windowClassName;
-		wcex.hIconSm       = nullptr;
+    bool IsOutside(long left, long top, long right, long bottom) const
+    {
+        return right < clipArea.left || bottom < clipArea.top || left >= clipArea.right || top >= clipArea.bottom;
+    }
 
-		return RegisterClassEx(&wcex);
-	}
+    // Bresenham
+    void DrawLine(CPoint start, CPoint end) const
+    {
+        if (IsOutside(Math::Min(start.x, end.x), Math::Min(start.y, end.y), Math::Max(start.x, end.x), Math::Max(start.y, end.y)))
+            return;
 
-	bool Create(CWnd* parent, tstring title, UINT style, int nCmdShow)
-	{
-		hWnd = ::CreateWindow(windowClassName, title.c_str(), style,
-							  CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, parent->GetSafeHwnd(), nullptr, hInstance, this);
-		if (hWnd == nullptr)
-			return false;
+        const auto pixel = ToPixel(penColor);
+        const long dx    =  ::labs(end.x - start.x), stepX = start.x < end.x ? 1 : -1;
+        const long dy    = -::labs(end.y - start.y), stepY = start.y < end.y ? 1 : -1;
+        auto       error = dx + dy;
+        for (auto x = start.x, y = start.y; ; ) {
+            Plot(x, y, pixel);
+            if (x == end.x && y == end.y)
+                break;
+            const auto error2 = 2 * error;
+            if (error2 >= dy) {
+                error += dy;
+                x     += stepX;
+            }
+            if (error2 <= dx) {
+                error += dx;
+                y     += stepY;
+            }
+        }
+    }
 
-		::ShowWindow(hWnd, nCmdShow);
-		::UpdateWindow(hWnd);
-		return true;
-	}
+    // Midpoint ellipse inscribed in the inclusive rectangle (left, top) - (right, bottom).
+    void DrawEllipse(long left, long top, long right, long bottom) const
+    {
+        if (IsOutside(left, top, right, bottom))
+            return;
 
-	LRESULT WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
-	{
-		switch (message)
-		{
-		case WM_COMMAND:
-		{
-            UINT notificationCode = HIWORD(wParam);
-            int  commandId        = LOWORD(wParam);
-			return OnCommand(notificationCode, commandId);
-		}
-		break;
-		case WM_PAINT:
-		{
-			CPaintDC dc(*this);
-            OnPrepareDC(dc);
-			OnDraw(dc);
-		}
-		break;
-		case WM_SIZE:
-			OnSize();
-			break;
-		case WM_ERASEBKGND:
-		{
-			auto hdc = HDC(wParam);
-			CAttachedDC dc(hdc);
-			OnEraseBackground(dc);
-		}
-		break;
-		case WM_LBUTTONDOWN:
-		{
-			const POINT point = { GET_X_LPARAM(lParam),
-								  GET_Y_LPARAM(lParam) };
-			OnLButtonDown(UINT(wParam), point);
-		}
-		break;
-		case WM_LBUTTONUP:
-		{
-			const POINT point = { GET_X_LPARAM(lParam),
-								  GET_Y_LPARAM(lParam) };
-			OnLButtonUp(UINT(wParam), point);
-		}
-		break;
-		case WM_MOUSEMOVE:
-		{
-			const POINT point = { GET_X_LPARAM(lParam),
-								  GET_Y_LPARAM(lParam) };
-			OnMouseMove(UINT(wParam), point);
-            TrackMouseEvent();
-		}
-		break;
-        case WM_MOUSELEAVE:
-            OnMouseLeave();
-            break;
+        const auto pixel    = ToPixel(penColor);
+        int64_t    a        = right - left, b = bottom - top, b1 = b & 1;
+        int64_t    dx       = 4 * (1 - a) * b * b, dy = 4 * (b1 + 1) * a * a;
+        int64_t    error    = dx + dy + b1 * a * a;
+        int64_t    x0       = left, x1 = right;
+        int64_t    y0       = top + (b + 1) / 2, y1 = y0 - b1;
+        a  *= 8 * a;
+        b1  = 8 * b * b;
+
+        do {
+            Plot(long(x1), long(y0), pixel);
+            Plot(long(x0), long(y0), pixel);
+            Plot(long(x0), long(y1), pixel);
+            Plot(long(x1), long(y1), pixel);
+            const auto error2 = 2 * error;
+            if (error2 <= dy) {
+                y0++;
+                y1--;
+                error += dy += a;
+            }
+            if (error2 >= dx || 2 * error > dy) {
+                x0++;
+                x1--;
+                error += dx += b1;
+            }
+        } while (x0 <= x1);
 
-        case WM_MOUSEWHEEL:
-        {
-            const auto  keys  = UINT(LOWORD(wParam));
-            const auto  delta = short(HIWORD(wParam)) / (double)WHEEL_DELTA;
-            const POINT point = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
-            OnMouseWheel(keys, delta, point);
+        while (y0 - y1 <= b) {
+            Plot(long(x0 - 1), long(y0  ), pixel);
+            Plot(long(x1 + 1), long(y0++), pixel);
+            Plot(long(x0 - 1), long(y1  ), pixel);
+            Plot(long(x1 + 1), long(y1--), pixel);
         }
-        break;
-        case WM_HSCROLL :
-        {
-            UINT  code     = LOWORD(wParam);
-            UINT  position = HIWORD(wParam);
-            static CWnd temporaryScrollBar;
-            CWnd* scrollBar = HWND(lParam) == nullptr ? nullptr : &temporaryScrollBar.Attach(HWND(lParam));
-            OnHScroll(code, position, scrollBar);
+    }
+
+    // Blends the atlas masks of the glyphs, looked up together, at whole pixel positions.
+    void DrawFromAtlas(const tstring& text, const vector<TextLayout::Line>& lines, CPoint topLeft, long pixelHeight, double scale, const CRect& area, uint32_t pixel) const
+    {
+        if (area.right <= area.left || area.bottom <= area.top)
+            return;
+        const auto page = GlyphAtlas::Get().Find(pixelHeight);
+        for (size_t lineIndex = 0; lineIndex < lines.size(); lineIndex++) {
+            const auto top = topLeft.y + Math::Round(lineIndex * BitmapFont::cellHeight * scale);
+            if (top >= area.bottom || top + page->GetHeight() <= area.top)
+                continue;
+            for (size_t characterIndex = 0; characterIndex < lines[lineIndex].length; characterIndex++) {
+                const auto left = topLeft.x + Math::Round(characterIndex * BitmapFont::cellWidth * scale);
+                if (left >= area.right)
+                    break;
+                if (left + page->GetWidth() > area.left)
+                    DrawRuns(page->GetFirstRun(text[lines[lineIndex].start + characterIndex]), page->GetLastRun(text[lines[lineIndex].start + characterIndex]), left, top, area, pixel);
+            }
         }
-        break;
-        case WM_VSCROLL:
-        {
-            UINT  code     = LOWORD(wParam);
-            UINT  position = HIWORD(wParam);
-            static CWnd temporaryScrollBar;
-            CWnd* scrollBar = HWND(lParam) == nullptr ? nullptr : &temporaryScrollBar.Attach(HWND(lParam));
-            OnVScroll(code, position, scrollBar);
+    }
+
+    // Opaque runs are filled; the others, the antialiased edges, are blended.
+    void DrawRuns(const GlyphAtlas::Page::Run* run, const GlyphAtlas::Page::Run* lastRun, long left, long top, const CRect& area, uint32_t pixel) const
+    {
+        for (; run != lastRun; run++) {
+            const auto y = top + run->y;
+            if (y < area.top || y >= area.bottom)
+                continue;
+            const auto runLeft  = Math::Max(area.left , left + run->left );
+            const auto runRight = Math::Min(area.right, left + run->right);
+            if (runLeft >= runRight)
+                continue;
+            auto       row      = pixels + size_t(y) * width;
+            if (run->alpha == 0xff)
+                std::fill(row + runLeft, row + runRight, pixel);
+            else
+                for (auto x = runLeft; x < runRight; x++)
+                    row[x] = Blend(row[x], pixel, run->alpha);
         }
-        break;
-        case WM_DESTROY:
-			OnDestroy();
-			break;
-		default:
-			return ::DefWindowProc(hWnd, message, wParam, lParam);
-		}
-		return 0;
-	}
+    }
 
-    void TrackMouseEvent()
+    // Red and blue, then green, each multiplied in one go; (n + 0x80 + (n + 0x80) / 0x100) / 0x100 is n / 0xff rounded.
+    static uint32_t Blend(uint32_t background, uint32_t foreground, uint32_t alpha)
     {
-        TRACKMOUSEEVENT tme;
-        tme.cbSize    = sizeof(tme);
-        tme.dwFlags   = TME_LEAVE;
-        tme.hwndTrack = GetSafeHwnd();
-        ::TrackMouseEvent(&tme);
+        const auto inverse   = 0xff - alpha;
+        auto       redBlue   = (background & 0xff00ff) * inverse + (foreground & 0xff00ff) * alpha + 0x800080;
+        auto       green     = (background & 0x00ff00) * inverse + (foreground & 0x00ff00) * alpha + 0x008000;
+        redBlue = ((redBlue + ((redBlue >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+        green   = ((green   + ((green   >> 8) & 0x00ff00)) >> 8) & 0x00ff00;
+        return 0xff000000 | redBlue | green;
     }
 
-	static LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
-	{
-        switch (message)
-        {
-        case WM_CREATE:
-        {
-            auto createStruct = reinterpret_cast<CREATESTRUCT*>(lParam);
-            auto self         = static_cast<CWnd*>(createStruct->lpCreateParams);
-            ::SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(self));
-            self->hWnd = hWnd;
-            self->OnCreate();
-            return 0;
-        }
-        break;
-        default:
-        {
-            auto self = reinterpret_cast<CWnd*>(::GetWindowLongPtr(hWnd, GWLP_USERDATA));
-            return self == nullptr ? ::DefWindowProc(hWnd, message, wParam, lParam)
-                                   : self->WindowProcedure(hWnd, message, wParam, lParam);
-        }
-        break;
+    void DrawGlyph(const uint8_t* glyph, double left, double top, double scale, const CRect& textArea, uint32_t pixel) const
+    {
+        for (int column = 0; column < BitmapFont::glyphWidth; column++) {
+            const auto dotLeft  = Math::Round(left + column * scale);
+            const auto dotRight = Math::Max(Math::Round(left + (column + 1) * scale), dotLeft + 1);
+            for (int row = 0; row < BitmapFont::glyphHeight; row++) {
+                if ((glyph[column] & (1 << row)) == 0)
+                    continue;
+                const auto dotTop    = Math::Round(top + row * scale);
+                const auto dotBottom = Math::Max(Math::Round(top + (row + 1) * scale), dotTop + 1);
+                Fill(CRect(CPoint(dotLeft, dotTop), CPoint(dotRight, dotBottom)).Intersect(textArea), pixel);
+            }
         }
-	}
+    }
 };
 
-const _TCHAR CWnd::windowClassName[] = _T("FCWindowClass");
+// Colours of device pixels collected from figures too small to draw individually, drawn to a DC as horizontal runs.
+class PixelCoverage : public Uncopyable
+{
+    static const COLORREF emptyColor = 0xffffffff;
 
-// CPaintDC
+    const CRect      area;
+    vector<COLORREF> colors;
+    CRect            usedArea;
 
-inline CPaintDC::CPaintDC(CWnd& window) : window(window)
-{
-	hdc = ::BeginPaint(window.GetSafeHwnd(), &ps);
-}
+public:
+    // area: the device pixels of the target DC to collect.
+    PixelCoverage(const RECT& area)
+        : area(area), colors(size_t(Math::Max(this->area.GetSize().cx, 0L)) * Math::Max(this->area.GetSize().cy, 0L), emptyColor)
+    {
+        ResetUsedArea();
+    }
 
-inline CPaintDC::~CPaintDC()
-{
-	::EndPaint(window.GetSafeHwnd(), &ps);
-}
+    void Fill(const RECT& deviceArea, COLORREF color)
+    {
+        const auto left   = Math::Max(deviceArea.left  , area.left  );
+        const auto top    = Math::Max(deviceArea.top   , area.top   );
+        const auto right  = Math::Min(deviceArea.right , area.right );
+        const auto bottom = Math::Min(deviceArea.bottom, area.bottom);
+        if (left >= right || top >= bottom)
+            return;
+        for (auto y = top; y < bottom; y++)
+            std::fill(colors.begin() + GetIndex(left, y), colors.begin() + GetIndex(right, y), color);
+        Extend(left, top, right, bottom);
+    }
 
-// CClientDC
+    // Bresenham
+    void DrawLine(CPoint start, CPoint end, COLORREF color)
+    {
+        const long dx    =  ::labs(end.x - start.x), stepX = start.x < end.x ? 1 : -1;
+        const long dy    = -::labs(end.y - start.y), stepY = start.y < end.y ? 1 : -1;
+        auto       error = dx + dy;
+        for (auto x = start.x, y = start.y; ; ) {
+            Fill(CRect(CPoint(x, y), CSize(1, 1)), color);
+            if (x == end.x && y == end.y)
+                break;
+            const auto error2 = 2 * error;
+            if (error2 >= dy) {
+                error += dy;
+                x     += stepX;
+            }
+            if (error2 <= dx) {
+                error += dx;
+                y     += stepY;
+            }
+        }
+    }
 
-inline CClientDC::CClientDC(CWnd& window) : window(window)
-{
-	hdc = ::GetDC(window.GetSafeHwnd());
-}
+    // Draws the collected pixels in device units and clears them.
+    void Flush(CDC& dc)
+    {
+        if (usedArea.left >= usedArea.right)
+            return;
 
-inline CClientDC::~CClientDC()
-{
-	::ReleaseDC(window.GetSafeHwnd(), hdc);
-}
+        const auto savedDC = dc.SaveDC();
+        dc.SetMapMode    (MM_TEXT );
+        dc.SetWindowOrg  (CPoint());
+        dc.SetViewportOrg(CPoint());
+        for (auto y = usedArea.top; y < usedArea.bottom; y++) {
+            for (auto x = usedArea.left; x < usedArea.right; ) {
+                const auto color = colors[GetIndex(x, y)];
+                auto       right = x + 1;
+                while (right < usedArea.right && colors[GetIndex(right, y)] == color)
+                    right++;
+                if (color != emptyColor)
+                    dc.FillRect(CRect(CPoint(x, y), CPoint(right, y + 1)), color);
+                x = right;
+            }
+            std::fill(colors.begin() + GetIndex(usedArea.left, y), colors.begin() + GetIndex(usedArea.right, y), emptyColor);
+        }
+        dc.RestoreDC(savedDC);
+        ResetUsedArea();
+    }
 
-class CEdit : public CWnd
+private:
+    size_t GetIndex(long x, long y) const
+    {
+        return size_t(y - area.top) * area.GetSize().cx + (x - area.left);
+    }
+
+    void ResetUsedArea()
+    {
+        usedArea.left   = area.right ;
+        usedArea.top    = area.bottom;
+        usedArea.right  = area.left  ;
+        usedArea.bottom = area.top   ;
+    }
+
+    void Extend(long left, long top, long right, long bottom)
+    {
+        usedArea.left   = Math::Min(usedArea.left  , left  );
+        usedArea.top    = Math::Min(usedArea.top   , top   );
+        usedArea.right  = Math::Max(usedArea.right , right );
+        usedArea.bottom = Math::Max(usedArea.bottom, bottom);
+    }
+};
+
+// Clips shapes to the device pixels a DC can reach, in floating point device coordinates, so that a shape far larger than the
+// window is neither rasterised outside it nor mapped to coordinates beyond what GDI takes. Shapes within a guard band around
+// the clip box are drawn whole, so that tiles drawn apart still meet pixel for pixel; the others are clipped to the guard band,
+// lines by Liang-Barsky, rectangles edge by edge and ellipses to the arcs between their crossings with it.
+// The clipped parts are collected as device polylines and drawn by Flush.
+class ViewportClipper : public Uncopyable
 {
+    static const long guardBand   = 1024;     // device pixels
+    static const long deviceLimit = 1L << 27; // device coordinates are clamped to this
+    const double      tolerance   = 0.25;     // device pixels an arc may deviate from its polyline
+
+    CPoint        windowOrg;
+    CPoint        viewportOrg;
+    double        scaleX;
+    double        scaleY;
+    double        left;
+    double        top;
+    double        right;
+    double        bottom;
+    vector<POINT> points;
+    vector<DWORD> pointCounts;
+
 public:
-    CEdit(HINSTANCE hInstance = nullptr) : CWnd(hInstance)
-    {}
+    ViewportClipper(const CDC& dc)
+    {
+        dc.GetMapping(windowOrg, scaleX, scaleY, viewportOrg);
+        const auto area = dc.GetDeviceClipBox().GetInflateRect(guardBand, guardBand);
+        left   = area.left  ;
+        top    = area.top   ;
+        right  = area.right ;
+        bottom = area.bottom;
+    }
 
-    bool Create(CWnd* parent, tstring text, UINT style, const RECT& area, UINT id = 0)
+    static void DrawLine(CDC& dc, const CLine& line)
     {
-        hWnd = ::CreateWindow(_T("EDIT"), text.c_str(), style,
-                              area.left, area.top, area.right - area.left, area.bottom - area.top,
-                              parent->GetSafeHwnd(), HMENU(id), hInstance, nullptr);
-        return hWnd != nullptr;
+        ViewportClipper clipper(dc);
+        if (clipper.Contains(clipper.ToDevice(CRect(line.start, line.end)))) {
+            dc.Draw(line);
+            return;
+        }
+        clipper.AddLine(line.start, line.end);
+        clipper.Flush(dc);
+    }
+
+    static void DrawRectangle(CDC& dc, const RECT& rect)
+    {
+        ViewportClipper clipper(dc);
+        if (clipper.Contains(clipper.ToDevice(rect))) {
+            dc.Rectangle(rect);
+            return;
+        }
+        clipper.AddRectangle(rect);
+        clipper.Flush(dc);
+    }
+
+    static void DrawEllipse(CDC& dc, const RECT& rect)
+    {
+        ViewportClipper clipper(dc);
+        if (clipper.Contains(clipper.ToDevice(rect))) {
+            dc.Ellipse(rect);
+            return;
+        }
+        clipper.AddEllipse(rect);
+        clipper.Flush(dc);
+    }
+
+    // The normalized device bounds of logicalArea, clamped so that they never overflow.
+    CRect ToDevice(const RECT& logicalArea) const
+    {
+        double x1, y1, x2, y2;
+        ToDevice(CPoint(logicalArea.left , logicalArea.top   ), x1, y1);
+        ToDevice(CPoint(logicalArea.right, logicalArea.bottom), x2, y2);
+        return CRect(CPoint(Clamp(x1), Clamp(y1)), CPoint(Clamp(x2), Clamp(y2)));
+    }
+
+    // Whether a shape with deviceArea as its bounds lies within the guard band, so that it can be drawn as is.
+    bool Contains(const RECT& deviceArea) const
+    {
+        return deviceArea.left >= left && deviceArea.top >= top && deviceArea.right <= right && deviceArea.bottom <= bottom;
+    }
+
+    bool IsEmpty() const
+    {
+        return pointCounts.size() == 0;
+    }
+
+    void AddLine(POINT start, POINT end)
+    {
+        double x1, y1, x2, y2;
+        ToDevice(start, x1, y1);
+        ToDevice(end  , x2, y2);
+        AddLine(x1, y1, x2, y2);
+    }
+
+    // The edges in the order Rectangle draws them, right and bottom exclusive.
+    void AddRectangle(const RECT& rect)
+    {
+        double x1, y1, x2, y2;
+        ToDevice(CPoint(rect.left , rect.top   ), x1, y1);
+        ToDevice(CPoint(rect.right, rect.bottom), x2, y2);
+        const auto minimumX = Math::Min(x1, x2), maximumX = Math::Max(x1, x2) - 1.0;
+        const auto minimumY = Math::Min(y1, y2), maximumY = Math::Max(y1, y2) - 1.0;
+        if (maximumX < minimumX || maximumY < minimumY)
+            return;
+        AddLine(minimumX, minimumY, maximumX, minimumY);
+        AddLine(maximumX, minimumY, maximumX, maximumY);
+        AddLine(maximumX, maximumY, minimumX, maximumY);
+        AddLine(minimumX, maximumY, minimumX, minimumY);
+    }
+
+    // The angles where the ellipse crosses the sides of the guard band split it into arcs wholly inside or outside;
+    // the arcs inside are drawn as polylines.
+    void AddEllipse(const RECT& rect)
+    {
+        double x1, y1, x2, y2;
+        ToDevice(CPoint(rect.left , rect.top   ), x1, y1);
+        ToDevice(CPoint(rect.right, rect.bottom), x2, y2);
+        const auto centerX = (x1 + x2) / 2, radiusX = ::fabs(x2 - x1) / 2;
+        const auto centerY = (y1 + y2) / 2, radiusY = ::fabs(y2 - y1) / 2;
+        if (centerX + radiusX < left || centerX - radiusX > right || centerY + radiusY < top || centerY - radiusY > bottom)
+            return;
+
+        const auto pi = ::acos(-1.0);
+        vector<double> angles;
+        for (auto x : { left, right }) {
+            if (radiusX > 0.0 && ::fabs(x - centerX) < radiusX) {
+                const auto angle = ::acos((x - centerX) / radiusX);
+                angles.push_back(angle);
+                angles.push_back(2.0 * pi - angle);
+            }
+        }
+        for (auto y : { top, bottom }) {
+            if (radiusY > 0.0 && ::fabs(y - centerY) < radiusY) {
+                const auto angle = ::asin((y - centerY) / radiusY);
+                angles.push_back(angle < 0.0 ? angle + 2.0 * pi : angle);
+                angles.push_back(pi - angle);
+            }
+        }
+        if (angles.size() == 0) {
+            if (IsInside(centerX + radiusX, centerY))
+                AddArc(centerX, centerY, radiusX, radiusY, 0.0, 2.0 * pi);
+            return;
+        }
+        sort(angles.begin(), angles.end());
+        angles.push_back(angles.front() + 2.0 * pi);
+        for (size_t index = 0; index + 1 < angles.size(); index++) {
+            const auto middle = (angles[index] + angles[index + 1]) / 2;
+            if (IsInside(centerX + radiusX * ::cos(middle), centerY + radiusY * ::sin(middle)))
+                AddArc(centerX, centerY, radiusX, radiusY, angles[index], angles[index + 1]);
+        }
+    }
+
+    // Draws the collected polylines in device units with the selected pen and clears them.
+    void Flush(CDC& dc)
+    {
+        if (IsEmpty())
+            return;
+
+        const auto savedDC = dc.SaveDC();
+        dc.SetMapMode    (MM_TEXT );
+        dc.SetWindowOrg  (CPoint());
+        dc.SetViewportOrg(CPoint());
+        dc.PolyPolyline(points.data(), pointCounts.data(), DWORD(pointCounts.size()));
+        dc.RestoreDC(savedDC);
+        points     .clear();
+        pointCounts.clear();
+    }
+
+private:
+    void ToDevice(POINT point, double& x, double& y) const
+    {
+        x = (double(point.x) - windowOrg.x) * scaleX + viewportOrg.x;
+        y = (double(point.y) - windowOrg.y) * scaleY + viewportOrg.y;
+    }
+
+    static long Clamp(double value)
+    {
+        return Math::Round(Math::Max(Math::Min(value, double(deviceLimit)), -double(deviceLimit)));
+    }
+
+    bool IsInside(double x, double y) const
+    {
+        return x >= left && x <= right && y >= top && y <= bottom;
+    }
+
+    // Liang-Barsky: the part of the segment inside is between the parameters where it enters and leaves the guard band.
+    void AddLine(double x1, double y1, double x2, double y2)
+    {
+        const auto   dx        = x2 - x1, dy = y2 - y1;
+        const double p[]       = { -dx, dx, -dy, dy };
+        const double q[]       = { x1 - left, right - x1, y1 - top, bottom - y1 };
+        double       entering  = 0.0, leaving = 1.0;
+        for (int side = 0; side < 4; side++) {
+            if (p[side] == 0.0) {
+                if (q[side] < 0.0)
+                    return;
+                continue;
+            }
+            const auto parameter = q[side] / p[side];
+            if (p[side] < 0.0)
+                entering = Math::Max(entering, parameter);
+            else
+                leaving  = Math::Min(leaving , parameter);
+            if (entering > leaving)
+                return;
+        }
+        points.push_back(CPoint(Math::Round(x1 + entering * dx), Math::Round(y1 + entering * dy)));
+        points.push_back(CPoint(Math::Round(x1 + leaving  * dx), Math::Round(y1 + leaving  * dy)));
+        pointCounts.push_back(2);
+    }
+
+    // Angle steps short enough that no chord strays more than tolerance from the arc.
+    void AddArc(double centerX, double centerY, double radiusX, double radiusY, double startAngle, double endAngle)
+    {
+        const auto step       = ::sqrt(8.0 * tolerance / Math::Max(Math::Max(radiusX, radiusY), tolerance));
+        const auto stepCount  = Math::Max(long(::ceil((endAngle - startAngle) / step)), 1L);
+        for (long index = 0; index <= stepCount; index++) {
+            const auto angle = startAngle + (endAngle - startAngle) * index / stepCount;
+            points.push_back(CPoint(Math::Round(centerX + radiusX * ::cos(angle)), Math::Round(centerY + radiusY * ::sin(angle))));
+        }
+        pointCounts.push_back(DWORD(stepCount + 1));
+    }
+};
+
+template <class THandle>
+class CGdiObj : public Uncopyable
+{
+protected:
+    const THandle hObject;
+
+    CGdiObj(THandle hObject) : hObject(hObject)
+    {
+        if (hObject == nullptr)
+            throw exception();
+    }
+
+public:
+    THandle GetHandle() const
+    {
+        return this == nullptr ? nullptr : hObject;
+    }
+
+    virtual ~CGdiObj()
+    {
+        if (hObject != nullptr)
+            ::DeleteObject(hObject);
+    }
+
+    // The object keeps no selection state, so one object may be selected into several DCs at once.
+    HGDIOBJ AttachTo(CDC& dc)
+    {
+        return ::SelectObject(dc.GetHandle(), GetHandle());
+    }
+
+    void DetachFrom(CDC& dc, HGDIOBJ hOldObject)
+    {
+        ::SelectObject(dc.GetHandle(), hOldObject);
+    }
+};
+
+class CPen : public CGdiObj<HPEN>
+{
+    const COLORREF color;
+
+public:
+	CPen(int style = PS_SOLID, int width = 0, COLORREF color = Color::Black)
+		: CGdiObj<HPEN>(::CreatePen(style, width, color)), color(color)
+	{}
+
+    COLORREF GetColor() const
+    {
+        return color;
+    }
+};
+
+class CFont : public CGdiObj<HFONT>
+{
+    const long height;
+
+public:
+    CFont(const LOGFONT& logFont)
+        : CGdiObj<HFONT>(::CreateFontIndirect(&logFont)), height(::labs(logFont.lfHeight))
+    {}
+
+    long GetHeight() const
+    {
+        return height;
+    }
+};
+
+class CBitmap : public CGdiObj<HBITMAP>
+{
+    const CSize size;
+
+public:
+    CBitmap(const CDC& dc, SIZE size)
+        : CGdiObj<HBITMAP>(::CreateCompatibleBitmap(dc.GetHandle(), size.cx, size.cy)), size(size)
+    {}
+
+    CSize GetSize() const
+    {
+        return size;
+    }
+};
+
+template <class TCGdiObj>
+class CGdiObjSelector : public Uncopyable
+{
+protected:
+	CDC&                 dc;
+
+private:
+    unique_ptr<TCGdiObj> obj;
+	bool                 isMine;
+    HGDIOBJ              hOldObject;
+
+public:
+    CGdiObjSelector(CDC& dc, TCGdiObj& obj, bool isMine) : dc(dc), obj(&obj), isMine(isMine), hOldObject(obj.AttachTo(dc))
+	{}
+
+	virtual ~CGdiObjSelector()
+	{
+        obj->DetachFrom(dc, hOldObject);
+        if (!isMine)
+            obj.release();
+	}
+};
+
+class PenSelector : public CGdiObjSelector<CPen>
+{
+    const COLORREF oldColor;
+
+public:
+    PenSelector(CDC& dc, CPen& pen)
+        : CGdiObjSelector<CPen>(dc, pen, false), oldColor(dc.SetPenColor(pen.GetColor()))
+    {}
+
+    PenSelector(CDC& dc, int style = PS_SOLID, int width = 0, COLORREF color = Color::Black)
+        : CGdiObjSelector<CPen>(dc, *new CPen(style, width, color), true), oldColor(dc.SetPenColor(color))
+    {}
+
+    virtual ~PenSelector()
+    {
+        dc.SetPenColor(oldColor);
+    }
+};
+
+class FontSelector : public CGdiObjSelector<CFont>
+{
+    const long oldHeight;
+
+public:
+    FontSelector(CDC& dc, CFont& font)
+        : CGdiObjSelector<CFont>(dc, font, false), oldHeight(dc.SetFontHeight(font.GetHeight()))
+    {}
+
+    FontSelector(CDC& dc, const LOGFONT& logFont)
+        : CGdiObjSelector<CFont>(dc, *new CFont(logFont), true), oldHeight(dc.SetFontHeight(::labs(logFont.lfHeight)))
+    {}
+
+    virtual ~FontSelector()
+    {
+        dc.SetFontHeight(oldHeight);
+    }
+};
+
+// Fonts created once per LOGFONT and kept for the life of the process.
+class FontCache : public Uncopyable
+{
+    struct LogFontLess
+    {
+        bool operator()(const LOGFONT& logFont1, const LOGFONT& logFont2) const
+        {
+            return memcmp(&logFont1, &logFont2, sizeof(LOGFONT)) < 0;
+        }
+    };
+
+    mutex                                        fontsMutex;
+    map<LOGFONT, unique_ptr<CFont>, LogFontLess> fonts;
+
+public:
+    static CFont& Get(const LOGFONT& logFont)
+    {
+        static FontCache cache;
+        lock_guard<mutex> lock(cache.fontsMutex);
+        auto& font = cache.fonts[logFont];
+        if (font == nullptr)
+            font.reset(new CFont(logFont));
+        return *font;
+    }
+
+    // The device size of text drawn from topLeft on dc, measured on dc once per string, font face and device font height.
+    static CSize GetTextSize(CDC& dc, const tstring& text, const LOGFONT& logFont, POINT topLeft)
+    {
+        auto pixelHeight = ::labs(logFont.lfHeight);
+        dc.LPtoDP(pixelHeight);
+        const auto layout = TextLayoutCache::Get().Find(text, dc.GetFaceName(logFont), Math::Max(pixelHeight, 1L), [&](const TextLayout&) {
+            FontSelector fontSelector(dc, Get(logFont));
+            CRect area(topLeft, CSize());
+            dc.DrawText(text, area, DT_LEFT | DT_TOP | DT_CALCRECT);
+            dc.LPtoDP(area);
+            return area.GetSize();
+        });
+        return layout->size;
+    }
+};
+
+class CWnd
+{
+	static const _TCHAR windowClassName[];            // メイン ウィンドウ クラス名
+
+protected:
+	HINSTANCE hInstance;
+	HWND      hWnd;
+    bool      isAttached;
+
+public:
+	HWND GetSafeHwnd() const
+	{
+		return this == nullptr ? nullptr : hWnd;
+	}
+
+	CWnd(HINSTANCE hInstance = nullptr) : hInstance(hInstance), hWnd(nullptr), isAttached(false)
+	{}
+
+    virtual ~CWnd()
+    {
+        Destroy();
+    }
+
+    bool Destroy()
+    {
+        if (isAttached || hWnd == nullptr)
+            return false;
+        ::DestroyWindow(hWnd);
+        hWnd = nullptr;
+        return true;
+    }
+
+	bool Create(CWnd* parent = nullptr, tstring title = _T(""), UINT style = WS_OVERLAPPEDWINDOW, UINT menuId = 0, int nCmdShow = SW_SHOW)
+	{
+		RegisterWindowClass(menuId);
+		return Create(parent, title, style, nCmdShow);
+	}
+
+    CWnd& Attach(HWND hWnd)
+    {
+        Destroy();
+        isAttached      = true;
+        this->hWnd      = hWnd;
+        this->hInstance = HINSTANCE(::GetWindowLongPtr(hWnd, GWLP_HINSTANCE));
+        return *this;
+    }
+
+    HWND Detach()
+    {
+        isAttached = false;
+        auto hWnd  = this->hWnd;
+        this->hWnd = nullptr;
+        return hWnd;
+    }
+
+	bool Move(const RECT& area) const
+	{
+		return ::MoveWindow(GetSafeHwnd(), area.left, area.top, area.right - area.left, area.bottom - area.top, TRUE);
+	}
+
+    bool Show(int showCommand = SW_SHOW)
+    {
+        return ::ShowWindow(GetSafeHwnd(), showCommand);
+    }
+
+    void SetFocus()
+    {
+        ::SetFocus(GetSafeHwnd());
+    }
+
+    void Set(const CFont& font)
+    {
+        SetWindowFont(GetSafeHwnd(), font.GetHandle(), true);
+    }
+
+    bool SetText(tstring text) const
+    {
+        return ::SetWindowText(GetSafeHwnd(), text.c_str());
+    }
+
+    tstring GetText() const
+    {
+        const int bufferSize = 1024;
+        TCHAR     buffer[bufferSize];
+        ::GetWindowText(GetSafeHwnd(), buffer, bufferSize - 2);
+        buffer[bufferSize - 1] = TCHAR('\0');
+        return tstring(buffer);
+    }
+
+	CRect GetClientArea() const
+	{
+		CRect clientArea;
+		::GetClientRect(GetSafeHwnd(), &clientArea);
+		return clientArea;
+	}
+
+	void Invalidate(const RECT* area = nullptr, bool bErase = true)
+	{
+		::InvalidateRect(GetSafeHwnd(), area, bErase);
+	}
+
+    bool ShowScrollBar(int bar, bool show = true)
+    {
+        return ::ShowScrollBar(hWnd, bar, show);
+    }
+
+    bool SetScrollInfo(int bar, const SCROLLINFO* scrollInfo, bool redraw = true)
+    {
+        return ::SetScrollInfo(hWnd, bar, scrollInfo, redraw);
+    }
+
+    bool GetScrollInfo(int bar, SCROLLINFO* scrollInfo)
+    {
+        return ::GetScrollInfo(hWnd, bar, scrollInfo);
+    }
+
+    bool SetTimer(UINT_PTR timerId, UINT elapse)
+    {
+        return ::SetTimer(hWnd, timerId, elapse, nullptr) != 0;
+    }
+
+    bool KillTimer(UINT_PTR timerId)
+    {
+        return ::KillTimer(hWnd, timerId) != FALSE;
+    }
+
+protected:
+	virtual LRESULT OnCommand(UINT notificationCode, int commandId)
+	{
+		return 0;
+	}
+
+    virtual void OnPrepareDC(CDC& dc)
+    {}
+
+	virtual void OnDraw(CDC& dc)
+	{}
+
+	virtual void OnEraseBackground(CDC& dc)
+	{}
+
+	virtual void OnLButtonDown(UINT keys, POINT point)
+	{}
+
+	virtual void OnLButtonUp(UINT keys, POINT point)
+	{}
+
+	virtual void OnMouseMove(UINT keys, POINT point)
+	{}
+
+    virtual void OnMouseLeave()
+    {}
+
+    virtual void OnMouseWheel(UINT keys, double delta, POINT point)
+    {}
+
+    virtual void OnHScroll(UINT code, UINT position, CWnd* pScrollBar)
+    {}
+
+    virtual void OnVScroll(UINT code, UINT position, CWnd* pScrollBar)
+    {}
+
+    virtual void OnTimer(UINT_PTR timerId)
+    {}
+
+    virtual void OnCreate()
+	{}
+
+	virtual void OnDestroy()
+	{}
+
+	virtual void OnSize()
+	{}
+
+private:
+	ATOM RegisterWindowClass(UINT menuId = 0)
+	{
+		WNDCLASSEXW wcex;
+		wcex.cbSize        = sizeof(WNDCLASSEX);
+		wcex.style         = CS_HREDRAW | CS_VREDRAW;
+		wcex.lpfnWndProc   = WndProc;
+		wcex.cbClsExtra    = 0;
+		wcex.cbWndExtra    = 0;
+		wcex.hInstance     = hInstance;
+		wcex.hIcon         = nullptr;
+		wcex.hCursor       = ::LoadCursor(nullptr, IDC_ARROW);
+		wcex.hbrBackground = HBRUSH(COLOR_WINDOW + 1);
+		wcex.lpszMenuName  = menuId == 0 ? nullptr : MAKEINTRESOURCEW(menuId);
+		wcex.lpszClassName = windowClassName;
+		wcex.hIconSm       = nullptr;
+
+		return RegisterClassEx(&wcex);
+	}
+
+	bool Create(CWnd* parent, tstring title, UINT style, int nCmdShow)
+	{
+		hWnd = ::CreateWindow(windowClassName, title.c_str(), style,
+							  CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, parent->GetSafeHwnd(), nullptr, hInstance, this);
+		if (hWnd == nullptr)
+			return false;
+
+		::ShowWindow(hWnd, nCmdShow);
+		::UpdateWindow(hWnd);
+		return true;
+	}
+
+	LRESULT WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+	{
+		switch (message)
+		{
+		case WM_COMMAND:
+		{
+            UINT notificationCode = HIWORD(wParam);
+            int  commandId        = LOWORD(wParam);
+			return OnCommand(notificationCode, commandId);
+		}
+		break;
+		case WM_PAINT:
+		{
+			CPaintDC dc(*this);
+            OnPrepareDC(dc);
+			OnDraw(dc);
+		}
+		break;
+		case WM_SIZE:
+			OnSize();
+			break;
+		case WM_ERASEBKGND:
+		{
+			auto hdc = HDC(wParam);
+			CAttachedDC dc(hdc);
+			OnEraseBackground(dc);
+		}
+		break;
+		case WM_LBUTTONDOWN:
+		{
+			const POINT point = { GET_X_LPARAM(lParam),
+								  GET_Y_LPARAM(lParam) };
+			OnLButtonDown(UINT(wParam), point);
+		}
+		break;
+		case WM_LBUTTONUP:
+		{
+			const POINT point = { GET_X_LPARAM(lParam),
+								  GET_Y_LPARAM(lParam) };
+			OnLButtonUp(UINT(wParam), point);
+		}
+		break;
+		case WM_MOUSEMOVE:
+		{
+			const POINT point = { GET_X_LPARAM(lParam),
+								  GET_Y_LPARAM(lParam) };
+			OnMouseMove(UINT(wParam), point);
+            TrackMouseEvent();
+		}
+		break;
+        case WM_MOUSELEAVE:
+            OnMouseLeave();
+            break;
+
+        case WM_MOUSEWHEEL:
+        {
+            const auto  keys  = UINT(LOWORD(wParam));
+            const auto  delta = short(HIWORD(wParam)) / (double)WHEEL_DELTA;
+            const POINT point = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+            OnMouseWheel(keys, delta, point);
+        }
+        break;
+        case WM_HSCROLL :
+        {
+            UINT  code     = LOWORD(wParam);
+            UINT  position = HIWORD(wParam);
+            static CWnd temporaryScrollBar;
+            CWnd* scrollBar = HWND(lParam) == nullptr ? nullptr : &temporaryScrollBar.Attach(HWND(lParam));
+            OnHScroll(code, position, scrollBar);
+        }
+        break;
+        case WM_VSCROLL:
+        {
+            UINT  code     = LOWORD(wParam);
+            UINT  position = HIWORD(wParam);
+            static CWnd temporaryScrollBar;
+            CWnd* scrollBar = HWND(lParam) == nullptr ? nullptr : &temporaryScrollBar.Attach(HWND(lParam));
+            OnVScroll(code, position, scrollBar);
+        }
+        break;
+        case WM_TIMER:
+            OnTimer(UINT_PTR(wParam));
+            break;
+        case WM_DESTROY:
+			OnDestroy();
+			break;
+		default:
+			return ::DefWindowProc(hWnd, message, wParam, lParam);
+		}
+		return 0;
+	}
+
+    void TrackMouseEvent()
+    {
+        TRACKMOUSEEVENT tme;
+        tme.cbSize    = sizeof(tme);
+        tme.dwFlags   = TME_LEAVE;
+        tme.hwndTrack = GetSafeHwnd();
+        ::TrackMouseEvent(&tme);
+    }
+
+	static LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+	{
+        switch (message)
+        {
+        case WM_CREATE:
+        {
+            auto createStruct = reinterpret_cast<CREATESTRUCT*>(lParam);
+            auto self         = static_cast<CWnd*>(createStruct->lpCreateParams);
+            ::SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(self));
+            self->hWnd = hWnd;
+            self->OnCreate();
+            return 0;
+        }
+        break;
+        default:
+        {
+            auto self = reinterpret_cast<CWnd*>(::GetWindowLongPtr(hWnd, GWLP_USERDATA));
+            return self == nullptr ? ::DefWindowProc(hWnd, message, wParam, lParam)
+                                   : self->WindowProcedure(hWnd, message, wParam, lParam);
+        }
+        break;
+        }
+	}
+};
+
+const _TCHAR CWnd::windowClassName[] = _T("FCWindowClass");
+
+// CPaintDC
+
+inline CPaintDC::CPaintDC(CWnd& window) : window(window)
+{
+	hdc = ::BeginPaint(window.GetSafeHwnd(), &ps);
+}
+
+inline CPaintDC::~CPaintDC()
+{
+	::EndPaint(window.GetSafeHwnd(), &ps);
+}
+
+// CClientDC
+
+inline CClientDC::CClientDC(CWnd& window) : window(window)
+{
+	hdc = ::GetDC(window.GetSafeHwnd());
+}
+
+inline CClientDC::~CClientDC()
+{
+	::ReleaseDC(window.GetSafeHwnd(), hdc);
+}
+
+class CEdit : public CWnd
+{
+public:
+    CEdit(HINSTANCE hInstance = nullptr) : CWnd(hInstance)
+    {}
+
+    bool Create(CWnd* parent, tstring text, UINT style, const RECT& area, UINT id = 0)
+    {
+        hWnd = ::CreateWindow(_T("EDIT"), text.c_str(), style,
+                              area.left, area.top, area.right - area.left, area.bottom - area.top,
+                              parent->GetSafeHwnd(), HMENU(UINT_PTR(id)), hInstance, nullptr);
+        return hWnd != nullptr;
+    }
+};
+
+class CClipboard : public Clipboard
+{
+    CWnd&      owner;
+    const UINT format;
+
+public:
+    CClipboard(CWnd& owner, tstring formatName)
+        : owner(owner), format(::RegisterClipboardFormat(formatName.c_str()))
+    {}
+
+    virtual bool SetData(const vector<uint8_t>& data)
+    {
+        if (!::OpenClipboard(owner.GetSafeHwnd()))
+            return false;
+
+        auto result = false;
+        ::EmptyClipboard();
+        auto hData = ::GlobalAlloc(GMEM_MOVEABLE, data.size());
+        if (hData != nullptr) {
+            auto bytes = ::GlobalLock(hData);
+            if (bytes != nullptr) {
+                ::memcpy(bytes, data.data(), data.size());
+                ::GlobalUnlock(hData);
+                result = ::SetClipboardData(format, hData) != nullptr;
+            }
+            if (!result)
+                ::GlobalFree(hData);
+        }
+        ::CloseClipboard();
+        return result;
+    }
+
+    virtual bool GetData(vector<uint8_t>& data)
+    {
+        if (!::IsClipboardFormatAvailable(format) || !::OpenClipboard(owner.GetSafeHwnd()))
+            return false;
+
+        auto result = false;
+        auto hData  = ::GetClipboardData(format);
+        if (hData != nullptr) {
+            auto bytes = static_cast<const uint8_t*>(::GlobalLock(hData));
+            if (bytes != nullptr) {
+                data.assign(bytes, bytes + ::GlobalSize(hData));
+                ::GlobalUnlock(hData);
+                result = true;
+            }
+        }
+        ::CloseClipboard();
+        return result;
+    }
+};
+
+} // namespace Windows
+
+namespace CadCore {
+using namespace Windows;
+
+const long modelSize = 1000000;
+
+// Sizes in device pixels below which figures are drawn with less detail.
+struct LevelOfDetail
+{
+    static const long simplifiedSize = 4; // figures this small are drawn as boxes
+    static const long greekingHeight = 6; // text this low is drawn as a bar
+};
+
+// A bounded pool of worker threads that share fine-grained tasks by work stealing. Each worker pushes and pops its newest
+// tasks at the back of its own deque, where their data is still in cache; an idle worker steals the oldest task from the front
+// of another's, which in divided work is the largest piece left. Threads outside the pool queue into a shared deque and run
+// tasks like a worker while they wait for a group, so a scheduler without workers runs everything on its callers.
+class TaskScheduler : public Uncopyable
+{
+public:
+    static const size_t maximumWorkerCount = 64;
+    static const size_t anyWorker          = SIZE_MAX;
+
+    // Tasks waited for together. A task may run more tasks in its own group; the first exception a task throws is rethrown by Wait.
+    class TaskGroup : public Uncopyable
+    {
+        friend class TaskScheduler;
+
+        TaskScheduler& scheduler;
+        atomic<size_t> pendingCount;
+        mutex          errorMutex;
+        exception_ptr  error;
+
+    public:
+        TaskGroup(TaskScheduler& scheduler = TaskScheduler::Get()) : scheduler(scheduler), pendingCount(0)
+        {}
+
+        virtual ~TaskGroup()
+        {
+            scheduler.RunUntil([this] { return pendingCount.load() == 0; });
+        }
+
+        // continuation is queued as a task of the group, once task has run, in the deque of the worker that ran it. affinity is
+        // a hint of the worker whose deque task is queued in; by default it is the calling worker's own.
+        void Run(function<void()> task, function<void()> continuation = nullptr, size_t affinity = anyWorker)
+        {
+            pendingCount++;
+            scheduler.Push(Task(this, move(task), move(continuation)), affinity);
+        }
+
+        void Wait()
+        {
+            scheduler.RunUntil([this] { return pendingCount.load() == 0; });
+            lock_guard<mutex> lock(errorMutex);
+            if (error) {
+                const auto thrownError = error;
+                error = nullptr;
+                rethrow_exception(thrownError);
+            }
+        }
+    };
+
+private:
+    struct Task
+    {
+        TaskGroup*       group;
+        function<void()> body;
+        function<void()> continuation;
+
+        Task(TaskGroup* group, function<void()> body, function<void()> continuation)
+            : group(group), body(move(body)), continuation(move(continuation))
+        {}
+    };
+
+    struct Queue
+    {
+        mutex       guard;
+        deque<Task> tasks;
+    };
+
+    static thread_local const TaskScheduler* currentScheduler;
+    static thread_local size_t               currentQueue;
+
+    vector<unique_ptr<Queue>> queues;       // the shared queue of outside threads, then one per worker
+    vector<thread>            workers;
+    atomic<size_t>            queuedCount;
+    atomic<size_t>            sleeperCount;
+    atomic<bool>              isClosing;
+    mutex                     sleepMutex;
+    condition_variable        wakeUp;
+
+public:
+    // The pool shared by the core: one worker fewer than the processors, as the waiting caller runs tasks too.
+    static TaskScheduler& Get()
+    {
+        static TaskScheduler scheduler(Math::Max(thread::hardware_concurrency(), 1U) - 1);
+        return scheduler;
+    }
+
+    TaskScheduler(size_t workerCount) : queuedCount(0), sleeperCount(0), isClosing(false)
+    {
+        workerCount = Math::Min(workerCount, maximumWorkerCount);
+        for (size_t queue = 0; queue <= workerCount; queue++)
+            queues.push_back(unique_ptr<Queue>(new Queue));
+        for (size_t worker = 0; worker < workerCount; worker++)
+            workers.push_back(thread([this, worker] { WorkLoop(worker + 1); }));
+    }
+
+    virtual ~TaskScheduler()
+    {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            isClosing = true;
+        }
+        wakeUp.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // The threads that run tasks while a caller waits: the workers and the caller.
+    size_t GetConcurrency() const
+    {
+        return workers.size() + 1;
+    }
+
+    // The worker running the calling thread's task, or anyWorker outside the pool.
+    size_t GetCurrentWorker() const
+    {
+        return currentScheduler == this && currentQueue > 0 ? currentQueue - 1 : anyWorker;
+    }
+
+    // Calls body(begin, end) over [begin, end) in ranges of at most grainSize, halving the range into tasks so that
+    // the pieces stolen first are the largest and each worker's ranges stay contiguous.
+    template <class TBody>
+    void ParallelFor(size_t begin, size_t end, size_t grainSize, const TBody& body)
+    {
+        TaskGroup group(*this);
+        Divide(group, begin, end, Math::Max(grainSize, size_t(1)), body);
+        group.Wait();
+    }
+
+    // Combines map(begin, end) over the ranges [begin, end) of grainSize in range order, so the result is the same
+    // whichever worker maps which range.
+    template <class T, class TMap, class TCombine>
+    T ParallelReduce(size_t begin, size_t end, size_t grainSize, const T& identity, const TMap& map, const TCombine& combine)
+    {
+        if (begin >= end)
+            return identity;
+        grainSize = Math::Max(grainSize, size_t(1));
+        vector<T> results((end - begin + grainSize - 1) / grainSize, identity);
+        ParallelFor(0, results.size(), 1, [&](size_t first, size_t last) {
+            for (auto range = first; range < last; range++)
+                results[range] = map(begin + range * grainSize, Math::Min(begin + (range + 1) * grainSize, end));
+        });
+        auto result = identity;
+        for (const auto& rangeResult : results)
+            result = combine(result, rangeResult);
+        return result;
+    }
+
+private:
+    template <class TBody>
+    void Divide(TaskGroup& group, size_t begin, size_t end, size_t grainSize, const TBody& body)
+    {
+        while (end - begin > grainSize) {
+            const auto middle = begin + (end - begin) / 2;
+            group.Run([this, &group, middle, end, grainSize, &body] { Divide(group, middle, end, grainSize, body); });
+            end = middle;
+        }
+        if (begin < end)
+            body(begin, end);
+    }
+
+    size_t GetOwnQueue() const
+    {
+        return currentScheduler == this ? currentQueue : 0;
+    }
+
+    void Push(Task task, size_t affinity)
+    {
+        auto& queue = *queues[affinity == anyWorker || workers.empty() ? GetOwnQueue() : affinity % workers.size() + 1];
+        {
+            lock_guard<mutex> lock(queue.guard);
+            queue.tasks.push_back(move(task));
+        }
+        queuedCount++;
+        if (sleeperCount.load() > 0) {
+            lock_guard<mutex> lock(sleepMutex);
+            wakeUp.notify_one();
+        }
+    }
+
+    // Pops the newest task of the own queue, or steals the oldest of the next queue that has one.
+    bool Pop(Task& task)
+    {
+        if (queuedCount.load() == 0)
+            return false;
+        const auto ownQueue = GetOwnQueue();
+        for (size_t offset = 0; offset < queues.size(); offset++) {
+            auto& queue = *queues[(ownQueue + offset) % queues.size()];
+            lock_guard<mutex> lock(queue.guard);
+            if (queue.tasks.empty())
+                continue;
+            if (offset == 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queuedCount--;
+            return true;
+        }
+        return false;
+    }
+
+    void Execute(Task& task)
+    {
+        try {
+            task.body();
+        } catch (...) {
+            lock_guard<mutex> lock(task.group->errorMutex);
+            if (!task.group->error)
+                task.group->error = current_exception();
+        }
+        if (task.continuation)
+            task.group->Run(move(task.continuation), nullptr, GetCurrentWorker());
+        if (--task.group->pendingCount == 0 && sleeperCount.load() > 0) {
+            lock_guard<mutex> lock(sleepMutex);
+            wakeUp.notify_all();
+        }
+    }
+
+    // Runs tasks until isDone(), sleeping while there are none. Wakers change the state before they take sleepMutex to notify,
+    // and sleepers count themselves before they check it, so one of the two always sees the other.
+    template <class TIsDone>
+    void RunUntil(const TIsDone& isDone)
+    {
+        Task task(nullptr, nullptr, nullptr);
+        while (!isDone()) {
+            if (Pop(task)) {
+                Execute(task);
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            sleeperCount++;
+            wakeUp.wait(lock, [&] { return queuedCount.load() > 0 || isClosing.load() || isDone(); });
+            sleeperCount--;
+        }
+    }
+
+    void WorkLoop(size_t queue)
+    {
+        currentScheduler = this;
+        currentQueue     = queue;
+        RunUntil([this] { return isClosing.load(); });
+    }
+};
+
+thread_local const TaskScheduler* TaskScheduler::currentScheduler = nullptr;
+thread_local size_t               TaskScheduler::currentQueue     = 0;
+
+// Thrown where a cancelled long operation would pause, so that it unwinds to where it can take its changes back.
+class OperationCancelled : public exception
+{};
+
+// How far a long operation has got, reported where it may pause: done of total steps.
+struct Progress
+{
+    size_t done;
+    size_t total;
+
+    Progress(size_t done, size_t total) : done(done), total(total)
+    {}
+};
+
+// A long operation written as a coroutine that runs in time slices. `co_await Progress(done, total)` marks a point where
+// it may pause: it hands back to the caller of Resume once the slice is used up, and throws OperationCancelled once the
+// operation has been cancelled. An operation does nothing until it is first resumed.
+class LongOperation : public Uncopyable
+{
+    typedef chrono::steady_clock Clock;
+
+public:
+    class Pause;
+
+    struct promise_type
+    {
+        Clock::time_point sliceEnd;
+        Progress          progress;
+        bool              isCancelled;
+        exception_ptr     error;
+
+        promise_type() : progress(0, 1), isCancelled(false)
+        {}
+
+        LongOperation get_return_object()
+        {
+            return LongOperation(coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        suspend_always initial_suspend() noexcept
+        {
+            return suspend_always();
+        }
+
+        suspend_always final_suspend() noexcept
+        {
+            return suspend_always();
+        }
+
+        void return_void()
+        {}
+
+        void unhandled_exception()
+        {
+            error = current_exception();
+        }
+
+        Pause await_transform(const Progress& progress)
+        {
+            return Pause(*this, progress);
+        }
+    };
+
+    class Pause
+    {
+        promise_type& promise;
+
+    public:
+        Pause(promise_type& promise, const Progress& progress) : promise(promise)
+        {
+            promise.progress = progress;
+        }
+
+        bool await_ready() const
+        {
+            return promise.isCancelled || Clock::now() < promise.sliceEnd;
+        }
+
+        void await_suspend(coroutine_handle<promise_type>) const
+        {}
+
+        void await_resume() const
+        {
+            if (promise.isCancelled)
+                throw OperationCancelled();
+        }
+    };
+
+private:
+    coroutine_handle<promise_type> handle;
+
+    LongOperation(coroutine_handle<promise_type> handle) : handle(handle)
+    {}
+
+public:
+    LongOperation(LongOperation&& operation) : handle(operation.handle)
+    {
+        operation.handle = nullptr;
+    }
+
+    virtual ~LongOperation()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool IsDone() const
+    {
+        return handle.done();
+    }
+
+    bool IsCancelled() const
+    {
+        return handle.promise().isCancelled;
+    }
+
+    // 0 to 100.
+    unsigned GetPercentage() const
+    {
+        const auto& progress = handle.promise().progress;
+        return IsDone() ? 100U : unsigned(progress.total == 0 ? 0 : Math::Min(progress.done, progress.total) * 100 / progress.total);
+    }
+
+    // Cancelling takes effect at the next pause.
+    void Cancel()
+    {
+        handle.promise().isCancelled = true;
+    }
+
+    // Runs the operation to its first pause after sliceTime and returns whether it has more to do. An exception
+    // the operation ends with is rethrown here, unless it is the OperationCancelled of its own cancellation.
+    bool Resume(Clock::duration sliceTime)
+    {
+        Debug::Assert(!IsDone());
+        handle.promise().sliceEnd = Clock::now() + sliceTime;
+        handle.resume();
+        if (!IsDone())
+            return true;
+
+        const auto error = handle.promise().error;
+        if (error) {
+            try {
+                rethrow_exception(error);
+            } catch (const OperationCancelled&) {
+            }
+        }
+        return false;
+    }
+};
+
+// Runs long operations one at a time, a slice per call, for a message loop to call while it has no messages waiting.
+// Observers are updated after each slice, and once more when the operation has ended.
+class LongOperationRunner : public Observable, public Uncopyable
+{
+public:
+    static const long defaultSliceTime = 16; // milliseconds: about a frame, so that input is handled without a noticeable delay
+
+private:
+    unique_ptr<LongOperation> operation;
+
+public:
+    bool IsRunning() const
+    {
+        return operation != nullptr;
+    }
+
+    unsigned GetPercentage() const
+    {
+        return IsRunning() ? operation->GetPercentage() : 100U;
+    }
+
+    void Start(LongOperation operation)
+    {
+        Debug::Assert(!IsRunning());
+        this->operation.reset(new LongOperation(move(operation)));
+        Update(nullptr);
+    }
+
+    void Cancel()
+    {
+        if (IsRunning())
+            operation->Cancel();
+    }
+
+    // Returns whether the operation is still running.
+    bool RunSlice(long sliceTime = defaultSliceTime)
+    {
+        if (!IsRunning())
+            return false;
+        try {
+            if (operation->Resume(chrono::milliseconds(sliceTime))) {
+                Update(nullptr);
+                return true;
+            }
+        } catch (...) {
+            operation.reset();
+            Update(nullptr);
+            throw;
+        }
+        operation.reset();
+        Update(nullptr);
+        return false;
+    }
+
+    // Runs the operation to its end without handing back.
+    void Finish()
+    {
+        while (RunSlice())
+            ;
+    }
+};
+
+class Figure;
+
+// Figures compiled to flat arrays of primitives grouped by colour, so that a target draws each colour with one pen,
+// lines as PolyPolyline batches and text after the shapes under one font. Primitives are added and removed per owning figure.
+// The arrays are split into chunks by the square of the model their primitives start in, and each chunk keeps the bounds of
+// what it holds, so drawing a small area visits only the chunks near it.
+class DisplayList : public Uncopyable
+{
+    enum Kind {
+        Lines,
+        Rectangles,
+        Ellipses,
+        Texts,
+        KindCount
+    };
+
+    // Lines keep their start in (left, top) and end in (right, bottom).
+    struct Primitive
+    {
+        const Figure*  owner;
+        RECT           area;
+        tstring        text;
+        const LOGFONT* logFont;
+    };
+
+    struct Batch
+    {
+        vector<Primitive> primitives[KindCount];
+    };
+
+    typedef pair<long, long> ChunkKey; // the square of the model, in chunkSize units
+
+    // The bounds only grow: a removed primitive leaves them as they were.
+    struct Chunk
+    {
+        CRect                shapeBounds;
+        CRect                textBounds;
+        map<COLORREF, Batch> batches;
+
+        Chunk() : shapeBounds(CRect::GetNone()), textBounds(CRect::GetNone())
+        {}
+    };
+
+    struct Slot
+    {
+        ChunkKey chunk;
+        COLORREF color;
+        Kind     kind;
+        size_t   index;
+    };
+
+    static const long chunkSize     = modelSize / 32;
+    static const long cullingMargin = 2; // device pixels, for the rounding of the area to draw
+    static const long textMargin    = 4; // device pixels, for glyphs that overhang their measured extent
+
+    map<ChunkKey, Chunk>                       chunks;
+    unordered_map<const Figure*, vector<Slot>> slots;
+
+public:
+    void AddLine(const Figure* owner, COLORREF color, POINT start, POINT end)
+    {
+        const RECT area = { start.x, start.y, end.x, end.y };
+        Add(owner, color, Lines, area);
+    }
+
+    void AddRectangle(const Figure* owner, COLORREF color, const RECT& area)
+    {
+        Add(owner, color, Rectangles, area);
+    }
+
+    void AddEllipse(const Figure* owner, COLORREF color, const RECT& area)
+    {
+        Add(owner, color, Ellipses, area);
+    }
+
+    void AddText(const Figure* owner, COLORREF color, const RECT& area, tstring text, const LOGFONT& logFont)
+    {
+        Add(owner, color, Texts, area, text, &logFont);
+    }
+
+    // Removes the primitives of owner, moving the last primitive of each array into the gap.
+    void Remove(const Figure* owner)
+    {
+        const auto ownerSlots = slots.find(owner);
+        if (ownerSlots == slots.end())
+            return;
+
+        auto removedSlots = ownerSlots->second;
+        slots.erase(ownerSlots);
+        sort(removedSlots.begin(), removedSlots.end(), [](const Slot& slot1, const Slot& slot2) { return slot1.index > slot2.index; });
+        for (const auto& slot : removedSlots) {
+            auto& primitives = chunks[slot.chunk].batches[slot.color].primitives[slot.kind];
+            if (slot.index + 1 < primitives.size()) {
+                primitives[slot.index] = move(primitives.back());
+                for (auto& movedSlot : slots[primitives[slot.index].owner]) {
+                    if (movedSlot.chunk == slot.chunk && movedSlot.color == slot.color && movedSlot.kind == slot.kind && movedSlot.index == primitives.size() - 1)
+                        movedSlot.index = slot.index;
+                }
+            }
+            primitives.pop_back();
+        }
+    }
+
+    // Removes the primitives of each owner with a primitive that reaches area, and returns those owners.
+    unordered_set<const Figure*> RemoveIn(const RECT& area)
+    {
+        unordered_set<const Figure*> owners;
+        for (const auto& chunk : chunks) {
+            if (!Reaches(chunk.second.shapeBounds, area) && !Reaches(chunk.second.textBounds, area))
+                continue;
+            for (const auto& batch : chunk.second.batches) {
+                for (const auto& primitives : batch.second.primitives) {
+                    for (const auto& primitive : primitives) {
+                        if (Intersects(primitive.area, area))
+                            owners.insert(primitive.owner);
+                    }
+                }
+            }
+        }
+        for (auto owner : owners)
+            Remove(owner);
+        return owners;
+    }
+
+    void Clear()
+    {
+        chunks.clear();
+        slots .clear();
+    }
+
+    // Draws the primitives that reach logicalArea: shapes chunk by chunk and colour by colour, then text.
+    // Primitives that project to a few pixels go into coverage.
+    void Draw(CDC& dc, PixelCoverage& coverage, const RECT& logicalArea) const
+    {
+        auto margin = cullingMargin, extraTextMargin = textMargin;
+        dc.DPtoLP(margin         );
+        dc.DPtoLP(extraTextMargin);
+        const auto area     = CRect(CPoint(logicalArea.left, logicalArea.top), CPoint(logicalArea.right, logicalArea.bottom)).GetInflateRect(margin, margin);
+        const auto textArea = area.GetInflateRect(extraTextMargin, extraTextMargin);
+
+        ViewportClipper clipper(dc);
+        for (const auto& chunk : chunks) {
+            if (!Reaches(chunk.second.shapeBounds, area))
+                continue;
+            for (const auto& batch : chunk.second.batches)
+                DrawShapes(dc, coverage, clipper, area, batch.first, batch.second);
+        }
+
+        const LOGFONT* currentLogFont = nullptr;
+        unique_ptr<FontSelector> fontSelector;
+        dc.SetBkMode(TRANSPARENT);
+        for (const auto& chunk : chunks) {
+            if (!Reaches(chunk.second.textBounds, textArea))
+                continue;
+            for (const auto& batch : chunk.second.batches) {
+                if (batch.second.primitives[Texts].size() > 0)
+                    DrawTexts(dc, coverage, area, batch.first, batch.second, currentLogFont, fontSelector);
+            }
+        }
+        fontSelector.reset();
+    }
+
+    // Edges count: a line along an axis has bounds of no width or height.
+    static bool Intersects(const RECT& area1, const RECT& area2)
+    {
+        const CRect bounds1(CPoint(area1.left, area1.top), CPoint(area1.right, area1.bottom));
+        const CRect bounds2(CPoint(area2.left, area2.top), CPoint(area2.right, area2.bottom));
+        return bounds1.left <= bounds2.right && bounds2.left <= bounds1.right && bounds1.top <= bounds2.bottom && bounds2.top <= bounds1.bottom;
+    }
+
+private:
+    void Add(const Figure* owner, COLORREF color, Kind kind, const RECT& area, tstring text = tstring(), const LOGFONT* logFont = nullptr)
+    {
+        const CRect     bounds(CPoint(area.left, area.top), CPoint(area.right, area.bottom));
+        const ChunkKey  key(GetChunkIndex(bounds.left), GetChunkIndex(bounds.top));
+        auto&           chunk      = chunks[key];
+        auto&           primitives = chunk.batches[color].primitives[kind];
+        const Primitive primitive  = { owner, area, text, logFont };
+        const Slot      slot       = { key, color, kind, primitives.size() };
+        primitives.push_back(primitive);
+        slots[owner].push_back(slot);
+
+        // Text is measured on the device and may reach past its stored area at other zooms, so its chunk allows for twice its size.
+        if (kind == Texts)
+            chunk.textBounds  = chunk.textBounds.Union(CRect(bounds.GetTopLeft(), CSize(bounds.GetSize().cx * 2, bounds.GetSize().cy * 2)));
+        else
+            chunk.shapeBounds = chunk.shapeBounds.Union(bounds);
+    }
+
+    static long GetChunkIndex(long coordinate)
+    {
+        return coordinate >= 0 ? coordinate / chunkSize : -((chunkSize - 1 - coordinate) / chunkSize);
+    }
+
+    static bool Reaches(const CRect& chunkBounds, const CRect& area)
+    {
+        return !chunkBounds.IsNone() && Intersects(chunkBounds, area);
+    }
+
+    // Text is drawn under the font the last text was drawn under until another one is needed.
+    static void DrawTexts(CDC& dc, PixelCoverage& coverage, const CRect& area, COLORREF color, const Batch& batch,
+                          const LOGFONT*& currentLogFont, unique_ptr<FontSelector>& fontSelector)
+    {
+        dc.SetTextColor(color);
+        for (const auto& text : batch.primitives[Texts]) {
+            if (!Intersects(GetTextArea(dc, text), area))
+                continue;
+            CRect deviceArea = text.area;
+            dc.LPtoDP(deviceArea);
+            if (deviceArea.GetSize().cy <= LevelOfDetail::greekingHeight) {
+                const auto top = deviceArea.top + deviceArea.GetSize().cy / 3;
+                coverage.Fill(CRect(CPoint(deviceArea.left, top), CPoint(deviceArea.right + 1, top + Math::Max(deviceArea.GetSize().cy / 3, 1L))), color);
+                continue;
+            }
+            if (text.logFont != currentLogFont) {
+                fontSelector.reset();
+                fontSelector.reset(new FontSelector(dc, FontCache::Get(*text.logFont)));
+                currentLogFont = text.logFont;
+            }
+            auto textArea = text.area;
+            dc.DrawText(text.text, textArea, DT_LEFT | DT_TOP | DT_NOCLIP);
+        }
+    }
+
+    // Drawn text may run past its position, so it is culled by its measured extent.
+    static CRect GetTextArea(CDC& dc, const Primitive& text)
+    {
+        const CPoint topLeft(text.area.left, text.area.top);
+        CPoint deviceTopLeft = topLeft;
+        dc.LPtoDP(deviceTopLeft);
+        CPoint first = deviceTopLeft - CSize(textMargin, textMargin), last = deviceTopLeft + FontCache::GetTextSize(dc, text.text, *text.logFont, topLeft) + CSize(textMargin, textMargin);
+        dc.DPtoLP(first);
+        dc.DPtoLP(last );
+        const CRect extent(first, last);
+        CRect area;
+        ::UnionRect(&area, &extent, &text.area);
+        return area;
+    }
+
+    // Shapes that reach past the viewport are drawn clipped by clipper.
+    static void DrawShapes(CDC& dc, PixelCoverage& coverage, ViewportClipper& clipper, const CRect& area, COLORREF color, const Batch& batch)
+    {
+        const auto& primitives = batch.primitives;
+        unique_ptr<PenSelector> penSelector;
+        const auto selectPen = [&] {
+            if (penSelector == nullptr)
+                penSelector.reset(new PenSelector(dc, PS_SOLID, 0, color));
+        };
+
+        vector<POINT> points;
+        for (const auto& line : primitives[Lines]) {
+            if (!Intersects(line.area, area))
+                continue;
+            CPoint     start(line.area.left, line.area.top), end(line.area.right, line.area.bottom);
+            const auto deviceArea = clipper.ToDevice(line.area);
+            if (IsSmall(deviceArea.GetSize())) {
+                dc.LPtoDP(start);
+                dc.LPtoDP(end  );
+                coverage.DrawLine(start, end, color);
+            } else if (clipper.Contains(deviceArea)) {
+                points.push_back(start);
+                points.push_back(end  );
+            } else {
+                clipper.AddLine(start, end);
+            }
+        }
+        if (points.size() > 0) {
+            selectPen();
+            const vector<DWORD> counts(points.size() / 2, 2);
+            dc.PolyPolyline(points.data(), counts.data(), DWORD(counts.size()));
+        }
+
+        for (auto kind : { Rectangles, Ellipses }) {
+            for (const auto& shape : primitives[kind]) {
+                if (!Intersects(shape.area, area))
+                    continue;
+                const auto deviceArea = clipper.ToDevice(shape.area);
+                if (IsSmall(deviceArea.GetSize())) {
+                    coverage.Fill(CRect(deviceArea.GetTopLeft(), deviceArea.GetBottomRight() + CSize(1, 1)), color);
+                    continue;
+                }
+                if (!clipper.Contains(deviceArea)) {
+                    if (kind == Rectangles)
+                        clipper.AddRectangle(shape.area);
+                    else
+                        clipper.AddEllipse(shape.area);
+                    continue;
+                }
+                selectPen();
+                if (kind == Rectangles)
+                    dc.Rectangle(shape.area);
+                else
+                    dc.Ellipse(shape.area);
+            }
+        }
+
+        if (!clipper.IsEmpty()) {
+            selectPen();
+            clipper.Flush(dc);
+        }
+    }
+
+    static bool IsSmall(SIZE deviceSize)
+    {
+        return deviceSize.cx <= LevelOfDetail::simplifiedSize && deviceSize.cy <= LevelOfDetail::simplifiedSize;
+    }
+
+};
+
+// Column-oriented form of a sequence of figures; the unit of compression for files and cold undo history.
+class FigureColumns
+{
+public:
+    enum Flag {
+        SelectedFlag = 1
+    };
+
+    vector<uint32_t> kinds;
+    vector<uint32_t> colors;
+    vector<uint32_t> flags;
+    vector<long>     xs;
+    vector<long>     ys;
+    vector<tstring>  texts;
+
+    size_t size() const
+    {
+        return kinds.size();
+    }
+
+    void Clear()
+    {
+        kinds .clear();
+        colors.clear();
+        flags .clear();
+        xs    .clear();
+        ys    .clear();
+        texts .clear();
+    }
+
+    void WritePoint(POINT point)
+    {
+        xs.push_back(point.x);
+        ys.push_back(point.y);
+    }
+
+    void WriteText(const tstring& text)
+    {
+        texts.push_back(text);
+    }
+
+    void Encode(ByteWriter& writer) const
+    {
+        BlockCodec::EncodeRuns  (kinds , writer);
+        BlockCodec::EncodeRuns  (colors, writer);
+        BlockCodec::EncodeRuns  (flags , writer);
+        BlockCodec::EncodeDeltas(xs    , writer);
+        BlockCodec::EncodeDeltas(ys    , writer);
+        writer.WriteVarUInt(texts.size());
+        for (const auto& text : texts)
+            EncodeText(text, writer);
+    }
+
+    void Decode(ByteReader& reader)
+    {
+        BlockCodec::DecodeRuns  (reader, kinds );
+        BlockCodec::DecodeRuns  (reader, colors);
+        BlockCodec::DecodeRuns  (reader, flags );
+        BlockCodec::DecodeDeltas(reader, xs    );
+        BlockCodec::DecodeDeltas(reader, ys    );
+        if (colors.size() != kinds.size() || flags.size() != kinds.size() || xs.size() != ys.size())
+            throw exception();
+        texts.resize(size_t(reader.ReadVarUInt()));
+        for (auto& text : texts)
+            DecodeText(reader, text);
+    }
+
+    static void EncodeText(const tstring& text, ByteWriter& writer)
+    {
+        writer.WriteVarUInt(text.size());
+        for (auto character : text)
+            writer.WriteVarUInt(uint64_t(character));
+    }
+
+    static void DecodeText(ByteReader& reader, tstring& text)
+    {
+        text.resize(size_t(reader.ReadVarUInt()));
+        for (auto& character : text)
+            character = _TCHAR(reader.ReadVarUInt());
+    }
+};
+
+class FigureColumnReader
+{
+    const FigureColumns& columns;
+    size_t               figureIndex;
+    size_t               pointIndex;
+    size_t               textIndex;
+
+public:
+    FigureColumnReader(const FigureColumns& columns)
+        : columns(columns), figureIndex(0), pointIndex(0), textIndex(0)
+    {}
+
+    bool IsEnd() const
+    {
+        return figureIndex >= columns.size();
+    }
+
+    void ReadHeader(uint32_t& kind, uint32_t& color, uint32_t& flags)
+    {
+        if (IsEnd())
+            throw exception();
+        kind  = columns.kinds [figureIndex];
+        color = columns.colors[figureIndex];
+        flags = columns.flags [figureIndex];
+        figureIndex++;
+    }
+
+    CPoint ReadPoint()
+    {
+        if (pointIndex >= columns.xs.size())
+            throw exception();
+        CPoint point(columns.xs[pointIndex], columns.ys[pointIndex]);
+        pointIndex++;
+        return point;
+    }
+
+    tstring ReadText()
+    {
+        if (textIndex >= columns.texts.size())
+            throw exception();
+        return columns.texts[textIndex++];
+    }
+};
+
+class Figure
+{
+    static const long defaultSelectorWidth = 10;
+    const COLORREF    selectorColor        = RGB(0x80, 0x80, 0x80);
+
+    bool     isSelected;
+	COLORREF color;
+
+public:
+    virtual ~Figure()
+    {}
+
+    virtual unique_ptr<Figure> Clone() const = 0;
+    virtual uint32_t GetKind() const = 0;
+    virtual size_t GetMemorySize() const = 0;
+    virtual void Offset(const SIZE& offset) = 0;
+    virtual void Transform(const AxisTransform& transform) = 0;
+
+    // The two points that place the figure: the ends of a line, the corners of a box.
+    virtual CLine GetPlacement() const = 0;
+    virtual void SetPlacement(const CLine& placement) = 0;
+
+    virtual tstring GetText() const
+    {
+        return tstring();
+    }
+
+    // Replaces count characters from first; figures without text ignore it.
+    virtual void ReplaceText(size_t first, size_t count, const tstring& text)
+    {}
+
+    bool IsSelected() const
+    {
+        return isSelected;
+    }
+
+    void Select(bool isSelected = true)
+    {
+        this->isSelected = isSelected;
+    }
+
+    void ToggleSelect()
+    {
+        Select(!IsSelected());
+    }
+
+	COLORREF GetColor() const
+	{
+		return color;
+	}
+
+	void SetColor(COLORREF color)
+	{
+		this->color = color;
+	}
+
+    virtual long GetDistance(CPoint point)
+    {
+        return LONG_MAX;
+    }   
+
+    CRect GetDrawingBoundRect(CDC& dc)
+    {
+        return GetDrawingBoundRect(dc, GetShapeBoundRect(dc));
+    }
+
+    // The area figures within bounds may draw on, their selection handles included.
+    static CRect GetDrawingBoundRect(CDC& dc, const CRect& bounds)
+    {
+        auto selectorWidth = defaultSelectorWidth;
+        dc.DPtoLP(selectorWidth);
+        const auto d = selectorWidth / 2 + 1;
+        return bounds.GetInflateRect(d, d);
+    }
+
+    virtual CRect GetBoundRect()
+    {
+        CPoint minimum(LONG_MAX, LONG_MAX);
+        CPoint maximum(LONG_MIN, LONG_MIN);
+        for (auto point : GetPoints()) {
+            minimum.x = Math::Min(minimum.x, point.x);
+            minimum.y = Math::Min(minimum.y, point.y);
+            maximum.x = Math::Max(maximum.x, point.x);
+            maximum.y = Math::Max(maximum.y, point.y);
+        }
+        return CRect(minimum, maximum);
+    }
+
+    virtual vector<CPoint> GetPoints()
+    {
+        return vector<CPoint>();
+    }
+
+	Figure() : isSelected(false), color(Color::Black)
+	{}
+
+    // Selection handles are not part of the shape; views draw them on their overlay.
+    void Draw(CDC& dc)
+    {
+        PenSelector penSelector(dc, PS_SOLID, 0, GetColor());
+        DrawShape(dc);
+    }
+
+    // Level of detail: a figure that projects to only a few pixels goes into coverage,
+    // without GDI objects or layout, and is drawn when the coverage is flushed.
+    void Draw(CDC& dc, PixelCoverage& coverage)
+    {
+        const auto deviceBounds = ViewportClipper(dc).ToDevice(GetBoundRect());
+        if (IsSmall(deviceBounds.GetSize())) {
+            DrawSimplified(dc, coverage, deviceBounds);
+            return;
+        }
+        Draw(dc);
+    }
+
+    void DrawHighlight(CDC& dc, COLORREF color, int width)
+    {
+        PenSelector penSelector(dc, PS_SOLID, width, color);
+        DrawHighlightShape(dc);
+    }
+
+    void DrawSelectors(CDC& dc)
+    {
+        PenSelector penSelector(dc, PS_SOLID, 0, selectorColor);
+        for (auto point : GetPoints())
+            DrawSelector(dc, point);
+    }
+
+    void Compile(DisplayList& displayList)
+    {
+        CompileShape(displayList);
+    }
+
+    void Write(FigureColumns& columns) const
+    {
+        columns.kinds .push_back(GetKind());
+        columns.colors.push_back(GetColor());
+        columns.flags .push_back(isSelected ? FigureColumns::SelectedFlag : 0);
+        WriteShape(columns);
+    }
+
+protected:
+    virtual void DrawShape(CDC& dc)
+    {}
+
+    virtual void DrawHighlightShape(CDC& dc)
+    {
+        DrawShape(dc);
+    }
+
+    // The area the shape covers when drawn on dc.
+    virtual CRect GetShapeBoundRect(CDC& dc)
+    {
+        return GetBoundRect();
+    }
+
+    virtual bool IsSmall(SIZE deviceSize) const
+    {
+        return deviceSize.cx <= LevelOfDetail::simplifiedSize && deviceSize.cy <= LevelOfDetail::simplifiedSize;
+    }
+
+    // Draws a small figure as a box over its device bounds (right and bottom inclusive).
+    virtual void DrawSimplified(CDC& dc, PixelCoverage& coverage, const CRect& deviceBounds)
+    {
+        coverage.Fill(CRect(deviceBounds.GetTopLeft(), deviceBounds.GetBottomRight() + CSize(1, 1)), GetColor());
+    }
+
+    virtual void CompileShape(DisplayList& displayList) const = 0;
+    virtual void WriteShape(FigureColumns& columns) const = 0;
+
+private:
+    void DrawSelector(CDC& dc, CPoint point)
+    {
+        if (!IsSelected())
+            return;
+
+        auto selectorWidth = defaultSelectorWidth;
+        dc.DPtoLP(selectorWidth);
+
+        CSize selectorSize(selectorWidth, selectorWidth);
+        CRect rect(point - selectorSize / 2, selectorSize);
+       
+        dc.Rectangle(rect);
+    }
+};
+
+class FigureFactory
+{
+public:
+    typedef unique_ptr<Figure> (*Creator)(FigureColumnReader& reader);
+
+    static void Register(uint32_t kind, Creator creator)
+    {
+        GetCreators()[kind] = creator;
+    }
+
+    static unique_ptr<Figure> Create(FigureColumnReader& reader)
+    {
+        uint32_t kind, color, flags;
+        reader.ReadHeader(kind, color, flags);
+
+        const auto creator = GetCreators().find(kind);
+        if (creator == GetCreators().end())
+            throw exception();
+        auto figure = creator->second(reader);
+        figure->SetColor(color);
+        figure->Select((flags & FigureColumns::SelectedFlag) != 0);
+        return figure;
+    }
+
+    template <class TIterator>
+    static void Write(TIterator first, TIterator last, ByteWriter& writer)
+    {
+        FigureColumns columns;
+        for (auto iterator = first; iterator != last; ++iterator)
+            (*iterator)->Write(columns);
+        columns.Encode(writer);
+    }
+
+    static void Read(ByteReader& reader, vector<shared_ptr<Figure>>& figures)
+    {
+        FigureColumns columns;
+        columns.Decode(reader);
+        FigureColumnReader columnReader(columns);
+        while (!columnReader.IsEnd())
+            figures.push_back(shared_ptr<Figure>(Create(columnReader).release()));
+    }
+
+private:
+    static map<uint32_t, Creator>& GetCreators()
+    {
+        static map<uint32_t, Creator> creators;
+        return creators;
+    }
+};
+
+struct UndoData
+{
+public:
+    enum Operation {
+        None, Add, Delete, Update, Move, Recolor, EditText, Transform
+    };
+
+    // The span of text an edit replaced: the common prefix and suffix of the old and new text are left out.
+    struct TextEdit
+    {
+        size_t  position;
+        tstring oldText;
+        tstring newText;
+    };
+
+    // Where the figures of a transform were and went, in ascending order of their indices.
+    struct Placements
+    {
+        vector<size_t> indices;
+        vector<CLine>  oldPlacements;
+        vector<CLine>  newPlacements;
+    };
+
+    Operation                        operation;
+    size_t                           index;
+    size_t                           count;      // Add, Delete: the figures of the range [index, index + count); Move, Transform: the figures changed
+    size_t                           first;      // Add, Delete: where the figures of the range start in the group
+    shared_ptr<Figure>               oldFigure;
+    shared_ptr<Figure>               newFigure;
+    shared_ptr<const vector<size_t>> indices;    // Move: the figures moved, in ascending order
+    CSize                            offset;     // Move: the offset all of them moved by
+    COLORREF                         oldColor;   // Recolor
+    COLORREF                         newColor;
+    shared_ptr<const TextEdit>       textEdit;   // EditText
+    shared_ptr<const Placements>     placements; // Transform
+
+    static UndoData AddData(size_t index, shared_ptr<Figure> newFigure)
+    {
+        return UndoData(Add, index, nullptr, newFigure);
+    }
+
+    static UndoData DeleteData(size_t index, shared_ptr<Figure> oldFigure)
+    {
+        return UndoData(Delete, index, oldFigure, nullptr);
+    }
+
+    static UndoData UpdateData(size_t index, shared_ptr<Figure> oldFigure, shared_ptr<Figure> newFigure)
+    {
+        return UndoData(Update, index, oldFigure, newFigure);
+    }
+
+    // A whole move is one record, as is a transform; index is that of its first figure.
+    static UndoData MoveData(shared_ptr<const vector<size_t>> indices, const SIZE& offset)
+    {
+        Debug::Assert(indices->size() > 0);
+        UndoData undoData(Move, indices->front());
+        undoData.count   = indices->size();
+        undoData.indices = indices;
+        undoData.offset  = offset;
+        return undoData;
+    }
+
+    static UndoData RecolorData(size_t index, COLORREF oldColor, COLORREF newColor)
+    {
+        UndoData undoData(Recolor, index);
+        undoData.oldColor = oldColor;
+        undoData.newColor = newColor;
+        return undoData;
+    }
+
+    static UndoData EditTextData(size_t index, const tstring& oldText, const tstring& newText)
+    {
+        size_t prefix = 0;
+        while (prefix < oldText.size() && prefix < newText.size() && oldText[prefix] == newText[prefix])
+            prefix++;
+        size_t suffix = 0;
+        while (suffix < oldText.size() - prefix && suffix < newText.size() - prefix && oldText[oldText.size() - suffix - 1] == newText[newText.size() - suffix - 1])
+            suffix++;
+
+        const auto textEdit = new TextEdit;
+        textEdit->position  = prefix;
+        textEdit->oldText   = oldText.substr(prefix, oldText.size() - prefix - suffix);
+        textEdit->newText   = newText.substr(prefix, newText.size() - prefix - suffix);
+        UndoData undoData(EditText, index);
+        undoData.textEdit = shared_ptr<const TextEdit>(textEdit);
+        return undoData;
+    }
+
+    // A whole transform is one record; index is that of its first figure.
+    static UndoData TransformData(shared_ptr<const Placements> placements)
+    {
+        Debug::Assert(placements->indices.size() > 0);
+        UndoData undoData(Transform, placements->indices.front());
+        undoData.count      = placements->indices.size();
+        undoData.placements = placements;
+        return undoData;
+    }
+
+    UndoData(Operation operation = None, size_t index = 0, shared_ptr<Figure> oldFigure = nullptr, shared_ptr<Figure> newFigure = nullptr)
+        : operation(operation), index(index), count(0), first(0), oldFigure(oldFigure), newFigure(newFigure), oldColor(0), newColor(0)
+    {}
+
+    bool IsRange() const
+    {
+        return operation == Add || operation == Delete;
+    }
+
+    size_t GetFigureCount() const
+    {
+        return IsRange() || operation == Move || operation == Transform ? count : 1;
+    }
+
+    bool IsDelta() const
+    {
+        return operation == Recolor || operation == EditText;
+    }
+
+    // Changes the figure in place: forward on redo, backward on undo.
+    void ApplyDelta(Figure& figure, bool isForward) const
+    {
+        switch (operation) {
+            case Recolor:
+                figure.SetColor(isForward ? newColor : oldColor);
+                break;
+            case EditText:
+                if (isForward)
+                    figure.ReplaceText(textEdit->position, textEdit->oldText.size(), textEdit->newText);
+                else
+                    figure.ReplaceText(textEdit->position, textEdit->newText.size(), textEdit->oldText);
+                break;
+            default:
+                Debug::Assert(false);
+                break;
+        }
+    }
+};
+
+// Temporary file for the frozen undo groups evicted from memory.
+// Freed records are reused, so the file stays about as large as the history it holds; it is deleted when closed.
+class UndoSpillFile : public Uncopyable
+{
+    HANDLE                  file;
+    uint64_t                size;
+    map<uint64_t, uint64_t> freeRecords; // offset -> size
+
+public:
+    UndoSpillFile() : file(INVALID_HANDLE_VALUE), size(0)
+    {
+        TCHAR folder[MAX_PATH];
+        TCHAR path  [MAX_PATH];
+        if (::GetTempPath(MAX_PATH, folder) == 0 || ::GetTempFileName(folder, _T("mcu"), 0, path) == 0)
+            throw exception();
+        file = ::CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            ::DeleteFile(path);
+            throw exception();
+        }
+    }
+
+    virtual ~UndoSpillFile()
+    {
+        ::CloseHandle(file);
+    }
+
+    uint64_t Write(const vector<uint8_t>& data)
+    {
+        const auto offset  = Allocate(data.size());
+        DWORD      written = 0;
+        if (!Seek(offset) || !::WriteFile(file, data.data(), DWORD(data.size()), &written, nullptr) || written != data.size()) {
+            Free(offset, data.size());
+            throw exception();
+        }
+        return offset;
+    }
+
+    void Read(uint64_t offset, size_t recordSize, vector<uint8_t>& data)
+    {
+        data.resize(recordSize);
+        DWORD read = 0;
+        if (!Seek(offset) || !::ReadFile(file, data.data(), DWORD(recordSize), &read, nullptr) || read != recordSize)
+            throw exception();
+    }
+
+    void Free(uint64_t offset, uint64_t recordSize)
+    {
+        auto next = freeRecords.lower_bound(offset);
+        if (next != freeRecords.end() && offset + recordSize == next->first) {
+            recordSize += next->second;
+            next = freeRecords.erase(next);
+        }
+        if (next != freeRecords.begin()) {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == offset) {
+                offset      = previous->first;
+                recordSize += previous->second;
+                freeRecords.erase(previous);
+            }
+        }
+        if (offset + recordSize == size) {
+            size = offset;
+            if (Seek(size))
+                ::SetEndOfFile(file);
+        } else {
+            freeRecords[offset] = recordSize;
+        }
+    }
+
+private:
+    // First fit: the records are about the same size, so holes fill up again quickly.
+    uint64_t Allocate(uint64_t recordSize)
+    {
+        for (auto record = freeRecords.begin(); record != freeRecords.end(); ++record) {
+            if (record->second < recordSize)
+                continue;
+            const auto offset        = record->first;
+            const auto remainingSize = record->second - recordSize;
+            freeRecords.erase(record);
+            if (remainingSize > 0)
+                freeRecords[offset + recordSize] = remainingSize;
+            return offset;
+        }
+        const auto offset = size;
+        size += recordSize;
+        return offset;
+    }
+
+    bool Seek(uint64_t offset)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = LONGLONG(offset);
+        return ::SetFilePointerEx(file, position, nullptr, FILE_BEGIN) != FALSE;
+    }
+};
+
+class UndoDataGroup : public Uncopyable
+{
+    // The fields of the range and delta records of a frozen group, column by column.
+    class RecordFields
+    {
+        vector<uint32_t> counts;
+        vector<long>     offsetXs;
+        vector<long>     offsetYs;
+        vector<uint32_t> oldColors;
+        vector<uint32_t> newColors;
+        vector<long>     textPositions;
+        vector<tstring>  texts;
+        vector<long>     moveIndices;      // ascending within a move, so their deltas are small
+        vector<long>     placementIndices; // ascending within a transform, so their deltas are small
+        vector<long>     placementXs;      // the old start and end, then the new start and end, figure by figure
+        vector<long>     placementYs;
+        size_t           countIndex;
+        size_t           offsetIndex;
+        size_t           colorIndex;
+        size_t           textIndex;
+        size_t           moveIndex;
+        size_t           placementIndex;
+
+    public:
+        RecordFields() : countIndex(0), offsetIndex(0), colorIndex(0), textIndex(0), moveIndex(0), placementIndex(0)
+        {}
+
+        void Write(const UndoData& undoData)
+        {
+            switch (undoData.operation) {
+                case UndoData::Add:
+                case UndoData::Delete:
+                    counts.push_back(uint32_t(undoData.count));
+                    break;
+                case UndoData::Move:
+                    counts  .push_back(uint32_t(undoData.count));
+                    offsetXs.push_back(undoData.offset.cx);
+                    offsetYs.push_back(undoData.offset.cy);
+                    for (auto index : *undoData.indices)
+                        moveIndices.push_back(long(index));
+                    break;
+                case UndoData::Recolor:
+                    oldColors.push_back(undoData.oldColor);
+                    newColors.push_back(undoData.newColor);
+                    break;
+                case UndoData::EditText:
+                    textPositions.push_back(long(undoData.textEdit->position));
+                    texts        .push_back(undoData.textEdit->oldText);
+                    texts        .push_back(undoData.textEdit->newText);
+                    break;
+                case UndoData::Transform: {
+                    const auto& placements = *undoData.placements;
+                    counts.push_back(uint32_t(undoData.count));
+                    for (size_t position = 0; position < placements.indices.size(); position++) {
+                        placementIndices.push_back(long(placements.indices[position]));
+                        WritePlacement(placements.oldPlacements[position]);
+                        WritePlacement(placements.newPlacements[position]);
+                    }
+                    break;
+                }
+                case UndoData::Update: // its figures go in the figure columns
+                    break;
+                default:
+                    Debug::Assert(false);
+                    break;
+            }
+        }
+
+        void Read(UndoData& undoData)
+        {
+            switch (undoData.operation) {
+                case UndoData::Add:
+                case UndoData::Delete:
+                    if (countIndex >= counts.size())
+                        throw exception();
+                    undoData.count = counts[countIndex++];
+                    break;
+                case UndoData::Move: {
+                    if (countIndex >= counts.size() || offsetIndex >= offsetXs.size() || counts[countIndex] > moveIndices.size() - moveIndex)
+                        throw exception();
+                    undoData.count  = counts[countIndex++];
+                    undoData.offset = CSize(offsetXs[offsetIndex], offsetYs[offsetIndex]);
+                    offsetIndex++;
+                    const auto indices = new vector<size_t>(moveIndices.begin() + moveIndex, moveIndices.begin() + moveIndex + undoData.count);
+                    undoData.indices   = shared_ptr<const vector<size_t>>(indices);
+                    moveIndex += undoData.count;
+                    break;
+                }
+                case UndoData::Recolor:
+                    if (colorIndex >= oldColors.size())
+                        throw exception();
+                    undoData.oldColor = oldColors[colorIndex];
+                    undoData.newColor = newColors[colorIndex];
+                    colorIndex++;
+                    break;
+                case UndoData::EditText: {
+                    if (textIndex >= textPositions.size())
+                        throw exception();
+                    const auto textEdit = new UndoData::TextEdit;
+                    textEdit->position  = size_t(textPositions[textIndex]);
+                    textEdit->oldText   = texts[textIndex * 2    ];
+                    textEdit->newText   = texts[textIndex * 2 + 1];
+                    undoData.textEdit   = shared_ptr<const UndoData::TextEdit>(textEdit);
+                    textIndex++;
+                    break;
+                }
+                case UndoData::Transform: {
+                    if (countIndex >= counts.size() || counts[countIndex] > placementIndices.size() - placementIndex)
+                        throw exception();
+                    undoData.count = counts[countIndex++];
+                    const auto placements = new UndoData::Placements;
+                    placements->indices      .reserve(undoData.count);
+                    placements->oldPlacements.reserve(undoData.count);
+                    placements->newPlacements.reserve(undoData.count);
+                    for (size_t position = 0; position < undoData.count; position++, placementIndex++) {
+                        placements->indices      .push_back(size_t(placementIndices[placementIndex]));
+                        placements->oldPlacements.push_back(ReadPlacement(placementIndex * 4    ));
+                        placements->newPlacements.push_back(ReadPlacement(placementIndex * 4 + 2));
+                    }
+                    undoData.placements = shared_ptr<const UndoData::Placements>(placements);
+                    break;
+                }
+                case UndoData::Update:
+                    break;
+                default:
+                    throw exception();
+            }
+        }
+
+        void Encode(ByteWriter& writer) const
+        {
+            BlockCodec::EncodeRuns  (counts       , writer);
+            BlockCodec::EncodeDeltas(offsetXs     , writer);
+            BlockCodec::EncodeDeltas(offsetYs     , writer);
+            BlockCodec::EncodeRuns  (oldColors    , writer);
+            BlockCodec::EncodeRuns  (newColors    , writer);
+            BlockCodec::EncodeDeltas(textPositions, writer);
+            for (const auto& text : texts)
+                FigureColumns::EncodeText(text, writer);
+            BlockCodec::EncodeDeltas(moveIndices     , writer);
+            BlockCodec::EncodeDeltas(placementIndices, writer);
+            BlockCodec::EncodeDeltas(placementXs     , writer);
+            BlockCodec::EncodeDeltas(placementYs     , writer);
+        }
+
+        void Decode(ByteReader& reader)
+        {
+            BlockCodec::DecodeRuns  (reader, counts       );
+            BlockCodec::DecodeDeltas(reader, offsetXs     );
+            BlockCodec::DecodeDeltas(reader, offsetYs     );
+            BlockCodec::DecodeRuns  (reader, oldColors    );
+            BlockCodec::DecodeRuns  (reader, newColors    );
+            BlockCodec::DecodeDeltas(reader, textPositions);
+            if (offsetXs.size() != offsetYs.size() || oldColors.size() != newColors.size())
+                throw exception();
+            texts.resize(textPositions.size() * 2);
+            for (auto& text : texts)
+                FigureColumns::DecodeText(reader, text);
+            BlockCodec::DecodeDeltas(reader, moveIndices     );
+            BlockCodec::DecodeDeltas(reader, placementIndices);
+            BlockCodec::DecodeDeltas(reader, placementXs     );
+            BlockCodec::DecodeDeltas(reader, placementYs     );
+            if (placementXs.size() != placementIndices.size() * 4 || placementYs.size() != placementXs.size())
+                throw exception();
+        }
+
+    private:
+        void WritePlacement(const CLine& placement)
+        {
+            placementXs.push_back(placement.start.x);
+            placementYs.push_back(placement.start.y);
+            placementXs.push_back(placement.end  .x);
+            placementYs.push_back(placement.end  .y);
+        }
+
+        CLine ReadPlacement(size_t position) const
+        {
+            return CLine(CPoint(placementXs[position    ], placementYs[position    ]),
+                         CPoint(placementXs[position + 1], placementYs[position + 1]));
+        }
+    };
+
+    vector<UndoData>           undoDataList;
+    vector<shared_ptr<Figure>> figures; // the figures of the Add and Delete ranges, range after range
+    vector<uint8_t>            frozenData;
+    UndoSpillFile*             spillFile;
+    uint64_t                   spillOffset;
+    size_t                     spillSize;
+    size_t                     memorySize; // counted when the group is committed, frozen, spilled and thawed
+
+public:
+    typedef vector<UndoData>::iterator iterator;
+
+    UndoDataGroup() : spillFile(nullptr), spillOffset(0), spillSize(0), memorySize(0)
+    {}
+
+    virtual ~UndoDataGroup()
+    {
+        if (IsSpilled())
+            spillFile->Free(spillOffset, spillSize);
+    }
+
+    bool IsEmpty() const
+    {
+        return undoDataList.size() == 0 && frozenData.size() == 0 && !IsSpilled();
+    }
+
+    bool IsFrozen() const
+    {
+        return frozenData.size() != 0 || IsSpilled();
+    }
+
+    bool IsSpilled() const
+    {
+        return spillFile != nullptr;
+    }
+
+    // Bytes the group kept in memory when it was last counted.
+    size_t GetMemorySize() const
+    {
+        return memorySize;
+    }
+
+    // Counts the bytes the group keeps in memory. Figures are counted only where the history alone keeps them alive.
+    void UpdateMemorySize()
+    {
+        memorySize = sizeof(*this) + undoDataList.capacity() * sizeof(UndoData) + figures.capacity() * sizeof(shared_ptr<Figure>) + frozenData.capacity();
+        for (const auto& figure : figures) {
+            if (figure.use_count() == 1)
+                memorySize += figure->GetMemorySize();
+        }
+        for (const auto& undoData : undoDataList) {
+            if (undoData.oldFigure.use_count() == 1)
+                memorySize += undoData.oldFigure->GetMemorySize();
+            if (undoData.newFigure.use_count() == 1)
+                memorySize += undoData.newFigure->GetMemorySize();
+            if (undoData.textEdit != nullptr)
+                memorySize += sizeof(UndoData::TextEdit) + (undoData.textEdit->oldText.capacity() + undoData.textEdit->newText.capacity()) * sizeof(TCHAR);
+            if (undoData.indices != nullptr)
+                memorySize += sizeof(vector<size_t>) + undoData.indices->capacity() * sizeof(size_t);
+            if (undoData.placements != nullptr)
+                memorySize += sizeof(UndoData::Placements) + undoData.placements->indices.capacity() * sizeof(size_t) +
+                              (undoData.placements->oldPlacements.capacity() + undoData.placements->newPlacements.capacity()) * sizeof(CLine);
+        }
+    }
+
+    size_t GetSpilledSize() const
+    {
+        return spillSize;
+    }
+
+    // Adds and deletes of neighbouring figures extend one range record, so a bulk operation costs a record per range
+    // and a pointer per figure.
+    void Add(const UndoData& undoData)
+    {
+        Debug::Assert(!IsFrozen());
+        if (!undoData.IsRange()) {
+            undoDataList.push_back(undoData);
+            return;
+        }
+        if (undoDataList.size() == 0 || !Extends(undoDataList.back(), undoData)) {
+            UndoData range(undoData.operation, undoData.index);
+            range.first = figures.size();
+            undoDataList.push_back(range);
+        }
+        undoDataList.back().count++;
+        figures.push_back(undoData.operation == UndoData::Add ? undoData.newFigure : undoData.oldFigure);
+    }
+
+    vector<shared_ptr<Figure>>::iterator GetFigures(const UndoData& range)
+    {
+        Debug::Assert(range.IsRange() && range.first + range.count <= figures.size());
+        return figures.begin() + range.first;
+    }
+
+    size_t GetFigureCount() const
+    {
+        size_t figureCount = 0;
+        for (const auto& undoData : undoDataList)
+            figureCount += undoData.GetFigureCount();
+        return figureCount;
+    }
+
+    iterator begin()
+    {
+        return undoDataList.begin();
+    }
+
+    iterator end()
+    {
+        return undoDataList.end();
+    }
+
+    size_t size() const
+    {
+        return undoDataList.size();
+    }
+
+    UndoData& operator[](size_t index)
+    {
+        return undoDataList[index];
+    }
+
+    const UndoData& operator[](size_t index) const
+    {
+        return undoDataList[index];
+    }
+
+    // Compresses the records of a cold group.
+    // Only figures that are not in the document are kept: a figure that is in the document is captured again when the group is undone or redone.
+    void Freeze(bool isApplied)
+    {
+        if (IsFrozen() || undoDataList.size() == 0)
+            return;
+
+        ByteWriter writer(frozenData);
+        Encode(writer, isApplied ? AppliedFlag | OldFiguresFlag : OldFiguresFlag);
+        frozenData.shrink_to_fit();
+
+        vector<UndoData>().swap(undoDataList);
+        vector<shared_ptr<Figure>>().swap(figures);
+        UpdateMemorySize();
+    }
+
+    // Moves the records of a frozen group out to the spill file.
+    void Spill(UndoSpillFile& file)
+    {
+        if (IsSpilled() || frozenData.size() == 0)
+            return;
+
+        spillOffset = file.Write(frozenData);
+        spillSize   = frozenData.size();
+        spillFile   = &file;
+        vector<uint8_t>().swap(frozenData);
+        UpdateMemorySize();
+    }
+
+    void Thaw()
+    {
+        if (!IsFrozen())
+            return;
+
+        Load();
+        ByteReader reader(frozenData);
+        Decode(reader);
+        vector<uint8_t>().swap(frozenData);
+        UpdateMemorySize();
+    }
+
+    // Writes what redoing the group takes: its records, the figures it adds and the new figures of its updates.
+    // The figures it deletes or replaces are captured from the document when it is redone.
+    void WriteRedo(ByteWriter& writer)
+    {
+        Debug::Assert(!IsFrozen());
+        Encode(writer, 0);
+    }
+
+    void ReadRedo(ByteReader& reader)
+    {
+        Debug::Assert(IsEmpty());
+        Decode(reader);
+    }
+
+    // Writes what undoing the group takes while it is in the document, as Freeze does.
+    void WriteUndo(ByteWriter& writer)
+    {
+        Debug::Assert(!IsFrozen());
+        Encode(writer, AppliedFlag | OldFiguresFlag);
+    }
+
+    void ReadUndo(ByteReader& reader)
+    {
+        Debug::Assert(IsEmpty());
+        Decode(reader);
+    }
+
+private:
+    enum EncodingFlag {
+        AppliedFlag    = 1, // the group is in the document
+        OldFiguresFlag = 2  // the old figures of updates are kept
+    };
+
+    void Encode(ByteWriter& writer, uint32_t encodingFlags)
+    {
+        const auto       isApplied = (encodingFlags & AppliedFlag) != 0;
+        vector<uint32_t> operations;
+        vector<long>     indices;
+        FigureColumns    columns;
+        RecordFields     fields;
+        for (const auto& undoData : undoDataList) {
+            operations.push_back(undoData.operation);
+            indices   .push_back(long(undoData.index));
+            if (HasRangeFigures(undoData.operation, isApplied)) {
+                for (auto figure = GetFigures(undoData); figure != GetFigures(undoData) + undoData.count; ++figure)
+                    (*figure)->Write(columns);
+            }
+            if (HasOldFigure(undoData.operation) && (encodingFlags & OldFiguresFlag) != 0)
+                undoData.oldFigure->Write(columns);
+            if (HasNewFigure(undoData.operation))
+                undoData.newFigure->Write(columns);
+            fields.Write(undoData);
+        }
+
+        writer.WriteVarUInt(encodingFlags);
+        BlockCodec::EncodeRuns  (operations, writer);
+        BlockCodec::EncodeDeltas(indices   , writer);
+        columns.Encode(writer);
+        fields .Encode(writer);
+    }
+
+    void Decode(ByteReader& reader)
+    {
+        const auto       encodingFlags = uint32_t(reader.ReadVarUInt());
+        const auto       isApplied     = (encodingFlags & AppliedFlag) != 0;
+        vector<uint32_t> operations;
+        vector<long>     indices;
+        FigureColumns    columns;
+        RecordFields     fields;
+        BlockCodec::DecodeRuns  (reader, operations);
+        BlockCodec::DecodeDeltas(reader, indices   );
+        columns.Decode(reader);
+        fields .Decode(reader);
+        if (operations.size() != indices.size())
+            throw exception();
+
+        // The figures of ranges that are in the document are left empty; they are captured when the range is applied.
+        FigureColumnReader columnReader(columns);
+        for (size_t index = 0; index < operations.size(); index++) {
+            UndoData undoData(UndoData::Operation(operations[index]), size_t(indices[index]));
+            fields.Read(undoData);
+            if (undoData.IsRange()) {
+                undoData.first = figures.size();
+                for (size_t count = 0; count < undoData.count; count++)
+                    figures.push_back(HasRangeFigures(undoData.operation, isApplied) ? shared_ptr<Figure>(FigureFactory::Create(columnReader).release()) : nullptr);
+            }
+            if (HasOldFigure(undoData.operation) && (encodingFlags & OldFiguresFlag) != 0)
+                undoData.oldFigure = FigureFactory::Create(columnReader);
+            if (HasNewFigure(undoData.operation))
+                undoData.newFigure = FigureFactory::Create(columnReader);
+            undoDataList.push_back(undoData);
+        }
+    }
+
+    void Load()
+    {
+        if (!IsSpilled())
+            return;
+
+        spillFile->Read(spillOffset, spillSize, frozenData);
+        spillFile->Free(spillOffset, spillSize);
+        spillFile   = nullptr;
+        spillOffset = 0;
+        spillSize   = 0;
+    }
+
+    // Deleting at the same index again takes the next figure of the run; adding right after the range grows it.
+    static bool Extends(const UndoData& range, const UndoData& undoData)
+    {
+        return range.operation == undoData.operation &&
+               undoData.index == (undoData.operation == UndoData::Delete ? range.index : range.index + range.count);
+    }
+
+    static bool HasRangeFigures(UndoData::Operation operation, bool isApplied)
+    {
+        return (operation == UndoData::Delete && isApplied) || (operation == UndoData::Add && !isApplied);
+    }
+
+    static bool HasOldFigure(UndoData::Operation operation)
+    {
+        return operation == UndoData::Update;
+    }
+
+    static bool HasNewFigure(UndoData::Operation operation)
+    {
+        return operation == UndoData::Update;
+    }
+};
+
+// Write-ahead journal of the changes to a document, for recovering them after a crash.
+// Each committed undo group, undo, redo and document load is appended as a record: its size, its kind and data, and a CRC-32.
+// A checkpoint record marks where an autosave snapshot was taken, so recovery can load the autosave and replay only the records
+// after it. Undoing or redoing a group the records after the last checkpoint do not hold appends the group itself.
+// Once the autosave is saved for good, the records before its checkpoint are compacted away, so the file only holds the
+// changes since the last autosave.
+// Appending only frames the record in memory; a flush thread gathers the records of commitInterval and writes and flushes
+// them in one go, so the UI thread never waits for the disk and a burst of edits costs one flush.
+// A torn record at the end of the file, left by a crash in the middle of a write, is cut off when the journal is opened.
+class OperationJournal : public Uncopyable
+{
+    static const char fileSignature[4];
+    static const long commitInterval = 20; // milliseconds; the most edits a crash can lose
+
+public:
+    enum RecordKind {
+        Commit = 1, Undo, Redo, Document, Checkpoint, Revert, Reapply, DiscardRedo
+    };
+
+    struct Record
+    {
+        RecordKind      kind;
+        vector<uint8_t> data;
+        uint64_t        end; // the file offset just past the record
+    };
+
+private:
+    const tstring           path;
+    HANDLE                  file;
+    vector<Record>          recoveredRecords;
+    mutex                   guard;
+    condition_variable      wake;
+    condition_variable      flushed;
+    vector<uint8_t>         pendingData;
+    uint64_t                appendedSize;      // the file size once the pending data is written
+    uint64_t                flushedSize;
+    map<uint64_t, uint64_t> checkpointOffsets; // checkpoint -> where its record starts in the file
+    uint64_t                compactOffset;     // where the records to keep start, while a compaction is due; 0 otherwise
+    bool                    isClosing;
+    bool                    isFailed;
+    thread                  flushThread;
+
+public:
+    // Opens the journal for appending after the records already in it, which are kept for GetRecoveredRecords.
+    OperationJournal(const tstring& path)
+        : path(path), file(INVALID_HANDLE_VALUE), appendedSize(0), flushedSize(0), compactOffset(0), isClosing(false), isFailed(false)
+    {
+        file = ::CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw exception();
+        try {
+            Open();
+        } catch (const exception&) {
+            ::CloseHandle(file);
+            throw;
+        }
+        flushThread = thread([this] { FlushLoop(); });
+    }
+
+    virtual ~OperationJournal()
+    {
+        Close();
+    }
+
+    const vector<Record>& GetRecoveredRecords() const
+    {
+        return recoveredRecords;
+    }
+
+    // Drops the recovered records from memory, and from the file those from recordCount on.
+    void ReleaseRecoveredRecords(size_t recordCount)
+    {
+        if (recordCount < recoveredRecords.size()) {
+            Flush();
+            const auto size = recordCount == 0 ? uint64_t(sizeof(fileSignature)) : recoveredRecords[recordCount - 1].end;
+            if (!Seek(size, FILE_BEGIN) || !::SetEndOfFile(file))
+                throw exception();
+            lock_guard<mutex> lock(guard);
+            appendedSize = flushedSize = size;
+            for (auto offset = checkpointOffsets.begin(); offset != checkpointOffsets.end(); )
+                offset = offset->second < size ? next(offset) : checkpointOffsets.erase(offset);
+        }
+        vector<Record>().swap(recoveredRecords);
+    }
+
+    void AppendCommit(UndoDataGroup& undoDataGroup)
+    {
+        vector<uint8_t> record;
+        ByteWriter      writer(record);
+        writer.WriteVarUInt(Commit);
+        undoDataGroup.WriteRedo(writer);
+        Append(record);
+    }
+
+    void AppendUndo()
+    {
+        Append(vector<uint8_t>(1, uint8_t(Undo)));
+    }
+
+    void AppendRedo()
+    {
+        Append(vector<uint8_t>(1, uint8_t(Redo)));
+    }
+
+    void AppendDiscardRedo()
+    {
+        Append(vector<uint8_t>(1, uint8_t(DiscardRedo)));
+    }
+
+    void AppendDocument(const vector<uint8_t>& data)
+    {
+        vector<uint8_t> record(1, uint8_t(Document));
+        record.insert(record.end(), data.begin(), data.end());
+        Append(record);
+    }
+
+    void AppendCheckpoint(uint64_t checkpoint)
+    {
+        vector<uint8_t> record;
+        ByteWriter      writer(record);
+        writer.WriteVarUInt(Checkpoint);
+        writer.WriteVarUInt(checkpoint);
+        Append(record, checkpoint);
+    }
+
+    void AppendRevert(UndoDataGroup& undoDataGroup)
+    {
+        vector<uint8_t> record;
+        ByteWriter      writer(record);
+        writer.WriteVarUInt(Revert);
+        undoDataGroup.WriteUndo(writer);
+        Append(record);
+    }
+
+    void AppendReapply(UndoDataGroup& undoDataGroup)
+    {
+        vector<uint8_t> record;
+        ByteWriter      writer(record);
+        writer.WriteVarUInt(Reapply);
+        undoDataGroup.WriteRedo(writer);
+        Append(record);
+    }
+
+    // The index of the checkpoint record of checkpoint, or the record count if there is none.
+    size_t FindCheckpoint(uint64_t checkpoint) const
+    {
+        for (size_t index = recoveredRecords.size(); index > 0; index--) {
+            const auto& record = recoveredRecords[index - 1];
+            if (record.kind == Checkpoint && ByteReader(record.data).ReadVarUInt() == checkpoint)
+                return index - 1;
+        }
+        return recoveredRecords.size();
+    }
+
+    // Drops the records before the checkpoint record of checkpoint from the file, once the autosave taken at it is saved for
+    // good: recovery starts from that autosave. The flush thread writes the records from the checkpoint on to a new file
+    // that then replaces the journal, so a crash leaves either the whole journal or the compacted one. Any thread may call it.
+    void Compact(uint64_t checkpoint)
+    {
+        lock_guard<mutex> lock(guard);
+        const auto found = checkpointOffsets.find(checkpoint);
+        if (isFailed || found == checkpointOffsets.end() || found->second <= Math::Max(compactOffset, uint64_t(sizeof(fileSignature))))
+            return;
+        compactOffset = found->second;
+        wake.notify_one();
+    }
+
+    // Waits until everything appended so far is on the disk, and a compaction due is done.
+    void Flush()
+    {
+        unique_lock<mutex> lock(guard);
+        flushed.wait(lock, [this] { return (flushedSize == appendedSize && compactOffset == 0) || isFailed; });
+    }
+
+    // Closes the journal and deletes the file: the document was closed normally and nothing needs recovering.
+    void Discard()
+    {
+        Close();
+        ::DeleteFile(path.c_str());
+    }
+
+private:
+    void Open()
+    {
+        LARGE_INTEGER fileSize;
+        if (!::GetFileSizeEx(file, &fileSize))
+            throw exception();
+        vector<uint8_t> data(size_t(fileSize.QuadPart));
+        DWORD           readSize = 0;
+        if (data.size() > 0 && (!Seek(0, FILE_BEGIN) || !::ReadFile(file, data.data(), DWORD(data.size()), &readSize, nullptr) || readSize != data.size()))
+            throw exception();
+
+        uint64_t validSize = 0;
+        if (data.size() >= sizeof(fileSignature) && equal(fileSignature, fileSignature + sizeof(fileSignature), data.begin()))
+            validSize = ReadRecords(data);
+        if (validSize == 0) {
+            DWORD written = 0;
+            if (!Seek(0, FILE_BEGIN) || !::WriteFile(file, fileSignature, DWORD(sizeof(fileSignature)), &written, nullptr) || written != sizeof(fileSignature))
+                throw exception();
+            validSize = sizeof(fileSignature);
+        }
+        if (!Seek(validSize, FILE_BEGIN) || !::SetEndOfFile(file) || !::FlushFileBuffers(file))
+            throw exception();
+        appendedSize = flushedSize = validSize;
+    }
+
+    // Reads the records up to the first one that is incomplete or damaged, and returns where they end.
+    uint64_t ReadRecords(const vector<uint8_t>& data)
+    {
+        size_t position = sizeof(fileSignature);
+        try {
+            while (position < data.size()) {
+                ByteReader reader(data.data() + position, data.size() - position);
+                const auto recordSize = size_t(reader.ReadVarUInt());
+                const auto headerSize = data.size() - position - reader.GetRemainingSize();
+                if (recordSize == 0 || data.size() - position - headerSize < recordSize + sizeof(uint32_t))
+                    break;
+
+                const auto record = data.data() + position + headerSize;
+                uint32_t   crc    = 0;
+                for (size_t index = 0; index < sizeof(crc); index++)
+                    crc |= uint32_t(record[recordSize + index]) << (index * 8);
+                if (crc != Crc32::Get(record, recordSize))
+                    break;
+
+                ByteReader recordReader(record, recordSize);
+                Record     recoveredRecord;
+                recoveredRecord.kind = RecordKind(recordReader.ReadVarUInt());
+                const auto dataStart = recordSize - recordReader.GetRemainingSize();
+                recoveredRecord.data.assign(record + dataStart, record + recordSize);
+                if (recoveredRecord.kind == Checkpoint)
+                    checkpointOffsets[ByteReader(recoveredRecord.data).ReadVarUInt()] = position;
+                position += headerSize + recordSize + sizeof(crc);
+                recoveredRecord.end = position;
+                recoveredRecords.push_back(move(recoveredRecord));
+            }
+        } catch (const exception&) {
+            // A size cut off by the end of the file: the records before it are kept.
+        }
+        return recoveredRecords.size() == 0 ? sizeof(fileSignature) : recoveredRecords.back().end;
+    }
+
+    // The record of a checkpoint notes where it starts, for compacting the records before it away.
+    void Append(const vector<uint8_t>& record, uint64_t checkpoint = 0)
+    {
+        lock_guard<mutex> lock(guard);
+        if (isFailed || isClosing)
+            return;
+
+        if (checkpoint != 0)
+            checkpointOffsets[checkpoint] = appendedSize;
+        const auto pendingSize = pendingData.size();
+        ByteWriter writer(pendingData);
+        writer.WriteVarUInt(record.size());
+        writer.Write(record.data(), record.size());
+        const auto crc = Crc32::Get(record.data(), record.size());
+        for (size_t index = 0; index < sizeof(crc); index++)
+            pendingData.push_back(uint8_t(crc >> (index * 8)));
+        appendedSize += pendingData.size() - pendingSize;
+        if (pendingSize == 0)
+            wake.notify_one();
+    }
+
+    void FlushLoop()
+    {
+        unique_lock<mutex> lock(guard);
+        for (;;) {
+            wake.wait(lock, [this] { return pendingData.size() > 0 || compactOffset != 0 || isClosing; });
+            if (pendingData.size() == 0) {
+                if (isClosing)
+                    return;
+                CompactFile(lock);
+                continue;
+            }
+            wake.wait_for(lock, chrono::milliseconds(commitInterval), [this] { return isClosing; });
+
+            vector<uint8_t> data;
+            data.swap(pendingData);
+            lock.unlock();
+            DWORD      written   = 0;
+            const auto isWritten = ::WriteFile(file, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size() && ::FlushFileBuffers(file);
+            lock.lock();
+
+            if (isWritten) {
+                flushedSize += data.size();
+            } else {
+                // The journal stops here rather than leave a gap that would make the records after it replay wrongly.
+                isFailed = true;
+                pendingData.clear();
+            }
+            flushed.notify_all();
+        }
+    }
+
+    // The flush thread's, with everything appended so far on the disk. Appends go on meanwhile; they are written after it.
+    void CompactFile(unique_lock<mutex>& lock)
+    {
+        const auto offset = compactOffset;
+        const auto size   = flushedSize;
+        lock.unlock();
+        const auto isCompacted = Rotate(offset, size);
+        lock.lock();
+
+        // A compaction asked for meanwhile is of a later checkpoint, and moves with the rest of the file; a failed one is
+        // given up until the next autosave.
+        const auto droppedSize = isCompacted ? offset - sizeof(fileSignature) : 0;
+        appendedSize  -= droppedSize;
+        flushedSize   -= droppedSize;
+        compactOffset  = compactOffset == offset ? 0 : compactOffset - droppedSize;
+        for (auto checkpointOffset = checkpointOffsets.begin(); checkpointOffset != checkpointOffsets.end(); ) {
+            if (checkpointOffset->second < offset && isCompacted) {
+                checkpointOffset = checkpointOffsets.erase(checkpointOffset);
+            } else {
+                checkpointOffset->second -= droppedSize;
+                ++checkpointOffset;
+            }
+        }
+        if (file == INVALID_HANDLE_VALUE) {
+            isFailed      = true;
+            compactOffset = 0;
+            pendingData.clear();
+        }
+        flushed.notify_all();
+    }
+
+    // Replaces the file with one of the records in [offset, size). Without the file reopened, the journal stops.
+    bool Rotate(uint64_t offset, uint64_t size)
+    {
+        vector<uint8_t> data(fileSignature, fileSignature + sizeof(fileSignature));
+        data.resize(sizeof(fileSignature) + size_t(size - offset));
+        DWORD      readSize = 0;
+        const auto isRead   = Seek(offset, FILE_BEGIN) && ::ReadFile(file, data.data() + sizeof(fileSignature), DWORD(size - offset), &readSize, nullptr) && readSize == size - offset;
+        if (!Seek(size, FILE_BEGIN) || !isRead)
+            return false;
+
+        const auto temporaryPath = path + _T(".tmp");
+        const auto temporaryFile = ::CreateFile(temporaryPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (temporaryFile == INVALID_HANDLE_VALUE)
+            return false;
+        DWORD      written   = 0;
+        const auto isWritten = ::WriteFile(temporaryFile, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size() && ::FlushFileBuffers(temporaryFile);
+        ::CloseHandle(temporaryFile);
+        if (!isWritten) {
+            ::DeleteFile(temporaryPath.c_str());
+            return false;
+        }
+
+        ::CloseHandle(file);
+        const auto isMoved = ::MoveFileEx(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+        if (!isMoved)
+            ::DeleteFile(temporaryPath.c_str());
+        file = ::CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file != INVALID_HANDLE_VALUE && !Seek(isMoved ? data.size() : size, FILE_BEGIN)) {
+            ::CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+        return isMoved && file != INVALID_HANDLE_VALUE;
+    }
+
+    void Close()
+    {
+        if (!flushThread.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(guard);
+            isClosing = true;
+            wake.notify_one();
+        }
+        flushThread.join();
+        if (file != INVALID_HANDLE_VALUE)
+            ::CloseHandle(file); // a failed compaction may have left none
+        file = INVALID_HANDLE_VALUE;
+    }
+
+    bool Seek(uint64_t offset, DWORD moveMethod)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = LONGLONG(offset);
+        return ::SetFilePointerEx(file, position, nullptr, moveMethod) != FALSE;
+    }
+};
+
+const char OperationJournal::fileSignature[4] = { 'M', 'C', 'J', '1' };
+
+class UndoBuffer : public Uncopyable
+{
+    static const size_t hotGroupCount       = 16;
+    static const size_t defaultMemoryBudget = 64 * 1024 * 1024;
+
+    unique_ptr<UndoSpillFile>         spillFile; // declared first: the groups free their records in it when they are destroyed
+    shared_ptr<UndoDataGroup>         currentUndoDataGroup;
+    vector<shared_ptr<UndoDataGroup>> undoList;
+    size_t                            currentIndex;
+    size_t                            memoryBudget;
+    size_t                            memorySize;   // the sum of the group sizes in undoList
+    OperationJournal*                 journal;
+    size_t                            journalFloor;   // the groups in [journalFloor, journalCeiling) are held by the journal's
+    size_t                            journalCeiling; // records after its last checkpoint
+
+public:
+    bool CanUndo() const
+    {
+        return currentIndex > 0;
+    }
+
+    bool CanRedo() const
+    {
+        return currentIndex < undoList.size();
+    }
+
+    // The groups that can be undone.
+    size_t GetUndoCount() const
+    {
+        return currentIndex;
+    }
+
+    UndoBuffer(size_t memoryBudget = defaultMemoryBudget) : currentUndoDataGroup(nullptr), currentIndex(0), memoryBudget(memoryBudget), memorySize(0), journal(nullptr), journalFloor(0), journalCeiling(0)
+    {}
+
+    OperationJournal* GetJournal() const
+    {
+        return journal;
+    }
+
+    // Committed groups, undos and redos are appended to the journal from now on.
+    void SetJournal(OperationJournal* journal)
+    {
+        Flush();
+        this->journal  = journal;
+        journalFloor   = 0;
+        journalCeiling = undoList.size();
+    }
+
+    // Marks the journal where a snapshot of the document taken now stands.
+    void Checkpoint(uint64_t checkpoint)
+    {
+        Flush();
+        if (journal == nullptr)
+            return;
+        journal->AppendCheckpoint(checkpoint);
+        journalFloor   = currentIndex;
+        journalCeiling = currentIndex;
+    }
+
+    size_t GetMemoryBudget() const
+    {
+        return memoryBudget;
+    }
+
+    void SetMemoryBudget(size_t memoryBudget)
+    {
+        this->memoryBudget = memoryBudget;
+        SpillColdGroups();
+    }
+
+    // The bytes the committed groups keep in memory.
+    size_t GetMemorySize() const
+    {
+        return memorySize;
+    }
+
+    // The bytes each group keeps in memory, oldest first.
+    vector<size_t> GetGroupMemorySizes() const
+    {
+        vector<size_t> memorySizes;
+        for (const auto& undoDataGroup : undoList)
+            memorySizes.push_back(undoDataGroup->GetMemorySize());
+        return memorySizes;
+    }
+
+    void Start()
+    {
+        Flush();
+        currentUndoDataGroup.reset(new UndoDataGroup());
+    }
+
+    void End()
+    {
+        Flush();
+    }
+
+    void Clear()
+    {
+        currentUndoDataGroup.reset();
+        undoList.clear();
+        currentIndex = 0;
+        memorySize     = 0;
+        journalFloor   = 0;
+        journalCeiling = 0;
+        spillFile.reset();
+    }
+
+    void PushAddData(size_t index, shared_ptr<Figure> newFigure)
+    {
+        Push(UndoData::AddData(index, newFigure));
+    }
+
+    void PushDeleteData(size_t index, shared_ptr<Figure> oldFigure)
+    {
+        Push(UndoData::DeleteData(index, oldFigure));
+    }
+
+    void PushMoveData(shared_ptr<const vector<size_t>> indices, const SIZE& offset)
+    {
+        Push(UndoData::MoveData(indices, offset));
+    }
+
+    void PushRecolorData(size_t index, COLORREF oldColor, COLORREF newColor)
+    {
+        Push(UndoData::RecolorData(index, oldColor, newColor));
+    }
+
+    void PushEditTextData(size_t index, const tstring& oldText, const tstring& newText)
+    {
+        Push(UndoData::EditTextData(index, oldText, newText));
+    }
+
+    void PushTransformData(shared_ptr<const UndoData::Placements> placements)
+    {
+        Push(UndoData::TransformData(placements));
+    }
+
+    // Adds a group that is not applied yet, so that the next Redo applies it. For replaying a journal.
+    void Append(shared_ptr<UndoDataGroup> undoDataGroup)
+    {
+        Flush();
+        Truncate(currentIndex);
+        AddGroup(undoDataGroup);
+    }
+
+    // Puts a group that is applied already before the groups that can be redone, so that the next Undo takes it back.
+    // For replaying a journal from a checkpoint the group was committed before.
+    void Insert(shared_ptr<UndoDataGroup> undoDataGroup)
+    {
+        Flush();
+        undoDataGroup->UpdateMemorySize();
+        undoList.insert(undoList.begin() + currentIndex++, undoDataGroup);
+        memorySize += undoDataGroup->GetMemorySize();
+    }
+
+    UndoDataGroup* Undo()
+    {
+        if (!CanUndo())
+            return nullptr;
+        auto& undoDataGroup = *undoList[--currentIndex];
+        ChangeGroup(undoDataGroup, [&] { undoDataGroup.Thaw(); });
+        if (journal != nullptr) {
+            if (currentIndex < journalFloor) {
+                journal->AppendRevert(undoDataGroup);
+                journalFloor = currentIndex;
+            } else {
+                journal->AppendUndo();
+            }
+        }
+        FreezeColdGroups();
+        return &undoDataGroup;
+    }
+
+    UndoDataGroup* Redo()
+    {
+        if (!CanRedo())
+            return nullptr;
+        auto& undoDataGroup = *undoList[currentIndex];
+        ChangeGroup(undoDataGroup, [&] { undoDataGroup.Thaw(); });
+        if (journal != nullptr) {
+            if (currentIndex >= journalCeiling) {
+                journal->AppendReapply(undoDataGroup);
+                journalCeiling = currentIndex + 1;
+            } else {
+                journal->AppendRedo();
+            }
+        }
+        currentIndex++;
+        FreezeColdGroups();
+        return &undoDataGroup;
+    }
+
+    // Forgets the groups that could be redone, as a new group would.
+    void DiscardRedo()
+    {
+        if (!CanRedo())
+            return;
+        if (journal != nullptr)
+            journal->AppendDiscardRedo();
+        Truncate(currentIndex);
+    }
+
+private:
+    void Push(const UndoData& undoData)
+    {
+        if (currentUndoDataGroup == nullptr)
+            Start();
+        currentUndoDataGroup->Add(undoData);
+    }
+
+    void Flush()
+    {
+        if (currentUndoDataGroup != nullptr && !currentUndoDataGroup->IsEmpty()) {
+            if (journal != nullptr)
+                journal->AppendCommit(*currentUndoDataGroup);
+            Truncate(currentIndex);
+            AddGroup(currentUndoDataGroup);
+            currentIndex++;
+            journalCeiling = undoList.size();
+            FreezeColdGroups();
+        }
+        currentUndoDataGroup.reset();
+    }
+
+    // Keeps only the groups around the current position uncompressed.
+    void FreezeColdGroups()
+    {
+        if (currentIndex > hotGroupCount) {
+            auto& undoDataGroup = *undoList[currentIndex - hotGroupCount - 1];
+            ChangeGroup(undoDataGroup, [&] { undoDataGroup.Freeze(true); });
+        }
+        if (currentIndex + hotGroupCount < undoList.size()) {
+            auto& undoDataGroup = *undoList[currentIndex + hotGroupCount];
+            ChangeGroup(undoDataGroup, [&] { undoDataGroup.Freeze(false); });
+        }
+        SpillColdGroups();
+    }
+
+    // Keeps the history within the memory budget, spilling the frozen groups farthest from the current position first.
+    void SpillColdGroups()
+    {
+        if (memorySize <= memoryBudget)
+            return;
+
+        try {
+            for (auto distance = std::max(currentIndex, undoList.size() - currentIndex); distance > hotGroupCount && memorySize > memoryBudget; distance--) {
+                if (distance <= currentIndex)
+                    Spill(*undoList[currentIndex - distance]);
+                if (currentIndex + distance <= undoList.size())
+                    Spill(*undoList[currentIndex + distance - 1]);
+            }
+        } catch (const exception&) {
+            // Without a usable spill file the history stays in memory.
+        }
+    }
+
+    void Spill(UndoDataGroup& undoDataGroup)
+    {
+        if (!undoDataGroup.IsFrozen() || undoDataGroup.IsSpilled())
+            return;
+        if (spillFile == nullptr)
+            spillFile.reset(new UndoSpillFile());
+        ChangeGroup(undoDataGroup, [&] { undoDataGroup.Spill(*spillFile); });
+    }
+
+    // Counts a group into the history.
+    void AddGroup(shared_ptr<UndoDataGroup> undoDataGroup)
+    {
+        undoDataGroup->UpdateMemorySize();
+        undoList.push_back(undoDataGroup);
+        memorySize += undoDataGroup->GetMemorySize();
+    }
+
+    void Truncate(size_t size)
+    {
+        for (auto index = size; index < undoList.size(); index++)
+            memorySize -= undoList[index]->GetMemorySize();
+        undoList.resize(size);
+        journalCeiling = Math::Min(journalCeiling, size);
+    }
+
+    // Applies change to a group and moves the total by the change in its size; a change that throws leaves the total alone.
+    template <class TChange>
+    void ChangeGroup(UndoDataGroup& undoDataGroup, TChange change)
+    {
+        const auto oldMemorySize = undoDataGroup.GetMemorySize();
+        change();
+        memorySize -= oldMemorySize;
+        memorySize += undoDataGroup.GetMemorySize();
+    }
+};
+
+class UndoScope
+{
+    UndoBuffer& undoBuffer;
+
+public:
+    UndoScope(UndoBuffer& undoBuffer) : undoBuffer(undoBuffer)
+    {
+        undoBuffer.Start();
+    }
+
+    virtual ~UndoScope()
+    {
+        undoBuffer.End();
+    }
+
+    void PushAddData(size_t index, shared_ptr<Figure> newFigure) const
+    {
+        undoBuffer.PushAddData(index, newFigure);
+    }
+
+    void PushDeleteData(size_t index, shared_ptr<Figure> oldFigure) const
+    {
+        undoBuffer.PushDeleteData(index, oldFigure);
+    }
+
+    void PushMoveData(shared_ptr<const vector<size_t>> indices, const SIZE& offset) const
+    {
+        undoBuffer.PushMoveData(indices, offset);
+    }
+
+    void PushRecolorData(size_t index, COLORREF oldColor, COLORREF newColor) const
+    {
+        undoBuffer.PushRecolorData(index, oldColor, newColor);
+    }
+
+    void PushEditTextData(size_t index, const tstring& oldText, const tstring& newText) const
+    {
+        undoBuffer.PushEditTextData(index, oldText, newText);
+    }
+
+    void PushTransformData(shared_ptr<const UndoData::Placements> placements) const
+    {
+        undoBuffer.PushTransformData(placements);
+    }
+};
+
+// Persistent sequence of figures: a B-tree whose nodes are shared between copies of the tree.
+// A shared node is copied before it changes, so copying a tree is O(1) and a change afterwards copies only the O(log n) nodes on its path.
+class FigureTree
+{
+    static const size_t nodeSize = 64;
+
+    struct Node
+    {
+        size_t                     count;    // figures under the node
+        vector<shared_ptr<Node>>   children; // empty in a leaf
+        vector<shared_ptr<Figure>> figures;  // leaf only
+
+        Node() : count(0)
+        {}
+
+        bool IsLeaf() const
+        {
+            return children.empty();
+        }
+
+        size_t GetWidth() const
+        {
+            return IsLeaf() ? figures.size() : children.size();
+        }
+    };
+
+    shared_ptr<Node> root;
+
+public:
+    class const_iterator
+    {
+        const Node* root;
+        const Node* leaf;
+        size_t      position;
+        size_t      index;
+
+    public:
+        typedef forward_iterator_tag      iterator_category;
+        typedef shared_ptr<Figure>        value_type;
+        typedef ptrdiff_t                 difference_type;
+        typedef const shared_ptr<Figure>* pointer;
+        typedef const shared_ptr<Figure>& reference;
+
+        const_iterator(const Node* root, size_t index) : root(root), leaf(nullptr), position(0), index(index)
+        {
+            Seek();
+        }
+
+        reference operator*() const
+        {
+            return leaf->figures[position];
+        }
+
+        pointer operator->() const
+        {
+            return &leaf->figures[position];
+        }
+
+        const_iterator& operator++()
+        {
+            index++;
+            if (++position >= leaf->figures.size())
+                Seek();
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return index == other.index;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return index != other.index;
+        }
+
+    private:
+        void Seek()
+        {
+            if (index < root->count)
+                leaf = FindLeaf(*root, index, position);
+        }
+    };
+
+    FigureTree() : root(new Node)
+    {}
+
+    // Builds the tree bottom up with full nodes.
+    template <class TIterator>
+    FigureTree(TIterator first, TIterator last)
+    {
+        vector<shared_ptr<Node>> level;
+        for (auto figure = first; figure != last; ) {
+            shared_ptr<Node> leaf(new Node);
+            for (; figure != last && leaf->figures.size() < nodeSize; ++figure)
+                leaf->figures.push_back(*figure);
+            leaf->count = leaf->figures.size();
+            level.push_back(leaf);
+        }
+        while (level.size() > 1) {
+            vector<shared_ptr<Node>> parents;
+            for (size_t index = 0; index < level.size(); index += nodeSize) {
+                shared_ptr<Node> parent(new Node);
+                for (auto child = index; child < Math::Min(index + nodeSize, level.size()); child++) {
+                    parent->children.push_back(level[child]);
+                    parent->count += level[child]->count;
+                }
+                parents.push_back(parent);
+            }
+            level.swap(parents);
+        }
+        root = level.empty() ? shared_ptr<Node>(new Node) : level.front();
+    }
+
+    size_t size() const
+    {
+        return root->count;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(root.get(), 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(root.get(), size());
+    }
+
+    const_iterator At(size_t index) const
+    {
+        Debug::Assert(index <= size());
+        return const_iterator(root.get(), index);
+    }
+
+    const shared_ptr<Figure>& operator[](size_t index) const
+    {
+        Debug::Assert(index < size());
+        size_t position = 0;
+        return FindLeaf(*root, index, position)->figures[position];
+    }
+
+    void Set(size_t index, shared_ptr<Figure> figure)
+    {
+        Debug::Assert(index < size());
+        auto node = Own(root);
+        while (!node->IsLeaf()) {
+            const auto position = FindChild(*node, index);
+            node = Own(node->children[position]);
+        }
+        node->figures[index] = figure;
+    }
+
+    // Whether the figure at index is held by this tree alone, through nodes no other tree holds, so that no copy of the tree sees it change.
+    bool IsExclusive(size_t index) const
+    {
+        Debug::Assert(index < size());
+        if (root.use_count() > 1)
+            return false;
+        auto node = root.get();
+        while (!node->IsLeaf()) {
+            const auto& child = node->children[FindChild(*node, index)];
+            if (child.use_count() > 1)
+                return false;
+            node = child.get();
+        }
+        return node->figures[index].use_count() == 1;
+    }
+
+    // The figures at the ascending indices, each made this tree's alone in one pass down the tree: the shared nodes on
+    // their paths are copied once each, and a figure held elsewhere too is replaced by a clone.
+    vector<Figure*> Detach(const vector<size_t>& indices)
+    {
+        vector<Figure*> detachedFigures;
+        detachedFigures.reserve(indices.size());
+        auto index = indices.begin();
+        Detach(root, 0, index, indices.end(), detachedFigures);
+        Debug::Assert(detachedFigures.size() == indices.size());
+        return detachedFigures;
+    }
+
+    void Insert(size_t index, shared_ptr<Figure> figure)
+    {
+        Debug::Assert(index <= size());
+        const auto sibling = Insert(root, index, figure);
+        if (sibling != nullptr) {
+            shared_ptr<Node> parent(new Node);
+            parent->children.push_back(root   );
+            parent->children.push_back(sibling);
+            parent->count = root->count + sibling->count;
+            root          = parent;
+        }
+    }
+
+    void Erase(size_t index, size_t count)
+    {
+        Debug::Assert(index + count <= size());
+        if (count == 0)
+            return;
+        Erase(root, index, count);
+        while (!root->IsLeaf() && root->children.size() == 1)
+            root = root->children.front();
+    }
+
+private:
+    // Copy on write: a node that another tree also holds is copied before it changes.
+    static Node* Own(shared_ptr<Node>& node)
+    {
+        if (node.use_count() > 1)
+            node.reset(new Node(*node));
+        else
+            atomic_thread_fence(memory_order_acquire); // a copy of the tree let go of the node, maybe on another thread
+        return node.get();
+    }
+
+    static size_t FindChild(const Node& node, size_t& index)
+    {
+        size_t position = 0;
+        while (index >= node.children[position]->count) {
+            index -= node.children[position]->count;
+            position++;
+        }
+        return position;
+    }
+
+    static const Node* FindLeaf(const Node& root, size_t index, size_t& position)
+    {
+        auto node = &root;
+        while (!node->IsLeaf())
+            node = node->children[FindChild(*node, index)].get();
+        position = index;
+        return node;
+    }
+
+    // first is the index of the first figure under the node.
+    static void Detach(shared_ptr<Node>& nodePointer, size_t first, vector<size_t>::const_iterator& index, vector<size_t>::const_iterator end, vector<Figure*>& detachedFigures)
+    {
+        auto node = Own(nodePointer);
+        if (node->IsLeaf()) {
+            for (; index != end && *index < first + node->count; ++index) {
+                auto& figure = node->figures[*index - first];
+                if (figure.use_count() > 1)
+                    figure.reset(figure->Clone().release());
+                else
+                    atomic_thread_fence(memory_order_acquire);
+                detachedFigures.push_back(figure.get());
+            }
+            return;
+        }
+        for (auto child = node->children.begin(); child != node->children.end() && index != end; ++child) {
+            if (*index < first + (*child)->count)
+                Detach(*child, first, index, end, detachedFigures);
+            first += (*child)->count;
+        }
+    }
+
+    // Returns the new right sibling when the node splits.
+    static shared_ptr<Node> Insert(shared_ptr<Node>& nodePointer, size_t index, shared_ptr<Figure> figure)
+    {
+        auto node = Own(nodePointer);
+        node->count++;
+        if (node->IsLeaf()) {
+            node->figures.insert(node->figures.begin() + index, figure);
+            return node->figures.size() > nodeSize ? Split(*node) : nullptr;
+        }
+
+        size_t position = 0;
+        while (position + 1 < node->children.size() && index > node->children[position]->count) {
+            index -= node->children[position]->count;
+            position++;
+        }
+        const auto sibling = Insert(node->children[position], index, figure);
+        if (sibling != nullptr)
+            node->children.insert(node->children.begin() + position + 1, sibling);
+        return node->children.size() > nodeSize ? Split(*node) : nullptr;
+    }
+
+    static shared_ptr<Node> Split(Node& node)
+    {
+        shared_ptr<Node> sibling(new Node);
+        const auto half = node.GetWidth() / 2;
+        if (node.IsLeaf()) {
+            sibling->figures.assign(node.figures.begin() + half, node.figures.end());
+            node.figures.resize(half);
+            sibling->count = sibling->figures.size();
+        } else {
+            sibling->children.assign(node.children.begin() + half, node.children.end());
+            node.children.resize(half);
+            for (const auto& child : sibling->children)
+                sibling->count += child->count;
+        }
+        node.count -= sibling->count;
+        return sibling;
+    }
+
+    static void Erase(shared_ptr<Node>& nodePointer, size_t index, size_t count)
+    {
+        auto node = Own(nodePointer);
+        node->count -= count;
+        if (node->IsLeaf()) {
+            node->figures.erase(node->figures.begin() + index, node->figures.begin() + index + count);
+            return;
+        }
+
+        const auto first    = FindChild(*node, index);
+        auto       position = first;
+        while (count > 0) {
+            auto&      child        = node->children[position];
+            const auto erasedCount  = Math::Min(count, child->count - index);
+            count                  -= erasedCount;
+            if (erasedCount == child->count) {
+                node->children.erase(node->children.begin() + position);
+            } else {
+                Erase(child, index, erasedCount);
+                position++;
+            }
+            index = 0;
+        }
+        Merge(*node, first == 0 ? 0 : first - 1, position + 1);
+    }
+
+    // Joins the children in [first, last) that fell below a quarter full with a neighbour.
+    static void Merge(Node& node, size_t first, size_t last)
+    {
+        for (auto position = first; position < last && position + 1 < node.children.size(); ) {
+            const auto leftWidth  = node.children[position    ]->GetWidth();
+            const auto rightWidth = node.children[position + 1]->GetWidth();
+            if ((leftWidth >= nodeSize / 4 && rightWidth >= nodeSize / 4) || leftWidth + rightWidth > nodeSize) {
+                position++;
+                continue;
+            }
+            const auto right  = node.children[position + 1];
+            const auto merged = Own(node.children[position]);
+            merged->figures .insert(merged->figures .end(), right->figures .begin(), right->figures .end());
+            merged->children.insert(merged->children.end(), right->children.begin(), right->children.end());
+            merged->count += right->count;
+            node.children.erase(node.children.begin() + position + 1);
+            last--;
+        }
+    }
+};
+
+// The figures of a document at one moment. Taking one is O(1), and the document never changes what a snapshot holds,
+// so a snapshot can be read on another thread while editing goes on.
+class DocumentSnapshot
+{
+    FigureTree             figures;
+    shared_ptr<const bool> token;
+
+public:
+    typedef FigureTree::const_iterator iterator;
+
+    DocumentSnapshot(const FigureTree& figures, shared_ptr<const bool> token) : figures(figures), token(token)
+    {}
+
+    iterator begin() const
+    {
+        return figures.begin();
+    }
+
+    iterator end() const
+    {
+        return figures.end();
+    }
+
+    size_t size() const
+    {
+        return figures.size();
+    }
+
+    const FigureTree& GetFigures() const
+    {
+        return figures;
+    }
+};
+
+// Selection changes leave the drawing unchanged, so they are reported apart from the figure updates of Observer.
+class SelectionObserver
+{
+public:
+    virtual void OnSelectionUpdate(Figure* figure)
+    {}
+};
+
+class CadData : public Observable, public Uncopyable
+{
+    static const char     fileSignature[4];
+    static const uint32_t fileVersion                = 1;
+    static const size_t   maximumUpdateCount         = 64;
+    static const size_t   parallelSearchMinimumCount = 16384; // figures below which a search is not worth dividing
+    static const size_t   parallelSearchRangeSize    = 4096;  // figures a search task measures
+    static const size_t   parallelTransformRangeSize = 4096;  // figures a transform task changes
+    static const size_t   longOperationStep          = 1024;  // figures between the points where a long operation may pause
+
+    CRect                      area;
+	FigureTree                 figures;
+	COLORREF                   currentColor;
+    UndoBuffer                 undoBuffer;
+    vector<SelectionObserver*> selectionObservers;
+    shared_ptr<const bool>     snapshotToken; // shared by the live snapshots
+
+public:
+	typedef FigureTree::const_iterator iterator;
+
+    const CRect& GetArea() const
+    {
+        return area;
+    }
+
+	COLORREF GetCurrentColor() const
+	{
+		return currentColor;
+	}
+
+	void SetCurrentColor(COLORREF color)
+	{
+		currentColor = color;
+	}
+
+    const UndoBuffer& GetUndoBuffer() const
+    {
+        return undoBuffer;
+    }
+
+    void SetUndoMemoryBudget(size_t memoryBudget)
+    {
+        undoBuffer.SetMemoryBudget(memoryBudget);
+    }
+
+	CadData() : area(CPoint(), CSize(modelSize, modelSize)), currentColor(Color::Black), snapshotToken(new bool(true))
+	{}
+
+    // While a snapshot is alive, a figure is cloned before it changes.
+    DocumentSnapshot GetSnapshot() const
+    {
+        return DocumentSnapshot(figures, snapshotToken);
+    }
+
+	iterator begin() const
+	{
+		return figures.begin();
+	}
+
+	iterator end() const
+	{
+		return figures.end();
+	}
+
+    void AddSelectionObserver(SelectionObserver& observer)
+    {
+        selectionObservers.push_back(&observer);
+    }
+
+	void Add(unique_ptr<Figure> figure)
+	{
+        const UndoScope undoScope(undoBuffer);
+        
+        SelectAll(false);
+        figure->Select();
+        figure->SetColor(GetCurrentColor());
+        auto newFigure = shared_ptr<Figure>(figure.release());
+        undoScope.PushAddData(figures.size(), newFigure);
+        figures.Insert(figures.size(), newFigure);
+        Update(newFigure.get());
+    }
+
+    // Adds the figures as one undo group with a single update.
+    void Add(const vector<shared_ptr<Figure>>& newFigures)
+    {
+        if (newFigures.size() == 0)
+            return;
+
+        const UndoScope undoScope(undoBuffer);
+
+        SelectAll(false, false);
+        for (const auto& figure : newFigures) {
+            figure->Select();
+            undoScope.PushAddData(figures.size(), figure);
+            figures.Insert(figures.size(), figure);
+        }
+        Update(nullptr);
+    }
+
+    void Copy(Clipboard& clipboard) const
+    {
+        vector<shared_ptr<Figure>> selectedFigures;
+        copy_if(figures.begin(), figures.end(), back_inserter(selectedFigures),
+                [](const shared_ptr<Figure>& figure) { return figure->IsSelected(); });
+        if (selectedFigures.size() == 0)
+            return;
+
+        vector<uint8_t> data;
+        ByteWriter      writer(data);
+        FigureFactory::Write(selectedFigures.begin(), selectedFigures.end(), writer);
+        clipboard.SetData(data);
+    }
+
+    void Paste(Clipboard& clipboard)
+    {
+        vector<uint8_t> data;
+        if (!clipboard.GetData(data))
+            return;
+
+        vector<shared_ptr<Figure>> newFigures;
+        try {
+            ByteReader reader(data);
+            FigureFactory::Read(reader, newFigures);
+        } catch (const exception&) {
+            return;
+        }
+        Add(newFigures);
+    }
+
+    // A few deleted figures are reported one by one so that views can repaint just their bounds.
+    void Delete(bool update = true)
+    {
+        const UndoScope undoScope(undoBuffer);
+
+        vector<shared_ptr<Figure>> deletedFigures;
+        vector<pair<size_t, size_t>> ranges;
+        size_t index = 0;
+        size_t count = 0;
+        for (const auto& figure : figures) {
+            if (figure->IsSelected()) {
+                undoScope.PushDeleteData(count, figure);
+                if (deletedFigures.size() <= maximumUpdateCount)
+                    deletedFigures.push_back(figure);
+                if (ranges.size() > 0 && ranges.back().first + ranges.back().second == index)
+                    ranges.back().second++;
+                else
+                    ranges.push_back(make_pair(index, size_t(1)));
+            } else {
+                count++;
+            }
+            index++;
+        }
+        for (auto range = ranges.rbegin(); range != ranges.rend(); ++range)
+            figures.Erase(range->first, range->second);
+        if (!update || deletedFigures.size() == 0)
+            return;
+        if (deletedFigures.size() > maximumUpdateCount) {
+            Update(nullptr);
+            return;
+        }
+        for (const auto& figure : deletedFigures)
+            UpdateRemoved(figure.get());
+    }
+
+    // Deletes the selection a slice at a time, for selections too large to delete between two messages. The ranges are taken
+    // out front to back, each at its index among the figures left, so the history is the same as that of Delete.
+    LongOperation DeleteInSlices()
+    {
+        const auto figureCount = figures.size();
+        vector<pair<size_t, size_t>> ranges;
+        size_t selectedCount = 0;
+        size_t index         = 0;
+        for (auto figure = figures.begin(); index < figureCount; ++figure) {
+            if ((*figure)->IsSelected()) {
+                if (ranges.size() > 0 && ranges.back().first + ranges.back().second == index)
+                    ranges.back().second++;
+                else
+                    ranges.push_back(make_pair(index, size_t(1)));
+                selectedCount++;
+            }
+            if (++index % longOperationStep == 0)
+                co_await Progress(index, figureCount + selectedCount);
+        }
+
+        const auto                 undoCount   = undoBuffer.GetUndoCount();
+        auto                       isCancelled = false;
+        vector<shared_ptr<Figure>> deletedFigures;
+        {
+            const UndoScope undoScope(undoBuffer);
+            try {
+                size_t deletedCount = 0;
+                for (const auto& range : ranges) {
+                    const auto position = range.first - deletedCount;
+                    for (size_t offset = 0; offset < range.second; ) {
+                        const auto count = Math::Min(range.second - offset, longOperationStep);
+                        auto       figure = figures.At(position);
+                        for (size_t step = 0; step < count; step++, ++figure) {
+                            undoScope.PushDeleteData(position, *figure);
+                            if (deletedFigures.size() <= maximumUpdateCount)
+                                deletedFigures.push_back(*figure);
+                        }
+                        figures.Erase(position, count);
+                        deletedCount += count;
+                        offset       += count;
+                        co_await Progress(figureCount + deletedCount, figureCount + selectedCount);
+                    }
+                }
+            } catch (const OperationCancelled&) {
+                isCancelled = true;
+            }
+        }
+        if (isCancelled) {
+            Rollback(undoCount);
+            co_return;
+        }
+        if (deletedFigures.size() == 0)
+            co_return;
+        if (deletedFigures.size() > maximumUpdateCount) {
+            Update(nullptr);
+            co_return;
+        }
+        for (const auto& figure : deletedFigures)
+            UpdateRemoved(figure.get());
+    }
+
+    // Moves the selected figures in place, on the task scheduler a range at a time. The history keeps their indices and
+    // the one offset they all moved by.
+    void MoveSelection(const SIZE& offset)
+    {
+        if (offset.cx == 0 && offset.cy == 0)
+            return;
+        const shared_ptr<vector<size_t>> indices(new vector<size_t>);
+        size_t index = 0;
+        for (const auto& figure : figures) {
+            if (figure->IsSelected())
+                indices->push_back(index);
+            index++;
+        }
+        if (indices->size() == 0)
+            return;
+
+        const UndoScope undoScope(undoBuffer);
+        Offset(*indices, offset, indices->size() <= maximumUpdateCount);
+        undoScope.PushMoveData(indices, offset);
+    }
+
+    // The bounds of the selected figures; CRect::GetNone() without a selection.
+    CRect GetSelectionBoundRect() const
+    {
+        return TaskScheduler::Get().ParallelReduce(0, figures.size(), parallelSearchRangeSize, CRect::GetNone(), [&](size_t first, size_t last) {
+            auto bounds = CRect::GetNone();
+            auto figure = figures.At(first);
+            for (auto index = first; index < last; ++index, ++figure) {
+                if ((*figure)->IsSelected())
+                    bounds = bounds.Union((*figure)->GetBoundRect());
+            }
+            return bounds;
+        }, [](const CRect& bounds, const CRect& rangeBounds) { return bounds.Union(rangeBounds); });
+    }
+
+    // Transforms the selected figures in place, on the task scheduler a range at a time. The history keeps a single record
+    // of where each figure was and went, as scaling rounds and cannot be taken back by the inverse transform.
+    void TransformSelection(const AxisTransform& transform)
+    {
+        const shared_ptr<UndoData::Placements> placements(new UndoData::Placements);
+        size_t index = 0;
+        for (const auto& figure : figures) {
+            if (figure->IsSelected())
+                placements->indices.push_back(index);
+            index++;
+        }
+        if (placements->indices.size() == 0)
+            return;
+
+        const UndoScope undoScope(undoBuffer);
+        const auto      update          = placements->indices.size() <= maximumUpdateCount;
+        const auto      selectedFigures = EditFigures(placements->indices, update);
+        placements->oldPlacements.resize(selectedFigures.size());
+        placements->newPlacements.resize(selectedFigures.size());
+        const auto area = ChangeFigures(selectedFigures, [&](size_t position, Figure& figure) {
+            placements->oldPlacements[position] = figure.GetPlacement();
+            figure.Transform(transform);
+            placements->newPlacements[position] = figure.GetPlacement();
+        });
+        undoScope.PushTransformData(placements);
+        UpdateFigures(selectedFigures, area, update);
+    }
+
+    LongOperation ColorSelectionInSlices(COLORREF color)
+    {
+        return ChangeSelectionInSlices(RecolorChange(color));
+    }
+
+    void SetText(const Figure& figure, const tstring& text)
+    {
+        const auto index = IndexOf(&figure);
+        if (index == figures.size())
+            return;
+        const auto oldText = figure.GetText();
+        if (oldText == text)
+            return;
+
+        const UndoScope undoScope(undoBuffer);
+        undoScope.PushEditTextData(index, oldText, text);
+        ApplyDelta(UndoData::EditTextData(index, oldText, text), true, true);
+    }
+
+    void ToggleSelect(POINT point, long minimumDistance)
+    {
+        const auto index = Search(point, minimumDistance);
+        if (index < figures.size()) {
+            auto& figure = Edit(index, true);
+            figure.ToggleSelect();
+            UpdateSelection(&figure);
+        }
+    }
+
+    void SelectAlone(POINT point, long minimumDistance)
+    {
+        SelectAll(false);
+        const auto index = Search(point, minimumDistance);
+        if (index < figures.size()) {
+            auto& figure = Edit(index, true);
+            figure.Select();
+            UpdateSelection(&figure);
+        }
+    }
+
+    // A large group is reported as one update rather than figure by figure.
+    // The ranges of one Delete are applied together in a single pass over the document.
+    void Undo()
+    {
+        auto undoDataGroup = undoBuffer.Undo();
+        if (undoDataGroup == nullptr)
+            return;
+        auto&      group  = *undoDataGroup;
+        const auto update = group.GetFigureCount() <= maximumUpdateCount;
+        for (auto last = group.size(); last > 0; ) {
+            auto first = last - 1;
+            if (group[first].operation == UndoData::Delete) {
+                while (first > 0 && IsSameDelete(group[first - 1], group[first]))
+                    first--;
+                UndoDelete(group, first, last, update);
+            } else {
+                Undo(group, group[first], update);
+            }
+            last = first;
+        }
+        if (!update && !IsMoveOrTransform(group))
+            Update(nullptr);
+    }
+    
+    void Redo()
+    {
+        auto undoDataGroup = undoBuffer.Redo();
+        if (undoDataGroup == nullptr)
+            return;
+        auto&      group  = *undoDataGroup;
+        const auto update = group.GetFigureCount() <= maximumUpdateCount;
+        for (size_t first = 0; first < group.size(); ) {
+            auto last = first + 1;
+            if (group[first].operation == UndoData::Delete) {
+                while (last < group.size() && IsSameDelete(group[last - 1], group[last]))
+                    last++;
+                RedoDelete(group, first, last, update);
+            } else {
+                Redo(group, group[first], update);
+            }
+            first = last;
+        }
+        if (!update && !IsMoveOrTransform(group))
+            Update(nullptr);
+    }
+
+    // Block-compressed binary form: signature, version, figure count, then blocks of up to BlockCodec::blockSize figures.
+    void Write(ostream& stream) const
+    {
+        Write(figures, stream);
+    }
+
+    // Writes the document as it was when the snapshot was taken. Safe on any thread.
+    static void Write(const DocumentSnapshot& snapshot, ostream& stream)
+    {
+        Write(snapshot.GetFigures(), stream);
+    }
+
+    void Read(istream& stream)
+    {
+        const vector<uint8_t> buffer((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+        ByteReader reader(buffer);
+
+        char signature[sizeof(fileSignature)];
+        reader.Read(signature, sizeof(signature));
+        if (!equal(signature, signature + sizeof(signature), fileSignature) || reader.ReadVarUInt() != fileVersion)
+            throw exception();
+
+        const auto count = size_t(reader.ReadVarUInt());
+        vector<shared_ptr<Figure>> newFigures;
+        newFigures.reserve(count);
+        while (newFigures.size() < count) {
+            const auto blockSize = size_t(reader.ReadVarUInt());
+            vector<uint8_t> block(blockSize);
+            reader.Read(block.data(), blockSize);
+            ByteReader blockReader(block);
+            FigureFactory::Read(blockReader, newFigures);
+        }
+        if (newFigures.size() != count)
+            throw exception();
+
+        figures = FigureTree(newFigures.begin(), newFigures.end());
+        undoBuffer.Clear();
+        if (undoBuffer.GetJournal() != nullptr)
+            undoBuffer.GetJournal()->AppendDocument(buffer);
+        Update(nullptr);
+    }
+
+    // Replays the records recovered by the journal, and journals the changes from then on. The document holds the autosave
+    // of checkpoint, if any: where the journal has its checkpoint record, the records after it are replayed on the autosave,
+    // and the records before it are compacted away; otherwise all of them are replayed on an empty document.
+    // Replay stops at a record that cannot be applied, and the journal is cut there.
+    void Recover(OperationJournal& journal, uint64_t checkpoint)
+    {
+        Debug::Assert(!undoBuffer.CanUndo() && !undoBuffer.CanRedo());
+
+        const auto& records     = journal.GetRecoveredRecords();
+        auto        recordCount = journal.FindCheckpoint(checkpoint);
+        auto        replayCount = records.size();
+        if (recordCount < records.size()) {
+            recordCount++;
+        } else {
+            figures     = FigureTree();
+            recordCount = 0;
+            // A journal compacted down to a checkpoint holds the changes to an autosave that could not be read; they are lost.
+            if (records.size() > 0 && records.front().kind == OperationJournal::Checkpoint)
+                replayCount = 0;
+        }
+        try {
+            for (; recordCount < replayCount; recordCount++)
+                Replay(records[recordCount]);
+        } catch (const exception&) {
+        }
+        journal.ReleaseRecoveredRecords(recordCount);
+        journal.Compact(checkpoint);
+        Update(nullptr);
+        undoBuffer.SetJournal(&journal);
+    }
+
+    // Marks the journal where a snapshot taken now stands, for an autosave of it.
+    void Checkpoint(uint64_t checkpoint)
+    {
+        undoBuffer.Checkpoint(checkpoint);
+    }
+
+    Figure* Find(POINT point, long minimumDistance) const
+    {
+        const auto index = Search(point, minimumDistance);
+        return index < figures.size() ? figures[index].get() : nullptr;
+    }
+
+private:
+    static void Write(const FigureTree& figures, ostream& stream)
+    {
+        vector<uint8_t> header;
+        ByteWriter      headerWriter(header);
+        headerWriter.Write(fileSignature, sizeof(fileSignature));
+        headerWriter.WriteVarUInt(fileVersion);
+        headerWriter.WriteVarUInt(figures.size());
+        stream.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+        for (size_t index = 0; index < figures.size(); index += BlockCodec::blockSize) {
+            const auto last = Math::Min(index + BlockCodec::blockSize, figures.size());
+            vector<uint8_t> block;
+            ByteWriter      blockWriter(block);
+            FigureFactory::Write(figures.At(index), figures.At(last), blockWriter);
+
+            vector<uint8_t> blockHeader;
+            ByteWriter(blockHeader).WriteVarUInt(block.size());
+            stream.write(reinterpret_cast<const char*>(blockHeader.data()), blockHeader.size());
+            stream.write(reinterpret_cast<const char*>(block      .data()), block      .size());
+        }
+    }
+
+    void Replay(const OperationJournal::Record& record)
+    {
+        switch (record.kind) {
+            case OperationJournal::Commit: {
+                shared_ptr<UndoDataGroup> undoDataGroup(new UndoDataGroup());
+                ByteReader                reader(record.data);
+                undoDataGroup->ReadRedo(reader);
+                undoBuffer.Append(undoDataGroup);
+                Redo();
+                break;
+            }
+            case OperationJournal::Undo:
+                Undo();
+                break;
+            case OperationJournal::Redo:
+                Redo();
+                break;
+            case OperationJournal::Document: {
+                istringstream stream(string(record.data.begin(), record.data.end()));
+                Read(stream);
+                break;
+            }
+            case OperationJournal::Checkpoint:
+                break;
+            // Replayed from a checkpoint taken after the group was committed, the history starts without the group.
+            case OperationJournal::Revert:
+                if (!undoBuffer.CanUndo()) {
+                    shared_ptr<UndoDataGroup> undoDataGroup(new UndoDataGroup());
+                    ByteReader                reader(record.data);
+                    undoDataGroup->ReadUndo(reader);
+                    undoBuffer.Insert(undoDataGroup);
+                }
+                Undo();
+                break;
+            case OperationJournal::Reapply:
+                if (!undoBuffer.CanRedo()) {
+                    shared_ptr<UndoDataGroup> undoDataGroup(new UndoDataGroup());
+                    ByteReader                reader(record.data);
+                    undoDataGroup->ReadRedo(reader);
+                    undoBuffer.Append(undoDataGroup);
+                }
+                Redo();
+                break;
+            case OperationJournal::DiscardRedo:
+                undoBuffer.DiscardRedo();
+                break;
+            default:
+                throw exception();
+        }
     }
-};
 
-} // namespace Windows
+    // The index of the nearest figure, or the figure count if none is near enough; of equally near figures, the first.
+    // Large documents are searched in ranges on the task scheduler, and as the nearest of each range is combined in range
+    // order with the same tie rule, the result is the one a single pass gives.
+    size_t Search(POINT point, long minimumDistance) const
+    {
+        typedef pair<long, size_t> Nearest; // the distance and the index
 
-namespace CadCore {
-using namespace Windows;
+        const auto searchRange = [&](size_t first, size_t last) {
+            Nearest nearest(minimumDistance, figures.size());
+            auto    figure = figures.At(first);
+            for (auto index = first; index < last; ++index, ++figure) {
+                const auto distance = (*figure)->GetDistance(point);
+                if (distance < nearest.first)
+                    nearest = Nearest(distance, index);
+            }
+            return nearest;
+        };
+        if (figures.size() < parallelSearchMinimumCount)
+            return searchRange(0, figures.size()).second;
 
-const long modelSize = 1000000;
+        return TaskScheduler::Get().ParallelReduce(0, figures.size(), parallelSearchRangeSize, Nearest(minimumDistance, figures.size()), searchRange,
+                                                   [](const Nearest& nearest, const Nearest& rangeNearest) {
+            return rangeNearest.first < nearest.first ? rangeNearest : nearest;
+        }).second;
+    }
 
-class Figure
-{
-    const long defaultSelectorWidth = 10;
-    const COLORREF selectorColor    = RGB(0x80, 0x80, 0x80);
+    void SelectAll(bool isSelected = true, bool update = true)
+    {
+        vector<size_t> indices;
+        size_t         index = 0;
+        for (const auto& figure : figures) {
+            if (figure->IsSelected() != isSelected)
+                indices.push_back(index);
+            index++;
+        }
+        for (auto index : indices) {
+            auto& figure = Edit(index, update);
+            figure.Select(isSelected);
+            if (update)
+                UpdateSelection(&figure);
+        }
+    }
 
-    bool     isSelected;
-	COLORREF color;
+    // Changes to a figure go through here. While a snapshot holds the figure, it is replaced by a clone;
+    // when update is false the caller reports the whole document instead.
+    Figure& Edit(size_t index, bool update)
+    {
+        if (snapshotToken.use_count() == 1 || figures.IsExclusive(index)) {
+            // The count is read relaxed: the fence orders the reads of the last snapshot, released on another thread, before the change.
+            atomic_thread_fence(memory_order_acquire);
+            return *figures[index];
+        }
 
-public:
-    virtual unique_ptr<Figure> Clone() const = 0;
+        const auto figure = figures[index];
+        const shared_ptr<Figure> clone(figure->Clone().release());
+        figures.Set(index, clone);
+        if (update) {
+            UpdateRemoved(figure.get());
+            Update       (clone .get());
+        }
+        return *clone;
+    }
 
-    bool IsSelected() const
+    void UpdateSelection(Figure* figure)
     {
-        return isSelected;
+        for (auto observer : selectionObservers)
+            observer->OnSelectionUpdate(figure);
     }
 
-    void Select(bool isSelected = true)
+    size_t IndexOf(const Figure* figure) const
     {
-        this->isSelected = isSelected;
+        return size_t(distance(figures.begin(), find_if(figures.begin(), figures.end(), [=](const shared_ptr<Figure>& element) { return element.get() == figure; })));
     }
 
-    void ToggleSelect()
+    // A change records itself in the undo scope it is given and returns the delta to apply.
+    static function<UndoData(const UndoScope&, size_t, const Figure&)> RecolorChange(COLORREF color)
     {
-        Select(!IsSelected());
+        return [=](const UndoScope& undoScope, size_t index, const Figure& figure) {
+            const auto undoData = UndoData::RecolorData(index, figure.GetColor(), color);
+            if (undoData.oldColor != undoData.newColor)
+                undoScope.PushRecolorData(index, undoData.oldColor, undoData.newColor);
+            return undoData;
+        };
     }
 
-	COLORREF GetColor() const
-	{
-		return color;
-	}
+    // Applies a change to each selected figure a slice at a time, and reports it the way Delete does.
+    // Each figure is recorded as it is changed, so a cancelled change is taken back exactly.
+    template <class TChange>
+    LongOperation ChangeSelectionInSlices(TChange change)
+    {
+        const auto     figureCount = figures.size();
+        vector<size_t> indices;
+        size_t         index = 0;
+        for (auto figure = figures.begin(); index < figureCount; ++figure) {
+            if ((*figure)->IsSelected())
+                indices.push_back(index);
+            if (++index % longOperationStep == 0)
+                co_await Progress(index, figureCount + indices.size());
+        }
 
-	void SetColor(COLORREF color)
-	{
-		this->color = color;
-	}
+        const auto undoCount   = undoBuffer.GetUndoCount();
+        const auto update      = indices.size() <= maximumUpdateCount;
+        auto       isCancelled = false;
+        {
+            const UndoScope undoScope(undoBuffer);
+            try {
+                for (size_t position = 0; position < indices.size(); ) {
+                    const auto last = Math::Min(position + longOperationStep, indices.size());
+                    for (; position < last; position++)
+                        ApplyDelta(change(undoScope, indices[position], *figures[indices[position]]), true, update);
+                    co_await Progress(figureCount + position, figureCount + indices.size());
+                }
+            } catch (const OperationCancelled&) {
+                isCancelled = true;
+            }
+        }
+        if (isCancelled)
+            Rollback(undoCount);
+        else if (!update && indices.size() > 0)
+            Update(nullptr);
+    }
 
-    virtual long GetDistance(CPoint point)
+    // Takes back the group a cancelled long operation committed, if it committed one, leaving no trace of it in the history.
+    void Rollback(size_t undoCount)
     {
-        return LONG_MAX;
-    }   
+        if (undoBuffer.GetUndoCount() == undoCount)
+            return;
+        Undo();
+        undoBuffer.DiscardRedo();
+    }
 
-    CRect GetDrawingBoundRect(CDC& dc)
+    void Undo(UndoDataGroup& group, UndoData& undoData, bool update)
     {
-        auto selectorWidth = defaultSelectorWidth;
-        dc.DPtoLP(selectorWidth);
-        const auto d = selectorWidth / 2 + 1;
-        return GetBoundRect().GetInflateRect(d, d);
+        switch (undoData.operation) {
+            case UndoData::Add:
+                Remove(undoData.index, undoData.count, group.GetFigures(undoData), update);
+                break;
+            case UndoData::Update:
+                undoData.newFigure = Replace(undoData.index, undoData.oldFigure, update);
+                break;
+            case UndoData::Move:
+                Offset(*undoData.indices, CSize() - undoData.offset, update);
+                break;
+            case UndoData::Transform:
+                Place(*undoData.placements, false, update);
+                break;
+            default:
+                ApplyDelta(undoData, false, update);
+                break;
+        }
     }
 
-    virtual CRect GetBoundRect()
+    void Redo(UndoDataGroup& group, UndoData& undoData, bool update)
     {
-        CPoint minimum(LONG_MAX, LONG_MAX);
-        CPoint maximum(LONG_MIN, LONG_MIN);
-        for (auto point : GetPoints()) {
-            minimum.x = Math::Min(minimum.x, point.x);
-            minimum.y = Math::Min(minimum.y, point.y);
-            maximum.x = Math::Max(maximum.x, point.x);
-            maximum.y = Math::Max(maximum.y, point.y);
+        switch (undoData.operation) {
+            case UndoData::Add:
+                Insert(undoData.index, undoData.count, group.GetFigures(undoData), update);
+                break;
+            case UndoData::Update:
+                undoData.oldFigure = Replace(undoData.index, undoData.newFigure, update);
+                break;
+            case UndoData::Move:
+                Offset(*undoData.indices, undoData.offset, update);
+                break;
+            case UndoData::Transform:
+                Place(*undoData.placements, true, update);
+                break;
+            default:
+                ApplyDelta(undoData, true, update);
+                break;
         }
-        return CRect(minimum, maximum);
     }
 
-    virtual vector<CPoint> GetPoints()
+    // The figure is reported before and after the change, so that views repaint both its old and its new bounds,
+    // and Edit reports a figure it replaces as removed.
+    void ApplyDelta(const UndoData& undoData, bool isForward, bool update)
     {
-        return vector<CPoint>();
+        Debug::Assert(undoData.IsDelta() && undoData.index < figures.size());
+        if (update)
+            Update(figures[undoData.index].get());
+        auto& figure = Edit(undoData.index, update);
+        undoData.ApplyDelta(figure, isForward);
+        if (update)
+            Update(&figure);
     }
 
-	Figure() : isSelected(false), color(Color::Black)
-	{}
-
-    void Draw(CDC& dc)
+    // Moves the figures at the ascending indices by offset, and reports them the way Place does.
+    void Offset(const vector<size_t>& indices, const SIZE& offset, bool update)
     {
-        PenSelector penSelector(dc, PS_SOLID, 0, GetColor());
-        DrawShape(dc);
-        DrawSelectors(dc);
+        const auto changedFigures = EditFigures(indices, update);
+        const auto area           = ChangeFigures(changedFigures, [&](size_t, Figure& figure) {
+            figure.Offset(offset);
+        });
+        UpdateFigures(changedFigures, area, update);
     }
 
-protected:
-    virtual void DrawShape(CDC& dc)
-    {}
+    // Puts the figures of a transform back where they were, or again where they went.
+    void Place(const UndoData::Placements& placements, bool isForward, bool update)
+    {
+        const auto& newPlacements  = isForward ? placements.newPlacements : placements.oldPlacements;
+        const auto  changedFigures = EditFigures(placements.indices, update);
+        const auto  area           = ChangeFigures(changedFigures, [&](size_t position, Figure& figure) {
+            figure.SetPlacement(newPlacements[position]);
+        });
+        UpdateFigures(changedFigures, area, update);
+    }
+
+    // The figures at the ascending indices, made safe to change on any thread: as in Edit, a figure a snapshot holds is
+    // replaced by a clone here, before the change. When update is true they are reported as they are, as removed if they
+    // may be replaced.
+    vector<Figure*> EditFigures(const vector<size_t>& indices, bool update)
+    {
+        const auto isShared = snapshotToken.use_count() > 1;
+        if (!isShared)
+            atomic_thread_fence(memory_order_acquire);
+        if (update) {
+            for (auto index : indices) {
+                if (isShared)
+                    UpdateRemoved(figures[index].get());
+                else
+                    Update(figures[index].get());
+            }
+        }
+        if (isShared)
+            return figures.Detach(indices);
+
+        vector<Figure*> editedFigures;
+        editedFigures.reserve(indices.size());
+        auto figure = figures.begin();
+        for (size_t index = 0; editedFigures.size() < indices.size(); index++, ++figure) {
+            if (index == indices[editedFigures.size()])
+                editedFigures.push_back(figure->get());
+        }
+        return editedFigures;
+    }
 
-private:
-    void DrawSelectors(CDC& dc)
+    // Calls change(position, figure) for each figure on the task scheduler and returns the area the figures left and reached.
+    template <class TChange>
+    static CRect ChangeFigures(const vector<Figure*>& changedFigures, const TChange& change)
     {
-        PenSelector penSelector(dc, PS_SOLID, 0, selectorColor);
-        for (auto point : GetPoints())
-            DrawSelector(dc, point);
+        return TaskScheduler::Get().ParallelReduce(0, changedFigures.size(), parallelTransformRangeSize, CRect::GetNone(), [&](size_t first, size_t last) {
+            auto area = CRect::GetNone();
+            for (auto position = first; position < last; position++) {
+                auto& figure = *changedFigures[position];
+                area = area.Union(figure.GetBoundRect());
+                change(position, figure);
+                area = area.Union(figure.GetBoundRect());
+            }
+            return area;
+        }, [](const CRect& area, const CRect& rangeArea) { return area.Union(rangeArea); });
     }
 
-    void DrawSelector(CDC& dc, CPoint point)
+    // A few figures are reported one by one; more, as one update of the area they changed.
+    void UpdateFigures(const vector<Figure*>& changedFigures, const CRect& area, bool update)
     {
-        if (!IsSelected())
+        if (!update) {
+            UpdateArea(area);
             return;
-
-        auto selectorWidth = defaultSelectorWidth;
-        dc.DPtoLP(selectorWidth);
-
-        CSize selectorSize(selectorWidth, selectorWidth);
-        CRect rect(point - selectorSize / 2, selectorSize);
-       
-        dc.Rectangle(rect);
+        }
+        for (auto figure : changedFigures)
+            Update(figure);
     }
-};
 
-struct UndoData
-{
-public:
-    enum Operation {
-        None, Add, Delete, Update
-    };
+    // A group of moves and transforms alone has reported the area it changed.
+    static bool IsMoveOrTransform(UndoDataGroup& group)
+    {
+        return all_of(group.begin(), group.end(), [](const UndoData& undoData) { return undoData.operation == UndoData::Move || undoData.operation == UndoData::Transform; });
+    }
 
-    Operation          operation;
-    shared_ptr<Figure> oldFigure;
-    shared_ptr<Figure> newFigure;
+    // One Delete leaves ranges in ascending order of their index among the remaining figures.
+    static bool IsSameDelete(const UndoData& previous, const UndoData& next)
+    {
+        return previous.operation == UndoData::Delete && next.operation == UndoData::Delete && previous.index < next.index;
+    }
 
-    static UndoData AddData(shared_ptr<Figure> newFigure)
+    // Puts the ranges [first, last) of one Delete back, front to back, each at the index it had before the Delete.
+    void UndoDelete(UndoDataGroup& group, size_t first, size_t last, bool update)
     {
-        return UndoData(Add, nullptr, newFigure);
+        size_t deletedCount = 0;
+        for (auto index = first; index < last; index++) {
+            const auto& range = group[index];
+            Insert(range.index + deletedCount, range.count, group.GetFigures(range), update);
+            deletedCount += range.count;
+        }
     }
 
-    static UndoData DeleteData(shared_ptr<Figure> oldFigure)
+    // Takes the ranges [first, last) of one Delete out back to front, keeping their figures in the group.
+    void RedoDelete(UndoDataGroup& group, size_t first, size_t last, bool update)
     {
-        return UndoData(Delete, oldFigure, nullptr);
+        size_t deletedCount = 0;
+        for (auto index = first; index < last; index++)
+            deletedCount += group[index].count;
+        for (auto index = last; index > first; index--) {
+            const auto& range = group[index - 1];
+            deletedCount -= range.count;
+            Remove(range.index + deletedCount, range.count, group.GetFigures(range), update);
+        }
     }
 
-    static UndoData UpdateData(shared_ptr<Figure> oldFigure, shared_ptr<Figure> newFigure)
+    template <class TIterator>
+    void Insert(size_t index, size_t count, TIterator first, bool update)
     {
-        return UndoData(Update, oldFigure, newFigure);
+        Debug::Assert(index <= figures.size());
+        for (size_t offset = 0; offset < count; offset++)
+            figures.Insert(index + offset, first[offset]);
+        if (update)
+            UpdateFigures(first, count);
     }
 
-    UndoData Invert() const
+    template <class TIterator>
+    void Remove(size_t index, size_t count, TIterator first, bool update)
     {
-        return UndoData(Invert(operation), newFigure, oldFigure);
+        Debug::Assert(index + count <= figures.size());
+        copy(figures.At(index), figures.At(index + count), first);
+        figures.Erase(index, count);
+        if (update) {
+            for (auto figure = first; figure != first + count; ++figure)
+                UpdateRemoved(figure->get());
+        }
     }
 
-private:
-    UndoData(Operation operation, shared_ptr<Figure> oldFigure, shared_ptr<Figure> newFigure)
-        : operation(operation), oldFigure(oldFigure), newFigure(newFigure)
-    {}
+    template <class TIterator>
+    void UpdateFigures(TIterator first, size_t count)
+    {
+        for (auto figure = first; figure != first + count; ++figure)
+            Update(figure->get());
+    }
 
-    static Operation Invert(Operation operation)
+    shared_ptr<Figure> Replace(size_t index, shared_ptr<Figure> figure, bool update)
     {
-        switch (operation) {
-            case Add   : return Delete;
-            case Delete: return Add   ;
-            case Update: return Update;
-            default    : Debug::Assert(false);
-        }
-        return None;
+        Debug::Assert(index < figures.size());
+        auto oldFigure = figures[index];
+        if (update)
+            UpdateRemoved(oldFigure.get());
+        figures.Set(index, figure);
+        if (update)
+            Update(figure.get());
+        return oldFigure;
     }
 };
 
-class UndoDataGroup
-{
-    vector<UndoData> undoDataList;
+const char CadData::fileSignature[4] = { 'M', 'C', '3', '2' };
 
+// Immutable versions of a document for reading on other threads. The writer (the UI thread) publishes the document as a new
+// version when a reader is made, and after each command while readers are left; a reader pins the latest version and reads
+// it without locks while editing goes on. With no reader no version is kept, as a version holds a snapshot and while a
+// snapshot holds the figures, the document clones each one it changes.
+// Replaced versions are reclaimed by epochs: a reader announces in its slot the epoch it pinned in, and a version retired
+// in epoch e is deleted once no slot holds an epoch of e or earlier, as only those readers can have seen it.
+class DocumentVersions : public Observer, public SelectionObserver, public Uncopyable
+{
 public:
-    typedef vector<UndoData>::iterator iterator;
+    static const size_t maximumReaderCount = 64;
 
-    bool IsEmpty() const
+    struct Version
     {
-        return undoDataList.size() == 0;
-    }
+        const uint64_t         number;
+        const DocumentSnapshot snapshot;
 
-    void Add(const UndoData& undoData)
-    {
-        undoDataList.push_back(undoData);
-    }
+        Version(uint64_t number, const DocumentSnapshot& snapshot) : number(number), snapshot(snapshot)
+        {}
+    };
 
-    iterator begin()
+private:
+    struct Slot
     {
-        return undoDataList.begin();
-    }
+        atomic<bool>     isUsed;
+        atomic<uint64_t> epoch; // 0 while nothing is pinned
 
-    iterator end()
-    {
-        return undoDataList.end();
-    }
+        Slot() : isUsed(false), epoch(0)
+        {}
+    };
 
-    size_t size() const
+public:
+    // A thread's place among the readers, taken once and used for all its pins. It is made on the writer's thread, which
+    // publishes the document for it; it may be destroyed on any.
+    class Reader : public Uncopyable
     {
-        return undoDataList.size();
-    }
+        friend class DocumentVersions;
 
-    const UndoData& operator[](size_t index) const
+        DocumentVersions& versions;
+        Slot&             slot;
+
+    public:
+        Reader(DocumentVersions& versions) : versions(versions), slot(versions.AcquireSlot())
+        {
+            versions.Publish();
+        }
+
+        virtual ~Reader()
+        {
+            slot.isUsed.store(false);
+        }
+    };
+
+    // The latest version when the pin was made, safe to read until the pin is destroyed. A reader holds one pin at a time;
+    // a snapshot copied out of it lives on after the pin, for reads that take long.
+    class Pin : public Uncopyable
     {
-        return undoDataList[index];
-    }
-};
+        Slot&          slot;
+        const Version& version;
 
-class UndoBuffer : public Uncopyable
-{
-    shared_ptr<UndoDataGroup>         currentUndoDataGroup;
-    vector<shared_ptr<UndoDataGroup>> undoList;
-    size_t                            currentIndex;
+    public:
+        Pin(Reader& reader) : slot(reader.slot), version(reader.versions.PinLatest(reader.slot))
+        {}
+
+        virtual ~Pin()
+        {
+            slot.epoch.store(0, memory_order_release);
+        }
+
+        uint64_t GetNumber() const
+        {
+            return version.number;
+        }
+
+        const DocumentSnapshot& GetSnapshot() const
+        {
+            return version.snapshot;
+        }
+    };
+
+private:
+    CadData&                               cadData;
+    Slot                                   slots[maximumReaderCount];
+    atomic<const Version*>                 latestVersion; // nullptr while there is no reader
+    atomic<uint64_t>                       epoch;
+    vector<pair<uint64_t, const Version*>> retiredVersions; // the writer's, with the epochs they were retired in
+    uint64_t                               lastNumber;
+    bool                                   isChanged;
 
 public:
-    bool CanUndo() const
+    DocumentVersions(CadData& cadData) : cadData(cadData), latestVersion(nullptr), epoch(1), lastNumber(0), isChanged(false)
     {
-        return currentIndex > 0;
+        cadData.AddObserver         (*this);
+        cadData.AddSelectionObserver(*this);
     }
 
-    bool CanRedo() const
+    // No reader may outlive the versions.
+    virtual ~DocumentVersions()
     {
-        return currentIndex < undoList.size();
+        for (const auto& retiredVersion : retiredVersions)
+            delete retiredVersion.second;
+        delete latestVersion.load();
     }
 
-    UndoBuffer() : currentUndoDataGroup(nullptr), currentIndex(0)
-    {}
-
-    void Start()
+    // The writer's: publishes the document as it is now if it changed since the last version, or retires the last version
+    // when no reader is left, and deletes the replaced versions no reader can still be reading.
+    // Readers are made on the writer's thread, so none appears while this runs.
+    void Publish()
     {
-        Flush();
-        currentUndoDataGroup.reset(new UndoDataGroup());
+        const auto replacedVersion = latestVersion.load(memory_order_relaxed);
+        if (!HasReader()) {
+            if (replacedVersion != nullptr)
+                Retire(nullptr);
+        } else if (isChanged || replacedVersion == nullptr) {
+            Retire(new Version(++lastNumber, cadData.GetSnapshot()));
+            isChanged = false;
+        }
+        Reclaim();
     }
 
-    void End()
+    size_t GetRetiredCount() const
     {
-        Flush();
+        return retiredVersions.size();
     }
 
-    void PushAddData(shared_ptr<Figure> newFigure)
+protected:
+    virtual void OnUpdate(void* data)
     {
-        Push(UndoData::AddData(newFigure));
+        isChanged = true;
     }
 
-    void PushDeleteData(shared_ptr<Figure> oldFigure)
+    virtual void OnSelectionUpdate(Figure* figure)
     {
-        Push(UndoData::DeleteData(oldFigure));
+        isChanged = true;
     }
 
-    void PushUpdateData(shared_ptr<Figure> oldFigure, shared_ptr<Figure> newFigure)
+private:
+    Slot& AcquireSlot()
     {
-        Push(UndoData::UpdateData(oldFigure, newFigure));
+        for (auto& slot : slots) {
+            auto isUsed = false;
+            if (slot.isUsed.compare_exchange_strong(isUsed, true))
+                return slot;
+        }
+        throw exception();
     }
 
-    bool Undo(vector<UndoData>& undoDataList)
+    bool HasReader() const
     {
-        if (CanUndo()) {
-            UndoDataGroup& undoDataGroup = *undoList[--currentIndex];
-            for (long index = undoDataGroup.size() - 1; index >= 0; index--)
-                undoDataList.push_back(undoDataGroup[index].Invert());
-            return true;
-        }
-        return false;
+        return any_of(begin(slots), end(slots), [](const Slot& slot) { return slot.isUsed.load(); });
     }
 
-    bool Redo(vector<UndoData>& undoDataList)
+    // Makes version the latest; the one it replaces is retired in the current epoch.
+    void Retire(const Version* version)
     {
-        if (CanRedo()) {
-            UndoDataGroup& undoDataGroup = *undoList[--currentIndex];
-            for (auto index = 0U; index < undoDataGroup.size(); index++)
-                undoDataList.push_back(undoDataGroup[index]);
-            return true;
-        }
-        return false;
+        const auto replacedVersion = latestVersion.load(memory_order_relaxed);
+        latestVersion.store(version);
+        if (replacedVersion != nullptr)
+            retiredVersions.push_back(make_pair(epoch.fetch_add(1), replacedVersion));
     }
 
-private:
-    void Push(const UndoData& undoData)
+    // The epoch is announced before the version is read, so the writer either sees the announcement or has not yet retired the version.
+    const Version& PinLatest(Slot& slot)
     {
-        if (currentUndoDataGroup == nullptr)
-            Start();
-        currentUndoDataGroup->Add(undoData);
+        Debug::Assert(slot.epoch.load(memory_order_relaxed) == 0);
+        slot.epoch.store(epoch.load());
+        return *latestVersion.load();
     }
 
-    void Flush()
+    void Reclaim()
     {
-        if (currentUndoDataGroup != nullptr && !currentUndoDataGroup->IsEmpty()) {
-            undoList.push_back(currentUndoDataGroup);
-            currentIndex++;
-        } else {
-            currentUndoDataGroup.reset();
+        auto oldestPinnedEpoch = UINT64_MAX;
+        for (const auto& slot : slots) {
+            const auto pinnedEpoch = slot.epoch.load();
+            if (pinnedEpoch != 0)
+                oldestPinnedEpoch = Math::Min(oldestPinnedEpoch, pinnedEpoch);
         }
+        retiredVersions.erase(remove_if(retiredVersions.begin(), retiredVersions.end(), [=](const pair<uint64_t, const Version*>& retiredVersion) {
+            if (retiredVersion.first >= oldestPinnedEpoch)
+                return false;
+            delete retiredVersion.second;
+            return true;
+        }), retiredVersions.end());
     }
 };
 
-class UndoScope
+// The display list of a document, recompiled for just the figures named in its change notifications.
+class DocumentDisplayList : public Observer, public Uncopyable
 {
-    UndoBuffer& undoBuffer;
+    static const size_t maximumIncrementalCount = 16;
 
-public:
-    UndoScope(UndoBuffer& undoBuffer) : undoBuffer(undoBuffer)
-    {
-        undoBuffer.Start();
-    }
+    const CadData&              cadData;
+    DisplayList                 displayList;
+    vector<pair<Figure*, bool>> changedFigures; // and whether the figure left the document
+    CRect                       changedArea;    // where many figures changed at once; CRect::GetNone() if nowhere
+    bool                        isCompiled;
 
-    virtual ~UndoScope()
+public:
+    DocumentDisplayList(CadData& cadData) : cadData(cadData), changedArea(CRect::GetNone()), isCompiled(false)
     {
-        undoBuffer.End();
+        cadData.AddObserver(*this);
     }
 
-    void PushAddData(shared_ptr<Figure> newFigure) const
+    const DisplayList& Get()
     {
-        undoBuffer.PushAddData(newFigure);
+        Compile();
+        return displayList;
     }
 
-    void PushDeleteData(shared_ptr<Figure> oldFigure) const
+    virtual void OnUpdate(void* data)
     {
-        undoBuffer.PushDeleteData(oldFigure);
+        if (data == nullptr)
+            isCompiled = false;
+        else if (isCompiled)
+            changedFigures.push_back(make_pair(static_cast<Figure*>(data), false));
     }
 
-    void PushUpdateData(shared_ptr<Figure> oldFigure, shared_ptr<Figure> newFigure) const
+    virtual void OnRemoved(void* data)
     {
-        undoBuffer.PushUpdateData(oldFigure, newFigure);
+        if (isCompiled)
+            changedFigures.push_back(make_pair(static_cast<Figure*>(data), true));
     }
-};
-
-class CadData : public Observable, public Uncopyable
-{
-    CRect                      area;
-	vector<shared_ptr<Figure>> figures;
-	COLORREF                   currentColor;
-    UndoBuffer                 undoBuffer;
-
-public:
-	typedef vector<shared_ptr<Figure>>::const_iterator iterator;
 
-    const CRect& GetArea() const
+    // A large move or transform: only the figures in the area are compiled again.
+    virtual void OnAreaUpdate(const RECT& area)
     {
-        return area;
+        if (isCompiled)
+            changedArea = changedArea.Union(area);
     }
 
-	COLORREF GetCurrentColor() const
-	{
-		return currentColor;
-	}
-
-	void SetCurrentColor(COLORREF color)
-	{
-		currentColor = color;
-	}
-
-	CadData() : area(CPoint(), CSize(modelSize, modelSize)), currentColor(Color::Black)
-	{}
+private:
+    // A figure is compiled again unless its last notification says it left the document, when it may be gone.
+    void Compile()
+    {
+        if (isCompiled && changedFigures.size() <= maximumIncrementalCount) {
+            for (auto change = changedFigures.begin(); change != changedFigures.end(); ++change) {
+                const auto figure = change->first;
+                if (any_of(change + 1, changedFigures.end(), [=](const pair<Figure*, bool>& laterChange) { return laterChange.first == figure; }))
+                    continue;
+                displayList.Remove(figure);
+                if (!change->second)
+                    figure->Compile(displayList);
+            }
+            if (!changedArea.IsNone())
+                Compile(changedArea);
+        } else {
+            displayList.Clear();
+            for (auto figure : cadData)
+                figure->Compile(displayList);
+            isCompiled = true;
+        }
+        changedFigures.clear();
+        changedArea = CRect::GetNone();
+    }
 
-	iterator begin() const
-	{
-		return figures.begin();
-	}
+    // The area holds where the figures were and where they are now. Those that had primitives there are compiled again
+    // with those there now; a figure a snapshot kept and the document replaced by a clone is among the first, and so is dropped.
+    void Compile(const CRect& area)
+    {
+        const auto owners = displayList.RemoveIn(area);
+        for (const auto& figure : cadData) {
+            if (DisplayList::Intersects(figure->GetBoundRect(), area) || owners.count(figure.get()) > 0) {
+                displayList.Remove(figure.get());
+                figure->Compile(displayList);
+            }
+        }
+    }
+};
 
-	iterator end() const
-	{
-		return figures.end();
-	}
+// Saves a document now and then without holding up editing: the UI thread only takes a snapshot, and a worker thread
+// writes it to a temporary file that then replaces the autosave file, so the file is always a complete document.
+// The file starts with the checkpoint the journal was marked with when the snapshot was taken; once it is saved, the
+// journal drops the records before that checkpoint.
+// A save is due after maximumInterval / (the changes since the last save), but no sooner than minimumInterval
+// nor than saveCostFactor times the last save took, so large documents are saved less often.
+class Autosaver : public Observer, public Uncopyable
+{
+    typedef chrono::steady_clock Clock;
+
+    static const long minimumInterval = 5000;   // milliseconds
+    static const long maximumInterval = 120000; // milliseconds; the longest a single change goes unsaved
+    static const long saveCostFactor  = 20;     // saving takes at most a twentieth of the worker's time
+
+    CadData&                     cadData;
+    OperationJournal*            journal; // the document's, if any, when the autosaver is made
+    const tstring                path;
+    mutex                        guard;
+    condition_variable           wake;
+    condition_variable           saved;
+    unique_ptr<DocumentSnapshot> pendingSnapshot;
+    uint64_t                     pendingCheckpoint;
+    bool                         isSaving;
+    bool                         isClosing;
+    Clock::duration              lastSaveDuration;
+    size_t                       changeCount;  // the UI thread's own from here on
+    Clock::time_point            lastSaveTime;
+    Clock::duration              lastPause;
+    thread                       worker;
 
-	void Add(unique_ptr<Figure> figure)
-	{
-        const UndoScope undoScope(undoBuffer);
-        
-        SelectAll(false);
-        figure->Select();
-        figure->SetColor(GetCurrentColor());
-        auto newFigure = shared_ptr<Figure>(figure.release());
-        figures.push_back(newFigure);
-        undoScope.PushAddData(newFigure);
-        Update(figure.get());
+public:
+    Autosaver(CadData& cadData, const tstring& path)
+        : cadData(cadData), journal(cadData.GetUndoBuffer().GetJournal()), path(path), pendingCheckpoint(0), isSaving(false), isClosing(false), lastSaveDuration(0), changeCount(0), lastSaveTime(Clock::now()), lastPause(0)
+    {
+        worker = thread([this] { SaveLoop(); });
+        cadData.AddObserver(*this);
     }
 
-    void Delete(bool update = true)
+    virtual ~Autosaver()
     {
-        const UndoScope undoScope(undoBuffer);
+        Close();
+    }
 
-        figures.erase(
-            remove_if(
-                figures.begin(), figures.end(),
-                [&](shared_ptr<Figure> figure) {
-                    if (figure->IsSelected()) {
-                        undoScope.PushDeleteData(figure);
-                        return true;
-                    }
-                    return false;
-                }
-            ),
-            figures.end()
-        );
-        if (update)
-            Update(nullptr);
+    // How long the last save held the UI thread: taking the snapshot and handing it to the worker.
+    Clock::duration GetLastPause() const
+    {
+        return lastPause;
     }
 
-    void ToggleSelect(POINT point, long minimumDistance)
+    // Starts a save if one is due. Called periodically on the UI thread.
+    void Tick()
     {
-        auto targetFigure = Search(point, minimumDistance);
-        if (targetFigure != nullptr) {
-            targetFigure->ToggleSelect();
-            Update(targetFigure.get());
-        }
+        if (changeCount > 0 && Clock::now() - lastSaveTime >= GetInterval())
+            Save();
     }
 
-    void SelectAlone(POINT point, long minimumDistance)
+    // Starts a save of the document as it is now, unless the last one is still being written.
+    bool Save()
     {
-        SelectAll(false);
-        auto targetFigure = Search(point, minimumDistance);
-        if (targetFigure != nullptr) {
-            targetFigure->Select();
-            Update(targetFigure.get());
+        const auto start = Clock::now();
+        {
+            lock_guard<mutex> lock(guard);
+            if (isSaving || isClosing)
+                return false;
+            pendingSnapshot.reset(new DocumentSnapshot(cadData.GetSnapshot()));
+            pendingCheckpoint = NewCheckpoint();
+            cadData.Checkpoint(pendingCheckpoint);
+            isSaving = true;
         }
+        wake.notify_one();
+        lastSaveTime = Clock::now();
+        lastPause    = lastSaveTime - start;
+        changeCount  = 0;
+        return true;
     }
 
-    void Undo()
+    // Waits until the save under way, if any, is written.
+    void Flush()
     {
-        vector<UndoData> undoDataList;
-        if (undoBuffer.Undo(undoDataList))
-            Do(undoDataList);
+        unique_lock<mutex> lock(guard);
+        saved.wait(lock, [this] { return !isSaving; });
     }
-    
-    void Redo()
+
+    // Stops saving and deletes the file: the document was closed normally and nothing needs recovering.
+    void Discard()
     {
-        vector<UndoData> undoDataList;
-        if (undoBuffer.Redo(undoDataList))
-            Do(undoDataList);
+        Close();
+        ::DeleteFile(path.c_str());
     }
 
-private:
-    shared_ptr<Figure> Search(POINT point, long minimumDistance)
+    // Reads the autosave file into the document and its checkpoint; false if there is none or it cannot be read.
+    static bool Load(CadData& cadData, const tstring& path, uint64_t& checkpoint)
     {
-        shared_ptr<Figure> targetFigure = nullptr;
-        for (auto figure : figures) {
-            auto distance = figure->GetDistance(point);
-            if (distance < minimumDistance) {
-                minimumDistance = distance;
-                targetFigure    = figure;
-            }
+        const auto file = ::CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER fileSize;
+        string        data;
+        DWORD         readSize = 0;
+        auto          isRead   = ::GetFileSizeEx(file, &fileSize) != FALSE;
+        if (isRead) {
+            data.resize(size_t(fileSize.QuadPart));
+            isRead = data.size() > 0 && ::ReadFile(file, &data[0], DWORD(data.size()), &readSize, nullptr) && readSize == data.size();
+        }
+        ::CloseHandle(file);
+        if (!isRead)
+            return false;
+
+        try {
+            ByteReader    reader(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+            const auto    savedCheckpoint = reader.ReadVarUInt();
+            istringstream stream(data.substr(data.size() - reader.GetRemainingSize()));
+            cadData.Read(stream);
+            checkpoint = savedCheckpoint;
+        } catch (const exception&) {
+            return false;
         }
-        return targetFigure;
+        return true;
     }
 
-    void SelectAll(bool isSelected = true, bool update = true)
+protected:
+    virtual void OnUpdate(void* data)
+    {
+        changeCount++;
+    }
+
+private:
+    Clock::duration GetInterval()
     {
-        for_each(figures.begin(), figures.end(), [&](shared_ptr<Figure> figure) {
-            if (figure->IsSelected() != isSelected) {
-                figure->Select(isSelected);
-                if (update)
-                    Update(figure.get());
+        Clock::duration saveDuration;
+        {
+            lock_guard<mutex> lock(guard);
+            saveDuration = lastSaveDuration;
+        }
+        const Clock::duration byChanges = chrono::milliseconds(maximumInterval) / int64_t(changeCount);
+        return Math::Max(Math::Max(byChanges, saveDuration * saveCostFactor), Clock::duration(chrono::milliseconds(minimumInterval)));
+    }
+
+    // Unique across sessions, and never 0.
+    static uint64_t NewCheckpoint()
+    {
+        static uint64_t lastCheckpoint = 0;
+        lastCheckpoint = Math::Max(lastCheckpoint + 1, uint64_t(chrono::system_clock::now().time_since_epoch().count()));
+        return lastCheckpoint;
+    }
+
+    // Below normal priority, so that on a busy core the worker never takes the UI thread's turn.
+    void SaveLoop()
+    {
+        ::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        unique_lock<mutex> lock(guard);
+        for (;;) {
+            wake.wait(lock, [this] { return pendingSnapshot != nullptr || isClosing; });
+            if (pendingSnapshot == nullptr)
+                return;
+
+            auto       snapshot   = move(pendingSnapshot);
+            const auto checkpoint = pendingCheckpoint;
+            lock.unlock();
+            const auto start = Clock::now();
+            try {
+                Write(*snapshot, checkpoint);
+                if (journal != nullptr)
+                    journal->Compact(checkpoint);
+            } catch (const exception&) {
+                // The last autosave stays as it was, and so does the journal.
             }
-        });
+            snapshot.reset(); // the document changes in place again the figures no other snapshot holds
+            const auto saveDuration = Clock::now() - start;
+            lock.lock();
+
+            lastSaveDuration = saveDuration;
+            isSaving         = false;
+            saved.notify_all();
+        }
     }
 
-    void Do(const vector<UndoData>& undoDataList)
+    void Write(const DocumentSnapshot& snapshot, uint64_t checkpoint)
     {
-        for (auto index = 0U; index < undoDataList.size(); index++)
-            Do(undoDataList[index]);
+        vector<uint8_t> header;
+        ByteWriter(header).WriteVarUInt(checkpoint);
+        ostringstream stream;
+        stream.write(reinterpret_cast<const char*>(header.data()), header.size());
+        CadData::Write(snapshot, stream);
+        const auto data = stream.str();
+
+        const auto temporaryPath = path + _T(".tmp");
+        const auto file          = ::CreateFile(temporaryPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw exception();
+        DWORD      written   = 0;
+        const auto isWritten = ::WriteFile(file, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size() && ::FlushFileBuffers(file);
+        ::CloseHandle(file);
+        if (!isWritten || !::MoveFileEx(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            ::DeleteFile(temporaryPath.c_str());
+            throw exception();
+        }
     }
 
-    void Do(const UndoData& undoData)
+    void Close()
     {
-        switch (undoData.operation) {
-            case UndoData::Add:
-                figures.push_back(undoData.newFigure);
-                Update(undoData.newFigure.get());
-                break;
-            case UndoData::Delete:
-                for (auto index = 0u; index < figures.size(); index++) {
-                    if (figures[index].get() == undoData.oldFigure.get()) {
-                        Update(undoData.oldFigure.get());
-                        figures.erase(figures.begin() + index);
-                        break;
-                    }
-                }
-                //figures.erase(remove(figures.begin(), figures.end(), undoData.oldFigure.get()), figures.end());
-                break;
-            case UndoData::Update:
-                break;
+        if (!worker.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(guard);
+            isClosing = true;
+            wake.notify_one();
         }
+        worker.join();
     }
 };
 
@@ -1601,53 +7301,49 @@ class RubberBandHolder
 {
 public:
 	virtual void DrawFigure(CDC& dc, POINT point) = 0;
+    virtual CRect GetFigureBoundRect(CDC& dc, POINT point) = 0;
 };
 
+// The preview of the figure being dragged out. It is drawn on the view's overlay, and the view repaints its device area when it moves.
 class RubberBand
 {
 	POINT point;
 	bool  hasPoint;
+    CRect area;
 
 	RubberBandHolder& holder;
 
 public:
 	void Set(CDC& dc, POINT point)
 	{
-		if (hasPoint)
-			Erase(dc);
-		else
-			hasPoint = true;
+		hasPoint    = true;
 		this->point = point;
-		Draw(dc);
+        area        = holder.GetFigureBoundRect(dc, point);
+        dc.LPtoDP(area);
+        area        = area.GetInflateRect(1, 1);
 	}
 
 	RubberBand(RubberBandHolder& holder)
-		: hasPoint(false), holder(holder)
+		: hasPoint(false), area(CPoint(), CSize()), holder(holder)
 	{}
 
 	void Draw(CDC& dc)
 	{
-		DrawFigure(dc);
+		if (hasPoint)
+            holder.DrawFigure(dc, point);
 	}
 
-	void Reset(CDC& dc)
+	void Reset()
 	{
-		Erase(dc);
 		hasPoint = false;
+        area     = CRect(CPoint(), CSize());
 	}
 
-private:
-	void Erase(CDC& dc)
-	{
-		DrawFigure(dc);
-	}
-
-	void DrawFigure(CDC& dc)
-	{
-		auto oldDrawMode = dc.SetROP2(R2_NOT);
-        holder.DrawFigure(dc, point);
-		dc.SetROP2(oldDrawMode);
-	}
+    // In device coordinates; empty when there is no preview.
+    const CRect& GetArea() const
+    {
+        return area;
+    }
 };
 
 class CadView;
@@ -1678,6 +7374,17 @@ public:
 
 	virtual void OnDrawRubberBand(CDC& dc, POINT point)
 	{}
+
+    virtual CRect GetRubberBandBoundRect(CDC& dc, POINT point)
+    {
+        return CRect(CPoint(), CSize());
+    }
+
+    // The figure to highlight under the cursor while no button is down; hoveredFigure is the one highlighted now.
+    virtual Figure* GetHoverTarget(CDC& dc, POINT point, Figure* hoveredFigure)
+    {
+        return nullptr;
+    }
 };
 
 class SelectCommand : public Command
@@ -1698,6 +7405,16 @@ public:
         else
             cadData.ToggleSelect(point, logicalSelectingMinimumDistance);
     }
+
+    // The document is searched only once the cursor leaves the hit area of the figure already highlighted.
+    virtual Figure* GetHoverTarget(CDC& dc, POINT point, Figure* hoveredFigure)
+    {
+        auto logicalSelectingMinimumDistance = selectingMinimumDistance;
+        dc.DPtoLP(logicalSelectingMinimumDistance);
+        if (hoveredFigure != nullptr && hoveredFigure->GetDistance(point) < logicalSelectingMinimumDistance)
+            return hoveredFigure;
+        return cadData.Find(point, logicalSelectingMinimumDistance);
+    }
 };
 
 class AddCommand : public Command
@@ -1705,6 +7422,9 @@ class AddCommand : public Command
 protected:
 	POINT        firstPoint;
 
+private:
+    unique_ptr<CPen> previewPen; // kept across frames; recreated only when the current colour changes
+
 public:
 	AddCommand(CadData& cadData, CadView& cadView) : Command(cadData, cadView)
 	{}
@@ -1721,20 +7441,39 @@ public:
 
 	virtual void OnDrawRubberBand(CDC& dc, POINT point)
 	{
-		auto figure = CreateFigure(point);
-		if (figure != nullptr)
-			figure->Draw(dc);
+        SetPreview(point);
+        const auto color = cadData.GetCurrentColor();
+        if (previewPen == nullptr || previewPen->GetColor() != color)
+            previewPen.reset(new CPen(PS_SOLID, 0, color));
+        PenSelector penSelector(dc, *previewPen);
+        DrawPreview(dc);
 	}
 
+    virtual CRect GetRubberBandBoundRect(CDC& dc, POINT point)
+    {
+        SetPreview(point);
+        return GetPreviewBoundRect();
+    }
+
 protected:
 	virtual unique_ptr<Figure> CreateFigure(POINT point) const = 0;
+
+    // The preview is the geometry of the figure CreateFigure would make, updated in place and drawn without a Figure,
+    // so that dragging allocates nothing.
+    virtual void  SetPreview(POINT point) = 0;
+    virtual void  DrawPreview(CDC& dc) const = 0;
+    virtual CRect GetPreviewBoundRect() const = 0;
 };
 
-class CommandManager : public RubberBandHolder, public Uncopyable
+// Long operations run through here too. While one runs the document is its own, so the mouse edits nothing until it ends.
+class CommandManager : public RubberBandHolder, public Observer, public Uncopyable
 {
 	CadData&            cadData;
+    DocumentVersions&   versions;
 	RubberBand          rubberBand;
 	unique_ptr<Command> command;
+    LongOperationRunner operationRunner;
+    bool                isDragRefused;
 
 public:
 	void SetCommand(unique_ptr<Command> command)
@@ -1742,52 +7481,104 @@ public:
 		this->command.reset(command.release());
 	}
 
-	CommandManager(CadData& cadData, CadView& cadView)
-		: cadData(cadData), rubberBand(*this)
+	CommandManager(CadData& cadData, DocumentVersions& versions, CadView& cadView)
+		: cadData(cadData), versions(versions), rubberBand(*this), isDragRefused(false)
 	{
 		command = unique_ptr<Command>(new SelectCommand(cadData, cadView));
+        operationRunner.AddObserver(*this);
 	}
 
+    LongOperationRunner& GetOperationRunner()
+    {
+        return operationRunner;
+    }
+
+    bool IsBusy() const
+    {
+        return operationRunner.IsRunning();
+    }
+
+    void Run(LongOperation operation)
+    {
+        operationRunner.Start(move(operation));
+    }
+
 	void OnDraw(CDC& dc)
 	{
 		rubberBand.Draw(dc);
-		for (auto figure : cadData)
-			figure->Draw(dc);
 	}
 
+    const CRect& GetRubberBandArea() const
+    {
+        return rubberBand.GetArea();
+    }
+
+    Figure* GetHoverTarget(CDC& dc, POINT point, Figure* hoveredFigure)
+    {
+        return command->GetHoverTarget(dc, point, hoveredFigure);
+    }
+
     void OnClick(CDC& dc, UINT keys, POINT point)
     {
+        if (IsBusy())
+            return;
         command->OnClick(dc, keys, point);
+        versions.Publish();
     }
 
+    // A drag started while busy is ignored to its end.
 	void OnDragStart(CDC& dc, POINT point)
 	{
+        isDragRefused = IsBusy();
+        if (isDragRefused)
+            return;
 		command->OnDragStart(dc, point);
 	}
 
     void OnDragging(CDC& dc, POINT point)
     {
+        if (isDragRefused)
+            return;
         command->OnDragging(dc, point);
         rubberBand.Set(dc, point);
     }
 
     void OnDragStop(CDC& dc)
     {
-        rubberBand.Reset(dc);
+        if (isDragRefused)
+            return;
+        rubberBand.Reset();
         command->OnDragStop(dc);
+        versions.Publish();
     }
 
 	void OnDragEnd(CDC& dc, POINT point)
 	{
-		rubberBand.Reset(dc);
+        if (isDragRefused)
+            return;
+		rubberBand.Reset();
 		command->OnDragEnd(dc, point);
+		versions.Publish();
 	}
 
+protected:
+    // A long operation is published once it has ended.
+    virtual void OnUpdate(void* data)
+    {
+        if (!IsBusy())
+            versions.Publish();
+    }
+
 private:
 	virtual void DrawFigure(CDC& dc, POINT point)
 	{
 		command->OnDrawRubberBand(dc, point);
 	}
+
+    virtual CRect GetFigureBoundRect(CDC& dc, POINT point)
+    {
+        return command->GetRubberBandBoundRect(dc, point);
+    }
 };
 
 class MouseEventConverter
@@ -1825,6 +7616,8 @@ public:
                     mouseMovePositions.push_back(point);
                 }
             }
+        } else if (!isDown) {
+            OnHover(point);
         }
     }
 
@@ -1863,6 +7656,9 @@ protected:
     virtual void OnDragStop()
     {}
 
+    virtual void OnHover(POINT point)
+    {}
+
 private:
     void Reset()
     {
@@ -1891,75 +7687,315 @@ public:
         lstrcpy(logFont.lfFaceName, _T("Meiryo"));
     }
 
-    operator const LOGFONT&()
+    operator const LOGFONT&()
+    {
+        return logFont;
+    }
+};
+
+
+const UINT WM_EDITCANCEL = WM_USER + 100;
+
+class Editor : public CEdit
+{
+    unique_ptr<CFont> font;
+    long              logicalFontHeight;
+    RECT              logicalArea;
+
+public:
+    void Set(CDC& dc, tstring text, long logicalFontHeight, const RECT& logicalArea)
+    {
+        this->logicalFontHeight = logicalFontHeight;
+        this->logicalArea       = logicalArea      ;
+        Set(dc, text);
+    }
+
+    void Reset(CDC& dc)
+    {
+        Set(dc, GetText());
+    }
+
+private:
+    void Set(CDC& dc, tstring text)
+    {
+        auto  fontHeight = logicalFontHeight;
+        dc.LPtoDP(fontHeight);
+        CRect area       = logicalArea;
+        dc.LPtoDP(area);
+
+        Set(text, fontHeight, area);
+    }
+
+    void Set(tstring text, long fontHeight, const RECT& area)
+    {
+        StandardLogFont logFont(fontHeight);
+        font.reset(new CFont(logFont));
+
+        SetText(text);
+        CEdit::Set(*font);
+        Move(area);
+        SetFocus();
+        Show();
+    }
+};
+
+// Rendered tiles of the static scene, keyed by zoom and tile position and evicted least recently used first.
+// At a zoom of deviceExtent / logicalExtent, tile (x, y) holds the device pixels [x * tileSize, (x + 1) * tileSize) x [y * tileSize, (y + 1) * tileSize)
+// of the scene mapped with the logical origin at device (0, 0).
+class TileCache : public Uncopyable
+{
+public:
+    static const long tileSize = 256;
+
+    struct Key
+    {
+        long logicalExtent;
+        long deviceExtent;
+        long x;
+        long y;
+
+        Key(long logicalExtent = 1, long deviceExtent = 1, long x = 0, long y = 0)
+            : logicalExtent(logicalExtent), deviceExtent(deviceExtent), x(x), y(y)
+        {}
+
+        bool IsSameZoom(const Key& key) const
+        {
+            return logicalExtent == key.logicalExtent && deviceExtent == key.deviceExtent;
+        }
+
+        double GetScale() const
+        {
+            return double(deviceExtent) / logicalExtent;
+        }
+
+        bool operator <(const Key& key) const
+        {
+            if (logicalExtent != key.logicalExtent)
+                return logicalExtent < key.logicalExtent;
+            if (deviceExtent != key.deviceExtent)
+                return deviceExtent < key.deviceExtent;
+            if (y != key.y)
+                return y < key.y;
+            return x < key.x;
+        }
+
+        // Device pixels of the tile at its zoom.
+        CRect GetArea() const
+        {
+            return CRect(CPoint(x * tileSize, y * tileSize), CSize(tileSize, tileSize));
+        }
+
+        // Maps dc so that the tile's pixels are at device (0, 0) - (tileSize, tileSize).
+        void PrepareDC(CDC& dc) const
+        {
+            dc.SetMapMode(MM_ISOTROPIC);
+            dc.SetWindowOrg  (CPoint());
+            dc.SetWindowExt  (CSize(logicalExtent, logicalExtent));
+            dc.SetViewportOrg(CPoint(-x * tileSize, -y * tileSize));
+            dc.SetViewportExt(CSize(deviceExtent, deviceExtent));
+        }
+    };
+
+private:
+    struct Tile
+    {
+        Key                 key;
+        shared_ptr<CBitmap> bitmap;
+    };
+
+    const size_t                   capacity;
+    list<Tile>                     tiles;     // most recently used first
+    map<Key, list<Tile>::iterator> index;
+
+public:
+    TileCache(size_t capacity) : capacity(capacity)
+    {}
+
+    shared_ptr<CBitmap> Find(const Key& key)
+    {
+        const auto position = index.find(key);
+        if (position == index.end())
+            return nullptr;
+        tiles.splice(tiles.begin(), tiles, position->second);
+        return position->second->bitmap;
+    }
+
+    void Store(const Key& key, shared_ptr<CBitmap> bitmap)
+    {
+        Remove(key);
+        const Tile tile = { key, bitmap };
+        tiles.push_front(tile);
+        index[key] = tiles.begin();
+        while (tiles.size() > capacity) {
+            index.erase(tiles.back().key);
+            tiles.pop_back();
+        }
+    }
+
+    // Drops the tiles at the zoom of key that intersect area (device pixels at that zoom).
+    void Invalidate(const Key& zoom, const CRect& area)
+    {
+        for (auto tile = tiles.begin(); tile != tiles.end(); ) {
+            if (tile->key.IsSameZoom(zoom) && !IsEmpty(tile->key.GetArea().Intersect(area))) {
+                index.erase(tile->key);
+                tile = tiles.erase(tile);
+            } else {
+                ++tile;
+            }
+        }
+    }
+
+    void Clear()
+    {
+        tiles.clear();
+        index.clear();
+    }
+
+    // One key per cached zoom.
+    vector<Key> GetZooms() const
+    {
+        vector<Key> zooms;
+        for (const auto& tile : tiles) {
+            if (find_if(zooms.begin(), zooms.end(), [&](const Key& zoom) { return zoom.IsSameZoom(tile.key); }) == zooms.end())
+                zooms.push_back(Key(tile.key.logicalExtent, tile.key.deviceExtent));
+        }
+        return zooms;
+    }
+
+    // Cached tiles at other zooms than key, farthest zoom first.
+    vector<pair<Key, shared_ptr<CBitmap>>> GetOtherZoomTiles(const Key& zoom) const
+    {
+        vector<pair<Key, shared_ptr<CBitmap>>> result;
+        for (const auto& tile : tiles) {
+            if (!tile.key.IsSameZoom(zoom))
+                result.push_back(make_pair(tile.key, tile.bitmap));
+        }
+        const auto distance = [&](const Key& key) { return ::fabs(::log(key.GetScale() / zoom.GetScale())); };
+        stable_sort(result.begin(), result.end(), [&](const pair<Key, shared_ptr<CBitmap>>& tile1, const pair<Key, shared_ptr<CBitmap>>& tile2) {
+            return distance(tile1.first) > distance(tile2.first);
+        });
+        return result;
+    }
+
+private:
+    void Remove(const Key& key)
+    {
+        const auto position = index.find(key);
+        if (position == index.end())
+            return;
+        tiles.erase(position->second);
+        index.erase(position);
+    }
+
+    static bool IsEmpty(const RECT& area)
     {
-        return logFont;
+        return area.right <= area.left || area.bottom <= area.top;
     }
 };
 
-
-const UINT WM_EDITCANCEL = WM_USER + 100;
-
-class Editor : public CEdit
+// Transient graphics drawn over the scene: selection handles and the highlight of the figure under the cursor.
+// The selected figures are gathered again only after the document or its selection changes.
+class Overlay : public Observer, public SelectionObserver, public Uncopyable
 {
-    unique_ptr<CFont> font;
-    long              logicalFontHeight;
-    RECT              logicalArea;
+    static const COLORREF highlightColor = RGB(0x00, 0x80, 0xff);
+
+    const CadData&  cadData;
+    vector<Figure*> selectedFigures;
+    bool            isSelectionValid;
+    Figure*         hoveredFigure;
 
 public:
-    void Set(CDC& dc, tstring text, long logicalFontHeight, const RECT& logicalArea)
+    static const int highlightWidth = 3; // device pixels
+
+    Overlay(CadData& cadData) : cadData(cadData), isSelectionValid(false), hoveredFigure(nullptr)
     {
-        this->logicalFontHeight = logicalFontHeight;
-        this->logicalArea       = logicalArea      ;
-        Set(dc, text);
+        cadData.AddObserver         (*this);
+        cadData.AddSelectionObserver(*this);
     }
 
-    void Reset(CDC& dc)
+    Figure* GetHoveredFigure() const
     {
-        Set(dc, GetText());
+        return hoveredFigure;
     }
 
-private:
-    void Set(CDC& dc, tstring text)
+    void SetHoveredFigure(Figure* figure)
     {
-        auto  fontHeight = logicalFontHeight;
-        dc.LPtoDP(fontHeight);
-        CRect area       = logicalArea;
-        dc.LPtoDP(area);
+        hoveredFigure = figure;
+    }
 
-        Set(text, fontHeight, area);
+    // Draws what reaches logicalArea.
+    void Draw(CDC& dc, const CRect& logicalArea)
+    {
+        if (!isSelectionValid) {
+            selectedFigures.clear();
+            for (auto figure : cadData) {
+                if (figure->IsSelected())
+                    selectedFigures.push_back(figure.get());
+            }
+            isSelectionValid = true;
+        }
+
+        if (hoveredFigure != nullptr)
+            hoveredFigure->DrawHighlight(dc, highlightColor, highlightWidth);
+        for (auto figure : selectedFigures) {
+            if (!IsEmpty(figure->GetDrawingBoundRect(dc).Intersect(logicalArea)))
+                figure->DrawSelectors(dc);
+        }
     }
 
-    void Set(tstring text, long fontHeight, const RECT& area)
+    virtual void OnUpdate(void* data)
     {
-        StandardLogFont logFont(fontHeight);
-        font.reset(new CFont(logFont));
+        isSelectionValid = false;
+        if (data == nullptr || data == hoveredFigure)
+            hoveredFigure = nullptr;
+    }
 
-        SetText(text);
-        CEdit::Set(*font);
-        Move(area);
-        SetFocus();
-        Show();
+    virtual void OnSelectionUpdate(Figure* figure)
+    {
+        isSelectionValid = false;
+    }
+
+private:
+    static bool IsEmpty(const RECT& area)
+    {
+        return area.right <= area.left || area.bottom <= area.top;
     }
 };
 
-class CadView : public CWnd, public MouseEventConverter, public Observer
+class CadView : public CWnd, public MouseEventConverter, public Observer, public SelectionObserver
 {
-    static const COLORREF backgroundColor = RGB(0xff, 0xff, 0xc0);
-    static const COLORREF paperColor      = RGB(0xff, 0xff, 0xff);
-    static const UINT     editId          = 100;
-
-    CommandManager&   commandManager;
-	CadData&          cadData;
-    CRect             logicalArea;
-
-    Editor            editor;
+    static const COLORREF backgroundColor   = RGB(0xff, 0xff, 0xc0);
+    static const COLORREF paperColor        = RGB(0xff, 0xff, 0xff);
+    static const UINT     editId            = 100;
+    static const UINT_PTR tileTimerId       = 1;
+    static const size_t   tileCacheCapacity = 256; // 64 MB of 32-bit 256 x 256 tiles
+    static const UINT     frameInterval     = 33;  // milliseconds between the frames of progressive rendering
+    static const long     frameBudget       = 20;  // milliseconds of tile rendering per frame
+    static const long     coarseness        = 4;   // zoom out of the tiles drawn first where no cached tile covers
+    static const long     coarseBudget      = 10;  // milliseconds of coarse tile rendering per paint
+
+    CommandManager&        commandManager;
+	CadData&               cadData;
+    CRect                  logicalArea;
+
+    Editor                 editor;
+    const Figure*          editedFigure;       // the text figure the editor writes to when it loses focus
+    DocumentDisplayList    displayList;
+    TileCache              tileCache;
+    vector<TileCache::Key> pendingTiles;       // nearest to the centre first
+    bool                   isRenderingTiles;   // the tile timer is running
+    Overlay                overlay;
+    unique_ptr<CBitmap>    sceneImage;
+    unique_ptr<CBitmap>    frameImage;
+    bool                   isSceneValid;
 
 public:
 	CadView(HINSTANCE hInstance, CadData& cadData, CommandManager& commandManager)
-		: CWnd(hInstance), cadData(cadData), commandManager(commandManager), logicalArea(cadData.GetArea())
+		: CWnd(hInstance), cadData(cadData), commandManager(commandManager), logicalArea(cadData.GetArea()), editedFigure(nullptr), displayList(cadData), tileCache(tileCacheCapacity)
+        , isRenderingTiles(false), overlay(cadData), isSceneValid(false)
 	{
-        cadData.AddObserver(*this);
+        cadData.AddObserver         (*this);
+        cadData.AddSelectionObserver(*this);
     }
 
     bool Create(CWnd* parent)
@@ -1972,11 +8008,25 @@ public:
         SetLogicalArea(cadData.GetArea());
     }
 
-    void SetEdit(tstring text, long fontHeight, const RECT& area)
+    // Edits the text of figure; the text is written to it when the editor loses focus.
+    void SetEdit(const Figure& figure, long fontHeight, const RECT& area)
     {
+        EndEdit();
+        editedFigure = &figure;
         CClientDC dc(*this);
         OnPrepareDC(dc);
-        editor.Set(dc, text, fontHeight, area);
+        editor.Set(dc, figure.GetText(), fontHeight, area);
+    }
+
+    // Fits logicalArea into deviceArea isotropically, centred.
+    static void PrepareDC(CDC& dc, const CRect& logicalArea, const CRect& deviceArea)
+    {
+        dc.SetMapMode(MM_ISOTROPIC);
+        dc.SetWindowOrg  (logicalArea.GetCenter());
+        dc.SetWindowExt  (logicalArea.GetSize  ());
+
+        dc.SetViewportOrg(deviceArea.GetCenter());
+        dc.SetViewportExt(deviceArea.GetSize  ());
     }
 
 protected:
@@ -1989,27 +8039,54 @@ protected:
 
     virtual void OnPrepareDC(CDC& dc)
     {
-        dc.SetMapMode(MM_ISOTROPIC);
-        dc.SetWindowOrg  (logicalArea.GetCenter());
-        dc.SetWindowExt  (logicalArea.GetSize  ());
-
-        auto clientArea = GetClientArea();
-        dc.SetViewportOrg(clientArea.GetCenter());
-        dc.SetViewportExt(clientArea.GetSize  ());
+        PrepareDC(dc, logicalArea, GetClientArea());
     }
     
+    // Composes the scene image and the overlay off screen. The scene image is redrawn from the tiles only after the view or
+    // the document changes, so dragging and hovering repaint just the areas of the overlay that moved.
     virtual void OnDraw(CDC& dc)
 	{
-        DrawPaper(dc);
-        commandManager.OnDraw(dc);
-		for (auto figure : cadData)
-			figure->Draw(dc);
+        const auto clientArea = GetClientArea();
+        if (clientArea.GetSize().cx <= 0 || clientArea.GetSize().cy <= 0)
+            return;
+        if (sceneImage == nullptr || sceneImage->GetSize().cx != clientArea.GetSize().cx || sceneImage->GetSize().cy != clientArea.GetSize().cy) {
+            sceneImage.reset(new CBitmap(dc, clientArea.GetSize()));
+            frameImage.reset(new CBitmap(dc, clientArea.GetSize()));
+            isSceneValid = false;
+        }
+
+        CMemoryDC                sceneDC(dc);
+        CGdiObjSelector<CBitmap> sceneSelector(sceneDC, *sceneImage, false);
+        if (!isSceneValid) {
+            sceneDC.FillRect(clientArea, backgroundColor);
+            OnPrepareDC(sceneDC);
+            DrawTiles(sceneDC);
+            SetDeviceMapping(sceneDC);
+            isSceneValid = true;
+        }
+
+        const auto savedDC = dc.SaveDC();
+        SetDeviceMapping(dc);
+        const auto paintArea = dc.GetClipBox().Intersect(clientArea);
+
+        CMemoryDC                frameDC(dc);
+        CGdiObjSelector<CBitmap> frameSelector(frameDC, *frameImage, false);
+        frameDC.BitBlt(paintArea, sceneDC, paintArea.GetTopLeft());
+        OnPrepareDC(frameDC);
+        CPoint topLeft = paintArea.GetTopLeft(), bottomRight = paintArea.GetBottomRight();
+        frameDC.DPtoLP(topLeft    );
+        frameDC.DPtoLP(bottomRight);
+        overlay.Draw(frameDC, CRect(topLeft, bottomRight));
+        commandManager.OnDraw(frameDC);
+        SetDeviceMapping(frameDC);
+
+        dc.BitBlt(paintArea, frameDC, paintArea.GetTopLeft());
+        dc.RestoreDC(savedDC);
 	}
 
+    // The frame covers the whole client area.
 	virtual void OnEraseBackground(CDC& dc)
-	{
-		dc.FillRect(GetClientArea(), backgroundColor);
-	}
+	{}
 
 	virtual void OnLButtonDown(UINT keys, POINT point)
 	{
@@ -2029,6 +8106,9 @@ protected:
     virtual void OnMouseLeave()
     {
         MouseEventConverter::OnMouseLeave();
+        CClientDC dc(*this);
+        OnPrepareDC(dc);
+        SetHoveredFigure(dc, nullptr);
     }
 
     virtual void OnMouseWheel(UINT keys, double delta, POINT point)
@@ -2109,18 +8189,70 @@ protected:
 
     virtual LRESULT OnCommand(UINT notificationCode, int commandId)
     {
-        if (commandId == editId && notificationCode == EN_KILLFOCUS) {
-            int a = 1;
-        }
+        if (commandId == editId && notificationCode == EN_KILLFOCUS)
+            EndEdit();
         return 0;
     }
 
+    // A frame of progressive rendering: renders the pending tiles for a frame's budget, then repaints. The message loop runs
+    // between frames, so input is never held up by more than one budget.
+    virtual void OnTimer(UINT_PTR timerId)
+    {
+        if (timerId != tileTimerId)
+            return;
+
+        const auto zoom = GetZoom();
+        pendingTiles.erase(remove_if(pendingTiles.begin(), pendingTiles.end(), [&](const TileCache::Key& key) { return !key.IsSameZoom(zoom); }), pendingTiles.end());
+        if (pendingTiles.size() > 0) {
+            CClientDC dc(*this);
+            pendingTiles.erase(pendingTiles.begin(), pendingTiles.begin() + RenderTiles(dc, pendingTiles, frameBudget));
+            isSceneValid = false;
+            Invalidate(nullptr, false);
+        }
+        if (pendingTiles.size() == 0)
+            StopRenderingTiles();
+    }
+
     virtual void OnUpdate(void* data)
     {
-        if (data == nullptr)
+        isSceneValid = false;
+        if (data == nullptr) {
+            tileCache.Clear();
             Invalidate();
-        else
+        } else {
             OnUpdate(*static_cast<Figure*>(data));
+        }
+    }
+
+    // A figure that leaves the document is no longer edited.
+    virtual void OnRemoved(void* data)
+    {
+        if (data == editedFigure)
+            CancelEdit();
+        OnUpdate(data);
+    }
+
+    // Only the tiles over the area are dropped, on every zoom; the rest stay cached.
+    virtual void OnAreaUpdate(const RECT& area)
+    {
+        isSceneValid = false;
+        CClientDC dc(*this);
+        InvalidateTiles(dc, area);
+        OnPrepareDC(dc);
+        const auto drawingBoundRect = ViewportClipper(dc).ToDevice(Figure::GetDrawingBoundRect(dc, area));
+        Invalidate(&drawingBoundRect);
+    }
+
+    // Only the overlay changes; the tiles and the scene image stay.
+    virtual void OnSelectionUpdate(Figure* figure)
+    {
+        if (figure == nullptr) {
+            Invalidate(nullptr, false);
+        } else {
+            CClientDC dc(*this);
+            OnPrepareDC(dc);
+            InvalidateOverlay(dc, *figure);
+        }
     }
 
 protected:
@@ -2136,31 +8268,50 @@ protected:
         commandManager.OnDragStart(*dc, point);
     }
 
+    // Runs for every mouse move of a drag, so the DC stays on the stack.
     virtual void OnDragging(POINT point)
     {
-        auto dc = DPtoLP(point);
+        CClientDC dc(*this);
+        OnPrepareDC(dc);
+        dc.DPtoLP(point);
         DebugOutput(_T("CadView::OnDragging"), point);
-        commandManager.OnDragging(*dc, point);
+        const auto oldArea = commandManager.GetRubberBandArea();
+        commandManager.OnDragging(dc, point);
+        InvalidateOverlay(oldArea);
+        InvalidateOverlay(commandManager.GetRubberBandArea());
     }
 
     virtual void OnDragEnd(POINT point)
     {
         auto dc = DPtoLP(point);
+        const auto oldArea = commandManager.GetRubberBandArea();
         commandManager.OnDragEnd(*dc, point);
+        InvalidateOverlay(oldArea);
     }
 
     virtual void OnDragStop()
     {
         CClientDC dc(*this);
         OnPrepareDC(dc);
+        const auto oldArea = commandManager.GetRubberBandArea();
         commandManager.OnDragStop(dc);
+        InvalidateOverlay(oldArea);
+    }
+
+    virtual void OnHover(POINT point)
+    {
+        auto dc = DPtoLP(point);
+        SetHoveredFigure(*dc, commandManager.GetHoverTarget(*dc, point, overlay.GetHoveredFigure()));
     }
 
 private:
+    // Cancels the frame in flight; the next paint starts one for the new view.
     void SetLogicalArea(const CRect& area)
     {
-        logicalArea = area;
-        logicalArea = logicalArea.Intersect(cadData.GetArea());
+        StopRenderingTiles();
+        logicalArea  = area;
+        logicalArea  = logicalArea.Intersect(cadData.GetArea());
+        isSceneValid = false;
         SetScrollBar();
         ResetEditor ();
         Invalidate  ();
@@ -2168,11 +8319,28 @@ private:
 
     void ResetEditor()
     {
+        if (editedFigure == nullptr)
+            return;
         CClientDC dc(*this);
         OnPrepareDC(dc);
         editor.Reset(dc);
     }
 
+    void EndEdit()
+    {
+        const auto figure = editedFigure;
+        if (figure == nullptr)
+            return;
+        CancelEdit();
+        cadData.SetText(*figure, editor.GetText());
+    }
+
+    void CancelEdit()
+    {
+        editedFigure = nullptr;
+        editor.Show(SW_HIDE);
+    }
+
     void SetScrollBar()
     {
         SetHorizontalScrollBar();
@@ -2225,6 +8393,39 @@ private:
     //    return dc.LPtoDP(point);
     //}
 
+    // Maps logical units one to one onto device pixels.
+    static void SetDeviceMapping(CDC& dc)
+    {
+        dc.SetMapMode    (MM_TEXT );
+        dc.SetWindowOrg  (CPoint());
+        dc.SetViewportOrg(CPoint());
+    }
+
+    void SetHoveredFigure(CDC& dc, Figure* figure)
+    {
+        const auto oldFigure = overlay.GetHoveredFigure();
+        if (figure == oldFigure)
+            return;
+        overlay.SetHoveredFigure(figure);
+        if (oldFigure != nullptr)
+            InvalidateOverlay(dc, *oldFigure);
+        if (figure != nullptr)
+            InvalidateOverlay(dc, *figure);
+    }
+
+    // Repaints the overlay over the figure, its handles and highlight included; dc is prepared.
+    void InvalidateOverlay(CDC& dc, Figure& figure)
+    {
+        const auto area = ViewportClipper(dc).ToDevice(figure.GetDrawingBoundRect(dc));
+        InvalidateOverlay(area.GetInflateRect(Overlay::highlightWidth, Overlay::highlightWidth));
+    }
+
+    void InvalidateOverlay(const CRect& deviceArea)
+    {
+        if (deviceArea.GetSize().cx > 0 && deviceArea.GetSize().cy > 0)
+            Invalidate(&deviceArea, false);
+    }
+
     void DrawPaper(CDC& dc)
     {
         dc.FillRect(cadData.GetArea(), paperColor);
@@ -2232,12 +8433,212 @@ private:
         dc.Rectangle(cadData.GetArea());
     }
 
+    // The isotropic mapping of OnPrepareDC as a tile zoom; GDI uses the smaller of the two axis scales.
+    TileCache::Key GetZoom() const
+    {
+        const auto deviceSize  = GetClientArea().GetSize();
+        const auto logicalSize = logicalArea.GetSize();
+        return int64_t(deviceSize.cx) * logicalSize.cy <= int64_t(deviceSize.cy) * logicalSize.cx
+               ? TileCache::Key(logicalSize.cx, deviceSize.cx)
+               : TileCache::Key(logicalSize.cy, deviceSize.cy);
+    }
+
+    // Blits the cached tiles of the visible area. Unless a frame is in flight, missing tiles are rendered for a frame's budget,
+    // nearest to the centre first. The rest are covered with scaled tiles of other zooms, with coarse tiles rendered where none
+    // reach, and left to progressive rendering on the timer.
+    void DrawTiles(CDC& dc)
+    {
+        const auto clientArea = GetClientArea();
+        if (clientArea.GetSize().cx <= 0 || clientArea.GetSize().cy <= 0 || logicalArea.GetSize().cx <= 0 || logicalArea.GetSize().cy <= 0)
+            return;
+
+        const auto zoom = GetZoom();
+        CPoint     origin;
+        dc.LPtoDP(origin);
+
+        vector<TileCache::Key> missingTiles;
+        for (auto y = GetTileIndex(clientArea.top - origin.y); y <= GetTileIndex(clientArea.bottom - 1 - origin.y); y++) {
+            for (auto x = GetTileIndex(clientArea.left - origin.x); x <= GetTileIndex(clientArea.right - 1 - origin.x); x++) {
+                const TileCache::Key key(zoom.logicalExtent, zoom.deviceExtent, x, y);
+                if (tileCache.Find(key) == nullptr)
+                    missingTiles.push_back(key);
+            }
+        }
+        const auto center   = clientArea.GetCenter() - origin;
+        const auto distance = [&](const TileCache::Key& key) { return Math::Square(double(key.GetArea().GetCenter().x - center.cx)) + Math::Square(double(key.GetArea().GetCenter().y - center.cy)); };
+        sort(missingTiles.begin(), missingTiles.end(), [&](const TileCache::Key& key1, const TileCache::Key& key2) { return distance(key1) < distance(key2); });
+
+        const auto savedDC = dc.SaveDC();
+        SetDeviceMapping(dc);
+
+        if (!isRenderingTiles && missingTiles.size() > 0)
+            missingTiles.erase(missingTiles.begin(), missingTiles.begin() + RenderTiles(dc, missingTiles, frameBudget));
+        if (missingTiles.size() > 0) {
+            const auto uncoveredTiles = DrawOtherZoomTiles(dc, zoom, origin, missingTiles);
+            if (uncoveredTiles.size() > 0) {
+                RenderCoarseTiles(dc, zoom, uncoveredTiles);
+                DrawOtherZoomTiles(dc, zoom, origin, uncoveredTiles);
+            }
+        }
+
+        CMemoryDC tileDC(dc);
+        for (auto y = GetTileIndex(clientArea.top - origin.y); y <= GetTileIndex(clientArea.bottom - 1 - origin.y); y++) {
+            for (auto x = GetTileIndex(clientArea.left - origin.x); x <= GetTileIndex(clientArea.right - 1 - origin.x); x++) {
+                const TileCache::Key key(zoom.logicalExtent, zoom.deviceExtent, x, y);
+                auto bitmap = tileCache.Find(key);
+                if (bitmap == nullptr)
+                    continue;
+                CGdiObjSelector<CBitmap> selector(tileDC, *bitmap, false);
+                const auto area = key.GetArea();
+                dc.BitBlt(CRect(CPoint(origin.x + area.left, origin.y + area.top), area.GetSize()), tileDC, CPoint());
+            }
+        }
+        dc.RestoreDC(savedDC);
+
+        pendingTiles = missingTiles;
+        if (pendingTiles.size() > 0 && !isRenderingTiles) {
+            SetTimer(tileTimerId, frameInterval);
+            isRenderingTiles = true;
+        }
+    }
+
+    void StopRenderingTiles()
+    {
+        if (isRenderingTiles)
+            KillTimer(tileTimerId);
+        isRenderingTiles = false;
+        pendingTiles.clear();
+    }
+
+    // Stretches the cached tiles of other zooms over the missing tiles (dc in device units) and returns the missing tiles none of them reached.
+    vector<TileCache::Key> DrawOtherZoomTiles(CDC& dc, const TileCache::Key& zoom, CPoint origin, const vector<TileCache::Key>& missingTiles)
+    {
+        vector<bool> isCovered(missingTiles.size(), false);
+        if (missingTiles.size() > 0) {
+            const auto clientArea = GetClientArea();
+            CMemoryDC  tileDC(dc);
+            for (const auto& tile : tileCache.GetOtherZoomTiles(zoom)) {
+                const auto ratio  = zoom.GetScale() / tile.first.GetScale();
+                const auto area   = tile.first.GetArea();
+                const auto left   = origin.x + area.left   * ratio, top    = origin.y + area.top    * ratio;
+                const auto right  = origin.x + area.right  * ratio, bottom = origin.y + area.bottom * ratio;
+                if (right - left < 1.0 || right <= clientArea.left || bottom <= clientArea.top || left >= clientArea.right || top >= clientArea.bottom)
+                    continue;
+
+                const CRect deviceArea(CPoint(Math::Round(left), Math::Round(top)), CPoint(Math::Round(right), Math::Round(bottom)));
+                CGdiObjSelector<CBitmap> selector(tileDC, *tile.second, false);
+                dc.StretchBlt(deviceArea, tileDC, CRect(CPoint(), tile.second->GetSize()));
+
+                for (size_t index = 0; index < missingTiles.size(); index++) {
+                    const auto missingArea = missingTiles[index].GetArea();
+                    if (deviceArea.left < origin.x + missingArea.right && deviceArea.right  > origin.x + missingArea.left &&
+                        deviceArea.top  < origin.y + missingArea.bottom && deviceArea.bottom > origin.y + missingArea.top)
+                        isCovered[index] = true;
+                }
+            }
+        }
+
+        vector<TileCache::Key> uncoveredTiles;
+        for (size_t index = 0; index < missingTiles.size(); index++) {
+            if (!isCovered[index])
+                uncoveredTiles.push_back(missingTiles[index]);
+        }
+        return uncoveredTiles;
+    }
+
+    // Renders keys in order until budget milliseconds have passed, at least one; returns how many were rendered.
+    size_t RenderTiles(const CDC& dc, const vector<TileCache::Key>& keys, long budget)
+    {
+        const auto start = chrono::steady_clock::now();
+        size_t     count = 0;
+        while (count < keys.size()) {
+            RenderTile(dc, keys[count++]);
+            if (chrono::steady_clock::now() - start >= chrono::milliseconds(budget))
+                break;
+        }
+        return count;
+    }
+
+    // Renders the tiles at 1 / coarseness of zoom that lie under tiles for the coarse budget, in the order of tiles; at that zoom
+    // most figures are drawn as a few pixels, and each tile stands in for coarseness x coarseness tiles. The next paint goes on.
+    void RenderCoarseTiles(const CDC& dc, const TileCache::Key& zoom, const vector<TileCache::Key>& tiles)
+    {
+        const TileCache::Key coarseZoom(zoom.logicalExtent, Math::Max(zoom.deviceExtent / coarseness, 1L));
+        if (coarseZoom.IsSameZoom(zoom))
+            return;
+
+        const auto             ratio = coarseZoom.GetScale() / zoom.GetScale();
+        vector<TileCache::Key> coarseTiles;
+        for (const auto& tile : tiles) {
+            const auto area = tile.GetArea();
+            for (auto y = GetTileIndex(long(::floor(area.top * ratio))); y <= GetTileIndex(long(::floor((area.bottom - 1) * ratio))); y++) {
+                for (auto x = GetTileIndex(long(::floor(area.left * ratio))); x <= GetTileIndex(long(::floor((area.right - 1) * ratio))); x++) {
+                    const TileCache::Key key(coarseZoom.logicalExtent, coarseZoom.deviceExtent, x, y);
+                    if (find_if(coarseTiles.begin(), coarseTiles.end(), [&](const TileCache::Key& coarseTile) { return !(coarseTile < key) && !(key < coarseTile); }) == coarseTiles.end() &&
+                        tileCache.Find(key) == nullptr)
+                        coarseTiles.push_back(key);
+                }
+            }
+        }
+        if (coarseTiles.size() > 0)
+            RenderTiles(dc, coarseTiles, coarseBudget);
+    }
+
+    // Renders a tile from the display list, drawing only the primitives that reach it.
+    void RenderTile(const CDC& dc, const TileCache::Key& key)
+    {
+        auto      bitmap = shared_ptr<CBitmap>(new CBitmap(dc, CSize(TileCache::tileSize, TileCache::tileSize)));
+        CMemoryDC tileDC(dc);
+        {
+            CGdiObjSelector<CBitmap> selector(tileDC, *bitmap, false);
+            const CRect tileArea(CPoint(), bitmap->GetSize());
+            tileDC.FillRect(tileArea, backgroundColor);
+            key.PrepareDC(tileDC);
+            DrawPaper(tileDC);
+
+            CPoint topLeft = tileArea.GetTopLeft(), bottomRight = tileArea.GetBottomRight();
+            tileDC.DPtoLP(topLeft    );
+            tileDC.DPtoLP(bottomRight);
+            PixelCoverage coverage(tileArea);
+            displayList.Get().Draw(tileDC, coverage, CRect(topLeft, bottomRight));
+            coverage.Flush(tileDC);
+        }
+        tileCache.Store(key, bitmap);
+    }
+
+    // Drops the cached tiles of every zoom that the figure is drawn on.
+    void InvalidateTiles(const CDC& dc, Figure& figure)
+    {
+        for (const auto& zoom : tileCache.GetZooms()) {
+            CMemoryDC mappingDC(dc);
+            zoom.PrepareDC(mappingDC);
+            const auto bounds = ViewportClipper(mappingDC).ToDevice(figure.GetDrawingBoundRect(mappingDC));
+            tileCache.Invalidate(zoom, bounds.GetInflateRect(1, 1));
+        }
+    }
+
+    // Drops the cached tiles of every zoom that figures within area may be drawn on.
+    void InvalidateTiles(const CDC& dc, const CRect& area)
+    {
+        for (const auto& zoom : tileCache.GetZooms()) {
+            CMemoryDC mappingDC(dc);
+            zoom.PrepareDC(mappingDC);
+            const auto bounds = ViewportClipper(mappingDC).ToDevice(Figure::GetDrawingBoundRect(mappingDC, area));
+            tileCache.Invalidate(zoom, bounds.GetInflateRect(1, 1));
+        }
+    }
+
+    static long GetTileIndex(long pixel)
+    {
+        return pixel >= 0 ? pixel / TileCache::tileSize : -((TileCache::tileSize - 1 - pixel) / TileCache::tileSize);
+    }
+
     void OnUpdate(Figure& figure)
     {
         CClientDC dc(*this);
+        InvalidateTiles(dc, figure);
         OnPrepareDC(dc);
-        auto      drawingBoundRect = figure.GetDrawingBoundRect(dc);
-        dc.LPtoDP(drawingBoundRect);
+        const auto drawingBoundRect = ViewportClipper(dc).ToDevice(figure.GetDrawingBoundRect(dc));
         Invalidate(&drawingBoundRect);
     }
 
@@ -2259,11 +8660,249 @@ private:
 #endif // _DEBUG
 };
 
+// Figures sorted by the top of their drawing bounds, for finding the figures that intersect a horizontal band.
+// An implicit binary tree over that order keeps the greatest bottom under each node, so a query skips every run of figures
+// that ends above the band, and one tall figure such as a page frame costs a single path instead of a scan of the document.
+class VerticalFigureIndex
+{
+    struct Entry
+    {
+        long   top;
+        long   bottom;
+        size_t index;
+
+        bool operator <(const Entry& entry) const
+        {
+            return top < entry.top;
+        }
+    };
+
+    vector<Figure*> figures;
+    vector<Entry>   entries;
+    vector<long>    maximumBottoms; // node 1 is the root, node n has children 2n and 2n + 1, and leaves start at leafCount
+    size_t          leafCount;
+
+public:
+    VerticalFigureIndex(const DocumentSnapshot& snapshot, CDC& dc) : leafCount(1)
+    {
+        for (const auto& figure : snapshot) {
+            const auto bounds = figure->GetDrawingBoundRect(dc);
+            const Entry entry = { bounds.top, bounds.bottom, figures.size() };
+            entries.push_back(entry);
+            figures.push_back(figure.get());
+        }
+        sort(entries.begin(), entries.end());
+
+        while (leafCount < entries.size())
+            leafCount *= 2;
+        maximumBottoms.assign(leafCount * 2, LONG_MIN);
+        for (size_t entry = 0; entry < entries.size(); entry++)
+            maximumBottoms[leafCount + entry] = entries[entry].bottom;
+        for (auto node = leafCount - 1; node > 0; node--)
+            maximumBottoms[node] = Math::Max(maximumBottoms[node * 2], maximumBottoms[node * 2 + 1]);
+    }
+
+    // Figures whose bounds intersect [top, bottom], in document order.
+    void Query(long top, long bottom, vector<Figure*>& result) const
+    {
+        const Entry highest = { bottom, 0, 0 };
+        const auto  end     = size_t(upper_bound(entries.begin(), entries.end(), highest) - entries.begin());
+        vector<size_t> indices;
+        Collect(1, 0, leafCount, end, top, indices);
+        sort(indices.begin(), indices.end());
+
+        result.clear();
+        for (auto index : indices)
+            result.push_back(figures[index]);
+    }
+
+private:
+    // Entries below end under node, which covers [first, last), that reach down to top.
+    void Collect(size_t node, size_t first, size_t last, size_t end, long top, vector<size_t>& indices) const
+    {
+        if (first >= end || maximumBottoms[node] < top)
+            return;
+        if (node >= leafCount) {
+            indices.push_back(entries[first].index);
+            return;
+        }
+        const auto middle = (first + last) / 2;
+        Collect(node * 2    , first , middle, end, top, indices);
+        Collect(node * 2 + 1, middle, last  , end, top, indices);
+    }
+};
+
+// Renders a document into a software render target as square tiles drawn concurrently.
+// Each figure is binned into the tiles its drawing bounds overlap, and each tile draws its bin in document order
+// through a view of the target clipped to the tile, so no two workers ever write the same pixel.
+class TiledRasterizer
+{
+public:
+    static const long defaultTileSize = 256;
+
+    static void Render(const DocumentSnapshot& snapshot, const CRect& logicalArea, CRasterDC& dc, long tileSize = defaultTileSize, TaskScheduler& scheduler = TaskScheduler::Get())
+    {
+        CadView::PrepareDC(dc, logicalArea, CRect(CPoint(), CSize(dc.GetWidth(), dc.GetHeight())));
+
+        tileSize          = Math::Max(tileSize, 1L);
+        const CSize tileCount((dc.GetWidth() + tileSize - 1) / tileSize, (dc.GetHeight() + tileSize - 1) / tileSize);
+        const auto  bins  = Bin(snapshot, dc, tileSize, tileCount);
+
+        // A tile per task: a dense cluster of figures makes its tiles far costlier than the rest, and stealing evens that out.
+        scheduler.ParallelFor(0, bins.size(), 1, [&](size_t firstTile, size_t lastTile) {
+            for (auto tile = firstTile; tile < lastTile; tile++) {
+                const CPoint    tileTopLeft(long(tile % tileCount.cx) * tileSize, long(tile / tileCount.cx) * tileSize);
+                const CRect     tileArea(tileTopLeft, CSize(tileSize, tileSize));
+                CRasterDC       tileDC(dc, tileArea);
+                PixelCoverage   coverage(tileArea.Intersect(CRect(CPoint(), CSize(dc.GetWidth(), dc.GetHeight()))));
+                for (auto figure : bins[tile])
+                    figure->Draw(tileDC, coverage);
+                coverage.Flush(tileDC);
+            }
+        });
+    }
+
+private:
+    static vector<vector<Figure*>> Bin(const DocumentSnapshot& snapshot, CRasterDC& dc, long tileSize, CSize tileCount)
+    {
+        vector<vector<Figure*>> bins(size_t(tileCount.cx) * tileCount.cy);
+        const ViewportClipper   clipper(dc);
+        for (const auto& figure : snapshot) {
+            const auto bounds = clipper.ToDevice(figure->GetDrawingBoundRect(dc)).GetInflateRect(1, 1);
+            if (bounds.right < 0 || bounds.bottom < 0)
+                continue;
+
+            const auto left   = Math::Max(bounds.left / tileSize, 0L);
+            const auto top    = Math::Max(bounds.top  / tileSize, 0L);
+            const auto right  = Math::Min(bounds.right  / tileSize, tileCount.cx - 1);
+            const auto bottom = Math::Min(bounds.bottom / tileSize, tileCount.cy - 1);
+            for (auto y = top; y <= bottom; y++) {
+                for (auto x = left; x <= right; x++)
+                    bins[size_t(y) * tileCount.cx + x].push_back(figure.get());
+            }
+        }
+        return bins;
+    }
+};
+
+// Headless rendering of a document through the software render target.
+class RasterExporter
+{
+    static const long     bandHeight             = 256;
+    static const unsigned bandCount              = 8;
+    static const long     maximumWholePixelCount = 2048 * 2048; // a larger output is rendered in bands
+
+public:
+    // Throws on failure, and leaves no file behind.
+    static void ExportPngFile(const DocumentSnapshot& snapshot, const CRect& logicalArea, SIZE size, const tstring& path)
+    {
+        ostringstream stream;
+        if (int64_t(size.cx) * size.cy <= maximumWholePixelCount)
+            ExportPng(snapshot, logicalArea, size, stream);
+        else
+            ExportPngBanded(snapshot, logicalArea, size, bandHeight, bandCount, stream);
+        const auto data = stream.str();
+
+        const auto file = ::CreateFile(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw exception();
+        DWORD      written   = 0;
+        const auto isWritten = ::WriteFile(file, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size();
+        ::CloseHandle(file);
+        if (!isWritten) {
+            ::DeleteFile(path.c_str());
+            throw exception();
+        }
+    }
+
+    static void Render(const DocumentSnapshot& snapshot, const CRect& logicalArea, CRasterDC& dc)
+    {
+        const CRect outputArea(CPoint(), CSize(dc.GetWidth(), dc.GetHeight()));
+        CadView::PrepareDC(dc, logicalArea, outputArea);
+
+        DisplayList displayList;
+        for (const auto& figure : snapshot)
+            figure->Compile(displayList);
+
+        CPoint topLeft = outputArea.GetTopLeft(), bottomRight = outputArea.GetBottomRight();
+        dc.DPtoLP(topLeft    );
+        dc.DPtoLP(bottomRight);
+        PixelCoverage coverage(outputArea);
+        displayList.Draw(dc, coverage, CRect(topLeft, bottomRight));
+        coverage.Flush(dc);
+    }
+
+    static void ExportPng(const DocumentSnapshot& snapshot, const CRect& logicalArea, SIZE size, ostream& stream)
+    {
+        CRasterDC dc(size);
+        TiledRasterizer::Render(snapshot, logicalArea, dc);
+
+        PngWriter pngWriter(stream, uint32_t(size.cx), uint32_t(size.cy));
+        for (long y = 0; y < size.cy; y++)
+            pngWriter.WriteRow(dc.GetRow(y));
+    }
+
+    // Renders the output as horizontal bands of bandHeight rows, bandCount bands at a time, and streams them to the encoder.
+    // Peak raster memory is bandCount * bandHeight * width pixels whatever the output size.
+    static void ExportPngBanded(const DocumentSnapshot& snapshot, const CRect& logicalArea, SIZE size, long bandHeight, unsigned bandCount, ostream& stream)
+    {
+        const CRect outputArea(CPoint(), size);
+        CRasterDC   mappingDC(CSize(1, 1));
+        CadView::PrepareDC(mappingDC, logicalArea, outputArea);
+        const VerticalFigureIndex index(snapshot, mappingDC);
+
+        bandHeight = Math::Max(bandHeight, 1L);
+        bandCount  = Math::Max(bandCount, 1U);
+        PngWriter pngWriter(stream, uint32_t(size.cx), uint32_t(size.cy));
+        for (long top = 0; top < size.cy; top += bandHeight * long(bandCount)) {
+            vector<unique_ptr<CRasterDC>> bands;
+            for (auto bandTop = top; bandTop < Math::Min(top + bandHeight * long(bandCount), size.cy); bandTop += bandHeight)
+                bands.push_back(unique_ptr<CRasterDC>(new CRasterDC(CSize(size.cx, Math::Min(bandHeight, size.cy - bandTop)))));
+            TaskScheduler::Get().ParallelFor(0, bands.size(), 1, [&](size_t firstBand, size_t lastBand) {
+                for (auto band = firstBand; band < lastBand; band++)
+                    RenderBand(index, logicalArea, outputArea, top + long(band) * bandHeight, *bands[band]);
+            });
+            for (const auto& band : bands) {
+                for (long y = 0; y < band->GetHeight(); y++)
+                    pngWriter.WriteRow(band->GetRow(y));
+            }
+        }
+    }
+
+private:
+    static void RenderBand(const VerticalFigureIndex& index, const CRect& logicalArea, const CRect& outputArea, long bandTop, CRasterDC& band)
+    {
+        // Shift the origin after centering so the band maps exactly like the whole output does.
+        CadView::PrepareDC(band, logicalArea, outputArea);
+        const auto center = outputArea.GetCenter();
+        band.SetViewportOrg(CPoint(center.x, center.y - bandTop));
+
+        CPoint top(0, -1), bottom(0, band.GetHeight());
+        band.DPtoLP(top   );
+        band.DPtoLP(bottom);
+
+        vector<Figure*> figures;
+        index.Query(Math::Min(top.y, bottom.y), Math::Max(top.y, bottom.y), figures);
+        PixelCoverage coverage(CRect(CPoint(), CSize(band.GetWidth(), band.GetHeight())));
+        for (auto figure : figures)
+            figure->Draw(band, coverage);
+        coverage.Flush(band);
+    }
+};
+
 } // namespace CadCore
 
 namespace Application {
 using namespace CadCore;
 
+class FigureKind
+{
+public:
+    enum : uint32_t {
+        Line = 1, Rectangle, Ellipse, Text
+    };
+};
+
 class LineFigure : public Figure
 {
     CLine position;
@@ -2286,9 +8925,46 @@ public:
         return unique_ptr<Figure>(new LineFigure(*this));
     }
 
+    virtual uint32_t GetKind() const
+    {
+        return FigureKind::Line;
+    }
+
+    virtual size_t GetMemorySize() const
+    {
+        return sizeof(*this);
+    }
+
+    virtual void Offset(const SIZE& offset)
+    {
+        position.Offset(offset);
+    }
+
+    virtual void Transform(const AxisTransform& transform)
+    {
+        position = transform.Map(position);
+    }
+
+    virtual CLine GetPlacement() const
+    {
+        return position;
+    }
+
+    virtual void SetPlacement(const CLine& placement)
+    {
+        position = placement;
+    }
+
+    static unique_ptr<Figure> Read(FigureColumnReader& reader)
+    {
+        auto start = reader.ReadPoint();
+        auto end   = reader.ReadPoint();
+        return unique_ptr<Figure>(new LineFigure(CLine(start, end)));
+    }
+
 	virtual void DrawShape(CDC& dc)
 	{
-        dc.Draw(position);
+        ViewportClipper::DrawLine(dc, position);
 	}
 
     virtual long GetDistance(CPoint point)
@@ -2296,6 +8972,11 @@ public:
         return position.GetDistance(point);
     }
 
+    virtual CRect GetBoundRect()
+    {
+        return CRect(position.start, position.end);
+    }
+
     virtual vector<CPoint> GetPoints()
     {
         vector<CPoint> points;
@@ -2303,6 +8984,27 @@ public:
         points.push_back(position.end  );
         return points;
     }
+
+protected:
+    virtual void DrawSimplified(CDC& dc, PixelCoverage& coverage, const CRect& deviceBounds)
+    {
+        auto start = position.start;
+        auto end   = position.end  ;
+        dc.LPtoDP(start);
+        dc.LPtoDP(end  );
+        coverage.DrawLine(start, end, GetColor());
+    }
+
+    virtual void CompileShape(DisplayList& displayList) const
+    {
+        displayList.AddLine(this, GetColor(), position.start, position.end);
+    }
+
+    virtual void WriteShape(FigureColumns& columns) const
+    {
+        columns.WritePoint(position.start);
+        columns.WritePoint(position.end  );
+    }
 };
 
 class RectangleFigure : public Figure
@@ -2327,9 +9029,46 @@ public:
         return unique_ptr<Figure>(new RectangleFigure(*this));
     }
 
+    virtual uint32_t GetKind() const
+    {
+        return FigureKind::Rectangle;
+    }
+
+    virtual size_t GetMemorySize() const
+    {
+        return sizeof(*this);
+    }
+
+    virtual void Offset(const SIZE& offset)
+    {
+        position.Offset(offset);
+    }
+
+    virtual void Transform(const AxisTransform& transform)
+    {
+        position = transform.Map(position);
+    }
+
+    virtual CLine GetPlacement() const
+    {
+        return CLine(position.GetTopLeft(), position.GetBottomRight());
+    }
+
+    virtual void SetPlacement(const CLine& placement)
+    {
+        position = CRect(placement.start, placement.end);
+    }
+
+    static unique_ptr<Figure> Read(FigureColumnReader& reader)
+    {
+        auto topLeft     = reader.ReadPoint();
+        auto bottomRight = reader.ReadPoint();
+        return unique_ptr<Figure>(new RectangleFigure(CRect(topLeft, bottomRight)));
+    }
+
     virtual void DrawShape(CDC& dc)
     {
-		dc.Rectangle(Position());
+		ViewportClipper::DrawRectangle(dc, Position());
 	}
 
     virtual long GetDistance(CPoint point)
@@ -2346,6 +9085,18 @@ public:
     {
         return position.GetCorners();
     }
+
+protected:
+    virtual void CompileShape(DisplayList& displayList) const
+    {
+        displayList.AddRectangle(this, GetColor(), position);
+    }
+
+    virtual void WriteShape(FigureColumns& columns) const
+    {
+        columns.WritePoint(position.GetTopLeft    ());
+        columns.WritePoint(position.GetBottomRight());
+    }
 };
 
 class EllipseFigure : public Figure
@@ -2370,9 +9121,46 @@ public:
         return unique_ptr<Figure>(new EllipseFigure(*this));
     }
 
+    virtual uint32_t GetKind() const
+    {
+        return FigureKind::Ellipse;
+    }
+
+    virtual size_t GetMemorySize() const
+    {
+        return sizeof(*this);
+    }
+
+    virtual void Offset(const SIZE& offset)
+    {
+        position.Offset(offset);
+    }
+
+    virtual void Transform(const AxisTransform& transform)
+    {
+        position = transform.Map(position);
+    }
+
+    virtual CLine GetPlacement() const
+    {
+        return CLine(position.GetTopLeft(), position.GetBottomRight());
+    }
+
+    virtual void SetPlacement(const CLine& placement)
+    {
+        position = CRect(placement.start, placement.end);
+    }
+
+    static unique_ptr<Figure> Read(FigureColumnReader& reader)
+    {
+        auto topLeft     = reader.ReadPoint();
+        auto bottomRight = reader.ReadPoint();
+        return unique_ptr<Figure>(new EllipseFigure(CRect(topLeft, bottomRight)));
+    }
+
     virtual void DrawShape(CDC& dc)
     {
-		dc.Ellipse(Position());
+		ViewportClipper::DrawEllipse(dc, Position());
 	}
 
     virtual long GetDistance(CPoint point)
@@ -2395,6 +9183,18 @@ public:
         points.push_back(CPoint::GetCenter(position.GetBottomLeft (), position.GetTopLeft    ()));
         return points;
     }
+
+protected:
+    virtual void CompileShape(DisplayList& displayList) const
+    {
+        displayList.AddEllipse(this, GetColor(), position);
+    }
+
+    virtual void WriteShape(FigureColumns& columns) const
+    {
+        columns.WritePoint(position.GetTopLeft    ());
+        columns.WritePoint(position.GetBottomRight());
+    }
 };
 
 class TextFigure : public Figure
@@ -2420,7 +9220,7 @@ public:
     }
 
     TextFigure(const TextFigure& figure)
-        : Figure(figure), position(figure.position)
+        : Figure(figure), position(figure.position), text(figure.text)
     {}
 
     virtual unique_ptr<Figure> Clone() const
@@ -2428,20 +9228,70 @@ public:
         return unique_ptr<Figure>(new TextFigure(*this));
     }
 
+    virtual uint32_t GetKind() const
+    {
+        return FigureKind::Text;
+    }
+
+    virtual size_t GetMemorySize() const
+    {
+        return sizeof(*this) + text.capacity() * sizeof(TCHAR);
+    }
+
+    virtual void Offset(const SIZE& offset)
+    {
+        position.Offset(offset);
+    }
+
+    // Text is neither turned nor scaled: it keeps its size at the top left of its transformed box.
+    virtual void Transform(const AxisTransform& transform)
+    {
+        position = CRect(transform.Map(position).GetTopLeft(), position.GetSize());
+    }
+
+    virtual CLine GetPlacement() const
+    {
+        return CLine(position.GetTopLeft(), position.GetBottomRight());
+    }
+
+    virtual void SetPlacement(const CLine& placement)
+    {
+        position = CRect(placement.start, placement.end);
+    }
+
+    virtual tstring GetText() const
+    {
+        return text;
+    }
+
+    virtual void ReplaceText(size_t first, size_t count, const tstring& text)
+    {
+        this->text.replace(first, count, text);
+    }
+
+    static unique_ptr<Figure> Read(FigureColumnReader& reader)
+    {
+        auto topLeft     = reader.ReadPoint();
+        auto bottomRight = reader.ReadPoint();
+        auto figure      = new TextFigure(topLeft, reader.ReadText());
+        figure->position = CRect(topLeft, bottomRight);
+        return unique_ptr<Figure>(figure);
+    }
+
     void CalculateArea(CDC& dc)
     {
-        FontSelector fontSelector(dc, logFont);
-        dc.DrawText(text, position, DT_LEFT | DT_TOP | DT_CALCRECT);
+        position = GetTextArea(dc);
     }
 
+    // Drawing never writes to the figure (figures may be drawn from several threads); the layout comes from the shared cache.
     virtual void DrawShape(CDC& dc)
     {
-        CalculateArea(dc);
+        RECT area = GetTextArea(dc);
 
-        FontSelector fontSelector(dc, logFont);
+        FontSelector fontSelector(dc, FontCache::Get(logFont));
         dc.SetTextColor(GetColor());
         dc.SetBkMode(TRANSPARENT);
-        dc.DrawText(text, position, DT_LEFT | DT_TOP);
+        dc.DrawText(text, area, DT_LEFT | DT_TOP);
     }
 
     virtual long GetDistance(CPoint point)
@@ -2458,14 +9308,83 @@ public:
     {
         return position.GetCorners();
     }
+
+private:
+    // The area the text takes on dc from its top left, measured once per string and device font height.
+    CRect GetTextArea(CDC& dc) const
+    {
+        CPoint bottomRight = position.GetTopLeft();
+        dc.LPtoDP(bottomRight);
+        bottomRight = bottomRight + FontCache::GetTextSize(dc, text, logFont, position.GetTopLeft());
+        dc.DPtoLP(bottomRight);
+        return CRect(position.GetTopLeft(), bottomRight);
+    }
+
+protected:
+    // The text is measured on the device, so it may reach past the stored position.
+    virtual CRect GetShapeBoundRect(CDC& dc)
+    {
+        const auto area = GetTextArea(dc);
+        CRect bounds;
+        ::UnionRect(&bounds, &area, &position);
+        return bounds;
+    }
+
+    virtual bool IsSmall(SIZE deviceSize) const
+    {
+        return deviceSize.cy <= LevelOfDetail::greekingHeight;
+    }
+
+    // Text keeps its own colour, so its box is highlighted instead.
+    virtual void DrawHighlightShape(CDC& dc)
+    {
+        dc.Rectangle(GetShapeBoundRect(dc));
+    }
+
+    // Greeking: a bar across the middle third of the text.
+    virtual void DrawSimplified(CDC& dc, PixelCoverage& coverage, const CRect& deviceBounds)
+    {
+        const auto height = deviceBounds.GetSize().cy;
+        const auto top    = deviceBounds.top + height / 3;
+        coverage.Fill(CRect(CPoint(deviceBounds.left, top), CPoint(deviceBounds.right + 1, top + Math::Max(height / 3, 1L))), GetColor());
+    }
+
+    virtual void CompileShape(DisplayList& displayList) const
+    {
+        displayList.AddText(this, GetColor(), position, text, logFont);
+    }
+
+    virtual void WriteShape(FigureColumns& columns) const
+    {
+        columns.WritePoint(position.GetTopLeft    ());
+        columns.WritePoint(position.GetBottomRight());
+        columns.WriteText (text);
+    }
 };
 
 StandardLogFont TextFigure::logFont;
 
+class FigureRegistry
+{
+    static FigureRegistry instance;
+
+    FigureRegistry()
+    {
+        FigureFactory::Register(FigureKind::Line     , LineFigure     ::Read);
+        FigureFactory::Register(FigureKind::Rectangle, RectangleFigure::Read);
+        FigureFactory::Register(FigureKind::Ellipse  , EllipseFigure  ::Read);
+        FigureFactory::Register(FigureKind::Text     , TextFigure     ::Read);
+    }
+};
+
+FigureRegistry FigureRegistry::instance;
+
 class AddLineCommand : public AddCommand
 {
+    CLine preview;
+
 public:
-	AddLineCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView)
+	AddLineCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView), preview(CPoint(), CPoint())
 	{}
 
 protected:
@@ -2473,12 +9392,30 @@ protected:
 	{
 		return unique_ptr<Figure>(new LineFigure(CLine(firstPoint, point)));
 	}
+
+    virtual void SetPreview(POINT point)
+    {
+        preview.start = firstPoint;
+        preview.end   = point;
+    }
+
+    virtual void DrawPreview(CDC& dc) const
+    {
+        dc.Draw(preview);
+    }
+
+    virtual CRect GetPreviewBoundRect() const
+    {
+        return CRect(preview.start, preview.end);
+    }
 };
 
 class AddRectangleCommand : public AddCommand
 {
+    CRect preview;
+
 public:
-	AddRectangleCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView)
+	AddRectangleCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView), preview(CPoint(), CSize())
 	{}
 
 protected:
@@ -2486,12 +9423,29 @@ protected:
 	{
 		return unique_ptr<Figure>(new RectangleFigure(CRect(firstPoint, point)));
 	}
+
+    virtual void SetPreview(POINT point)
+    {
+        preview = CRect(firstPoint, point);
+    }
+
+    virtual void DrawPreview(CDC& dc) const
+    {
+        dc.Rectangle(preview);
+    }
+
+    virtual CRect GetPreviewBoundRect() const
+    {
+        return preview;
+    }
 };
 
 class AddEllipseCommand : public AddCommand
 {
+    CRect preview;
+
 public:
-	AddEllipseCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView)
+	AddEllipseCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView), preview(CPoint(), CSize())
 	{}
 
 protected:
@@ -2499,12 +9453,29 @@ protected:
 	{
 		return unique_ptr<Figure>(new EllipseFigure(CRect(firstPoint, point)));
 	}
+
+    virtual void SetPreview(POINT point)
+    {
+        preview = CRect(firstPoint, point);
+    }
+
+    virtual void DrawPreview(CDC& dc) const
+    {
+        dc.Ellipse(preview);
+    }
+
+    virtual CRect GetPreviewBoundRect() const
+    {
+        return preview;
+    }
 };
 
 class AddCircleCommand : public AddCommand
 {
+    CRect preview;
+
 public:
-	AddCircleCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView)
+	AddCircleCommand(CadData& cadData, CadView& cadView) : AddCommand(cadData, cadView), preview(CPoint(), CSize())
 	{}
 
 protected:
@@ -2514,11 +9485,22 @@ protected:
 		return unique_ptr<Figure>(new EllipseFigure(MakeRectangle(CPoint(firstPoint), radius)));
 	}
 
-	virtual void OnDrawRubberBand(CDC& dc, POINT point)
-	{
-		AddCommand::OnDrawRubberBand(dc, point);
-		dc.Ellipse(MakeRectangle(CPoint(firstPoint), 2));
-	}
+    virtual void SetPreview(POINT point)
+    {
+        preview = MakeRectangle(CPoint(firstPoint), CPoint(firstPoint).GetDistance(point));
+    }
+
+    // The circle and a mark at its centre.
+    virtual void DrawPreview(CDC& dc) const
+    {
+        dc.Ellipse(preview);
+        dc.Ellipse(MakeRectangle(CPoint(firstPoint), 2));
+    }
+
+    virtual CRect GetPreviewBoundRect() const
+    {
+        return preview;
+    }
 
 private:
 	static CRect MakeRectangle(CPoint centerPoint, double radius)
@@ -2542,29 +9524,50 @@ public:
         auto figure = new TextFigure(point, text.str());
 
         figure->CalculateArea(dc);
-        cadView.SetEdit(figure->Text(), StandardLogFont::defaultHeight, figure->Position());
         cadData.Add(unique_ptr<Figure>(figure));
+        cadView.SetEdit(*figure, StandardLogFont::defaultHeight, figure->Position());
     }
 };
 
-class MainWindow : public CWnd
+class MainWindow : public CWnd, public Observer
 {
-	static const _TCHAR title[];
-
+	static const _TCHAR   title[];
+    static const _TCHAR   journalFileName[];
+    static const _TCHAR   autosaveFileName[];
+    static const UINT_PTR autosaveTimerId  = 1;
+    static const UINT     autosaveTickTime = 1000; // milliseconds between the checks whether an autosave is due
+    static const long     moveStep         = modelSize / 100;
+    static const long     exportSize       = 4096; // pixels along the longer side of an exported image
+    static const WORD     exportFailure    = 0x100; // the notification code an export task posts with ID_FILE_EXPORT_PNG when it fails
+    static const double   scaleStep;
+
+    unique_ptr<OperationJournal> journal; // declared first: the document appends to it until it is destroyed
 	CadData		   cadData;
+    DocumentVersions versions; // what worker threads read: the document as of the last finished command, while they read it
+    TaskScheduler::TaskGroup exportTasks; // declared after the document: its destructor waits for the exports reading it
 	CadView		   cadView;
 	CommandManager commandManager;
+    CClipboard     clipboard;
+    unique_ptr<Autosaver> autosaver;
 
 public:
 	MainWindow(HINSTANCE hInstance)
-		: CWnd(hInstance), commandManager(cadData, cadView), cadView(hInstance, cadData, commandManager)
-	{}
+		: CWnd(hInstance), versions(cadData), commandManager(cadData, versions, cadView), cadView(hInstance, cadData, commandManager), clipboard(*this, _T("Shos.MiniCad32.Figures"))
+	{
+        commandManager.GetOperationRunner().AddObserver(*this);
+    }
+
+    LongOperationRunner& GetOperationRunner()
+    {
+        return commandManager.GetOperationRunner();
+    }
 
 	bool Create(int nCmdShow)
 	{
 		if (CWnd::Create(nullptr, title, WS_OVERLAPPEDWINDOW, IDC_MiniCad32, nCmdShow)) {
 			cadView.Create(this);
 			AdjustViewSize();
+            Recover();
 			return true;
 		}
 		return false;
@@ -2573,14 +9576,32 @@ public:
 protected:
 	virtual LRESULT OnCommand(UINT notificationCode, int commandId)
 	{
+        if (commandId == ID_FILE_EXPORT_PNG && notificationCode == exportFailure) {
+            ::MessageBox(hWnd, _T("The image could not be exported."), title, MB_OK | MB_ICONERROR);
+            return 0;
+        }
+        // The document is a long operation's until it ends.
+        if (commandManager.IsBusy() && commandId != ID_VISUAL_HOME && commandId != IDM_ABOUT && commandId != IDM_EXIT)
+            return 0;
+
 		switch (commandId)
 		{
+        case ID_FILE_EXPORT_PNG:
+            ExportPng();
+            break;
+
         case ID_EDIT_UNDO:
             cadData.Undo();
             break;
         case ID_EDIT_REDO:
             cadData.Redo();
             break;
+        case ID_EDIT_COPY:
+            cadData.Copy(clipboard);
+            break;
+        case ID_EDIT_PASTE:
+            cadData.Paste(clipboard);
+            break;
 
         case ID_VISUAL_HOME:
             cadView.Home();
@@ -2590,7 +9611,7 @@ protected:
             commandManager.SetCommand(unique_ptr<Command>(new SelectCommand(cadData, cadView)));
             break;
         case ID_FIGURE_DELETE:
-            cadData.Delete();
+            commandManager.Run(cadData.DeleteInSlices());
             break;
 
         case ID_FIGURE_LINE:
@@ -2609,17 +9630,48 @@ protected:
             commandManager.SetCommand(unique_ptr<Command>(new AddTextCommand(cadData, cadView)));
             break;
 
+        case ID_TRANSFORM_MOVE_LEFT:
+            cadData.MoveSelection(CSize(-moveStep, 0));
+            break;
+        case ID_TRANSFORM_MOVE_RIGHT:
+            cadData.MoveSelection(CSize( moveStep, 0));
+            break;
+        case ID_TRANSFORM_MOVE_UP:
+            cadData.MoveSelection(CSize(0, -moveStep));
+            break;
+        case ID_TRANSFORM_MOVE_DOWN:
+            cadData.MoveSelection(CSize(0,  moveStep));
+            break;
+        case ID_TRANSFORM_TURN_RIGHT:
+            TransformSelection( 1, 1.0, 1.0);
+            break;
+        case ID_TRANSFORM_TURN_LEFT:
+            TransformSelection(-1, 1.0, 1.0);
+            break;
+        case ID_TRANSFORM_MIRROR_HORIZONTAL:
+            TransformSelection( 0, -1.0, 1.0);
+            break;
+        case ID_TRANSFORM_MIRROR_VERTICAL:
+            TransformSelection( 0, 1.0, -1.0);
+            break;
+        case ID_TRANSFORM_ENLARGE:
+            TransformSelection( 0, scaleStep, scaleStep);
+            break;
+        case ID_TRANSFORM_SHRINK:
+            TransformSelection( 0, 1.0 / scaleStep, 1.0 / scaleStep);
+            break;
+
         case ID_COLOR_BLACK:
-			cadData.SetCurrentColor(Color::Black);
+			SetColor(Color::Black);
 			break;
 		case ID_COLOR_RED:
-			cadData.SetCurrentColor(Color::Red  );
+			SetColor(Color::Red  );
 			break;
 		case ID_COLOR_GREEN:
-			cadData.SetCurrentColor(Color::Green);
+			SetColor(Color::Green);
 			break;
 		case ID_COLOR_BLUE:
-			cadData.SetCurrentColor(Color::Blue );
+			SetColor(Color::Blue );
 			break;
 
 		case IDM_ABOUT:
@@ -2629,19 +9681,46 @@ protected:
 			::DestroyWindow(hWnd);
 			break;
 		}
+        if (!commandManager.IsBusy())
+            versions.Publish();
 		return 0;
 	}
 
 	virtual void OnDestroy()
 	{
+        auto& operationRunner = commandManager.GetOperationRunner();
+        operationRunner.Cancel();
+        operationRunner.Finish();
+        if (autosaver != nullptr)
+            autosaver->Discard();
+        if (journal != nullptr)
+            journal->Discard();
 		::PostQuitMessage(0);
 	}
 
+    virtual void OnTimer(UINT_PTR timerId)
+    {
+        // A long operation's changes are journaled when it ends, so a snapshot in the middle of one would not match the journal.
+        if (timerId == autosaveTimerId && autosaver != nullptr && !commandManager.IsBusy())
+            autosaver->Tick();
+    }
+
 	virtual void OnSize()
 	{
 		AdjustViewSize();
 	}
 
+    // Shows the progress of a long operation in the title.
+    virtual void OnUpdate(void* data)
+    {
+        tstringstream text;
+        text << title;
+        if (commandManager.IsBusy())
+            text << _T(" - ") << commandManager.GetOperationRunner().GetPercentage() << _T("%");
+        if (text.str() != GetText())
+            SetText(text.str());
+    }
+
 private:
 	static INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 	{
@@ -2666,23 +9745,128 @@ private:
 		const auto clientArea = GetClientArea();
 		cadView.Move(clientArea);
 	}
+
+    // The colour of the figures to add, and of the selection.
+    void SetColor(COLORREF color)
+    {
+        cadData.SetCurrentColor(color);
+        commandManager.Run(cadData.ColorSelectionInSlices(color));
+    }
+
+    // Turns, mirrors and scales the selection about the centre of its bounds.
+    void TransformSelection(int quarterTurns, double scaleX, double scaleY)
+    {
+        const auto bounds = cadData.GetSelectionBoundRect();
+        if (!bounds.IsNone())
+            cadData.TransformSelection(AxisTransform(bounds.GetCenter(), quarterTurns, scaleX, scaleY));
+    }
+
+    // Exports the figures as an image on the task scheduler, from the version of the document pinned as it is now, so
+    // editing goes on meanwhile. A failure is posted back, as the message box belongs to the UI thread.
+    void ExportPng()
+    {
+        TCHAR        path[MAX_PATH] = _T("MiniCad32.png");
+        OPENFILENAME fileName       = {};
+        fileName.lStructSize        = sizeof(fileName);
+        fileName.hwndOwner          = hWnd;
+        fileName.lpstrFilter        = _T("PNG (*.png)\0*.png\0");
+        fileName.lpstrFile          = path;
+        fileName.nMaxFile           = MAX_PATH;
+        fileName.lpstrDefExt        = _T("png");
+        fileName.Flags              = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST | OFN_HIDEREADONLY;
+        if (!::GetSaveFileName(&fileName))
+            return;
+
+        const auto    documentArea = cadData.GetArea();
+        const tstring exportPath   = path;
+        const auto    window       = hWnd;
+        // Made here, as a reader is made on the thread that edits; the task lets go of it.
+        const shared_ptr<DocumentVersions::Reader> reader(new DocumentVersions::Reader(versions));
+        exportTasks.Run([reader, documentArea, exportPath, window] {
+            try {
+                const DocumentVersions::Pin pin(*reader);
+                auto area = CRect::GetNone();
+                for (const auto& figure : pin.GetSnapshot())
+                    area = area.Union(figure->GetBoundRect());
+                if (area.IsNone())
+                    area = documentArea;
+                const auto size  = area.GetSize();
+                const auto scale = double(exportSize) / Math::Max(Math::Max(size.cx, size.cy), 1L);
+                RasterExporter::ExportPngFile(pin.GetSnapshot(), area, CSize(Math::Max(long(size.cx * scale), 1L), Math::Max(long(size.cy * scale), 1L)), exportPath);
+            } catch (const exception&) {
+                ::PostMessage(window, WM_COMMAND, MAKEWPARAM(ID_FILE_EXPORT_PNG, exportFailure), 0);
+            }
+        });
+    }
+
+    // Recovers the edits of a session that ended without closing the window: from the last autosave and the journal after
+    // its checkpoint, from the whole journal where it has no such checkpoint, or from the autosave alone where the journal
+    // has nothing. Without a journal (another instance holds it, say) editing goes on unjournaled and without autosaves,
+    // as the files are that instance's.
+    void Recover()
+    {
+        TCHAR folder[MAX_PATH];
+        if (::GetTempPath(MAX_PATH, folder) == 0)
+            return;
+        const auto autosavePath = tstring(folder) + autosaveFileName;
+        auto       isJournaled  = false;
+        uint64_t   checkpoint   = 0;
+        try {
+            journal.reset(new OperationJournal(tstring(folder) + journalFileName));
+            isJournaled = journal->GetRecoveredRecords().size() > 0;
+            if (isJournaled && !Autosaver::Load(cadData, autosavePath, checkpoint))
+                checkpoint = 0;
+            cadData.Recover(*journal, checkpoint);
+        } catch (const exception&) {
+            journal.reset();
+            return;
+        }
+        // Read with the journal on, the autosave becomes the journal's first record.
+        if (!isJournaled)
+            Autosaver::Load(cadData, autosavePath, checkpoint);
+        versions.Publish();
+        try {
+            autosaver.reset(new Autosaver(cadData, autosavePath));
+            SetTimer(autosaveTimerId, autosaveTickTime);
+        } catch (const exception&) {
+        }
+    }
 };
 
-const _TCHAR MainWindow::title[] = _T("MiniCad32");
+const _TCHAR MainWindow::title           [] = _T("MiniCad32");
+const _TCHAR MainWindow::journalFileName [] = _T("MiniCad32.journal");
+const _TCHAR MainWindow::autosaveFileName[] = _T("MiniCad32.autosave");
+const double MainWindow::scaleStep          = 2.0;
 
 class Program
 {
 public:
 	int Main(HINSTANCE hInstance, int nCmdShow)
 	{
-		return MainWindow(hInstance).Create(nCmdShow) ? MainMessageLoop() : FALSE;
+        MainWindow mainWindow(hInstance);
+		return mainWindow.Create(nCmdShow) ? MainMessageLoop(mainWindow.GetOperationRunner()) : FALSE;
 	}
 
 private:
-	static int MainMessageLoop()
+    // While a long operation runs, it gets a slice whenever no message is waiting, and Escape cancels it.
+	static int MainMessageLoop(LongOperationRunner& operationRunner)
 	{
 		MSG msg;
-		while (::GetMessage(&msg, nullptr, 0, 0)) {
+		for (;;) {
+            if (operationRunner.IsRunning()) {
+                if (!::PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                    operationRunner.RunSlice();
+                    continue;
+                }
+                if (msg.message == WM_QUIT)
+                    break;
+                if (msg.message == WM_KEYDOWN && msg.wParam == VK_ESCAPE) {
+                    operationRunner.Cancel();
+                    continue;
+                }
+            } else if (!::GetMessage(&msg, nullptr, 0, 0)) {
+                break;
+            }
 			::TranslateMessage(&msg);
 			::DispatchMessage (&msg);
 		}
@@ -24,7 +24,19 @@
 #define ID_EDIT_UNDO                    32782
 #define ID_EDIT_REDO                    32783
 #define ID_EDIT_COPY                    32784
+#define ID_EDIT_PASTE                   32786
 #define ID_VISUAL_HOME                  32785
+#define ID_TRANSFORM_MOVE_LEFT          32787
+#define ID_TRANSFORM_MOVE_RIGHT         32788
+#define ID_TRANSFORM_MOVE_UP            32789
+#define ID_TRANSFORM_MOVE_DOWN          32790
+#define ID_TRANSFORM_TURN_RIGHT         32791
+#define ID_TRANSFORM_TURN_LEFT          32792
+#define ID_TRANSFORM_MIRROR_HORIZONTAL  32793
+#define ID_TRANSFORM_MIRROR_VERTICAL    32794
+#define ID_TRANSFORM_ENLARGE            32795
+#define ID_TRANSFORM_SHRINK             32796
+#define ID_FILE_EXPORT_PNG              32797
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -33,7 +45,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NO_MFC                     1
 #define _APS_NEXT_RESOURCE_VALUE        129
-#define _APS_NEXT_COMMAND_VALUE         32786
+#define _APS_NEXT_COMMAND_VALUE         32798
 #define _APS_NEXT_CONTROL_VALUE         1000
 #define _APS_NEXT_SYMED_VALUE           110
 #endif